@@ -19,6 +19,8 @@ int nettest3(void);
 int nettest4(void);
 int nettest5(void);
 int nettest6(void);
+int nettest7(void);
+int nettest8(int megs, int rcvbuf, int sndbuf, int ack_delay);
 
 static int read_thread(void *args)
 {
@@ -296,8 +298,211 @@ int nettest6(void)
 	}
 }
 
+// throughput test, accepts connections on port 1901 and reads whatever is sent
+// as fast as it can, then prints the rate. feed it with something like
+// dd if=/dev/zero bs=64k count=1000 | nc <ip> 1901 on the other end
+int nettest7(void)
+{
+	int err;
+	sockaddr addr;
+	int new_fd;
+
+	fd = socket_create(SOCK_PROTO_TCP, 0);
+	printf("created socket, fd %d\n", fd);
+	if(fd < 0)
+		return 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.addr.len = 4;
+	addr.addr.type = ADDR_TYPE_IP;
+	addr.port = 1901;
+	NETADDR_TO_IPV4(addr.addr) = IPV4_DOTADDR_TO_ADDR(0,0,0,0);
+
+	err = socket_bind(fd, &addr);
+	printf("socket_bind returns %d\n", err);
+	if(err < 0)
+		return 0;
+
+	err = socket_listen(fd);
+	printf("socket_listen returns %d\n", err);
+	if(err < 0)
+		return 0;
+
+	for(;;) {
+		static char buf[65536];
+		long long total = 0;
+		bigtime_t start, elapsed;
+		ssize_t len;
+
+		new_fd = socket_accept(fd, &addr);
+		printf("socket_accept returns %d\n", new_fd);
+		if(new_fd < 0)
+			continue;
+
+		start = _kern_system_time();
+		for(;;) {
+			len = socket_read(new_fd, buf, sizeof(buf));
+			if(len <= 0)
+				break;
+			total += len;
+		}
+		elapsed = _kern_system_time() - start;
+		socket_close(new_fd);
+
+		if(elapsed <= 0)
+			elapsed = 1;
+		printf("read %Ld bytes in %Ld usecs, %Ld KB/sec\n", total, elapsed, (total * 1000000 / elapsed) / 1024);
+	}
+}
+
+// loopback bulk transfer benchmark, a thread pushes megs of data through a
+// connection on port 1902 to the main thread, which prints the rate.
+// the buffer sizes and ack delay are handed to socket_setopt, -1 leaves the default
+static int bench_megs;
+static int bench_sndbuf;
+static int bench_ack_delay;
+
+static void bench_setopts(int sock, int rcvbuf, int sndbuf, int ack_delay)
+{
+	if(rcvbuf >= 0)
+		socket_setopt(sock, SOCK_OPT_RCVBUF, rcvbuf);
+	if(sndbuf >= 0)
+		socket_setopt(sock, SOCK_OPT_SNDBUF, sndbuf);
+	if(ack_delay >= 0)
+		socket_setopt(sock, SOCK_OPT_TCP_ACK_DELAY, ack_delay);
+}
+
+static int bench_send_thread(void *args)
+{
+	static char buf[65536];
+	sockaddr addr;
+	long long total;
+	ssize_t len;
+	int sock;
+	int err;
+
+	sock = socket_create(SOCK_PROTO_TCP, 0);
+	if(sock < 0) {
+		printf("bench: socket_create returns %d\n", sock);
+		return 0;
+	}
+
+	bench_setopts(sock, -1, bench_sndbuf, bench_ack_delay);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.addr.len = 4;
+	addr.addr.type = ADDR_TYPE_IP;
+	addr.port = 1902;
+	NETADDR_TO_IPV4(addr.addr) = IPV4_DOTADDR_TO_ADDR(127,0,0,1);
+
+	err = socket_connect(sock, &addr);
+	if(err < 0) {
+		printf("bench: socket_connect returns %d\n", err);
+		socket_close(sock);
+		return 0;
+	}
+
+	memset(buf, 0x55, sizeof(buf));
+	for(total = (long long)bench_megs * 1024 * 1024; total > 0; total -= len) {
+		len = socket_write(sock, buf, total < (long long)sizeof(buf) ? total : (long long)sizeof(buf));
+		if(len <= 0) {
+			printf("bench: socket_write returns %ld\n", (long)len);
+			break;
+		}
+	}
+
+	socket_close(sock);
+
+	return 0;
+}
+
+int nettest8(int megs, int rcvbuf, int sndbuf, int ack_delay)
+{
+	static char buf[65536];
+	int err;
+	sockaddr addr;
+	int new_fd;
+	long long total = 0;
+	bigtime_t start, elapsed;
+	ssize_t len;
+
+	fd = socket_create(SOCK_PROTO_TCP, 0);
+	if(fd < 0) {
+		printf("bench: socket_create returns %d\n", fd);
+		return 0;
+	}
+
+	// accepted sockets pick these up from the listener
+	bench_setopts(fd, rcvbuf, -1, ack_delay);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.addr.len = 4;
+	addr.addr.type = ADDR_TYPE_IP;
+	addr.port = 1902;
+	NETADDR_TO_IPV4(addr.addr) = IPV4_DOTADDR_TO_ADDR(0,0,0,0);
+
+	err = socket_bind(fd, &addr);
+	if(err < 0) {
+		printf("bench: socket_bind returns %d\n", err);
+		return 0;
+	}
+
+	err = socket_listen(fd);
+	if(err < 0) {
+		printf("bench: socket_listen returns %d\n", err);
+		return 0;
+	}
+
+	bench_megs = megs;
+	bench_sndbuf = sndbuf;
+	bench_ack_delay = ack_delay;
+	_kern_thread_resume_thread(_kern_thread_create_thread("bench_send_thread", &bench_send_thread, NULL));
+
+	new_fd = socket_accept(fd, &addr);
+	if(new_fd < 0) {
+		printf("bench: socket_accept returns %d\n", new_fd);
+		return 0;
+	}
+
+	start = _kern_system_time();
+	for(;;) {
+		len = socket_read(new_fd, buf, sizeof(buf));
+		if(len <= 0)
+			break;
+		total += len;
+	}
+	elapsed = _kern_system_time() - start;
+
+	printf("bench: receive window grew to %d, ack delay %d\n",
+		socket_getopt(new_fd, SOCK_OPT_RCVBUF), socket_getopt(new_fd, SOCK_OPT_TCP_ACK_DELAY));
+
+	socket_close(new_fd);
+	socket_close(fd);
+
+	if(elapsed <= 0)
+		elapsed = 1;
+	printf("bench: read %Ld bytes in %Ld usecs, %Ld.%02Ld MB/sec\n", total, elapsed,
+		total / elapsed, (total * 100 / elapsed) % 100);
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
+	if(argc > 1 && !strcmp(argv[1], "sink"))
+		return nettest7();
+	if(argc > 1 && !strcmp(argv[1], "bench")) {
+		if(argc > 2 && !strcmp(argv[2], "-h")) {
+			printf("usage: %s bench [megs [rcvbuf [sndbuf [ack delay]]]]\n", argv[0]);
+			printf("buffer sizes of 0 auto-tune, -1 leaves the default\n");
+			return 0;
+		}
+		return nettest8(argc > 2 ? atoi(argv[2]) : 64,
+			argc > 3 ? atoi(argv[3]) : -1,
+			argc > 4 ? atoi(argv[4]) : -1,
+			argc > 5 ? atoi(argv[5]) : -1);
+	}
+
 //	nettest1();
 //	nettest2();
 //	nettest3();
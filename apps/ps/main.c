@@ -27,7 +27,7 @@ static void do_ps(void)
 
 	if(display_threads)
 		printf("   tid");
-	printf("   pid  ppid  pgid   sid    user  kernel                            name\n");
+	printf("   pid  ppid  pgid   sid    user  kernel  faults   major                            name\n");
 	for(;;) {
 		bigtime_t total_user_time = 0;
 		bigtime_t total_kernel_time = 0;
@@ -44,9 +44,9 @@ static void do_ps(void)
 				break;
 
 			if(display_threads) {
-				printf("%6d%6d%6d%6d%6d%8Ld%8Ld%32s\n", 
+				printf("%6d%6d%6d%6d%6d%8Ld%8Ld%16s%32s\n", 
 					ti.id, pi.pid, pi.ppid, pi.pgid, pi.sid, 
-					ti.user_time/1000, ti.kernel_time/1000, ti.name);
+					ti.user_time/1000, ti.kernel_time/1000, "", ti.name);
 			}
 			total_user_time += ti.user_time;
 			total_kernel_time += ti.kernel_time;
@@ -55,9 +55,9 @@ static void do_ps(void)
 		if(display_threads)
 			printf("    --");
 		
-		printf("%6d%6d%6d%6d%8Ld%8Ld%32s\n", 
+		printf("%6d%6d%6d%6d%8Ld%8Ld%8d%8d%32s\n", 
 			pi.pid, pi.ppid, pi.pgid, pi.sid, 
-			total_user_time/1000, total_kernel_time/1000, pi.name);
+			total_user_time/1000, total_kernel_time/1000, pi.page_faults, pi.major_faults, pi.name);
 		count++;
 	}
 
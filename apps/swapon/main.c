@@ -0,0 +1,27 @@
+/*
+** Copyright 2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <sys/syscalls.h>
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char *argv[])
+{
+	int rc;
+
+	if(argc < 2) {
+		printf("not enough arguments to swapon:\n");
+		printf("usage: swapon <device>\n");
+		return 0;
+	}
+
+	rc = _kern_vm_swapon(argv[1]);
+	if (rc < 0) {
+		printf("_kern_vm_swapon() returned error: %s\n", strerror(rc));
+	} else {
+		printf("swapping on %s.\n", argv[1]);
+	}
+
+	return 0;
+}
@@ -8,20 +8,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include <newos/tty_priv.h>
+#include <socket/socket.h>
 
-static int debug_fd; // debug spew to the console
-static int tty_master_fd;
-static int tty_slave_fd;
-static int tty_num;
-static int socket_fd;
-static sem_id wait_sem;
+/*
+	One thread serves every session. Each session is a socket and the master
+	end of a tty, with the shell running on the slave end. Both fds of every
+	session and the listen socket sit in one wait set, so the cost of a pass
+	through the loop depends on how many of them are ready, not how many there are.
 
-// XXX fix for big endian (move to libnet or whatever it's gonna be called)
-static short ntohs(short value)
-{
-	return ((value>>8)&0xff) | ((value&0xff)<<8);
-}
+	telnetd -p <port> <program> [args] listens on the port itself.
+	telnetd <program> [args] serves the one socket it was started on (by socketd).
+*/
+
+#define MAX_SESSIONS 256
+#define MAX_EVENTS 32
+#define MAX_SB_LEN 64
 
 enum {
 	SE = 240,
@@ -39,150 +42,151 @@ enum {
 	OPT_NAWS = 31,
 };
 
-static void process_subblock(int sb_type, unsigned char *buf, int len)
-{
-	char temp[128];
+// telnet command parser states
+enum {
+	NORMAL = 0,
+	SEEN_IAC,
+	SEEN_OPT_NEGOTIATION,
+	SEEN_SB,
+	IN_SB,
+};
 
-	sprintf(temp, "process_subblock: type %d, len %d\r\n", sb_type, len);
-	write(debug_fd, temp, strlen(temp));
+typedef struct session {
+	bool inuse;
+	int socket_fd;
+	int tty_master_fd;
+	proc_id pid;
 
-	if(sb_type == OPT_NAWS) {
-		struct tty_winsize ws;
+	// telnet command parser
+	int state;
+	int curr_sb_type;
+	int sb_len;
+	unsigned char sb[MAX_SB_LEN];
+} session;
 
-		ws.cols = ntohs(*(unsigned short *)&buf[0]);
-		ws.rows = ntohs(*(unsigned short *)&buf[2]);
-		sprintf(temp, "NAWS %d %d\r\n", ws.cols, ws.rows);
-		write(debug_fd, temp, strlen(temp));
+static session sessions[MAX_SESSIONS];
+static wait_set_id wait_set;
+static int listen_fd = -1;
+static char **spawn_argv;
+static int spawn_argc;
 
-		ioctl(tty_master_fd, _TTY_IOCTL_SET_WINSIZE, &ws, sizeof(ws)); 
-	}
+// XXX fix for big endian (move to libnet or whatever it's gonna be called)
+static short ntohs(short value)
+{
+	return ((value>>8)&0xff) | ((value&0xff)<<8);
 }
 
-static int telnet_reader(void *arg)
+static int open_listen_socket(int port)
 {
-	unsigned char buf[4096];
-	unsigned char sb[4096];
-	ssize_t len;
-	int i;
-	enum {
-		NORMAL = 0,
-		SEEN_IAC,
-		SEEN_OPT_NEGOTIATION,
-		SEEN_SB,
-		IN_SB,
-	} state = NORMAL;
-	int output_start, output_len;
-	int curr_sb_type = 0;
-	int sb_len = 0;
-	char temp[128];
+	int err;
+	sockaddr addr;
+	int fd;
 
-	for(;;) {
-		/* read from the socket */
-		len = read(socket_fd, buf, sizeof(buf));
-		if(len <= 0)
-			break;
+	fd = socket_create(SOCK_PROTO_TCP, 0);
+	if(fd < 0)
+		return fd;
 
-		output_start = 0;
-		output_len = 0;
-		for(i = 0; i < len; i++) {
-			// try to remove commands
-			switch(state) {
-				case NORMAL:
-					if(buf[i] == IAC) {
-						state = SEEN_IAC;
-						if(output_len > 0)
-							write(tty_master_fd, &buf[output_start], output_len);
-						output_len = 0;
-						write(debug_fd, "NORMAL: IAC\r\n", strlen("NORMAL: IAC\r\n"));
-					} else {
-						output_len++;
-					}
-					break;
-				case SEEN_IAC:
-					sprintf(temp, "SEEN_IAC: 0x%x\r\n", buf[i]);
-					write(debug_fd, temp, strlen(temp));
-					if(buf[i] == SB) {
-						state = SEEN_SB;
-					} else if(buf[i] == IAC) {
-						output_start = i;
-						output_len = 1;
-						state = NORMAL;
-					} else {
-						state = SEEN_OPT_NEGOTIATION;
-					}
-					break;
-				case SEEN_OPT_NEGOTIATION:
-					sprintf(temp, "SEEN_OPT_NEGOTIATION: 0x%x\r\n", buf[i]);
-					write(debug_fd, temp, strlen(temp));
-					// we can transition back to normal now, we've eaten this option
-					state = NORMAL;
-					output_len = 0;
-					output_start = i+1;
-					break;
-				case SEEN_SB:
-					sprintf(temp, "SEEN_SB: 0x%x\r\n", buf[i]);
-					write(debug_fd, temp, strlen(temp));
-					if(buf[i] == SE) {
-						state = NORMAL;
-						output_len = 0;
-						output_start = i+1;
-					} else {
-						curr_sb_type = buf[i];
-						state = IN_SB;
-						sb_len = 0;
-					}
-					break;
-				case IN_SB:
-					sprintf(temp, "IN_SB: 0x%x\r\n", buf[i]);
-					write(debug_fd, temp, strlen(temp));
-					if(buf[i] == SE) {
-						state = NORMAL;
-						output_len = 0;
-						output_start = i+1;
-					} else if(buf[i] == IAC) {
-						process_subblock(curr_sb_type, sb, sb_len);
-					} else {
-						sb[sb_len++] = buf[i];
-					}
-					break;
-			}
-		}
-		if(output_len > 0)
-			write(tty_master_fd, &buf[output_start], output_len);
-	}
+	memset(&addr, 0, sizeof(addr));
+	addr.addr.len = 4;
+	addr.addr.type = ADDR_TYPE_IP;
+	addr.port = port;
+	NETADDR_TO_IPV4(addr.addr) = IPV4_DOTADDR_TO_ADDR(0,0,0,0);
 
-	_kern_sem_release(wait_sem, 1);
+	err = socket_bind(fd, &addr);
+	if(err < 0)
+		goto err;
 
-	_kern_exit(0);
-	return 0;
+	err = socket_listen(fd);
+	if(err < 0)
+		goto err;
+
+	return fd;
+
+err:
+	socket_close(fd);
+
+	return err;
 }
 
-static int telnet_writer(void *arg)
+static void process_subblock(session *s, int sb_type, unsigned char *buf, int len)
 {
-	char buf[4096];
-	ssize_t len;
-	ssize_t write_len;
+	if(sb_type == OPT_NAWS && len >= 4) {
+		struct tty_winsize ws;
 
-	for(;;) {
-		/* read from the tty's master end */
-		len = read(tty_master_fd, buf, sizeof(buf));
-		if(len <= 0)
-			break;
+		ws.cols = ntohs(*(unsigned short *)&buf[0]);
+		ws.rows = ntohs(*(unsigned short *)&buf[2]);
 
-		write_len = write(socket_fd, buf, len);
-		if(write_len < 0)
-			break;
+		ioctl(s->tty_master_fd, _TTY_IOCTL_SET_WINSIZE, &ws, sizeof(ws));
 	}
+}
 
-	_kern_sem_release(wait_sem, 1);
+// strips the telnet commands out of what came in on the socket and hands the rest to the tty
+static void process_socket_data(session *s, unsigned char *buf, ssize_t len)
+{
+	int output_start = 0;
+	int output_len = 0;
+	int i;
 
-	_kern_exit(0);
-	return 0;
+	for(i = 0; i < len; i++) {
+		switch(s->state) {
+			case NORMAL:
+				if(buf[i] == IAC) {
+					s->state = SEEN_IAC;
+					if(output_len > 0)
+						write(s->tty_master_fd, &buf[output_start], output_len);
+					output_len = 0;
+				} else {
+					output_len++;
+				}
+				break;
+			case SEEN_IAC:
+				if(buf[i] == SB) {
+					s->state = SEEN_SB;
+				} else if(buf[i] == IAC) {
+					output_start = i;
+					output_len = 1;
+					s->state = NORMAL;
+				} else {
+					s->state = SEEN_OPT_NEGOTIATION;
+				}
+				break;
+			case SEEN_OPT_NEGOTIATION:
+				// we can transition back to normal now, we've eaten this option
+				s->state = NORMAL;
+				output_len = 0;
+				output_start = i+1;
+				break;
+			case SEEN_SB:
+				if(buf[i] == SE) {
+					s->state = NORMAL;
+					output_len = 0;
+					output_start = i+1;
+				} else {
+					s->curr_sb_type = buf[i];
+					s->state = IN_SB;
+					s->sb_len = 0;
+				}
+				break;
+			case IN_SB:
+				if(buf[i] == SE) {
+					s->state = NORMAL;
+					output_len = 0;
+					output_start = i+1;
+				} else if(buf[i] == IAC) {
+					process_subblock(s, s->curr_sb_type, s->sb, s->sb_len);
+				} else if(s->sb_len < MAX_SB_LEN) {
+					s->sb[s->sb_len++] = buf[i];
+				}
+				break;
+		}
+	}
+	if(output_len > 0)
+		write(s->tty_master_fd, &buf[output_start], output_len);
 }
 
-static int send_opts()
+static int send_opts(int socket_fd)
 {
-	char buf[4096];
+	unsigned char buf[9];
 
 	// negotiate the only options I care about
 	buf[0] = IAC;
@@ -198,20 +202,157 @@ static int send_opts()
 	return write(socket_fd, buf, 9);
 }
 
-static void sigchld_handler(int signal)
+// starts the program on a new tty, with the slave end as its stdin, stdout and stderr
+static proc_id spawn_on_tty(int tty_slave_fd)
+{
+	int saved_fds[3];
+	proc_id pid;
+	int i;
+
+	for(i = 0; i < 3; i++) {
+		saved_fds[i] = dup(i);
+		dup2(tty_slave_fd, i);
+	}
+
+	pid = _kern_proc_create_proc(spawn_argv[0], spawn_argv[0], spawn_argv, spawn_argc, 5, PROC_FLAG_NEW_PGROUP);
+
+	for(i = 0; i < 3; i++) {
+		dup2(saved_fds[i], i);
+		close(saved_fds[i]);
+	}
+
+	return pid;
+}
+
+static void close_session(session *s)
+{
+	_kern_wait_set_remove(wait_set, WAIT_OBJECT_FD, s->socket_fd);
+	_kern_wait_set_remove(wait_set, WAIT_OBJECT_FD, s->tty_master_fd);
+
+	// the other end went away, the shell may still be around
+	_kern_send_proc_signal(s->pid, SIGHUP);
+
+	close(s->socket_fd);
+	close(s->tty_master_fd);
+	s->inuse = false;
+}
+
+static int start_session(int socket_fd)
+{
+	session *s = NULL;
+	struct tty_flags flags;
+	char temp[128];
+	int tty_slave_fd;
+	int tty_num;
+	int i;
+
+	for(i = 0; i < MAX_SESSIONS; i++) {
+		if(!sessions[i].inuse) {
+			s = &sessions[i];
+			break;
+		}
+	}
+	if(s == NULL)
+		goto err;
+
+	s->socket_fd = socket_fd;
+	s->state = NORMAL;
+	s->curr_sb_type = 0;
+	s->sb_len = 0;
+
+	s->tty_master_fd = open("/dev/tty/master", 0);
+	if(s->tty_master_fd < 0)
+		goto err;
+
+	tty_num = ioctl(s->tty_master_fd, _TTY_IOCTL_GET_TTY_NUM, NULL, 0);
+	if(tty_num < 0)
+		goto err1;
+
+	ioctl(s->tty_master_fd, _TTY_IOCTL_GET_TTY_FLAGS, &flags, sizeof(flags));
+	flags.input_flags |= TTY_FLAG_CRNL;
+	ioctl(s->tty_master_fd, _TTY_IOCTL_SET_TTY_FLAGS, &flags, sizeof(flags));
+
+	sprintf(temp, "/dev/tty/slave/%d", tty_num);
+	tty_slave_fd = open(temp, 0);
+	if(tty_slave_fd < 0)
+		goto err1;
+
+	// send some options over to the other side
+	send_opts(socket_fd);
+
+	// now start the app, once we let go of the slave end it's the only one holding it
+	s->pid = spawn_on_tty(tty_slave_fd);
+	close(tty_slave_fd);
+	if(s->pid < 0)
+		goto err1;
+
+	if(_kern_wait_set_add(wait_set, WAIT_OBJECT_FD, socket_fd, WAIT_EVENT_READ, s) < 0)
+		goto err2;
+	if(_kern_wait_set_add(wait_set, WAIT_OBJECT_FD, s->tty_master_fd, WAIT_EVENT_READ, s) < 0)
+		goto err3;
+
+	s->inuse = true;
+	return 0;
+
+err3:
+	_kern_wait_set_remove(wait_set, WAIT_OBJECT_FD, socket_fd);
+err2:
+	_kern_send_proc_signal(s->pid, SIGHUP);
+err1:
+	close(s->tty_master_fd);
+err:
+	close(socket_fd);
+	return -1;
+}
+
+static void handle_socket(session *s)
+{
+	unsigned char buf[4096];
+	ssize_t len;
+
+	len = read(s->socket_fd, buf, sizeof(buf));
+	if(len <= 0) {
+		close_session(s);
+		return;
+	}
+
+	process_socket_data(s, buf, len);
+}
+
+static void handle_tty(session *s)
 {
-	_kern_sem_release(wait_sem, 1);
+	char buf[4096];
+	ssize_t len;
+
+	// reads end of file once the program on the other end exits
+	len = read(s->tty_master_fd, buf, sizeof(buf));
+	if(len <= 0) {
+		close_session(s);
+		return;
+	}
+
+	if(write(s->socket_fd, buf, len) < 0)
+		close_session(s);
 }
 
 int main(int argc, char **argv)
 {
-	char **spawn_argv;
-	int spawn_argc;
+	wait_event events[MAX_EVENTS];
+	int first_arg = 1;
+	int port = 0;
+	int count;
 	int i;
-	proc_id pid;
-	thread_id tid;
 
-	if(argc < 2) {
+	if(argc >= 3 && strcmp(argv[1], "-p") == 0) {
+		port = atoi(argv[2]);
+		if(port == 0) {
+			printf("%s: invalid port number\n", argv[0]);
+			return -1;
+		}
+		first_arg = 3;
+	}
+
+	if(argc - first_arg < 1) {
 		printf("%s: not enough arguments\n", argv[0]);
 		return -1;
 	}
@@ -220,79 +361,91 @@ int main(int argc, char **argv)
 	setsid();
 
 	// build an array of args to pass anything we start up
-	spawn_argc = argc - 1;
+	spawn_argc = argc - first_arg;
 	spawn_argv = (char **)malloc(sizeof(char *) * spawn_argc);
 	if(spawn_argv == NULL)
 		return -1;
 	for(i = 0; i < spawn_argc; i++) {
-		spawn_argv[i] = argv[i + 1];
+		spawn_argv[i] = argv[i + first_arg];
 	}
 
-	// register for SIGCHLD signals
-	signal(SIGCHLD, &sigchld_handler);
-
-//	debug_fd = open("/dev/console", 0);
-	debug_fd = -1;
-
-	wait_sem = _kern_sem_create(0, "telnetd wait sem");
-	if(wait_sem < 0)
+	wait_set = _kern_wait_set_create();
+	if(wait_set < 0)
 		return -1;
 
-	tty_master_fd = open("/dev/tty/master", 0);
-	if(tty_master_fd < 0)
-		return -2;
-
-	tty_num = ioctl(tty_master_fd, _TTY_IOCTL_GET_TTY_NUM, NULL, 0);
-	if(tty_num < 0)
-		return -3;
-
-	{
-		struct tty_flags flags;
+	if(port != 0) {
+		listen_fd = open_listen_socket(port);
+		if(listen_fd < 0)
+			return listen_fd;
+
+		if(_kern_wait_set_add(wait_set, WAIT_OBJECT_FD, listen_fd, WAIT_EVENT_READ, NULL) < 0)
+			return -1;
+	} else {
+		int socket_fd;
+
+		// move the socket we were started on out of the way, the session holds the only reference
+		socket_fd = dup(0); // assume stdin, stdout, and stderr are the same socket
+		for(i = 0; i < 3; i++) {
+			close(i);
+			open("/dev/null", 0);
+		}
 
-		ioctl(tty_master_fd, _TTY_IOCTL_GET_TTY_FLAGS, &flags, sizeof(flags));
-		flags.input_flags |= TTY_FLAG_CRNL;
-		ioctl(tty_master_fd, _TTY_IOCTL_SET_TTY_FLAGS, &flags, sizeof(flags));
+		if(start_session(socket_fd) < 0)
+			return -1;
 	}
 
-	{
-		char temp[128];
-		sprintf(temp, "/dev/tty/slave/%d", tty_num);
+	for(;;) {
+		bool accept_pending = false;
 
-		tty_slave_fd = open(temp, 0);
-		if(tty_slave_fd < 0)
-			return -4;
-	}
+		count = _kern_wait_set_wait(wait_set, events, MAX_EVENTS, 0, 0);
+		if(count == ERR_INTERRUPTED)
+			continue;
+		if(count < 0)
+			break;
 
-	// move the stdin and stdout out of the way
-	socket_fd = dup(0); // assume stdin, stdout, and stderr are the same socket
-	close(0);
-	close(1);
-	close(2);
+		for(i = 0; i < count; i++) {
+			session *s = (session *)events[i].cookie;
 
-	// set the endpoints to the tty slave endpoint
-	dup2(tty_slave_fd, 0);
-	dup2(tty_slave_fd, 1);
-	dup2(tty_slave_fd, 2);
-	close(tty_slave_fd);
+			if(s == NULL) {
+				// the listen socket, new sessions are started once this batch is done
+				// so their fds can't be mistaken for ones closed in it
+				accept_pending = true;
+				continue;
+			}
 
-	// send some options over to the other side
-	send_opts();
+			// may have been closed by an earlier event in this batch
+			if(!s->inuse)
+				continue;
 
-	// now start the app
-	pid = _kern_proc_create_proc(spawn_argv[0], spawn_argv[0], spawn_argv, spawn_argc, 5, PROC_FLAG_NEW_PGROUP);
-	if(pid < 0)
-		return -1;
+			if(events[i].id == s->socket_fd)
+				handle_socket(s);
+			else if(events[i].id == s->tty_master_fd)
+				handle_tty(s);
+		}
+
+		if(accept_pending) {
+			sockaddr addr;
+			int new_fd;
 
-	tid = _kern_thread_create_thread("telnet reader", &telnet_reader, NULL);
-	_kern_thread_set_priority(tid, 30);
-	_kern_thread_resume_thread(tid);
+			// the listen socket only polls readable once a connection has
+			// finished its handshake, so this doesn't wait on a half open one
+			new_fd = socket_accept(listen_fd, &addr);
+			if(new_fd >= 0)
+				start_session(new_fd);
+		}
 
-	tid = _kern_thread_create_thread("telnet writer", &telnet_writer, NULL);
-	_kern_thread_set_priority(tid, 30);
-	_kern_thread_resume_thread(tid);
+		// serving the one socket we were started on, and it's gone
+		if(listen_fd < 0) {
+			for(i = 0; i < MAX_SESSIONS; i++) {
+				if(sessions[i].inuse)
+					break;
+			}
+			if(i == MAX_SESSIONS)
+				break;
+		}
+	}
 
-	_kern_sem_acquire(wait_sem, 1);
+	_kern_wait_set_delete(wait_set);
 
 	return 0;
 }
-
@@ -0,0 +1,155 @@
+/*
+** Copyright 2006, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscalls.h>
+
+// the writable fs to test is set in the environment:
+// WRITEBACK_DEVICE (say "x.x.x.x:/path" for nfs), and WRITEBACK_FS if it isn't nfs
+#define WB_MOUNT_POINT "/writeback"
+#define WB_FILE WB_MOUNT_POINT "/writeback.test"
+
+static const char *wb_device;
+static const char *wb_fs;
+
+// not a multiple of the page size, so the last page hangs past the end of the file
+#define WB_FILE_SIZE (3 * 4096 + 100)
+
+static char wb_buf[WB_FILE_SIZE];
+static char wb_check[WB_FILE_SIZE];
+
+static void wb_fill(char *buf, int pattern)
+{
+	int i;
+
+	for(i = 0; i < WB_FILE_SIZE; i++)
+		buf[i] = (char)(i * 7 + pattern);
+}
+
+static int wb_write(int pattern)
+{
+	int fd;
+	ssize_t len;
+
+	fd = _kern_open(WB_FILE, O_RDWR);
+	if(fd < 0) {
+		printf("error %d opening %s\n", fd, WB_FILE);
+		return fd;
+	}
+
+	wb_fill(wb_buf, pattern);
+	len = _kern_write(fd, wb_buf, 0, WB_FILE_SIZE);
+	_kern_close(fd);
+	if(len != WB_FILE_SIZE) {
+		printf("write returns %ld\n", (long)len);
+		return -1;
+	}
+
+	return 0;
+}
+
+// remounts, so the data can only have come from the fs, and compares it
+static int wb_remount_and_check(int pattern)
+{
+	struct file_stat stat;
+	int fd;
+	ssize_t len;
+	int err;
+
+	err = _kern_unmount(WB_MOUNT_POINT);
+	if(err < 0) {
+		printf("unmount returns %d\n", err);
+		return err;
+	}
+	err = _kern_mount(WB_MOUNT_POINT, wb_device, wb_fs, NULL);
+	if(err < 0) {
+		printf("mount returns %d\n", err);
+		return err;
+	}
+
+	err = _kern_rstat(WB_FILE, &stat);
+	if(err < 0 || stat.size != WB_FILE_SIZE) {
+		printf("file size %Ld after write back, should be %d\n", stat.size, WB_FILE_SIZE);
+		return -1;
+	}
+
+	fd = _kern_open(WB_FILE, O_RDONLY);
+	if(fd < 0)
+		return fd;
+	memset(wb_check, 0, sizeof(wb_check));
+	len = _kern_read(fd, wb_check, 0, WB_FILE_SIZE);
+	_kern_close(fd);
+
+	wb_fill(wb_buf, pattern);
+	if(len != WB_FILE_SIZE || memcmp(wb_buf, wb_check, WB_FILE_SIZE) != 0) {
+		printf("data read back doesn't match what was written (read returns %ld)\n", (long)len);
+		return -1;
+	}
+
+	return 0;
+}
+
+int writeback_test(int arg)
+{
+	int err;
+
+	wb_device = getenv("WRITEBACK_DEVICE");
+	if(wb_device == NULL) {
+		printf("set WRITEBACK_DEVICE (and WRITEBACK_FS if it isn't nfs) to a writable fs to test\n");
+		return -1;
+	}
+	wb_fs = getenv("WRITEBACK_FS");
+	if(wb_fs == NULL)
+		wb_fs = "nfs";
+
+	_kern_mkdir(WB_MOUNT_POINT);
+	err = _kern_mount(WB_MOUNT_POINT, wb_device, wb_fs, NULL);
+	printf("mount returns %d\n", err);
+	if(err < 0)
+		return err;
+
+	// writes that grow the file go straight to the fs
+	_kern_unlink(WB_FILE);
+	err = _kern_create(WB_FILE);
+	if(err < 0)
+		goto out;
+	err = wb_write(0);
+	if(err < 0)
+		goto out;
+
+	// writes inside the file stay in the cache until they're flushed
+	printf("overwriting, then sync\n");
+	err = wb_write(1);
+	if(err < 0)
+		goto out;
+	err = _kern_sync();
+	if(err < 0) {
+		printf("sync returns %d\n", err);
+		goto out;
+	}
+	err = wb_remount_and_check(1);
+	if(err < 0)
+		goto out;
+
+	// unmounting has to write them back too
+	printf("overwriting, then unmount\n");
+	err = wb_write(2);
+	if(err < 0)
+		goto out;
+	err = wb_remount_and_check(2);
+	if(err < 0)
+		goto out;
+
+	printf("dirty pages were written back on sync and unmount\n");
+
+out:
+	_kern_unlink(WB_FILE);
+	_kern_unmount(WB_MOUNT_POINT);
+
+	return err;
+}
@@ -41,6 +41,8 @@ static test_option opts[] = {
 	{ "4", "syscall benchmark", &syscall_bench, 0 },
 	{ "5", "test signals", &sig_test, 0 },
 	{ "6", "fpu safety test", &fpu_test, 0 },
+	{ "7", "port throughput benchmark", &port_bench, 0 },
+	{ "8", "file cache write back test (needs WRITEBACK_DEVICE)", &writeback_test, 0 },
 	{ 0, 0, 0, 0 }
 };
 
@@ -105,3 +105,113 @@ static int port_test_thread_func(void* arg)
 	return 0;
 }
 
+
+/*
+ * port throughput, copying vs. PORT_FLAG_REMAP
+ */
+#define BENCH_MIN_SIZE (4*1024)
+#define BENCH_MAX_SIZE (4*1024*1024)
+#define BENCH_COPY_MAX_SIZE (64*1024)		// largest message the copy path takes
+#define BENCH_BYTES (64*1024*1024)			// moved per message size
+
+static int bench_count(size_t size)
+{
+	int count = BENCH_BYTES / size;
+
+	return (count < 16) ? 16 : count;
+}
+
+static void bench_report(const char *mode, size_t size, int count, bigtime_t t)
+{
+	if(t <= 0)
+		t = 1;
+	printf("%s\t%7ld bytes\t%6d msgs\t%8Ld usecs\t%6Ld MB/s\t%6Ld usecs/msg\n",
+		mode, (long)size, count, t, ((bigtime_t)size * count) / t, t / count);
+}
+
+static int bench_copy(port_id port, size_t size)
+{
+	static char buf[BENCH_COPY_MAX_SIZE];
+	int count = bench_count(size);
+	bigtime_t t;
+	int32 code;
+	int i;
+	int err;
+
+	// fill the message every time around, the remap test has to as well
+	t = _kern_system_time();
+	for(i = 0; i < count; i++) {
+		memset(buf, 0x55, size);
+		err = _kern_port_write(port, i, buf, size);
+		if(err < 0)
+			return err;
+		err = _kern_port_read(port, &code, buf, size);
+		if(err < 0)
+			return err;
+	}
+	t = _kern_system_time() - t;
+
+	bench_report("copy", size, count, t);
+	return 0;
+}
+
+static int bench_remap(port_id port, size_t size)
+{
+	int count = bench_count(size);
+	region_id rid;
+	void *buf;
+	bigtime_t t;
+	int32 code;
+	int i;
+	int err;
+
+	// the region read back is read only, so every message is filled in a new one
+	t = _kern_system_time();
+	for(i = 0; i < count; i++) {
+		rid = _kern_vm_create_anonymous_region("port_bench", &buf, REGION_ADDR_ANY_ADDRESS,
+			size, REGION_WIRING_LAZY, LOCK_RW);
+		if(rid < 0)
+			return rid;
+		memset(buf, 0x55, size);
+		err = _kern_port_write_etc(port, i, buf, size, PORT_FLAG_REMAP, 0);
+		if(err < 0) {
+			_kern_vm_delete_region(rid);
+			return err;
+		}
+		err = _kern_port_read_etc(port, &code, &rid, sizeof(rid), PORT_FLAG_REMAP, 0);
+		if(err < 0)
+			return err;
+		_kern_vm_delete_region(rid);
+	}
+	t = _kern_system_time() - t;
+
+	bench_report("remap", size, count, t);
+	return 0;
+}
+
+int port_bench(int arg)
+{
+	port_id port;
+	size_t size;
+	int err;
+
+	port = _kern_port_create(1, "port bench");
+	if(port < 0) {
+		printf("port_bench: error %d creating port\n", port);
+		return port;
+	}
+
+	for(size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 4) {
+		if(size <= BENCH_COPY_MAX_SIZE) {
+			err = bench_copy(port, size);
+			if(err < 0)
+				printf("port_bench: copy of %ld bytes failed, error %d\n", (long)size, err);
+		}
+		err = bench_remap(port, size);
+		if(err < 0)
+			printf("port_bench: remap of %ld bytes failed, error %d\n", (long)size, err);
+	}
+
+	_kern_port_delete(port);
+	return 0;
+}
@@ -11,6 +11,8 @@ int thread_spawn_test(int arg);
 int syscall_bench(int arg);
 int sig_test(int arg);
 int fpu_test(int arg);
+int port_bench(int arg);
+int writeback_test(int arg);
 
 #endif
 
@@ -25,6 +25,53 @@ typedef struct thread_time {
 
 static thread_time *times = NULL;
 
+typedef struct proc_faults {
+	struct proc_faults *next;
+
+	struct proc_info info;
+
+	int delta_faults;
+	int delta_major_faults;
+
+	bool touched;
+} proc_faults;
+
+static proc_faults *faults = NULL;
+
+static proc_faults *find_proc_in_list(proc_id id)
+{
+	proc_faults *pf;
+
+	for(pf = faults; pf; pf = pf->next) {
+		if(id == pf->info.pid)
+			return pf;
+	}
+	return NULL;
+}
+
+static void prune_untouched_procs(void)
+{
+	proc_faults *pf, *last, *temp;
+
+	last = NULL;
+	pf = faults;
+	while(pf) {
+		if(!pf->touched) {
+			if(!last)
+				faults = pf->next;
+			else
+				last->next = pf->next;
+			temp = pf;
+			pf = pf->next;
+			free(temp);
+		} else {
+			pf->touched = false;
+			last = pf;
+			pf = pf->next;
+		}
+	}
+}
+
 static thread_time *find_in_list(thread_id id)
 {
 	thread_time *tt;
@@ -106,6 +153,7 @@ static int gather_info(void)
 	struct proc_info pi;
 	struct thread_info ti;
 	thread_time *tt;
+	proc_faults *pf;
 	int err;
 	uint32 cookie, cookie2;
 
@@ -116,6 +164,21 @@ static int gather_info(void)
 		if(err < 0)
 			break;
 
+		pf = find_proc_in_list(pi.pid);
+		if(!pf) {
+			pf = malloc(sizeof(proc_faults));
+			if(!pf)
+				return ERR_NO_MEMORY;
+
+			memcpy(&pf->info, &pi, sizeof(pi));
+			pf->next = faults;
+			faults = pf;
+		}
+		pf->delta_faults = pi.page_faults - pf->info.page_faults;
+		pf->delta_major_faults = pi.major_faults - pf->info.major_faults;
+		memcpy(&pf->info, &pi, sizeof(pi));
+		pf->touched = true;
+
 		cookie2 = 0;
 		for(;;) {
 			err = _kern_thread_get_next_thread_info(&cookie2, pi.pid, &ti);
@@ -151,6 +214,7 @@ static int gather_info(void)
 
 	// prune any untouched entries
 	prune_untouched();
+	prune_untouched_procs();
 
 	// sort the entries
 //	sort_times();
@@ -161,6 +225,7 @@ static int gather_info(void)
 static int display_info(void)
 {
 	thread_time *tt;
+	proc_faults *pf;
 	bigtime_t total_user = 0;
 	bigtime_t total_kernel = 0;
 
@@ -177,6 +242,15 @@ static int display_info(void)
 	}
 	printf("%18s%12Ld%12Ld\n", "total:", total_user, total_kernel);
 
+	// and the page faults of the procs that took any since last time
+	printf("\n   pid  faults   major                            name\n");
+	for(pf = faults; pf; pf = pf->next) {
+		if(pf->delta_faults == 0)
+			continue;
+		printf("%6d%8d%8d%32s\n",
+			pf->info.pid, pf->delta_faults, pf->delta_major_faults, pf->info.name);
+	}
+
 	return 0;
 }
 
@@ -0,0 +1,88 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/syscalls.h>
+#include <newos/errors.h>
+
+#define ITERATIONS 2000
+#define MAX_THREADS 8
+
+static const char *paths[] = {
+	"/boot/bin/ls",
+	"/boot/bin/shell",
+	"/boot/bin/vfstest",
+	"/boot/bin/no_such_file",	// exercises the negative lookups
+	"/dev/null",
+};
+#define NUM_PATHS (sizeof(paths) / sizeof(paths[0]))
+
+// stats and opens/closes every path ITERATIONS times
+static int lookup_thread(void *arg)
+{
+	struct file_stat stat;
+	unsigned int i, j;
+	int fd;
+
+	for(i = 0; i < ITERATIONS; i++) {
+		for(j = 0; j < NUM_PATHS; j++) {
+			_kern_rstat(paths[j], &stat);
+
+			fd = _kern_open(paths[j], 0);
+			if(fd >= 0)
+				_kern_close(fd);
+		}
+	}
+
+	return 0;
+}
+
+// runs the lookup loop in 1, 2, 4 and 8 threads at once
+static void parallel_lookup_test(void)
+{
+	thread_id tids[MAX_THREADS];
+	bigtime_t t;
+	int ops;
+	int num_threads;
+	int i;
+
+	for(num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2) {
+		t = _kern_system_time();
+		for(i = 0; i < num_threads; i++) {
+			tids[i] = _kern_thread_create_thread("lookup thread", &lookup_thread, NULL);
+			_kern_thread_resume_thread(tids[i]);
+		}
+		for(i = 0; i < num_threads; i++)
+			_kern_thread_wait_on_thread(tids[i], NULL);
+		t = _kern_system_time() - t;
+
+		// a stat and an open/close per path per iteration
+		ops = num_threads * ITERATIONS * NUM_PATHS * 2;
+		printf("%d threads doing %d path operations took %d microseconds, %d ops per second\n",
+			num_threads, ops, (int)t, t ? (int)(((bigtime_t)ops * 1000000) / t) : 0);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct file_stat stat;
+	unsigned int j;
+
+	printf("VFS test\n");
+
+	for(j = 0; j < NUM_PATHS; j++) {
+		int err = _kern_rstat(paths[j], &stat);
+		printf("stat '%s' returns %d\n", paths[j], err);
+	}
+
+	printf("running parallel open/stat tests\n");
+	parallel_lookup_test();
+
+	printf("vfstest: exiting\n");
+	return 0;
+}
+
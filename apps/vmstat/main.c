@@ -13,8 +13,8 @@ int main(int argc, char **argv)
 
 	for(i = 0;; i++) {
 		if((i % 20) == 0) {
-			printf("   act inact  busy   mod  modt  free clear wired unused max commit page faults\n");
-			printf("------------------------------------------------------------------------------\n");
+			printf("   act inact  busy   mod  modt  free clear wired unused max commit page faults page ins read ahead  fault around busy waits  swap swfree swouts  swins reclaimed\n");
+			printf("-------------------------------------------------------------------------------------------------------------------------------------------------------\n");
 		}
 
 		int err = _kern_vm_get_vm_info(&info);
@@ -23,9 +23,11 @@ int main(int argc, char **argv)
 			return -1;
 		}
 
-		printf("%6d%6d%6d%6d%6d%6d%6d%6d%7d%11d%12d\n",
+		printf("%6d%6d%6d%6d%6d%6d%6d%6d%7d%11d%12d%9d%11d%14d%11d%6d%7d%7d%7d%10d\n",
 			info.active_pages, info.inactive_pages, info.busy_pages, info.modified_pages, info.modified_temporary_pages,
-			info.free_pages, info.clear_pages, info.wired_pages, info.unused_pages, info.max_commit, info.page_faults);
+			info.free_pages, info.clear_pages, info.wired_pages, info.unused_pages, info.max_commit, info.page_faults,
+			info.page_ins, info.read_ahead_pages, info.fault_around_pages, info.busy_page_waits,
+			info.swap_pages, info.swap_free_pages, info.swap_outs, info.swap_ins, info.reclaimed_pages);
 
 		sleep(1);
 	}
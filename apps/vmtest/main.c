@@ -9,6 +9,150 @@
 #include <newos/errors.h>
 #include <unistd.h>
 
+#define FAULT_REGION_SIZE (8*1024*1024)
+
+static int fault_thread(void *arg)
+{
+	region_id region;
+	char *ptr;
+	int i;
+
+	region = _kern_vm_create_anonymous_region("fault test", (void **)&ptr, REGION_ADDR_ANY_ADDRESS,
+		FAULT_REGION_SIZE, REGION_WIRING_LAZY, LOCK_RW);
+	if(region < 0)
+		return region;
+
+	// touch every page, each one is a soft fault and a page allocation
+	for(i = 0; i < FAULT_REGION_SIZE; i += 4096)
+		ptr[i] = 1;
+
+	_kern_vm_delete_region(region);
+	return 0;
+}
+
+// faults in FAULT_REGION_SIZE worth of pages in each of a number of threads at once
+static void parallel_fault_test(void)
+{
+	thread_id tids[8];
+	bigtime_t t;
+	int num_threads;
+	int i;
+
+	for(num_threads = 1; num_threads <= 8; num_threads *= 2) {
+		t = _kern_system_time();
+		for(i = 0; i < num_threads; i++) {
+			tids[i] = _kern_thread_create_thread("fault thread", &fault_thread, NULL);
+			_kern_thread_resume_thread(tids[i]);
+		}
+		for(i = 0; i < num_threads; i++)
+			_kern_thread_wait_on_thread(tids[i], NULL);
+		t = _kern_system_time() - t;
+
+		printf("%d threads faulting in %d pages each took %d microseconds, %d usecs per page\n",
+			num_threads, FAULT_REGION_SIZE / 4096, (int)t, (int)(t / (num_threads * (FAULT_REGION_SIZE / 4096))));
+	}
+}
+
+#define MAX_TEST_REGIONS 4096
+
+static region_id test_regions[MAX_TEST_REGIONS];
+static char *test_region_ptrs[MAX_TEST_REGIONS];
+
+// times region creation, faults and deletion with a growing number of regions
+// in the address space. The faults hop around between regions so the lookup
+// can't be served out of the last hit.
+static void region_count_fault_test(void)
+{
+	bigtime_t create_time, fault_time, delete_time;
+	int num_regions;
+	int count;
+	int i;
+
+	for(num_regions = 16; num_regions <= MAX_TEST_REGIONS; num_regions *= 4) {
+		create_time = _kern_system_time();
+		for(count = 0; count < num_regions; count++) {
+			test_regions[count] = _kern_vm_create_anonymous_region("region count test", (void **)&test_region_ptrs[count],
+				REGION_ADDR_ANY_ADDRESS, 4096, REGION_WIRING_LAZY, LOCK_RW);
+			if(test_regions[count] < 0) {
+				printf("error %d creating region %d\n", test_regions[count], count);
+				break;
+			}
+		}
+		create_time = _kern_system_time() - create_time;
+
+		if(count > 0) {
+			fault_time = _kern_system_time();
+			for(i = 0; i < count; i++)
+				test_region_ptrs[(i * 7919) % count][0] = 1;
+			fault_time = _kern_system_time() - fault_time;
+		} else {
+			fault_time = 0;
+		}
+
+		delete_time = _kern_system_time();
+		for(i = 0; i < count; i++)
+			_kern_vm_delete_region(test_regions[i]);
+		delete_time = _kern_system_time() - delete_time;
+
+		if(count == 0)
+			break;
+
+		printf("%5d regions: create %d usecs/region, fault %d usecs/fault, delete %d usecs/region\n",
+			count, (int)(create_time / count), (int)(fault_time / count), (int)(delete_time / count));
+
+		if(count < num_regions)
+			break;
+	}
+}
+
+// times fork against how much memory the parent has touched. The child
+// exits right away, so this is the cost of setting up the copy on write
+// address space and tearing it down again.
+static void fork_latency_test(void)
+{
+	region_id region;
+	char *ptr;
+	bigtime_t fork_time, total_time, write_time;
+	proc_id pid;
+	int size;
+	int i;
+
+	for(size = 1024*1024; size <= 64*1024*1024; size *= 4) {
+		region = _kern_vm_create_anonymous_region("fork test", (void **)&ptr, REGION_ADDR_ANY_ADDRESS,
+			size, REGION_WIRING_LAZY, LOCK_RW);
+		if(region < 0) {
+			printf("error %d creating %d byte region\n", region, size);
+			break;
+		}
+		for(i = 0; i < size; i += 4096)
+			ptr[i] = 1;
+
+		total_time = _kern_system_time();
+		pid = _kern_proc_fork();
+		if(pid == 0)
+			_kern_exit(0);
+		fork_time = _kern_system_time() - total_time;
+		if(pid < 0) {
+			printf("error %d forking\n", pid);
+			_kern_vm_delete_region(region);
+			break;
+		}
+		_kern_proc_wait_on_proc(pid, NULL);
+		total_time = _kern_system_time() - total_time;
+
+		// the first write to each page after the fork makes a copy of it
+		write_time = _kern_system_time();
+		for(i = 0; i < size; i += 4096)
+			ptr[i] = 2;
+		write_time = _kern_system_time() - write_time;
+
+		printf("%5d KB touched: fork %d usecs, fork+exit+wait %d usecs, rewriting it %d usecs\n",
+			size / 1024, (int)fork_time, (int)total_time, (int)write_time);
+
+		_kern_vm_delete_region(region);
+	}
+}
+
 int main(void)
 {
 	int rc = 0;
@@ -118,6 +262,21 @@ int main(void)
 	}
 #endif
 
+#if 1
+	printf("running parallel page fault tests\n");
+	parallel_fault_test();
+#endif
+
+#if 1
+	printf("running page fault tests against the number of regions\n");
+	region_count_fault_test();
+#endif
+
+#if 1
+	printf("running fork latency tests against the address space size\n");
+	fork_latency_test();
+#endif
+
 	printf("vmtest: exiting w/return code %d\n", rc);
 	return rc;
 }
@@ -69,7 +69,7 @@ typedef struct pdentry {
 	unsigned int write_through:1;
 	unsigned int cache_disabled:1;
 	unsigned int accessed:1;
-	unsigned int reserved:1;
+	unsigned int dirty:1; // only for 4MB pages
 	unsigned int page_size:1;
 	unsigned int global:1;
 	unsigned int avail:3;
@@ -190,6 +190,7 @@ void setup_system_time(unsigned int cv_factor);
 bigtime_t i386_cycles_to_time(uint64 cycles);
 void i386_context_switch(struct arch_thread *old, struct arch_thread *new);
 void i386_enter_uspace(addr_t entry, void *args, addr_t ustack_top);
+void i386_return_to_uspace(struct iframe *frame);
 void i386_set_kstack(addr_t kstack);
 void i386_switch_stack_and_call(addr_t stack, void (*func)(void *), void *arg);
 void i386_swap_pgdir(addr_t new_pgdir);
@@ -20,6 +20,8 @@ void arch_thread_context_switch(struct thread *t_from, struct thread *t_to, stru
 int arch_thread_initialize_kthread_stack(struct thread *t, int (*start_func)(void));
 void arch_thread_dump_info(void *info);
 void arch_thread_enter_uspace(struct thread *t, addr_t entry, void *args, addr_t ustack_top);
+void *arch_thread_save_user_state(void);
+void arch_thread_enter_uspace_forked(struct thread *t, void *state);
 void arch_thread_switch_kstack_and_call(addr_t new_kstack, void (*func)(void *), void *arg);
 
 struct thread *arch_thread_get_current_thread(void);
@@ -15,6 +15,7 @@ typedef struct vm_translation_map_struct {
 	struct vm_translation_map_ops_struct *ops;
 	recursive_lock lock;
 	int map_count;
+	int large_map_count;
 	struct vm_translation_map_arch_info_struct *arch_data;
 } vm_translation_map;
 
@@ -24,6 +25,7 @@ typedef struct vm_translation_map_ops_struct {
 	int (*lock)(vm_translation_map*);
 	int (*unlock)(vm_translation_map*);
 	int (*map)(vm_translation_map *map, addr_t va, addr_t pa, unsigned int attributes);
+	int (*map_large)(vm_translation_map *map, addr_t va, addr_t pa, unsigned int attributes);
 	int (*unmap)(vm_translation_map *map, addr_t start, addr_t end);
 	int (*query)(vm_translation_map *map, addr_t va, addr_t *out_physical, unsigned int *out_flags);
 	addr_t (*get_mapped_size)(vm_translation_map*);
@@ -41,6 +43,11 @@ void vm_translation_map_module_init_post_sem(kernel_args *ka);
 // quick function to map a page in regardless of map context. Used in VM initialization,
 // before most vm data structures exist
 int vm_translation_map_quick_map(kernel_args *ka, addr_t va, addr_t pa, unsigned int attributes, addr_t (*get_free_page)(kernel_args *));
+// same thing for one large page, va and pa have to be aligned to the large page size
+int vm_translation_map_quick_map_large(kernel_args *ka, addr_t va, addr_t pa, unsigned int attributes);
+
+// size of the pages map_large maps, 0 if the cpu can't do large pages
+addr_t vm_translation_map_large_page_size(void);
 
 // quick function to return the physical pgdir of a mapping, needed for a context switch
 // XXX both are arch dependant
@@ -21,6 +21,17 @@ typedef struct cpu_ent {
 	int preempted;
 	struct timer_event quantum_timer;
 
+	// thread.c: per-cpu run queue, under its own lock. The lock is also held
+	// across a context switch and let go by the thread switched to.
+	spinlock_t run_q_lock;
+	struct list_node run_q[THREAD_NUM_PRIORITY_LEVELS];
+	uint32 run_q_bitmap[THREAD_NUM_PRIORITY_LEVELS / 32]; // bit set for every non-empty queue
+	int run_q_count; // non-idle threads waiting in run_q
+	struct thread *running_thread;
+	int run_q_steals; // threads pulled over from other cpus' run queues
+	struct thread *switch_prev; // thread being switched away from
+	int switch_death_stack; // death stack to hand back once the switch is done, -1 if none
+
 	// remember which thread's fpu state we hold
 	// NULL means we dont hold any state
 	struct thread *fpu_state_thread;
@@ -28,6 +39,7 @@ typedef struct cpu_ent {
 	// timer.c: per-cpu timer queues
 	struct timer_event * volatile timer_events;
 	spinlock_t timer_spinlock;
+	bool tick_stopped; // periodic tick is off while this cpu idles
 
 	// arch-specific stuff
 	struct arch_cpu_info arch;
@@ -26,6 +26,9 @@ struct dev_calls {
 	int (*dev_canpage)(dev_ident ident);
 	ssize_t (*dev_readpage)(dev_ident ident, iovecs *vecs, off_t pos);
 	ssize_t (*dev_writepage)(dev_ident ident, iovecs *vecs, off_t pos);
+
+	// optional, see fs_poll
+	int (*dev_poll)(dev_cookie cookie, struct wait_watch *watch);
 };
 
 /* api drivers will use these to publish devices */
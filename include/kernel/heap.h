@@ -13,5 +13,10 @@ int heap_init_postsem(kernel_args *ka);
 void *kmalloc(unsigned int size);
 void kfree(void *address);
 char *kstrdup(const char*text);
+
+// page runs for the slab allocator
+void *heap_alloc_slab_pages(unsigned int pages);
+void heap_free_slab_pages(void *address, unsigned int pages);
+void *heap_find_slab(void *address);
 #endif
 
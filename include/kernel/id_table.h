@@ -0,0 +1,47 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _KERNEL_ID_TABLE_H
+#define _KERNEL_ID_TABLE_H
+
+// per slot bookkeeping, must be embedded in every table entry
+struct id_table_link {
+	int next;	// next free slot + 1, 0 terminates the free list
+	int gen;	// bumped every time the slot is handed out
+};
+
+struct id_table_stats {
+	unsigned int capacity;
+	unsigned int max_entries;
+	int in_use;
+	int allocs;
+	int frees;
+	int grows;
+	int retries;	// lost races on the free list head
+};
+
+void *id_table_create(const char *name, unsigned int entry_size, int link_offset,
+	unsigned int chunk_entries, unsigned int initial_entries, unsigned int max_entries,
+	void init_func(void *e));
+int id_table_alloc(void *_table);
+void id_table_free(void *_table, int id);
+void *id_table_lookup(void *_table, int id);
+unsigned int id_table_capacity(void *_table);
+void id_table_get_stats(void *_table, struct id_table_stats *stats);
+void id_table_dump(void *_table);
+
+/*
+	ids handed out by id_table_alloc are >= 0, with the slot in the low bits
+	and the slot's generation above it, so a stale id won't match a recycled slot.
+	id_table_lookup() returns the slot an id maps to, or NULL if the table
+	hasn't grown that far. The caller still has to compare the id stored in the
+	entry under the entry's own lock, the table doesn't track that.
+	Slots 0 .. id_table_capacity() - 1 can be walked by passing them as the id.
+
+	init_func is called on every entry when a chunk is added to the table,
+	entries are zeroed before that.
+*/
+
+#endif
+
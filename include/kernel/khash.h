@@ -23,6 +23,7 @@ void hash_close(void *_hash_table, struct hash_iterator *i, bool free_iterator);
 void *hash_next(void *_hash_table, struct hash_iterator *i);
 void hash_rewind(void *_hash_table, struct hash_iterator *i);
 void hash_dump(void *_hash_table);
+int hash_init_postthread(void);
 
 /* function ptrs must look like this:
 	// hash function should calculate hash on either e or key,
@@ -33,6 +34,10 @@ unsigned int hash_func(void *e, const void *key, unsigned int range);
 	// NOTE: compare func can be null, in which case the hash
 	// code will compare the key pointer with the target
 int compare_func(void *e, const void *key);
+
+	// tables grow on their own as elements are inserted, table_size
+	// passed to hash_init is only the starting size. The range passed to
+	// hash_func changes as they do, and isn't a power of 2.
 */
 
 unsigned int hash_hash_str( const char *str );
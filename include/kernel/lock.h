@@ -30,6 +30,7 @@ typedef struct mutex {
 int mutex_init(mutex *m, const char *name);
 void mutex_destroy(mutex *m);
 void mutex_lock(mutex *m);
+bool mutex_trylock(mutex *m);
 void mutex_unlock(mutex *m);
 
 #define ASSERT_LOCKED_MUTEX(m) { ASSERT(thread_get_current_thread_id() == (m)->holder); }
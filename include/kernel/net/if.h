@@ -28,6 +28,22 @@ enum {
 
 typedef int if_id;
 
+// returned by a driver's IOCTL_NET_IF_GET_RX_HOOKS, if it can hand received
+// frames up already in a cbuf instead of copying them out in read()
+typedef struct if_rx_hooks {
+	void *cookie;
+	// blocks until frames come in, returns how many (up to max) are linked through packet_next
+	int (*rx)(void *cookie, cbuf **chain, int max);
+} if_rx_hooks;
+
+// returned by a driver's IOCTL_NET_IF_GET_TX_HOOKS, if it can take a whole
+// list of frames in one call instead of one write() per frame
+typedef struct if_tx_hooks {
+	void *cookie;
+	// queues up the frames linked through packet_next, and frees them
+	void (*tx)(void *cookie, cbuf *chain);
+} if_tx_hooks;
+
 typedef struct ifnet {
 	struct ifnet *next;
 	if_id id;
@@ -41,6 +57,12 @@ typedef struct ifnet {
 	size_t mtu;
 	int (*link_input)(cbuf *buf, struct ifnet *i);
 	int (*link_output)(cbuf *buf, struct ifnet *i, netaddr *target, int protocol_type);
+	if_rx_hooks rx_hooks;
+	if_tx_hooks tx_hooks;
+	uint32 rx_packets;
+	uint32 rx_wakeups;
+	uint32 tx_packets;
+	uint32 tx_wakeups;
 	sem_id tx_queue_sem;
 	mutex tx_queue_lock;
 	fixed_queue tx_queue;
@@ -56,6 +78,7 @@ void if_bind_address(ifnet *i, ifaddr *addr);
 void if_bind_link_address(ifnet *i, ifaddr *addr);
 int if_boot_interface(ifnet *i);
 int if_output(cbuf *b, ifnet *i);
+bool if_lose_rx_packet(cbuf *b);
 
 #endif
 
@@ -21,7 +21,11 @@ ssize_t socket_write(sock_id id, const void *buf, ssize_t len);
 ssize_t socket_recvfrom(sock_id id, void *buf, ssize_t len, sockaddr *addr);
 ssize_t socket_recvfrom_etc(sock_id id, void *buf, ssize_t len, sockaddr *addr, int flags, bigtime_t timeout);
 ssize_t socket_sendto(sock_id id, const void *buf, ssize_t len, sockaddr *addr);
+int socket_setopt(sock_id id, int opt, int value);
+int socket_getopt(sock_id id, int opt);
 int socket_close(sock_id id);
+struct wait_watch;
+int socket_poll(sock_id id, struct wait_watch *watch);
 
 int socket_dev_init(void);
 
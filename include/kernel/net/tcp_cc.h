@@ -0,0 +1,50 @@
+/*
+** Copyright 2001-2006, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _NEWOS_KERNEL_NET_TCP_CC_H
+#define _NEWOS_KERNEL_NET_TCP_CC_H
+
+#include <kernel/kernel.h>
+
+/*
+	Congestion control for tcp. The socket owns the loss recovery and the
+	retransmit timer, the algorithm only decides how the congestion window
+	opens as data is acked and how far it closes when a loss is seen.
+	All windows are in bytes.
+*/
+
+typedef struct tcp_cc {
+	const struct tcp_cc_ops *ops;
+
+	uint32 mss;
+	uint32 cwnd;
+	uint32 ssthresh;
+	uint32 bytes_acked; // acked in congestion avoidance since the window last grew
+
+	/* cubic */
+	uint32 w_max;       // window right before the last reduction
+	uint32 w_last_max;
+	uint32 w_est;       // what reno would have by now
+	uint32 k;           // msecs from the start of the epoch until the window is back to w_max
+	bigtime_t epoch_start;
+} tcp_cc;
+
+typedef struct tcp_cc_ops {
+	const char *name;
+	void (*init)(tcp_cc *cc);
+	// new data was acked outside of loss recovery, srtt is in usecs
+	void (*ack)(tcp_cc *cc, uint32 acked, bigtime_t srtt);
+	// a loss was seen, returns the new ssthresh
+	uint32 (*loss)(tcp_cc *cc, uint32 flight_size);
+	// the retransmit timer went off, called after loss()
+	void (*timeout)(tcp_cc *cc);
+} tcp_cc_ops;
+
+void tcp_cc_init(tcp_cc *cc, uint32 mss);
+void tcp_cc_set_mss(tcp_cc *cc, uint32 mss);
+void tcp_cc_dump(tcp_cc *cc);
+int tcp_cc_module_init(void);
+
+#endif
+
@@ -19,6 +19,8 @@ int udp_accept(void *prot_data, sockaddr *addr, void **new_socket);
 int udp_close(void *prot_data);
 ssize_t udp_recvfrom(void *prot_data, void *buf, ssize_t len, sockaddr *saddr, int flags, bigtime_t timeout);
 ssize_t udp_sendto(void *prot_data, const void *buf, ssize_t len, sockaddr *addr);
+struct wait_watch;
+int udp_poll(void *prot_data, struct wait_watch *watch);
 int udp_init(void);
 
 #endif
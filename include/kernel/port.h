@@ -19,6 +19,12 @@
 // PORT_FLAG_TIMEOUT       must be the same as SEM_FLAG_TIMEOUT
 #define PORT_FLAG_TIMEOUT 2
 #define PORT_FLAG_INTERRUPTABLE 4
+// PORT_FLAG_REMAP (user calls only): the message buffer must be the start of one of the
+// writer's regions, which is handed over with the message. Big messages out of private,
+// writable anonymous memory move the pages rather than copying them. A reader passing the
+// flag gets a new read only region holding the message, its region_id is stored in the
+// read buffer.
+#define PORT_FLAG_REMAP 0x10
 #define PORT_FLAG_USE_USER_MEMCPY 0x80000000
 
 struct port_info {
@@ -46,6 +52,8 @@ ssize_t		port_buffer_size_etc(port_id port,
 				uint32 flags,
 				bigtime_t timeout);
 int32		port_count(port_id port);
+struct wait_watch;
+int			port_poll(port_id port, struct wait_watch *watch);
 ssize_t		port_read(port_id port,
 				int32 *msg_code,
 				void *msg_buffer,
@@ -73,6 +81,7 @@ int port_delete_owned_ports(proc_id owner);
 // temp: test
 void port_test(void);
 int	 port_test_thread_func(void* arg);
+void port_stress_test(void);
 
 // user-level API
 port_id		user_port_create(int32 queue_length, const char *name);
@@ -11,6 +11,7 @@
 #define SEM_FLAG_NO_RESCHED 1
 #define SEM_FLAG_TIMEOUT 2
 #define SEM_FLAG_INTERRUPTABLE 4
+#define SEM_FLAG_NO_NOTIFY 8 // release only, don't tell wait sets watching the sem
 
 struct sem_info {
 	sem_id		sem;
@@ -23,6 +24,7 @@ struct sem_info {
 int sem_init(kernel_args *ka);
 sem_id sem_create_etc(int count, const char *name, proc_id owner);
 sem_id sem_create(int count, const char *name);
+sem_id sem_create_mutex(const char *name);
 int sem_delete(sem_id id);
 int sem_delete_etc(sem_id id, int return_code);
 int sem_acquire(sem_id id, int count);
@@ -33,6 +35,8 @@ int sem_get_count(sem_id id, int32* thread_count);
 int sem_get_sem_info(sem_id id, struct sem_info *info);
 int sem_get_next_sem_info(proc_id proc, uint32 *cookie, struct sem_info *info);
 int set_sem_owner(sem_id id, proc_id proc);
+struct wait_watch;
+int sem_poll(sem_id id, struct wait_watch *watch);
 
 sem_id user_sem_create(int count, const char *name);
 int user_sem_delete(sem_id id);
@@ -48,6 +52,7 @@ int user_set_sem_owner(sem_id id, proc_id proc);
 
 int sem_delete_owned_sems(proc_id owner);
 int sem_interrupt_thread(struct thread *t);
+void sem_drop_held_sems(struct thread *t);
 
 #endif
 
@@ -0,0 +1,40 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _KERNEL_SLAB_H
+#define _KERNEL_SLAB_H
+
+#include <kernel/kernel.h>
+
+struct slab_cache;
+
+// flags for slab_cache_create
+#define SLAB_NO_MAGAZINES 0x1	// skip the per cpu layer, every call goes to the slabs
+
+// kmalloc sizes up to this are served out of the kmalloc-N caches
+#define SLAB_KMALLOC_MAX 2048
+
+struct slab_cache *slab_cache_create(const char *name, unsigned int size, unsigned int align, int flags);
+void *slab_alloc(struct slab_cache *cache);
+void slab_free(struct slab_cache *cache, void *obj);
+
+/*
+	Objects are handed out of a per cpu pair of magazines with interrupts
+	disabled, which is also the only thing protecting them. Only when both
+	are exhausted does the cpu trade with the cache's depot of full and empty
+	magazines, and only when that comes up empty does it go down to the slabs,
+	both under the cache's spinlock. Slabs are runs of heap pages and are
+	taken from the heap with the heap mutex, so slab_alloc and slab_free
+	must not be called with interrupts disabled, same as kmalloc.
+
+	Anything that came out of a cache can also be released with kfree.
+*/
+
+// used by the heap
+int slab_init(void);
+void *slab_kmalloc(unsigned int size);
+void slab_kfree(void *slab_base, void *address);
+
+#endif
+
@@ -42,6 +42,7 @@ int smp_get_current_cpu(void);
 
 // spinlock functions
 void acquire_spinlock(spinlock_t *lock);
+bool try_acquire_spinlock(spinlock_t *lock);
 void release_spinlock(spinlock_t *lock);
 
 #if !_WITH_SMP
@@ -63,6 +64,7 @@ extern inline int smp_get_current_cpu(void) { return 0; }
 
 // spinlock functions
 extern inline void acquire_spinlock(spinlock_t *lock) {}
+extern inline bool try_acquire_spinlock(spinlock_t *lock) { return true; }
 extern inline void release_spinlock(spinlock_t *lock) {}
 
 #endif
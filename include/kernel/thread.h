@@ -95,10 +95,19 @@ struct thread {
 	struct list_node q_node;
 	struct proc *proc;
 	char name[SYS_MAX_OS_NAME_LEN];
-	int priority;
+	int priority; // effective priority, including inheritance and wakeup boosts
+	int base_priority; // priority set through thread_set_priority
+	int inherited_priority; // highest priority inherited from mutex waiters, -1 if none
+	struct list_node pi_sems; // priority inheriting sems we currently hold
+	spinlock_t pi_sems_lock; // guards pi_sems, taken inside the sem locks
+	int run_q_priority; // run queue we sit in, may be aged above priority
+	bigtime_t ready_time; // when we were put into a run queue
+	int quantum_expirations; // quanta used up in a row without blocking
 	int state;
 	int next_state;
 	struct cpu_ent *cpu;
+	struct cpu_ent *last_cpu; // cpu we last ran on, or whose run queue we sit in
+	volatile bool in_switch; // last_cpu is still switching away from us
 	bool in_kernel;
 
 	struct cpu_ent *fpu_cpu; // this cpu holds our fpu state
@@ -143,6 +152,8 @@ struct proc_info {
 	sess_id sid;
 	int state;
 	int num_threads;
+	int page_faults;
+	int major_faults;
 	char name[SYS_MAX_OS_NAME_LEN];
 };
 
@@ -175,7 +186,11 @@ int thread_atinterrupt_exit(void); // called upon exit of an interrupt. Attempts
 int thread_suspend_thread(thread_id id);
 int thread_resume_thread(thread_id id);
 int thread_set_priority(thread_id id, int priority);
+void thread_inherit_priority(struct thread *t, int priority);
+void thread_drop_inherited_priority(struct thread *t);
+void thread_wakeup_boost(struct thread *t);
 void thread_resched(void);
+void thread_preempt(void);
 void thread_start_threading(void);
 int thread_snooze(bigtime_t time);
 void thread_yield(void);
@@ -206,6 +221,7 @@ int user_thread_get_next_thread_info(uint32 *cookie, proc_id pid, struct thread_
 
 struct proc *proc_get_kernel_proc(void);
 proc_id proc_create_proc(const char *path, const char *name, char **args, int argc, int priority, int flags);
+proc_id proc_fork_proc(void);
 int proc_kill_proc(proc_id);
 int proc_wait_on_proc(proc_id id, int *retcode);
 thread_id proc_get_main_thread(proc_id id);
@@ -223,6 +239,7 @@ int user_proc_get_next_proc_info(uint32 *cookie, struct proc_info *info);
 // used in syscalls.c
 int user_thread_wait_on_thread(thread_id id, int *uretcode);
 proc_id user_proc_create_proc(const char *path, const char *name, char **args, int argc, int priority, int flags);
+proc_id user_proc_fork(void);
 int user_proc_wait_on_proc(proc_id id, int *uretcode);
 thread_id user_thread_create_user_thread(char *uname, addr_t entry, void *args);
 int user_thread_set_priority(thread_id id, int priority);
@@ -10,6 +10,8 @@
 int time_init(kernel_args *ka);
 int time_init2(kernel_args *ka); // should be called just before enabling interrupts
 void time_tick(int tick_rate);
+void time_catch_up(void);
+bool time_can_stop_tick(void);
 
 // microseconds since the system was booted
 bigtime_t system_time(void);
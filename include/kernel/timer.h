@@ -32,10 +32,12 @@ int timer_set_event(bigtime_t relative_time, timer_mode mode, struct timer_event
 int timer_cancel_event(struct timer_event *event);
 
 /*
- * these two are only to be used by the scheduler
+ * these are only to be used by the scheduler
  */
 int local_timer_cancel_event(struct timer_event *event);
 int _local_timer_cancel_event(int curr_cpu, struct timer_event *event);
+void timer_stop_tick(void);
+void timer_start_tick(void);
 
 #endif
 
@@ -52,6 +52,8 @@ struct file_stat {
 	off_t		size;
 };
 
+struct wait_watch;
+
 struct fs_calls {
 	int (*fs_mount)(fs_cookie *fs, fs_id id, const char *device, void *args, vnode_id *root_vnid);
 	int (*fs_unmount)(fs_cookie fs);
@@ -91,11 +93,19 @@ struct fs_calls {
 
 	int (*fs_rstat)(fs_cookie fs, fs_vnode v, struct file_stat *stat);
 	int (*fs_wstat)(fs_cookie fs, fs_vnode v, struct file_stat *stat, int stat_mask);
+
+	// optional, attaches the watch to the object and returns the WAIT_EVENT_s ready on it
+	int (*fs_poll)(fs_cookie fs, fs_vnode v, file_cookie cookie, struct wait_watch *watch);
 };
 
 int vfs_init(kernel_args *ka);
 int vfs_bootstrap_all_filesystems(void);
+// flags for vfs_register_filesystem_etc
+#define FS_FLAG_NO_NAME_CACHE 0x1	// names can change behind the vfs' back, always ask fs_lookup
+#define FS_FLAG_WRITE_BACK    0x2	// fs_writepage works, writes to cached files can be written back later
+
 int vfs_register_filesystem(const char *name, struct fs_calls *calls);
+int vfs_register_filesystem_etc(const char *name, struct fs_calls *calls, int flags);
 void *vfs_new_ioctx(void *parent_ioctx);
 int vfs_free_ioctx(void *ioctx);
 int vfs_test(void);
@@ -110,6 +120,8 @@ image_id vfs_load_fs_module(const char *path);
 int vfs_get_vnode(fs_id fsid, vnode_id vnid, fs_vnode *v);
 int vfs_put_vnode(fs_id fsid, vnode_id vnid);
 int vfs_remove_vnode(fs_id fsid, vnode_id vnid);
+int vfs_name_cache_purge(fs_id fsid, vnode_id dir, const char *name); // name NULL purges the whole dir
+int vfs_file_cache_invalidate(fs_id fsid, vnode_id vnid); // the file changed behind the vfs' back
 
 /* calls needed by the VM for paging */
 int vfs_get_vnode_from_fd(int fd, bool kernel, void **vnode);
@@ -123,6 +135,12 @@ ssize_t vfs_writepage(void *vnode, iovecs *vecs, off_t pos);
 void *vfs_get_cache_ptr(void *vnode);
 int vfs_set_cache_ptr(void *vnode, void *cache);
 
+/* calls needed by wait sets */
+int vfs_get_fd_ptr(int fd, bool kernel, void **descriptor);
+void vfs_put_fd_ptr(void *descriptor);
+int vfs_poll(void *descriptor, struct wait_watch *watch);
+int vfs_free_unused_vnodes(int count);
+
 /* calls kernel code should make if it's trying strange stuff */
 int vfs_mount(char *path, const char *device, const char *fs_name, void *args, bool kernel);
 int vfs_unmount(char *path, bool kernel);
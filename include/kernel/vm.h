@@ -30,6 +30,9 @@ typedef struct vm_page {
 
 	unsigned int type : 2;
 	unsigned int state : 4;
+	unsigned int cpu_cached : 1;	// free or clear, and sitting in a per cpu cache
+	unsigned int buddy_head : 1;	// first page of a free block in the buddy allocator
+	unsigned int buddy_order : 4;	// log2 of the size of that block
 } vm_page;
 
 #define VM_PAGE_MAGIC 'vmpg'
@@ -75,6 +78,8 @@ typedef struct vm_cache {
 	unsigned int temporary : 1;
 	unsigned int scan_skip : 1;
 	off_t virtual_size;
+	int read_ahead;			// pages read in on the last miss, grows while misses are sequential
+	off_t read_ahead_next;	// offset just past the last read, a miss here is sequential
 } vm_cache;
 
 #define VM_CACHE_MAGIC 'vmca'
@@ -107,6 +112,15 @@ typedef struct vm_region {
 	struct vm_address_space *aspace;
 	struct vm_region *aspace_next;
 	struct vm_virtual_map *map;
+
+	// the map's address ordered tree, see vm_region_tree.c
+	struct vm_region *tree_parent;
+	struct vm_region *tree_left;
+	struct vm_region *tree_right;
+	int tree_height;
+	addr_t gap;		// free space between this region and the one below it
+	addr_t max_gap;	// largest gap in this region's subtree
+
 	struct list_node cache_node;
 	struct vm_region *hash_next;
 } vm_region;
@@ -116,8 +130,11 @@ typedef struct vm_region {
 // virtual map (1 per address space)
 typedef struct vm_virtual_map {
 	vm_region *region_list;
+	vm_region *region_tree;
 	vm_region *region_hint;
 	int change_count;
+	int lookups;
+	int hint_hits;
 	sem_id sem;
 	struct vm_address_space *aspace;
 	addr_t base;
@@ -138,7 +155,9 @@ typedef struct vm_address_space {
 	char *name;
 	aspace_id id;
 	int ref_count;
-	int fault_count;
+	int fault_count;	// reset by the working set daemon
+	int faults;			// since the aspace was created
+	int major_faults;	// the ones that had to read from a store
 	int state;
 	addr_t scan_va;
 	addr_t working_set_size;
@@ -208,6 +227,7 @@ int vm_init_postthread(kernel_args *ka);
 
 aspace_id vm_create_aspace(const char *name, addr_t base, addr_t alloc_base, addr_t size, bool kernel);
 int vm_delete_aspace(aspace_id);
+aspace_id vm_clone_aspace(const char *name, aspace_id aid);
 vm_address_space *vm_get_kernel_aspace(void);
 aspace_id vm_get_kernel_aspace_id(void);
 vm_address_space *vm_get_current_user_aspace(void);
@@ -229,7 +249,9 @@ region_id vm_clone_region(aspace_id aid, char *name, void **address, int addr_ty
 	region_id source_region, int mapping, int lock);
 int vm_delete_region(aspace_id aid, region_id id);
 region_id vm_find_region_by_name(aspace_id aid, const char *name);
+region_id vm_find_region_by_address(aspace_id aid, addr_t address);
 int vm_get_region_info(region_id id, vm_region_info *info);
+bool vm_region_is_private_anonymous(region_id rid);
 
 int vm_get_page_mapping(aspace_id aid, addr_t vaddr, addr_t *paddr);
 int vm_get_physical_page(addr_t paddr, addr_t *vaddr, int flags);
@@ -271,6 +293,17 @@ typedef struct {
 
 	// info about vm activity
 	int page_faults;
+	int page_ins;
+	int read_ahead_pages;
+	int fault_around_pages;
+	int busy_page_waits;
+
+	// info about swap
+	int swap_pages;
+	int swap_free_pages;
+	int swap_outs;
+	int swap_ins;
+	int reclaimed_pages;
 } vm_info_t;
 
 addr_t vm_get_mem_size(void);
@@ -14,11 +14,38 @@ vm_cache *vm_cache_create(vm_store *store);
 vm_cache_ref *vm_cache_ref_create(vm_cache *cache);
 void vm_cache_acquire_ref(vm_cache_ref *cache_ref, bool acquire_store_ref);
 void vm_cache_release_ref(vm_cache_ref *cache_ref);
+void vm_cache_release_ref_etc(vm_cache_ref *cache_ref, bool release_store_ref);
+bool vm_cache_try_acquire_ref(vm_cache_ref *cache_ref);
 vm_page *vm_cache_lookup_page(vm_cache_ref *cache_ref, off_t page);
 void vm_cache_insert_page(vm_cache_ref *cache_ref, vm_page *page, off_t offset);
 void vm_cache_remove_page(vm_cache_ref *cache_ref, vm_page *page);
 int vm_cache_insert_region(vm_cache_ref *cache_ref, vm_region *region);
 int vm_cache_remove_region(vm_cache_ref *cache_ref, vm_region *region);
+void vm_cache_collapse(vm_cache_ref *cache_ref);
+ssize_t vm_cache_page_in(vm_cache_ref *cache_ref, vm_page *page, off_t offset, off_t end);
+
+// file data cache
+vm_cache_ref *vm_get_vnode_cache(void *vnode);
+ssize_t vm_cache_read_file(void *vnode, void *buf, off_t pos, ssize_t len, off_t size);
+ssize_t vm_cache_write_file(void *vnode, const void *buf, off_t pos, ssize_t len, bool dirty);
+int vm_cache_flush_file(void *vnode);
+int vm_cache_invalidate_file(void *vnode);
+
+/*
+	vm_get_vnode_cache returns the vnode's cache, attaching a new one if it
+	doesn't have one yet. It lives until the vnode is destroyed, the caller
+	must hold a ref to the vnode.
+
+	vm_cache_read_file and vm_cache_write_file copy between buf and the cache,
+	pos and len must already be clipped to the size of the file. Missing pages
+	are read in from the vnode, reads pass the file's size so read-ahead stops
+	at the end of the file. A dirty write leaves the pages modified for
+	vm_cache_flush_file to write back, otherwise the data is assumed to have
+	been written to the file already and only pages in the cache are updated.
+
+	vm_cache_invalidate_file is for files that changed behind the cache's back.
+	It writes back what's dirty, then drops every page that isn't mapped or busy.
+*/
 
 #endif
 
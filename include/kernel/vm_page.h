@@ -12,6 +12,7 @@
 int vm_page_init(kernel_args *ka);
 int vm_page_init_postheap(kernel_args *ka);
 int vm_page_init2(kernel_args *ka);
+int vm_page_init_postsem(kernel_args *ka);
 int vm_page_init_postthread(kernel_args *ka);
 
 int vm_mark_page_inuse(addr_t page);
@@ -19,9 +20,14 @@ int vm_mark_page_range_inuse(addr_t start_page, addr_t len);
 int vm_page_set_state(vm_page *page, int state);
 
 vm_page *vm_page_allocate_page(int state);
+int vm_page_allocate_pages(int state, vm_page **pages, int count);
 vm_page *vm_page_allocate_page_run(int state, addr_t len);
 vm_page *vm_page_allocate_specific_page(addr_t page_num, int state);
 vm_page *vm_lookup_page(addr_t page_num);
 
+// sleeping on busy pages
+void vm_page_wait_busy(vm_page *page, vm_cache_ref *cache_ref);
+void vm_page_wake_busy_waiters(vm_page *page);
+
 #endif
 
@@ -22,6 +22,18 @@
 #define WORKING_SET_ADJUST_INTERVAL 5000000
 #define MAX_FAULTS_PER_SECOND 100
 #define MIN_FAULTS_PER_SECOND 10
+#define UNUSED_VNODE_TRIM_COUNT 64
+
+#define VM_READ_AHEAD_MIN 4			// pages read on the first sequential miss in a cache
+#define VM_READ_AHEAD_MAX 16
+#define VM_FAULT_AROUND_PAGES 8		// aligned block around a fault that gets mapped if it's in memory
+
+#define PAGEOUT_CLUSTER 16			// modified pages written to swap in one go
+#define PAGEOUT_INTERVAL 1000000
+#define PAGE_RECLAIM_BATCH 64		// clean pages freed per reclaim call
+#define PAGE_RECLAIM_SCAN_FACTOR 4	// pages looked at for every one to free
+#define FREE_PAGE_WAIT_TIMEOUT 100000
+#define FREE_PAGE_WAIT_RETRIES 50
 
 #define WRITE_COUNT 1024
 #define READ_COUNT 1
@@ -35,6 +47,15 @@
 int vm_page_fault(addr_t address, addr_t fault_address, bool is_write, bool is_user, addr_t *newip);
 void vm_increase_max_commit(addr_t delta);
 int vm_daemon_init(void);
+void vm_page_daemon_wakeup(void);
+int vm_page_reclaim(int target);
+
+// the address ordered tree of regions in a virtual map
+vm_region *vm_region_tree_floor(vm_virtual_map *map, addr_t address);
+vm_region *vm_region_tree_lookup(vm_virtual_map *map, addr_t address);
+void vm_region_tree_insert(vm_virtual_map *map, vm_region *region, vm_region *prev);
+void vm_region_tree_remove(vm_virtual_map *map, vm_region *region);
+int vm_region_tree_find_gap(vm_virtual_map *map, addr_t start, addr_t size, addr_t *_base);
 
 // used by the page daemon to walk the list of address spaces
 int vm_aspace_walk_start(struct hash_iterator *i);
@@ -46,6 +67,7 @@ addr_t vm_page_num_free_pages(void);
 
 // allocates memory from the ka structure
 addr_t vm_alloc_from_ka_struct(kernel_args *ka, unsigned int size, int lock);
+addr_t vm_alloc_large_from_ka_struct(kernel_args *ka, unsigned int size, int lock);
 addr_t vm_alloc_ppage_from_kernel_struct(kernel_args *ka);
 
 // a global structure holding data about the vm for informational purposes
@@ -0,0 +1,16 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _KERNEL_VM_STORE_ANONYMOUS_SWAP_H
+#define _KERNEL_VM_STORE_ANONYMOUS_SWAP_H
+
+#include <kernel/kernel.h>
+#include <kernel/vm.h>
+
+int vm_store_anonymous_swap_init(void);
+vm_store *vm_store_create_anonymous_swap(void);
+int vm_store_anonymous_swap_swapped_pages(vm_store *store);
+
+#endif
+
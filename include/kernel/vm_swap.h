@@ -0,0 +1,38 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _KERNEL_VM_SWAP_H
+#define _KERNEL_VM_SWAP_H
+
+#include <kernel/kernel.h>
+#include <kernel/vm.h>
+#include <kernel/vfs.h>
+
+// a page sized slot in the swap space
+typedef int swap_slot;
+#define SWAP_SLOT_NONE (-1)
+
+int vm_swap_init(void);
+int vm_swap_add(const char *path);
+bool vm_swap_enabled(void);
+
+int vm_swap_alloc(int count, swap_slot *slot);
+void vm_swap_free(swap_slot slot, int count);
+ssize_t vm_swap_read(swap_slot slot, iovecs *vecs, int first, int count);
+ssize_t vm_swap_write(swap_slot slot, iovecs *vecs, int first, int count);
+
+int user_vm_swapon(const char *upath);
+
+/*
+	There is one swap space, a block device or partition added with
+	vm_swap_add(), which also adds its size to max_commit.
+	vm_swap_alloc() hands out up to count consecutive slots and returns how
+	many it got, it only returns fewer if it couldn't find a long enough run.
+	vm_swap_read() and vm_swap_write() move vecs->vec[first] .. [first + count - 1],
+	which have to be one page each, to and from the consecutive slots
+	starting at slot.
+*/
+
+#endif
+
@@ -0,0 +1,80 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _KERNEL_WAIT_SET_H
+#define _KERNEL_WAIT_SET_H
+
+#include <kernel/kernel.h>
+#include <kernel/list.h>
+
+// events an object can be waited on for
+#define WAIT_EVENT_READ  1	// a read (or accept, or sem acquire) won't block
+#define WAIT_EVENT_WRITE 2	// a write won't block
+#define WAIT_EVENT_ERROR 4	// the object went away or the other end hung up, always reported
+
+// kinds of objects a wait set can watch
+enum {
+	WAIT_OBJECT_FD = 0,
+	WAIT_OBJECT_SEM,
+	WAIT_OBJECT_PORT
+};
+
+// WAIT_FLAG_TIMEOUT must be the same as SEM_FLAG_TIMEOUT
+#define WAIT_FLAG_TIMEOUT 2
+
+typedef struct wait_event {
+	int type;		// WAIT_OBJECT_*
+	int id;			// the fd, sem_id or port_id
+	int events;		// WAIT_EVENT_* that are ready
+	void *cookie;	// passed to wait_set_add
+} wait_event;
+
+// embedded in every object that can be waited on, holds the watches on it
+struct wait_object {
+	struct list_node watches;
+};
+
+struct wait_watch;
+
+void wait_object_init(struct wait_object *obj);
+void wait_object_attach(struct wait_object *obj, struct wait_watch *watch);
+void wait_object_notify(struct wait_object *obj, int events);
+void wait_object_detach_all(struct wait_object *obj);
+
+int wait_set_init(void);
+wait_set_id wait_set_create(void);
+int wait_set_delete(wait_set_id id);
+int wait_set_add(wait_set_id id, int type, int object, int events, void *cookie);
+int wait_set_remove(wait_set_id id, int type, int object);
+int wait_set_wait(wait_set_id id, wait_event *events, int count, int flags, bigtime_t timeout);
+int wait_set_delete_owned_sets(proc_id owner);
+
+wait_set_id user_wait_set_create(void);
+int user_wait_set_delete(wait_set_id id);
+int user_wait_set_add(wait_set_id id, int type, int object, int events, void *cookie);
+int user_wait_set_remove(wait_set_id id, int type, int object);
+int user_wait_set_wait(wait_set_id id, wait_event *events, int count, int flags, bigtime_t timeout);
+
+/*
+	A wait set holds watches on fds, sems and ports and hands back the ones
+	that are ready. Watches stay in the set until they're removed, and a ready
+	watch sits on the set's ready list, so a wait only looks at ready objects,
+	not at everything in the set.
+
+	Objects that can be waited on embed a struct wait_object. Their poll hook
+	(fs_poll, dev_poll, sem_poll, port_poll) calls wait_object_attach() first
+	and then returns which WAIT_EVENT_s are ready right now. Whenever one of
+	those may have become true, the object calls wait_object_notify(), after
+	the state change and under the same lock the poll hook looks at it under,
+	so a watch can't miss it. Notifications are only hints, the waiter polls
+	the object again before reporting it, so extra ones are harmless.
+	An object that goes away with watches still on it calls
+	wait_object_detach_all(), which reports WAIT_EVENT_ERROR to them.
+
+	A fd watch holds a reference to the file descriptor, closing the fd
+	doesn't close the object underneath until the watch is removed.
+*/
+
+#endif
+
@@ -32,6 +32,13 @@ enum {
 
 #define SOCK_FLAG_TIMEOUT 1
 
+/* socket options, all int valued */
+enum {
+	SOCK_OPT_SNDBUF = 1,    /* bytes, 0 sizes it automatically */
+	SOCK_OPT_RCVBUF,        /* bytes, 0 sizes it automatically */
+	SOCK_OPT_TCP_ACK_DELAY, /* msecs, 0 acks every segment */
+};
+
 typedef struct sockaddr {
 	netaddr addr;
 	int port;
@@ -60,6 +67,8 @@ enum {
 	IOCTL_NET_CONTROL_ROUTE_LIST,
 	IOCTL_NET_IF_GET_ADDR,
 	IOCTL_NET_IF_GET_TYPE,
+	IOCTL_NET_IF_GET_RX_HOOKS,
+	IOCTL_NET_IF_GET_TX_HOOKS,
 };
 
 /* used in all of the IF control messages */
@@ -37,6 +37,11 @@ typedef struct _socket_api_create_t {
 	int flags;
 } _socket_api_create_t;
 
+typedef struct _socket_api_opt_t {
+	int opt;
+	int value;
+} _socket_api_opt_t;
+
 typedef struct _socket_api_args_t {
 	union {
 		_socket_api_transfer_t transfer;
@@ -45,6 +50,7 @@ typedef struct _socket_api_args_t {
 		_socket_api_accept_t accept;
 		_socket_api_bind_t bind;
 		_socket_api_create_t create;
+		_socket_api_opt_t opt;
 	} u;
 } _socket_api_args_t;
 
@@ -58,6 +64,8 @@ enum {
 	_SOCKET_API_RECVFROM,
 	_SOCKET_API_RECVFROM_ETC,
 	_SOCKET_API_SENDTO,
+	_SOCKET_API_SETOPT,
+	_SOCKET_API_GETOPT,
 };
 
 #endif
@@ -23,6 +23,8 @@ ssize_t socket_write(int fd, const void *buf, ssize_t len);
 ssize_t socket_recvfrom(int fd, void *buf, ssize_t len, sockaddr *addr);
 ssize_t socket_recvfrom_etc(int fd, void *buf, ssize_t len, sockaddr *addr, int flags, bigtime_t timeout);
 ssize_t socket_sendto(int fd, const void *buf, ssize_t len, sockaddr *addr);
+int socket_setopt(int fd, int opt, int value);
+int socket_getopt(int fd, int opt);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -36,6 +36,9 @@ struct file_stat {
 #define SEM_FLAG_INTERRUPTABLE 4
 
 #define PORT_FLAG_TIMEOUT 2
+// write: msg_buffer is the start of a region, which is given away with the message
+// read: msg_buffer receives the region_id of a new region holding the message
+#define PORT_FLAG_REMAP 0x10
 
 // info about a region that external entities may want to know
 typedef struct vm_region_info {
@@ -71,6 +74,8 @@ struct proc_info {
 	sess_id sid;
 	int state;
 	int num_threads;
+	int page_faults;
+	int major_faults;
 	char name[SYS_MAX_OS_NAME_LEN];
 };
 
@@ -140,8 +145,39 @@ typedef struct {
 
 	// info about vm activity
 	int page_faults;
+	int page_ins;
+	int read_ahead_pages;
+	int fault_around_pages;
+	int busy_page_waits;
+
+	// info about swap
+	int swap_pages;
+	int swap_free_pages;
+	int swap_outs;
+	int swap_ins;
+	int reclaimed_pages;
 } vm_info_t;
 
+// wait sets
+#define WAIT_EVENT_READ  1	// a read (or accept, or sem acquire) won't block
+#define WAIT_EVENT_WRITE 2	// a write won't block
+#define WAIT_EVENT_ERROR 4	// the object went away or the other end hung up, always reported
+
+enum {
+	WAIT_OBJECT_FD = 0,
+	WAIT_OBJECT_SEM,
+	WAIT_OBJECT_PORT
+};
+
+#define WAIT_FLAG_TIMEOUT 2
+
+typedef struct wait_event {
+	int type;		// WAIT_OBJECT_*
+	int id;			// the fd, sem_id or port_id
+	int events;		// WAIT_EVENT_* that are ready
+	void *cookie;	// passed to _kern_wait_set_add
+} wait_event;
+
 typedef enum {
 	TIMER_MODE_ONESHOT = 0,
 	TIMER_MODE_PERIODIC
@@ -200,6 +236,7 @@ int _kern_set_sem_owner(sem_id id, proc_id proc);
 thread_id _kern_get_current_thread_id(void);
 void _kern_exit(int retcode);
 proc_id _kern_proc_create_proc(const char *path, const char *name, char **args, int argc, int priority, int flags);
+proc_id _kern_proc_fork(void);
 thread_id _kern_thread_create_thread(const char *name, int (*func)(void *args), void *args);
 int _kern_thread_set_priority(thread_id tid, int priority);
 int _kern_thread_wait_on_thread(thread_id tid, int *retcode);
@@ -222,6 +259,7 @@ region_id _kern_vm_map_file(const char *name, void **address, int addr_type,
 int _kern_vm_delete_region(region_id id);
 int _kern_vm_get_region_info(region_id id, vm_region_info *info);
 int _kern_vm_get_vm_info(vm_info_t *uinfo);
+int _kern_vm_swapon(const char *path);
 
 /* process group/session group functions */
 int _kern_setpgid(proc_id, pgrp_id);
@@ -244,6 +282,13 @@ int			_kern_port_set_owner(port_id port, proc_id proc);
 int			_kern_port_write(port_id port, int32 msg_code, void *msg_buffer, size_t buffer_size);
 int			_kern_port_write_etc(port_id port, int32 msg_code, void *msg_buffer, size_t buffer_size, uint32 flags, bigtime_t timeout);
 
+/* wait sets, wait on any number of fds, sems and ports at once */
+wait_set_id	_kern_wait_set_create(void);
+int			_kern_wait_set_delete(wait_set_id id);
+int			_kern_wait_set_add(wait_set_id id, int type, int object, int events, void *cookie);
+int			_kern_wait_set_remove(wait_set_id id, int type, int object);
+int			_kern_wait_set_wait(wait_set_id id, wait_event *events, int count, int flags, bigtime_t timeout);
+
 /* atomic_* ops (needed for cpus that dont support them directly) */
 int _kern_atomic_add(int *val, int incr);
 int _kern_atomic_and(int *val, int incr);
@@ -733,6 +733,7 @@ static struct dev_calls console_hooks = {
 	/* cannot page from /dev/console */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -365,6 +365,7 @@ static struct dev_calls floppy_hooks = {
 	/* no paging here */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
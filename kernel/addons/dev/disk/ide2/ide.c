@@ -251,6 +251,7 @@ struct dev_calls ide_hooks = {
 	/* cannot page from pci devices */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 void	init_ide_struct(int bus,int device,int partition_id)
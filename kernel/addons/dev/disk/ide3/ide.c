@@ -351,6 +351,7 @@ static struct dev_calls ide_hooks = {
 	// can't page from ide devices
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
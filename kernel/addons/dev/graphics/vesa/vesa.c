@@ -121,6 +121,7 @@ static struct dev_calls vesa_hooks = {
 	/* cannot page from /dev/vesa */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -253,6 +253,7 @@ struct dev_calls ps2_mouse_hooks = {
 	/* cannot page from mouse */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 }; // ps2_mouse_hooks
 
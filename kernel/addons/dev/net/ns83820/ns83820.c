@@ -102,6 +102,7 @@ static struct dev_calls ns83820_hooks = {
 	/* no paging here */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
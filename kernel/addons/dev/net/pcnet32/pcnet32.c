@@ -111,6 +111,7 @@ static struct dev_calls pcnet32_hooks = {
 	/* no paging here */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -102,6 +102,7 @@ static struct dev_calls rhine_hooks = {
 	/* no paging here */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
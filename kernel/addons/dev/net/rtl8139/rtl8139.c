@@ -59,6 +59,16 @@ static ssize_t rtl8139_write(dev_cookie cookie, const void *buf, off_t pos, ssiz
 	return len;
 }
 
+static int rtl8139_rx_hook(void *cookie, cbuf **chain, int max)
+{
+	return rtl8139_rx_cbuf((rtl8139 *)cookie, chain, max);
+}
+
+static void rtl8139_tx_hook(void *cookie, cbuf *chain)
+{
+	rtl8139_xmit_chain((rtl8139 *)cookie, chain);
+}
+
 static int rtl8139_ioctl(dev_cookie cookie, int op, void *buf, size_t len)
 {
 	rtl8139 *rtl = (rtl8139 *)cookie;
@@ -84,6 +94,22 @@ static int rtl8139_ioctl(dev_cookie cookie, int op, void *buf, size_t len)
 				err = ERR_VFS_INSUFFICIENT_BUF;
 			}
 			break;
+		case IOCTL_NET_IF_GET_RX_HOOKS: // let the stack take received frames in cbufs
+			if(len >= sizeof(if_rx_hooks)) {
+				((if_rx_hooks *)buf)->cookie = rtl;
+				((if_rx_hooks *)buf)->rx = &rtl8139_rx_hook;
+			} else {
+				err = ERR_VFS_INSUFFICIENT_BUF;
+			}
+			break;
+		case IOCTL_NET_IF_GET_TX_HOOKS: // let the stack hand over lists of frames to send
+			if(len >= sizeof(if_tx_hooks)) {
+				((if_tx_hooks *)buf)->cookie = rtl;
+				((if_tx_hooks *)buf)->tx = &rtl8139_tx_hook;
+			} else {
+				err = ERR_VFS_INSUFFICIENT_BUF;
+			}
+			break;
 		default:
 			err = ERR_INVALID_ARGS;
 	}
@@ -102,6 +128,7 @@ static struct dev_calls rtl8139_hooks = {
 	/* no paging here */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -58,6 +58,7 @@
 	(uint16)((uint16)(in) - 16)
 
 #define MYRT_INTS (RT_INT_PCIERR | RT_INT_RX_ERR | RT_INT_RX_OK | RT_INT_TX_ERR | RT_INT_TX_OK | RT_INT_RXBUF_OVERFLOW)
+#define RT_RX_INTS (RT_INT_RX_ERR | RT_INT_RX_OK)
 
 static int rtl8139_int(void*);
 
@@ -234,7 +235,8 @@ int rtl8139_init(rtl8139 *rtl)
 	// Disable all multi-interrupts
 	RTL_WRITE_16(rtl, RT_MULTIINTR, 0);
 
-	RTL_WRITE_16(rtl, RT_INTRMASK, MYRT_INTS);
+	rtl->int_mask = MYRT_INTS;
+	RTL_WRITE_16(rtl, RT_INTRMASK, rtl->int_mask);
 //	RTL_WRITE_16(rtl, RT_INTRMASK, 0x807f);
 
 	// Enable RX/TX once more
@@ -266,7 +268,7 @@ static void rtl8139_resetrx(rtl8139 *rtl)
 	RTL_WRITE_16(rtl, RT_RXBUFHEAD, 0);
 
 	// start it back up
-	RTL_WRITE_16(rtl, RT_INTRMASK, MYRT_INTS);
+	RTL_WRITE_16(rtl, RT_INTRMASK, rtl->int_mask);
 
 	// Enable RX/TX once more
 	RTL_WRITE_8(rtl, RT_CHIPCMD, RT_CMD_RX_ENABLE | RT_CMD_TX_ENABLE);
@@ -334,47 +336,69 @@ void rtl8139_xmit(rtl8139 *rtl, const char *ptr, ssize_t len)
 	mutex_unlock(&rtl->lock);
 }
 
+// queues up a list of frames linked through packet_next, and frees them
+void rtl8139_xmit_chain(rtl8139 *rtl, cbuf *chain)
+{
+	cbuf *buf;
+	cbuf *next;
+	size_t len;
+
+	for(buf = chain; buf; buf = next) {
+		next = buf->packet_next;
+		buf->packet_next = NULL;
+
+		len = cbuf_get_len(buf);
+		if(len > ETHERNET_MAX_SIZE) {
+			dprintf("rtl8139_xmit_chain: dropping oversized frame, len %ld\n", (long)len);
+			cbuf_free_chain(buf);
+			continue;
+		}
+
+		sem_acquire(rtl->tx_sem, 1);
+		mutex_lock(&rtl->lock);
+
+		int_disable_interrupts();
+		acquire_spinlock(&rtl->reg_spinlock);
+
+		// copy it right out of the chain, writing the status starts the send
+		cbuf_memcpy_from_chain((void*)(rtl->txbuf + rtl->txbn * 0x800), buf, 0, len);
+		if(len < ETHERNET_MIN_SIZE)
+			len = ETHERNET_MIN_SIZE;
+
+		RTL_WRITE_32(rtl, RT_TXSTATUS0 + rtl->txbn*4, len | 0x80000);
+		if(++rtl->txbn >= 4)
+			rtl->txbn = 0;
+
+		release_spinlock(&rtl->reg_spinlock);
+		int_restore_interrupts();
+
+		mutex_unlock(&rtl->lock);
+
+		cbuf_free_chain(buf);
+	}
+}
+
 typedef struct rx_entry {
 	volatile uint16 status;
 	volatile uint16 len;
 	volatile uint8 data[1];
 } rx_entry;
 
-ssize_t rtl8139_rx(rtl8139 *rtl, char *buf, ssize_t buf_len)
+// NOTE: expects the reg_spinlock to be held
+// copies the next frame out of the ring, returns 0 if there isn't a complete one there
+static ssize_t rtl8139_rx_frame(rtl8139 *rtl, char *buf, ssize_t buf_len)
 {
 	rx_entry *entry;
 	uint32 tail;
 	uint16 len;
-	int rc;
-	bool release_sem = false;
-
-//	dprintf("rtl8139_rx: entry\n");
-
-	if(buf_len < 1500)
-		return -1;
-
-restart:
-	sem_acquire(rtl->rx_sem, 1);
-	mutex_lock(&rtl->lock);
-
-	int_disable_interrupts();
-	acquire_spinlock(&rtl->reg_spinlock);
 
 	tail = TAILREG_TO_TAIL(RTL_READ_16(rtl, RT_RXBUFTAIL));
 //	dprintf("tailreg = 0x%x, actual tail 0x%x\n", RTL_READ_16(rtl, RT_RXBUFTAIL), tail);
-	if(tail == RTL_READ_16(rtl, RT_RXBUFHEAD)) {
-		release_spinlock(&rtl->reg_spinlock);
-		int_restore_interrupts();
-		mutex_unlock(&rtl->lock);
-		goto restart;
-	}
+	if(tail == RTL_READ_16(rtl, RT_RXBUFHEAD))
+		return 0;
 
-	if(RTL_READ_8(rtl, RT_CHIPCMD) & RT_CMD_RX_BUF_EMPTY) {
-		release_spinlock(&rtl->reg_spinlock);
-		int_restore_interrupts();
-		mutex_unlock(&rtl->lock);
-		goto restart;
-	}
+	if(RTL_READ_8(rtl, RT_CHIPCMD) & RT_CMD_RX_BUF_EMPTY)
+		return 0;
 
 	// grab another buffer
 	entry = (rx_entry *)((uint8 *)rtl->rxbuf + tail);
@@ -382,12 +406,8 @@ restart:
 //	dprintf("entry->len = 0x%x\n", entry->len);
 
 	// see if it's an unfinished buffer
-	if(entry->len == 0xfff0) {
-		release_spinlock(&rtl->reg_spinlock);
-		int_restore_interrupts();
-		mutex_unlock(&rtl->lock);
-		goto restart;
-	}
+	if(entry->len == 0xfff0)
+		return 0;
 
 	// figure the len that we need to copy
 	len = entry->len - 4; // minus the crc
@@ -396,19 +416,14 @@ restart:
 	if((entry->status & RT_RX_STATUS_OK) == 0 || len > ETHERNET_MAX_SIZE) {
 		// error, lets reset the card
 		rtl8139_resetrx(rtl);
-		release_spinlock(&rtl->reg_spinlock);
-		int_restore_interrupts();
-		mutex_unlock(&rtl->lock);
-		goto restart;
+		return 0;
 	}
 
 	// copy the buffer
 	if(len > buf_len) {
 		dprintf("rtl8139_rx: packet too large for buffer (len %d, buf_len %ld)\n", len, (long)buf_len);
 		RTL_WRITE_16(rtl, RT_RXBUFTAIL, TAILREG_TO_TAIL(RTL_READ_16(rtl, RT_RXBUFHEAD)));
-		rc = ERR_TOO_BIG;
-		release_sem = true;
-		goto out;
+		return ERR_TOO_BIG;
 	}
 	if(tail + len > 0xffff) {
 //		dprintf("packet wraps around\n");
@@ -417,19 +432,55 @@ restart:
 	} else {
 		memcpy(buf, (const void *)&entry->data[0], len);
 	}
-	rc = len;
 
 	// calculate the new tail
 	tail = ((tail + entry->len + 4 + 3) & ~3) % 0x10000;
 //	dprintf("new tail at 0x%x, tailreg will say 0x%x\n", tail, TAIL_TO_TAILREG(tail));
 	RTL_WRITE_16(rtl, RT_RXBUFTAIL, TAIL_TO_TAILREG(tail));
 
-	if(tail != RTL_READ_16(rtl, RT_RXBUFHEAD)) {
-		// we're at last one more packet behind
-		release_sem = true;
-	}
+	return len;
+}
+
+// The rx interrupt is masked as soon as frames come in, and the reader keeps
+// polling the ring until it finds it empty, only then is the interrupt turned
+// back on. Under load the card doesn't interrupt for every frame, and a reader
+// picks up everything that came in since it last looked.
+
+// NOTE: expects the reg_spinlock to be held
+// returns whether the next reader shouldn't wait for an interrupt
+static bool rtl8139_rx_done(rtl8139 *rtl)
+{
+	if(!(RTL_READ_8(rtl, RT_CHIPCMD) & RT_CMD_RX_BUF_EMPTY))
+		return true; // more frames, keep polling
+
+	// the ring is empty, go back to waiting for interrupts
+	rtl->int_mask |= RT_RX_INTS;
+	RTL_WRITE_16(rtl, RT_INTRMASK, rtl->int_mask);
+
+	// a frame may have come in before the interrupt was unmasked
+	return !(RTL_READ_8(rtl, RT_CHIPCMD) & RT_CMD_RX_BUF_EMPTY);
+}
+
+ssize_t rtl8139_rx(rtl8139 *rtl, char *buf, ssize_t buf_len)
+{
+	ssize_t rc;
+	bool release_sem;
+
+//	dprintf("rtl8139_rx: entry\n");
+
+	if(buf_len < 1500)
+		return -1;
+
+restart:
+	sem_acquire(rtl->rx_sem, 1);
+	mutex_lock(&rtl->lock);
+
+	int_disable_interrupts();
+	acquire_spinlock(&rtl->reg_spinlock);
+
+	rc = rtl8139_rx_frame(rtl, buf, buf_len);
+	release_sem = rtl8139_rx_done(rtl);
 
-out:
 	release_spinlock(&rtl->reg_spinlock);
 	int_restore_interrupts();
 
@@ -437,13 +488,16 @@ out:
 		sem_release(rtl->rx_sem, 1);
 	mutex_unlock(&rtl->lock);
 
+	if(rc == 0)
+		goto restart;
+
 #if 0
 {
 	int i;
-	dprintf("RX %x (%d)\n", buf, len);
+	dprintf("RX %x (%d)\n", buf, rc);
 
 	dprintf("dumping packet:");
-	for(i=0; i<len; i++) {
+	for(i=0; i<rc; i++) {
 		if(i%8 == 0)
 			dprintf("\n");
 		dprintf("0x%02x ", buf[i]);
@@ -455,6 +509,80 @@ out:
 	return rc;
 }
 
+// the chip receives into one big ring, so the frames can't be handed up
+// where they landed, but they can be copied out of the ring right into cbufs.
+// hands up to max of them up, linked through packet_next.
+int rtl8139_rx_cbuf(rtl8139 *rtl, cbuf **chain, int max)
+{
+	cbuf *head = NULL;
+	cbuf *tail = NULL;
+	cbuf *buf;
+	ssize_t len;
+	int count = 0;
+	int err = NO_ERROR;
+	bool release_sem;
+
+restart:
+	sem_acquire(rtl->rx_sem, 1);
+	mutex_lock(&rtl->lock);
+
+	while(count < max) {
+		// a max size frame fits in a single cbuf
+		buf = cbuf_get_chain(ETHERNET_MAX_SIZE);
+		if(!buf) {
+			err = ERR_NO_MEMORY;
+			break;
+		}
+
+		int_disable_interrupts();
+		acquire_spinlock(&rtl->reg_spinlock);
+
+		len = rtl8139_rx_frame(rtl, buf->data, ETHERNET_MAX_SIZE);
+
+		release_spinlock(&rtl->reg_spinlock);
+		int_restore_interrupts();
+
+		if(len <= 0) {
+			cbuf_free_chain(buf);
+			if(len == 0)
+				break;
+			continue;
+		}
+
+		buf->len = len;
+		buf->total_len = len;
+		buf->packet_next = NULL;
+		if(tail)
+			tail->packet_next = buf;
+		else
+			head = buf;
+		tail = buf;
+		count++;
+	}
+
+	int_disable_interrupts();
+	acquire_spinlock(&rtl->reg_spinlock);
+
+	release_sem = rtl8139_rx_done(rtl);
+
+	release_spinlock(&rtl->reg_spinlock);
+	int_restore_interrupts();
+
+	if(release_sem)
+		sem_release(rtl->rx_sem, 1);
+	mutex_unlock(&rtl->lock);
+
+	if(count == 0) {
+		if(err < 0)
+			return err;
+		goto restart;
+	}
+
+	*chain = head;
+
+	return count;
+}
+
 static int rtl8139_rxint(rtl8139 *rtl, uint16 int_status)
 {
 	int rc = INT_NO_RESCHEDULE;
@@ -465,7 +593,14 @@ static int rtl8139_rxint(rtl8139 *rtl, uint16 int_status)
 //		RTL_READ_32(rtl, RT_RXBUF), RTL_READ_16(rtl, RT_RXBUFHEAD), RTL_READ_16(rtl, RT_RXBUFTAIL));
 //	dprintf("BUF_EMPTY = %d\n", RTL_READ_8(rtl, RT_CHIPCMD) & RT_CMD_RX_BUF_EMPTY);
 
+	// a reader is already polling the ring
+	if((rtl->int_mask & RT_RX_INTS) == 0)
+		return rc;
+
 	if(!(RTL_READ_8(rtl, RT_CHIPCMD) & RT_CMD_RX_BUF_EMPTY)) {
+		// the reader takes it from here, until it finds the ring empty
+		rtl->int_mask &= ~RT_RX_INTS;
+
 		sem_release_etc(rtl->rx_sem, 1, SEM_FLAG_NO_RESCHED);
 		rc = INT_RESCHEDULE;
 	}
@@ -544,8 +679,8 @@ static int rtl8139_int(void* data)
 		}
 	}
 
-	// reenable interrupts
-	RTL_WRITE_16(rtl, RT_INTRMASK, MYRT_INTS);
+	// reenable interrupts, minus rx if a reader is polling for them
+	RTL_WRITE_16(rtl, RT_INTRMASK, rtl->int_mask);
 
 	release_spinlock(&rtl->reg_spinlock);
 
@@ -8,6 +8,7 @@
 #include <kernel/kernel.h>
 #include <kernel/vm.h>
 #include <kernel/smp.h>
+#include <kernel/cbuf.h>
 
 typedef struct rtl8139 {
 	int irq;
@@ -27,11 +28,14 @@ typedef struct rtl8139 {
 	sem_id tx_sem;
 	mutex lock;
 	spinlock_t reg_spinlock;
+	uint16 int_mask; // the interrupts currently unmasked
 } rtl8139;
 
 int rtl8139_detect(rtl8139 **rtl);
 int rtl8139_init(rtl8139 *rtl);
 void rtl8139_xmit(rtl8139 *rtl, const char *ptr, ssize_t len);
 ssize_t rtl8139_rx(rtl8139 *rtl, char *buf, ssize_t buf_len);
+void rtl8139_xmit_chain(rtl8139 *rtl, cbuf *chain);
+int rtl8139_rx_cbuf(rtl8139 *rtl, cbuf **chain, int max);
 
 #endif
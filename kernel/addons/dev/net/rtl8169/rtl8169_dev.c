@@ -77,9 +77,11 @@
 #define TXDESC(r, num) ((r)->txdesc[num])
 #define RXDESC_PHYS(r, num) ((r)->rxdesc_phys + (num) * sizeof(rtl_rx_descriptor))
 #define TXDESC_PHYS(r, num) ((r)->txdesc_phys + (num) * sizeof(rtl_tx_descriptor))
-#define RXBUF(r, num) (&(r)->rxbuf[(num) * BUFSIZE_PER_FRAME])
 #define TXBUF(r, num) (&(r)->txbuf[(num) * BUFSIZE_PER_FRAME])
 
+#define RTL_INTS (IMR_SYSERR | IMR_LINKCHG | IMR_TER | IMR_TOK | IMR_RER | IMR_ROK | IMR_RXOVL)
+#define RTL_RX_INTS (IMR_ROK | IMR_RER)
+
 static int rtl8169_int(void*);
 
 struct vendor_dev_match {
@@ -185,12 +187,12 @@ static void rtl8169_setup_descriptors(rtl8169 *r)
 	for (i=0; i < NUM_RX_DESCRIPTORS; i++) {
 		addr_t physaddr;
 
-		physaddr = vtophys(RXBUF(r, i));
-		SHOW_FLOW(2, "setup_descriptors: rx buffer at %p, addr 0x%x\n", RXBUF(r, i), physaddr);
+		physaddr = vtophys(r->rx_cbufs[i]->data);
+		SHOW_FLOW(2, "setup_descriptors: rx buffer at %p, addr 0x%x\n", r->rx_cbufs[i]->data, physaddr);
 
 		r->rxdesc[i].rx_buffer_low = physaddr;
 		r->rxdesc[i].rx_buffer_high = physaddr >> 32;
-		r->rxdesc[i].frame_len = BUFSIZE_PER_FRAME;
+		r->rxdesc[i].frame_len = RX_BUFSIZE_PER_FRAME;
 		r->rxdesc[i].flags = RTL_DESC_OWN | ((i == (NUM_RX_DESCRIPTORS - 1)) ? RTL_DESC_EOR : 0);
 	}
 	for (i=0; i < NUM_TX_DESCRIPTORS; i++) {
@@ -247,9 +249,17 @@ int rtl8169_init(rtl8169 *r)
 	SHOW_INFO(2, "rtl8169: tx descriptors at %p, phys 0x%x\n", r->txdesc, r->txdesc_phys);
 	r->reg_spinlock = 0;
 
-	/* create a large tx and rx buffer for the descriptors to point to */
-	r->rxbuf_region = vm_create_anonymous_region(vm_get_kernel_aspace_id(), "rtl8169_rxbuf", (void **)&r->rxbuf,
-			REGION_ADDR_ANY_ADDRESS, NUM_RX_DESCRIPTORS * BUFSIZE_PER_FRAME, REGION_WIRING_WIRED, LOCK_KERNEL|LOCK_RW);
+	/* the rx descriptors point at cbufs, which get handed up the stack as is */
+	for (i = 0; i < NUM_RX_DESCRIPTORS; i++) {
+		r->rx_cbufs[i] = cbuf_get_chain(RX_BUFSIZE_PER_FRAME);
+		if (r->rx_cbufs[i] == NULL) {
+			SHOW_ERROR0(1, "rtl8169_init: error allocating rx buffers\n");
+			err = ERR_NO_MEMORY;
+			goto err2;
+		}
+	}
+
+	/* create a large tx buffer for the descriptors to point to */
 	r->txbuf_region = vm_create_anonymous_region(vm_get_kernel_aspace_id(), "rtl8169_txbuf", (void **)&r->txbuf,
 			REGION_ADDR_ANY_ADDRESS, NUM_TX_DESCRIPTORS * BUFSIZE_PER_FRAME, REGION_WIRING_WIRED, LOCK_KERNEL|LOCK_RW);
 
@@ -310,10 +320,17 @@ int rtl8169_init(rtl8169 *r)
 	RTL_WRITE_16(r, REG_ISR, 0xffff);
 	
 	/* unmask interesting interrupts */
-	RTL_WRITE_16(r, REG_IMR, IMR_SYSERR | IMR_LINKCHG | IMR_TER | IMR_TOK | IMR_RER | IMR_ROK | IMR_RXOVL);
+	r->int_mask = RTL_INTS;
+	RTL_WRITE_16(r, REG_IMR, r->int_mask);
 
 	return 0;
 
+err2:
+	for (i = 0; i < NUM_RX_DESCRIPTORS; i++) {
+		if (r->rx_cbufs[i] != NULL)
+			cbuf_free_chain(r->rx_cbufs[i]);
+		r->rx_cbufs[i] = NULL;
+	}
 err1:
 	vm_delete_region(vm_get_kernel_aspace_id(), r->region);
 err:
@@ -362,12 +379,97 @@ restart:
 	mutex_unlock(&r->lock);
 }
 
+/* queues up a list of frames linked through packet_next, and frees them */
+void rtl8169_xmit_chain(rtl8169 *r, cbuf *chain)
+{
+	cbuf *buf;
+	cbuf *next;
+	size_t len;
+
+	mutex_lock(&r->lock);
+
+	for (buf = chain; buf; buf = next) {
+		next = buf->packet_next;
+		buf->packet_next = NULL;
+
+		len = cbuf_get_len(buf);
+		if (len > ETHERNET_MAX_SIZE) {
+			SHOW_ERROR(1, "rtl8169_xmit_chain: dropping oversized frame, len %d\n", len);
+			cbuf_free_chain(buf);
+			continue;
+		}
+
+		int_disable_interrupts();
+		acquire_spinlock(&r->reg_spinlock);
+
+		while (r->txdesc[r->tx_idx_free].flags & RTL_DESC_OWN) {
+			/* ring is full, get what we've queued so far going and wait for some of it to go out */
+			RTL_WRITE_8(r, REG_TPPOLL, (1<<6));
+			release_spinlock(&r->reg_spinlock);
+			int_restore_interrupts();
+			mutex_unlock(&r->lock);
+
+			sem_acquire(r->tx_sem, 1);
+
+			mutex_lock(&r->lock);
+			int_disable_interrupts();
+			acquire_spinlock(&r->reg_spinlock);
+		}
+
+		/* queue it up, but don't tell the nic yet */
+		cbuf_memcpy_from_chain(TXBUF(r, r->tx_idx_free), buf, 0, len);
+		if (len < 64)
+			len = 64;
+
+		r->txdesc[r->tx_idx_free].frame_len = len;
+		r->txdesc[r->tx_idx_free].flags = (r->txdesc[r->tx_idx_free].flags & RTL_DESC_EOR) | RTL_DESC_FS | RTL_DESC_LS | RTL_DESC_OWN;
+		inc_tx_idx_free(r);
+
+		release_spinlock(&r->reg_spinlock);
+		int_restore_interrupts();
+
+		cbuf_free_chain(buf);
+	}
+
+	/* one kick for the whole batch */
+	int_disable_interrupts();
+	acquire_spinlock(&r->reg_spinlock);
+
+	RTL_WRITE_8(r, REG_TPPOLL, (1<<6)); // something is on the normal queue
+
+	release_spinlock(&r->reg_spinlock);
+	int_restore_interrupts();
+
+	mutex_unlock(&r->lock);
+}
+
+/*
+ * The rx interrupt is masked as soon as frames come in, and the reader keeps
+ * polling the ring until it finds it empty. Only then is the interrupt turned
+ * back on. Under load the nic doesn't interrupt for every frame, and a reader
+ * picks up everything that came in since it last looked.
+ */
+
+/* NOTE: expects the reg_spinlock to be held. returns whether the next reader shouldn't wait for an interrupt */
+static bool rtl8169_rx_done(rtl8169 *r)
+{
+	if ((r->rxdesc[r->rx_idx_free].flags & RTL_DESC_OWN) == 0)
+		return true; // more frames, keep polling
+
+	/* the ring is empty, go back to waiting for interrupts */
+	r->rx_idx_full = r->rx_idx_free;
+	r->int_mask |= RTL_RX_INTS;
+	RTL_WRITE_16(r, REG_IMR, r->int_mask);
+
+	/* a frame may have come in before the interrupt was unmasked */
+	return (r->rxdesc[r->rx_idx_free].flags & RTL_DESC_OWN) == 0;
+}
+
 ssize_t rtl8169_rx(rtl8169 *r, char *buf, ssize_t buf_len)
 {
-	uint32 tail;
 	size_t len;
 	int rc;
-	bool release_sem = false;
+	bool release_sem;
 
 	SHOW_FLOW0(3, "rtl8169_rx: entry\n");
 
@@ -383,9 +485,12 @@ restart:
 
 	/* look at the descriptor pointed to by rx_idx_free */
 	if (r->rxdesc[r->rx_idx_free].flags & RTL_DESC_OWN) {
-		/* for some reason it's owned by the card, wait for more packets */
+		/* nothing there after all, wait for more packets */
+		release_sem = rtl8169_rx_done(r);
 		release_spinlock(&r->reg_spinlock);
 		int_restore_interrupts();
+		if (release_sem)
+			sem_release(r->rx_sem, 1);
 		mutex_unlock(&r->lock);
 		goto restart;
 	}
@@ -396,27 +501,22 @@ restart:
 
 	if (len > buf_len) {
 		rc = ERR_TOO_BIG;
-		release_sem = true;
-		goto out;
+	} else {
+		memcpy(buf, r->rx_cbufs[r->rx_idx_free]->data, len);
+		rc = len;
 	}
 
-	memcpy(buf, RXBUF(r, r->rx_idx_free), len);
-	rc = len;
-
 #if debug_level_flow >= 3
-	hexdump(RXBUF(r, r->rx_idx_free), len);
+	hexdump(r->rx_cbufs[r->rx_idx_free]->data, len);
 #endif
 
 	/* stick it back in the free list */
-	r->rxdesc[r->rx_idx_free].buffer_size = BUFSIZE_PER_FRAME;
+	r->rxdesc[r->rx_idx_free].buffer_size = RX_BUFSIZE_PER_FRAME;
 	r->rxdesc[r->rx_idx_free].flags = (r->rxdesc[r->rx_idx_free].flags & RTL_DESC_EOR) | RTL_DESC_OWN;
 	inc_rx_idx_free(r);
 
-	/* see if there are more packets pending */
-	if ((r->rxdesc[r->rx_idx_free].flags & RTL_DESC_OWN) == 0)
-		release_sem = true; // if so, release the rx sem so the next reader gets a shot
+	release_sem = rtl8169_rx_done(r);
 
-out:
 	release_spinlock(&r->reg_spinlock);
 	int_restore_interrupts();
 
@@ -427,10 +527,125 @@ out:
 	return rc;
 }
 
+/*
+ * hands up to max received frames up in the cbufs they were received into, linked
+ * through packet_next, and gives the nic a fresh cbuf in place of each of them
+ */
+int rtl8169_rx_cbuf(rtl8169 *r, cbuf **chain, int max)
+{
+	cbuf *head = NULL;
+	cbuf *tail = NULL;
+	cbuf *buf;
+	cbuf *new_buf;
+	addr_t new_phys;
+	size_t len;
+	int count = 0;
+	int err = NO_ERROR;
+	bool release_sem;
+
+	SHOW_FLOW0(3, "rtl8169_rx_cbuf: entry\n");
+
+restart:
+	sem_acquire(r->rx_sem, 1);
+	mutex_lock(&r->lock);
+
+	while (count < max) {
+		/* get the replacement ready before touching the ring, this may block */
+		new_buf = cbuf_get_chain(RX_BUFSIZE_PER_FRAME);
+		if (new_buf == NULL) {
+			err = ERR_NO_MEMORY;
+			break;
+		}
+		new_phys = vtophys(new_buf->data);
+
+		int_disable_interrupts();
+		acquire_spinlock(&r->reg_spinlock);
+
+		/* look at the descriptor pointed to by rx_idx_free */
+		if (r->rxdesc[r->rx_idx_free].flags & RTL_DESC_OWN) {
+			/* the ring is empty */
+			release_spinlock(&r->reg_spinlock);
+			int_restore_interrupts();
+			cbuf_free_chain(new_buf);
+			break;
+		}
+
+		/* process this packet */
+		len = r->rxdesc[r->rx_idx_free].frame_len & 0x3fff;
+		SHOW_FLOW(3, "rtl8169_rx_cbuf: desc idx %d: len %d\n", r->rx_idx_free, len);
+
+		if (len == 0 || len > RX_BUFSIZE_PER_FRAME) {
+			/* leave the buffer where it is, and drop the frame */
+			buf = new_buf;
+			len = 0;
+		} else {
+			/* swap in the new buffer */
+			buf = r->rx_cbufs[r->rx_idx_free];
+			r->rx_cbufs[r->rx_idx_free] = new_buf;
+			r->rxdesc[r->rx_idx_free].rx_buffer_low = new_phys;
+			r->rxdesc[r->rx_idx_free].rx_buffer_high = new_phys >> 32;
+		}
+
+		/* stick it back in the free list */
+		r->rxdesc[r->rx_idx_free].buffer_size = RX_BUFSIZE_PER_FRAME;
+		r->rxdesc[r->rx_idx_free].flags = (r->rxdesc[r->rx_idx_free].flags & RTL_DESC_EOR) | RTL_DESC_OWN;
+		inc_rx_idx_free(r);
+
+		release_spinlock(&r->reg_spinlock);
+		int_restore_interrupts();
+
+		if (len == 0) {
+			cbuf_free_chain(buf);
+			continue;
+		}
+
+#if debug_level_flow >= 3
+		hexdump(buf->data, len);
+#endif
+
+		/* it's a single cbuf, trim it down to the frame */
+		buf->len = len;
+		buf->total_len = len;
+		buf->packet_next = NULL;
+		if (tail)
+			tail->packet_next = buf;
+		else
+			head = buf;
+		tail = buf;
+		count++;
+	}
+
+	int_disable_interrupts();
+	acquire_spinlock(&r->reg_spinlock);
+
+	release_sem = rtl8169_rx_done(r);
+
+	release_spinlock(&r->reg_spinlock);
+	int_restore_interrupts();
+
+	if (release_sem)
+		sem_release(r->rx_sem, 1);
+	mutex_unlock(&r->lock);
+
+	if (count == 0) {
+		if (err < 0)
+			return err;
+		goto restart;
+	}
+
+	*chain = head;
+
+	return count;
+}
+
 static int rtl8169_rxint(rtl8169 *r, uint16 int_status)
 {
 	int rc = INT_NO_RESCHEDULE;
 
+	/* a reader is already polling the ring */
+	if ((r->int_mask & RTL_RX_INTS) == 0)
+		return rc;
+
 	if (int_status & (IMR_ROK|IMR_RER)) {
 		int i;
 
@@ -449,6 +664,10 @@ static int rtl8169_rxint(rtl8169 *r, uint16 int_status)
 		SHOW_FLOW(3, "rxint: got %d frames, idx_full = %d, idx_free = %d\n", i, r->rx_idx_full, r->rx_idx_free);
 
 		if (i > 0) {
+			/* the reader takes it from here, until it finds the ring empty */
+			r->int_mask &= ~RTL_RX_INTS;
+			RTL_WRITE_16(r, REG_IMR, r->int_mask);
+
 			sem_release_etc(r->rx_sem, 1, SEM_FLAG_NO_RESCHED);
 			rc = INT_RESCHEDULE;
 		}
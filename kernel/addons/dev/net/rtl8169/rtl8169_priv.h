@@ -8,6 +8,7 @@
 #include <kernel/kernel.h>
 #include <kernel/vm.h>
 #include <kernel/smp.h>
+#include <kernel/cbuf.h>
 #include "rtl8169_dev.h"
 
 typedef struct rtl8169 {
@@ -23,6 +24,7 @@ typedef struct rtl8169 {
 
 	mutex lock;
 	spinlock_t reg_spinlock;
+	uint16 int_mask; // the interrupts currently unmasked
 
 	region_id txdesc_region;
 	struct rtl_tx_descriptor *txdesc;
@@ -36,8 +38,7 @@ typedef struct rtl8169 {
 	region_id rxdesc_region;
 	struct rtl_rx_descriptor *rxdesc;
 	addr_t rxdesc_phys;
-	region_id rxbuf_region;
-	uint8 *rxbuf;
+	cbuf *rx_cbufs[NUM_RX_DESCRIPTORS]; // the nic receives straight into these
 	int rx_idx_free; // first free descriptor (owned by us)
 	int rx_idx_full; // first full descriptor (owned by the NIC)
 	sem_id rx_sem;
@@ -50,9 +51,14 @@ typedef struct rtl8169 {
 
 #define BUFSIZE_PER_FRAME 2048
 
+// fits a max size frame (see REG_RMS) in one cbuf, and a multiple of 8 as the nic wants
+#define RX_BUFSIZE_PER_FRAME 1536
+
 int rtl8169_detect(rtl8169 **rtl);
 int rtl8169_init(rtl8169 *rtl);
 void rtl8169_xmit(rtl8169 *rtl, const char *ptr, ssize_t len);
 ssize_t rtl8169_rx(rtl8169 *rtl, char *buf, ssize_t buf_len);
+void rtl8169_xmit_chain(rtl8169 *rtl, cbuf *chain);
+int rtl8169_rx_cbuf(rtl8169 *rtl, cbuf **chain, int max);
 
 #endif
@@ -34,6 +34,40 @@
 
 tty_global thetty;
 
+// gets a tty that's not in use ready to be used
+// NOTE: expects thetty.lock to be held
+static int setup_tty(tty_desc *tty)
+{
+	int i;
+
+	for(i=0; i<2; i++) {
+		struct line_buffer *lbuf = &tty->buf[i];
+
+		if(lbuf->buffer == NULL) {
+			lbuf->buffer = kmalloc(TTY_BUFFER_SIZE);
+			if(lbuf->buffer == NULL)
+				return ERR_NO_MEMORY;
+		}
+
+		// start out empty, whatever the last user left behind
+		lbuf->head = 0;
+		lbuf->tail = 0;
+		lbuf->line_start = 0;
+		lbuf->state = TTY_STATE_NORMAL;
+		while(sem_acquire_etc(lbuf->read_sem, 1, SEM_FLAG_TIMEOUT, 0, NULL) == NO_ERROR)
+			;
+	}
+
+	tty->inuse = true;
+	tty->pgid = -1;
+	tty->wsize.cols = 80;
+	tty->wsize.rows = 25;
+	tty->slave_count = 0;
+	tty->hung_up = false;
+
+	return 0;
+}
+
 tty_desc *allocate_new_tty(void)
 {
 	int i;
@@ -44,11 +78,9 @@ tty_desc *allocate_new_tty(void)
 	for(i=0; i<NUM_TTYS; i++) {
 		if(thetty.ttys[i].inuse == false) {
 			ASSERT(thetty.ttys[i].ref_count == 0);
-			thetty.ttys[i].inuse = true;
+			if(setup_tty(&thetty.ttys[i]) < 0)
+				break;
 			thetty.ttys[i].ref_count = 1;
-			thetty.ttys[i].pgid = -1;
-			thetty.ttys[i].wsize.cols = 80;
-			thetty.ttys[i].wsize.rows = 25;
 			tty = &thetty.ttys[i];
 			break;
 		}
@@ -59,13 +91,18 @@ tty_desc *allocate_new_tty(void)
 	return tty;
 }
 
-void inc_tty_ref(tty_desc *tty)
+int inc_tty_ref(tty_desc *tty)
 {
+	int err = 0;
+
 	mutex_lock(&thetty.lock);
-	tty->ref_count++;
-	if(tty->ref_count == 1)
-		tty->inuse = true;
+	if(tty->ref_count == 0)
+		err = setup_tty(tty);
+	if(err >= 0)
+		tty->ref_count++;
 	mutex_unlock(&thetty.lock);
+
+	return err;
 }
 
 void dec_tty_ref(tty_desc *tty)
@@ -77,6 +114,38 @@ void dec_tty_ref(tty_desc *tty)
 	mutex_unlock(&thetty.lock);
 }
 
+void tty_slave_opened(tty_desc *tty)
+{
+	struct line_buffer *lbuf = &tty->buf[ENDPOINT_MASTER_READ];
+
+	mutex_lock(&tty->lock);
+	tty->slave_count++;
+	if(tty->hung_up) {
+		// the hang up left the master's read sem up for end of file, take it
+		// back down unless there's really something to read
+		tty->hung_up = false;
+		if(AVAILABLE_READ(lbuf) == 0) {
+			while(sem_acquire_etc(lbuf->read_sem, 1, SEM_FLAG_TIMEOUT, 0, NULL) == NO_ERROR)
+				;
+		}
+	}
+	mutex_unlock(&tty->lock);
+}
+
+void tty_slave_closed(tty_desc *tty)
+{
+	struct line_buffer *lbuf = &tty->buf[ENDPOINT_MASTER_READ];
+
+	mutex_lock(&tty->lock);
+	if(--tty->slave_count == 0) {
+		// hang up, wake up the master so it reads end of file
+		tty->hung_up = true;
+		sem_release(lbuf->read_sem, 1);
+		wait_object_notify(&lbuf->waiters, WAIT_EVENT_ERROR);
+	}
+	mutex_unlock(&tty->lock);
+}
+
 static int tty_insert_char(struct line_buffer *lbuf, char c, bool move_line_start)
 {
 	bool was_empty = (AVAILABLE_READ(lbuf) == 0);
@@ -86,8 +155,10 @@ static int tty_insert_char(struct line_buffer *lbuf, char c, bool move_line_star
 	INC_HEAD(lbuf);
 	if(move_line_start)
 		lbuf->line_start = lbuf->head;
-	if(was_empty && AVAILABLE_READ(lbuf) > 0)
+	if(was_empty && AVAILABLE_READ(lbuf) > 0) {
 		sem_release(lbuf->read_sem, 1);
+		wait_object_notify(&lbuf->waiters, WAIT_EVENT_READ);
+	}
 
 	return 0;
 }
@@ -176,6 +247,28 @@ int tty_ioctl(tty_desc *tty, int op, void *buf, size_t len)
 	return err;
 }
 
+int tty_poll(tty_desc *tty, struct wait_watch *watch, int endpoint)
+{
+	int events = 0;
+
+	ASSERT(endpoint == ENDPOINT_MASTER_READ || endpoint == ENDPOINT_SLAVE_READ);
+
+	mutex_lock(&tty->lock);
+
+	wait_object_attach(&tty->buf[endpoint].waiters, watch);
+
+	if(AVAILABLE_READ(&tty->buf[endpoint]) > 0)
+		events |= WAIT_EVENT_READ;
+	if(AVAILABLE_WRITE(&tty->buf[1 - endpoint]) > 0)
+		events |= WAIT_EVENT_WRITE;
+	if(endpoint == ENDPOINT_MASTER_READ && tty->hung_up)
+		events |= WAIT_EVENT_READ | WAIT_EVENT_ERROR;
+
+	mutex_unlock(&tty->lock);
+
+	return events;
+}
+
 ssize_t tty_read(tty_desc *tty, void *buf, ssize_t len, int endpoint)
 {
 	struct line_buffer *lbuf;
@@ -192,21 +285,34 @@ ssize_t tty_read(tty_desc *tty, void *buf, ssize_t len, int endpoint)
 	ASSERT(endpoint == ENDPOINT_MASTER_READ || endpoint == ENDPOINT_SLAVE_READ);
 	lbuf = &tty->buf[endpoint];
 
-	// wait for data in the buffer
-	err = sem_acquire_etc(lbuf->read_sem, 1, SEM_FLAG_INTERRUPTABLE, 0, NULL);
-	if(err == ERR_INTERRUPTED)
-		return err;
+	for(;;) {
+		// wait for data in the buffer
+		err = sem_acquire_etc(lbuf->read_sem, 1, SEM_FLAG_INTERRUPTABLE, 0, NULL);
+		if(err == ERR_INTERRUPTED)
+			return err;
 
-	mutex_lock(&tty->lock);
+		mutex_lock(&tty->lock);
 
-	// quick sanity check
-	ASSERT(lbuf->len > 0);
-	ASSERT(lbuf->head < lbuf->len);
-	ASSERT(lbuf->tail < lbuf->len);
-	ASSERT(lbuf->line_start < lbuf->len);
+		// quick sanity check
+		ASSERT(lbuf->len > 0);
+		ASSERT(lbuf->head < lbuf->len);
+		ASSERT(lbuf->tail < lbuf->len);
+		ASSERT(lbuf->line_start < lbuf->len);
+
+		// figure out how much data is ready to be read
+		data_len = AVAILABLE_READ(lbuf);
+		if(data_len > 0)
+			break;
 
-	// figure out how much data is ready to be read
-	data_len = AVAILABLE_READ(lbuf);
+		if(endpoint == ENDPOINT_MASTER_READ && tty->hung_up) {
+			// woken up by a hang up, leave the sem up so every read sees end of file
+			sem_release(lbuf->read_sem, 1);
+			goto err;
+		}
+
+		// woken up by a hang up the slave has since undone by opening again
+		mutex_unlock(&tty->lock);
+	}
 	len = min(data_len, len);
 
 	ASSERT(len > 0);
@@ -238,6 +344,9 @@ ssize_t tty_read(tty_desc *tty, void *buf, ssize_t len, int endpoint)
 	if(data_len == lbuf->len - 1)
 		sem_release(lbuf->write_sem, 1);
 
+	// the writer on the other end reads from the other buffer, that's where its watches are
+	wait_object_notify(&tty->buf[1 - endpoint].waiters, WAIT_EVENT_WRITE);
+
 err:
 	mutex_unlock(&tty->lock);
 
@@ -446,6 +555,8 @@ int dev_bootstrap(void)
 			if(thetty.ttys[i].buf[j].write_sem < 0)
 				panic("couldn't create tty write sem\n");
 
+			thetty.ttys[i].buf[j].buffer = NULL;
+			wait_object_init(&thetty.ttys[i].buf[j].waiters);
 			thetty.ttys[i].buf[j].head = 0;
 			thetty.ttys[i].buf[j].tail = 0;
 			thetty.ttys[i].buf[j].line_start = 0;
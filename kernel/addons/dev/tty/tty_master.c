@@ -111,6 +111,13 @@ static ssize_t ttym_write(dev_cookie _cookie, const void *buf, off_t pos, ssize_
 	return ret;
 }
 
+static int ttym_poll(dev_cookie _cookie, struct wait_watch *watch)
+{
+	tty_master_cookie *cookie = (tty_master_cookie *)_cookie;
+
+	return tty_poll(cookie->tty, watch, ENDPOINT_MASTER_READ);
+}
+
 struct dev_calls ttym_hooks = {
 	&ttym_open,
 	&ttym_close,
@@ -122,6 +129,7 @@ struct dev_calls ttym_hooks = {
 	/* cannot page from /dev/tty */
 	NULL,
 	NULL,
-	NULL
+	NULL,
+	&ttym_poll
 };
 
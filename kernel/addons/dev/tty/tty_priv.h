@@ -2,11 +2,12 @@
 #define _NEWOS_KERNEL_DEV_TTY_TTY_PRIV_H
 
 #include <kernel/lock.h>
+#include <kernel/wait_set.h>
 #include <newos/tty_priv.h>
 
 #define TTY_TRACE 0
 
-#define NUM_TTYS 8
+#define NUM_TTYS 256
 #define TTY_BUFFER_SIZE 4096
 
 #define AVAILABLE_READ(buf)  (((buf)->line_start + (buf)->len - (buf)->tail) % (buf)->len)
@@ -34,9 +35,10 @@ struct line_buffer {
 	int len;
 	sem_id read_sem;
 	sem_id write_sem;
-	char buffer[TTY_BUFFER_SIZE];
+	char *buffer; // TTY_BUFFER_SIZE, allocated the first time the tty is used
 	int state;
 	int flags;
+	struct wait_object waiters; // watches on the endpoint that reads this buffer
 };
 
 typedef struct tty_desc {
@@ -46,6 +48,8 @@ typedef struct tty_desc {
 	mutex lock;
 	pgrp_id pgid;
 	struct tty_winsize wsize;
+	int slave_count;	// open slave cookies
+	bool hung_up;		// the last slave went away, the master reads end of file
 	struct line_buffer buf[2]; /* one buffer in either direction */
 } tty_desc;
 
@@ -61,11 +65,14 @@ extern struct dev_calls ttym_hooks;
 
 tty_desc *allocate_new_tty(void);
 void deallocate_tty(tty_desc *tty);
-void inc_tty_ref(tty_desc *tty);
+int inc_tty_ref(tty_desc *tty);
 void dec_tty_ref(tty_desc *tty);
+void tty_slave_opened(tty_desc *tty);
+void tty_slave_closed(tty_desc *tty);
 ssize_t tty_read(tty_desc *tty, void *buf, ssize_t len, int endpoint);
 ssize_t tty_write(tty_desc *tty, const void *buf, ssize_t len, int endpoint);
 int tty_ioctl(tty_desc *tty, int op, void *buf, size_t len);
+int tty_poll(tty_desc *tty, struct wait_watch *watch, int endpoint);
 
 #endif
 
@@ -26,14 +26,20 @@ static int ttys_open(dev_ident ident, dev_cookie *_cookie)
 {
 	tty_slave_cookie *cookie;
 	tty_desc *tty = (tty_desc *)ident;
+	int err;
 
-	inc_tty_ref(tty);
+	err = inc_tty_ref(tty);
+	if(err < 0)
+		return err;
 
 	cookie = (tty_slave_cookie *)kmalloc(sizeof(tty_slave_cookie));
-	if(cookie == NULL)
+	if(cookie == NULL) {
+		dec_tty_ref(tty);
 		return ERR_NO_MEMORY;
+	}
 
 	cookie->tty = tty;
+	tty_slave_opened(tty);
 
 	TRACE(("ttys_open: opened tty %d, cookie %p\n", cookie->tty->index, cookie));
 
@@ -52,6 +58,7 @@ static int ttys_freecookie(dev_cookie _cookie)
 {
 	tty_slave_cookie *cookie = (tty_slave_cookie *)_cookie;
 
+	tty_slave_closed(cookie->tty);
 	dec_tty_ref(cookie->tty);
 	kfree(cookie);
 
@@ -110,6 +117,13 @@ static ssize_t ttys_write(dev_cookie _cookie, const void *buf, off_t pos, ssize_
 }
 
 
+static int ttys_poll(dev_cookie _cookie, struct wait_watch *watch)
+{
+	tty_slave_cookie *cookie = (tty_slave_cookie *)_cookie;
+
+	return tty_poll(cookie->tty, watch, ENDPOINT_SLAVE_READ);
+}
+
 struct dev_calls ttys_hooks = {
 	&ttys_open,
 	&ttys_close,
@@ -121,6 +135,7 @@ struct dev_calls ttys_hooks = {
 	/* cannot page from /dev/tty */
 	NULL,
 	NULL,
-	NULL
+	NULL,
+	&ttys_poll
 };
 
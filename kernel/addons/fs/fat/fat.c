@@ -264,7 +264,9 @@ static struct fs_calls fat_calls = {
 	&fat_rmdir,
 
 	&fat_rstat,
-	&fat_wstat
+	&fat_wstat,
+
+	NULL
 };
 
 int fs_bootstrap(void);
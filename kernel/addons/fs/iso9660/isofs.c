@@ -824,23 +824,54 @@ static int isofs_canpage(fs_cookie _fs, fs_vnode _v)
 {
 	struct isofs_vnode *v = _v;
 
-	TOUCH(v);
-
 	TRACE(("isofs_canpage: vnode 0x%x\n", v));
 
-	return 0;
+	if(v->stream.type == STREAM_TYPE_FILE)
+		return 1;
+	else
+		return 0;
 }
 
 //--------------------------------------------------------------------------------
 static ssize_t isofs_readpage(fs_cookie _fs, fs_vnode _v, iovecs *vecs, off_t pos)
 {
+	struct isofs *fs = _fs;
 	struct isofs_vnode *v = _v;
-
-	TOUCH(v);
+	ssize_t err = 0;
+	ssize_t total = 0;
+	unsigned int i;
 
 	TRACE(("isofs_readpage: vnode 0x%x, vecs 0x%x, pos 0x%x 0x%x\n", v, vecs, pos));
 
-	return ERR_NOT_ALLOWED;
+	if(v->stream.type != STREAM_TYPE_FILE)
+		return ERR_NOT_ALLOWED;
+
+	mutex_lock(&fs->lock);
+
+	// read straight into the pages, zero whatever is past the end of the file
+	for(i=0; i<vecs->num; i++) {
+		size_t copy_len = 0;
+
+		if(pos < v->stream.data_len) {
+			copy_len = min(vecs->vec[i].len, v->stream.data_len - pos);
+			err = sys_read(fs->fd, vecs->vec[i].start, v->stream.data_pos + pos, copy_len);
+			if(err < 0)
+				goto error;
+			copy_len = err;
+		}
+
+		if(copy_len < vecs->vec[i].len)
+			memset((char *)vecs->vec[i].start + copy_len, 0, vecs->vec[i].len - copy_len);
+
+		pos += vecs->vec[i].len;
+		total += vecs->vec[i].len;
+	}
+	err = total;
+
+error:
+	mutex_unlock(&fs->lock);
+
+	return err;
 }
 
 //--------------------------------------------------------------------------------
@@ -964,7 +995,9 @@ static struct fs_calls isofs_calls = {
 	&isofs_rmdir,		// rmdir
 
 	&isofs_rstat,		// rstat
-	&isofs_wstat		// wstat
+	&isofs_wstat,		// wstat
+
+	NULL
 };
 
 int fs_bootstrap(void);
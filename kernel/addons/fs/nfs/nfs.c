@@ -57,6 +57,7 @@ static nfs_vnode *new_vnode_struct(nfs_fs *fs)
 
 	v->hash_next = NULL;
 	v->fs = fs;
+	v->attr_valid = false;
 
 	return v;
 }
@@ -671,11 +672,32 @@ static int nfs_readdir(fs_cookie _fs, fs_vnode _v, dir_cookie _cookie, void *buf
 	return err;
 }
 
+/* records the size and mtime the file has now, returns whether they differ from
+   the last ones recorded. NOTE: expects the vnode lock to be held */
+static bool nfs_note_attributes(nfs_vnode *v, const nfs_fattr *attr)
+{
+	bool changed;
+
+	changed = v->attr_valid
+		&& (v->attr_size != attr->size
+		 || v->attr_mtime.seconds != attr->mtime.seconds
+		 || v->attr_mtime.useconds != attr->mtime.useconds);
+
+	v->attr_valid = true;
+	v->attr_size = attr->size;
+	v->attr_mtime = attr->mtime;
+
+	return changed;
+}
+
 int nfs_open(fs_cookie fs, fs_vnode _v, file_cookie *_cookie, int oflags)
 {
 	nfs_fs *nfs = (nfs_fs *)fs;
 	nfs_vnode *v = (nfs_vnode *)_v;
 	nfs_cookie *cookie;
+	uint8 attrstatbuf[NFS_ATTRSTAT_MAXLEN];
+	nfs_attrstat attrstat;
+	bool changed = false;
 	int err;
 
 	TOUCH(nfs);
@@ -687,6 +709,19 @@ int nfs_open(fs_cookie fs, fs_vnode _v, file_cookie *_cookie, int oflags)
 		goto err;
 	}
 
+	/* the server can change the file at any time. Check on every open and have
+	   the vfs drop what it has cached if someone else changed it. */
+	mutex_lock(&v->lock);
+	err = nfs_getattr(nfs, v, attrstatbuf, &attrstat);
+	if(err >= 0)
+		changed = nfs_note_attributes(v, attrstat.attributes);
+	mutex_unlock(&v->lock);
+	if(err < 0)
+		goto err;
+
+	if(changed)
+		vfs_file_cache_invalidate(nfs->id, VNODETOVNID(v));
+
 	cookie = kmalloc(sizeof(nfs_cookie));
 	if(cookie == NULL) {
 		err = ERR_NO_MEMORY;
@@ -841,19 +876,23 @@ ssize_t nfs_read(fs_cookie fs, fs_vnode _v, file_cookie _cookie, void *buf, off_
 
 static ssize_t nfs_writefile(nfs_fs *nfs, nfs_vnode *v, nfs_cookie *cookie, const void *buf, off_t pos, ssize_t len, bool updatecookiepos)
 {
-#if 0
-	uint8 abuf[sizeof(nfs_writeargs) + WRITE_BUF_SIZE];
-	nfs_writeargs *args = (nfs_writeargs *)abuf;
-	nfs_attrstat  *res  = (nfs_attrstat *)abuf;
+	uint8 argbuf[NFS_WRITEARGS_MAXLEN + WRITE_BUF_SIZE];
+	nfs_writeargs args;
+	size_t arglen;
+
+	uint8 resbuf[NFS_ATTRSTAT_MAXLEN];
+	nfs_attrstat res;
 	int err;
 	ssize_t total_written = 0;
 
+	TRACE("nfs_writefile: v %p, buf %p, pos %Ld, len %d\n", v, buf, pos, len);
+
 	/* check args */
 	if(pos < 0)
 		pos = cookie->u.file.pos;
 	/* can't do more than 32-bit offsets right now */
 	if(pos > 0xffffffff)
-		return 0;
+		return ERR_INVALID_ARGS;
 	/* negative or zero length means nothing */
 	if(len <= 0)
 		return 0;
@@ -861,24 +900,41 @@ static ssize_t nfs_writefile(nfs_fs *nfs, nfs_vnode *v, nfs_cookie *cookie, cons
 	while(len > 0) {
 		ssize_t to_write = min(len, WRITE_BUF_SIZE);
 
-		/* put together the message */
-		memcpy(&args->file, &v->nfs_handle, sizeof(args->file));
-		args->beginoffset = 0; // unused
-		args->offset = htonl(pos);
-		args->totalcount = htonl(to_write);
-		err = user_memcpy(args->data, (const uint8 *)buf + total_written, to_write);
+		/* put together the message, the data goes after the args padded out to 4 bytes */
+		args.file = &v->nfs_handle;
+		args.beginoffset = 0; // unused
+		args.offset = pos;
+		args.totalcount = 0; // unused
+		args.len = to_write;
+		arglen = nfs_pack_writeargs(argbuf, &args);
+
+		err = user_memcpy(argbuf + arglen, (const uint8 *)buf + total_written, to_write);
 		if(err < 0) {
-			total_written = err;
+			if(total_written == 0)
+				total_written = err; // bad user give me bad buffer
 			break;
 		}
+		memset(argbuf + arglen + to_write, 0, ROUNDUP(to_write, 4) - to_write);
+		arglen += ROUNDUP(to_write, 4);
 
-		err = rpc_call(&nfs->rpc, NFSPROG, NFSVERS, NFSPROC_WRITE, args, sizeof(*args) + to_write, abuf, sizeof(abuf));
-		if(err < 0)
+		err = rpc_call(&nfs->rpc, NFSPROG, NFSVERS, NFSPROC_WRITE, argbuf, arglen, resbuf, sizeof(resbuf));
+		if(err < 0) {
+			if(total_written == 0)
+				total_written = err;
 			break;
+		}
 
-		/* get response */
-		if(ntohl(res->status) != NFS_OK)
+		nfs_unpack_attrstat(resbuf, &res);
+
+		/* get response, the write back of cached pages needs to hear about failures */
+		if(res.status != NFS_OK) {
+			if(total_written == 0)
+				total_written = nfs_status_to_error(res.status);
 			break;
+		}
+
+		/* our own writes don't make the cached data stale */
+		nfs_note_attributes(v, res.attributes);
 
 		pos += to_write;
 		len -= to_write;
@@ -889,8 +945,6 @@ static ssize_t nfs_writefile(nfs_fs *nfs, nfs_vnode *v, nfs_cookie *cookie, cons
 		cookie->u.file.pos = pos;
 
 	return total_written;
-#endif
-	return ERR_UNIMPLEMENTED;
 }
 
 ssize_t nfs_write(fs_cookie fs, fs_vnode _v, file_cookie _cookie, const void *buf, off_t pos, ssize_t len)
@@ -1051,6 +1105,14 @@ ssize_t nfs_writepage(fs_cookie fs, fs_vnode _v, iovecs *vecs, off_t pos)
 {
 	nfs_fs *nfs = (nfs_fs *)fs;
 	nfs_vnode *v = (nfs_vnode *)_v;
+	uint8 attrstatbuf[NFS_ATTRSTAT_MAXLEN];
+	nfs_attrstat attrstat;
+	off_t size;
+	unsigned int i;
+	ssize_t len;
+	ssize_t writefile_return;
+	ssize_t total_bytes_written = 0;
+	int err;
 
 	TOUCH(nfs);TOUCH(v);
 
@@ -1059,7 +1121,37 @@ ssize_t nfs_writepage(fs_cookie fs, fs_vnode _v, iovecs *vecs, off_t pos)
 	if(v->st == STREAM_TYPE_DIR)
 		return ERR_VFS_IS_DIR;
 
-	return ERR_UNIMPLEMENTED;
+	mutex_lock(&v->lock);
+
+	/* the last page runs past the end of the file, don't grow the file with it */
+	err = nfs_getattr(nfs, v, attrstatbuf, &attrstat);
+	if(err < 0) {
+		total_bytes_written = err;
+		goto out;
+	}
+	size = attrstat.attributes->size;
+
+	for (i=0; i < vecs->num && pos < size; i++) {
+		len = min((off_t)vecs->vec[i].len, size - pos);
+
+		writefile_return = nfs_writefile(nfs, v, NULL, vecs->vec[i].start, pos, len, false);
+		TRACE("nfs_writepage: nfs_writefile returns %d\n", writefile_return);
+		if (writefile_return < 0) {
+			total_bytes_written = writefile_return;
+			goto out;
+		}
+
+		pos += writefile_return;
+		total_bytes_written += writefile_return;
+
+		if (writefile_return < len)
+			break;
+	}
+
+out:
+	mutex_unlock(&v->lock);
+
+	return total_bytes_written;
 }
 
 static int _nfs_create(nfs_fs *nfs, nfs_vnode *dir, const char *name, stream_type type, vnode_id *new_vnid)
@@ -1390,13 +1482,16 @@ static struct fs_calls nfs_calls = {
 	&nfs_rmdir,
 
 	&nfs_rstat,
-	&nfs_wstat
+	&nfs_wstat,
+
+	NULL
 };
 
 int fs_bootstrap(void);
 int fs_bootstrap(void)
 {
 	dprintf("bootstrap_nfs: entry\n");
-	return vfs_register_filesystem("nfs", &nfs_calls);
+	// the server can change names under us at any time
+	return vfs_register_filesystem_etc("nfs", &nfs_calls, FS_FLAG_NO_NAME_CACHE | FS_FLAG_WRITE_BACK);
 }
 
@@ -36,6 +36,11 @@ typedef struct nfs_vnode {
 	mutex lock;
 	stream_type st;
 	nfs_fhandle nfs_handle;
+
+	/* what the file looked like when the vfs' cached data was last in sync with it */
+	bool attr_valid;
+	unsigned int attr_size;
+	nfs_timeval attr_mtime;
 } nfs_vnode;
 
 typedef struct nfs_cookie {
@@ -181,12 +181,14 @@ typedef struct {
 void nfs_unpack_readres(uint8 *buf, nfs_readres *res);
 
 typedef struct {
-	nfs_fhandle file;
+	nfs_fhandle *file;
 	unsigned int beginoffset;
 	unsigned int offset;
 	unsigned int totalcount;
-	unsigned char data[0];
+	unsigned int len; // of the data, which follows the packed args padded to 4 bytes
 } nfs_writeargs;
+#define NFS_WRITEARGS_MAXLEN (FHSIZE + 4 * 4)
+size_t nfs_pack_writeargs(uint8 *buf, const nfs_writeargs *args);
 
 typedef struct {
 	nfs_status status;
@@ -107,6 +107,18 @@ size_t nfs_pack_readargs(uint8 *buf, const nfs_readargs *args)
 	return sizeof(nfs_fhandle) + 3 * 4;
 }
 
+size_t nfs_pack_writeargs(uint8 *buf, const nfs_writeargs *args)
+{
+	memcpy(buf, args->file, sizeof(nfs_fhandle)); // file handle
+	buf += sizeof(nfs_fhandle);
+	*(unsigned int *)buf = htonl(args->beginoffset);
+	*(unsigned int *)(buf + 4) = htonl(args->offset);
+	*(unsigned int *)(buf + 8) = htonl(args->totalcount);
+	*(unsigned int *)(buf + 12) = htonl(args->len);
+
+	return sizeof(nfs_fhandle) + 4 * 4;
+}
+
 size_t nfs_pack_createopargs(uint8 *buf, const nfs_createargs *args)
 {
 	size_t off;
@@ -123,7 +123,9 @@ static struct fs_calls zfs_calls = {
 	&zfs_rmdir,
 
 	&zfs_rstat,
-	&zfs_wstat
+	&zfs_wstat,
+
+	NULL
 };
 
 int fs_bootstrap(void);
@@ -260,6 +260,14 @@ int arch_cpu_init_percpu(kernel_args *ka, int curr_cpu)
 {
 	detect_cpu(ka, curr_cpu);
 
+	// turn on 4MB pages, every cpu has to have them on before they show up
+	// in a page directory it uses
+	if(get_cpu_struct(curr_cpu)->arch.feature[FEATURE_COMMON] & X86_PSE) {
+		uint32 cr4;
+		read_cr4(cr4);
+		write_cr4(cr4 | (1<<4)); // PSE bit in cr4
+	}
+
 	return 0;
 }
 
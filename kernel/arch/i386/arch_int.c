@@ -195,9 +195,7 @@ void i386_handle_trap(struct iframe frame)
 	if(frame.cs == USER_CODE_SEG)
 		ret |= thread_atinterrupt_exit();
 	if(ret == INT_RESCHEDULE) {
-		GRAB_THREAD_LOCK();
-		thread_resched();
-		RELEASE_THREAD_LOCK();
+		thread_preempt();
 	}
 
 //	dprintf("0x%x cpu %d!\n", thread_get_current_thread_id(), smp_get_current_cpu());
@@ -162,6 +162,44 @@ void arch_thread_enter_uspace(struct thread *t, addr_t entry, void *args, addr_t
 	i386_enter_uspace(entry, args, ustack_top - 4);
 }
 
+// copies the user state the current thread entered the kernel with, for
+// arch_thread_enter_uspace_forked() to return to in the child of a fork
+void *arch_thread_save_user_state(void)
+{
+	struct iframe *frame;
+
+	frame = (struct iframe *)kmalloc(sizeof(struct iframe));
+	if(frame == NULL)
+		return NULL;
+	memcpy(frame, i386_get_curr_iframe(), sizeof(struct iframe));
+
+	return frame;
+}
+
+void arch_thread_enter_uspace_forked(struct thread *t, void *state)
+{
+	struct iframe frame;
+
+	memcpy(&frame, state, sizeof(frame));
+	kfree(state);
+
+	// the syscall returns 0 in the child
+	frame.eax = 0;
+	frame.edx = 0;
+
+	// make sure the fpu is in a good state
+	asm("fninit");
+
+	int_disable_interrupts();
+
+	i386_set_kstack(t->kernel_stack_base + KSTACK_SIZE);
+
+	// set the interrupt disable count to zero, since we'll have ints enabled as soon as we enter user space
+	t->int_disable_level = 0;
+
+	i386_return_to_uspace(&frame);
+}
+
 int
 arch_setup_signal_frame(struct thread *t, struct sigaction *sa, int sig, int sig_mask)
 {
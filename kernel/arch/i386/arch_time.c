@@ -37,6 +37,11 @@ bigtime_t arch_get_time_delta(void)
 		return 0;
 }
 
+bool arch_time_has_counter(void)
+{
+	return use_rdtsc;
+}
+
 /* MC146818 RTC code */
 static uint8 read_rtc(uint8 reg)
 {
@@ -45,6 +45,10 @@ static sem_id iospace_full_sem;
 
 #define PAGE_INVALIDATE_CACHE_SIZE 64
 
+// a pgdir entry can map a 4MB page directly if the cpu has PSE
+#define LARGE_PAGE_SIZE (PAGE_SIZE * 1024)
+static bool large_pages = false;
+
 // vm_translation object stuff
 typedef struct vm_translation_map_arch_info_struct {
 	pdentry *pgdir_virt;
@@ -74,6 +78,8 @@ static spinlock_t tmap_list_lock;
 #define FIRST_KERNEL_PGDIR_ENT  (VADDR_TO_PDENT(KERNEL_BASE))
 #define NUM_KERNEL_PGDIR_ENTS   (VADDR_TO_PDENT(KERNEL_SIZE))
 
+#define IS_KERNEL_PGDIR_ENT(index) ((unsigned int)(index) >= FIRST_KERNEL_PGDIR_ENT && (unsigned int)(index) < (FIRST_KERNEL_PGDIR_ENT + NUM_KERNEL_PGDIR_ENTS))
+
 static int vm_translation_map_quick_query(addr_t va, addr_t *out_physical);
 static int get_physical_page_tmap(addr_t pa, addr_t *va, int flags);
 static int put_physical_page_tmap(addr_t va);
@@ -150,7 +156,8 @@ static void destroy_tmap(vm_translation_map *map)
 			addr_t pgtable_addr;
 			vm_page *page;
 
-			if(map->arch_data->pgdir_virt[i].present == 1) {
+			// 4MB pages don't have a pgtable to free
+			if(map->arch_data->pgdir_virt[i].present == 1 && map->arch_data->pgdir_virt[i].page_size == 0) {
 				pgtable_addr = map->arch_data->pgdir_virt[i].addr;
 				page = vm_lookup_page(pgtable_addr);
 				if(!page)
@@ -178,6 +185,60 @@ static void put_pgtable_in_pgdir(pdentry *e, addr_t pgtable_phys, int attributes
 	e->present = 1;
 }
 
+static void invalidate_page(vm_translation_map *map, addr_t va)
+{
+	if(map->arch_data->num_invalidate_pages < PAGE_INVALIDATE_CACHE_SIZE) {
+		map->arch_data->pages_to_invalidate[map->arch_data->num_invalidate_pages] = va;
+	}
+	map->arch_data->num_invalidate_pages++;
+}
+
+// replaces the 4MB page at pgdir entry index with a pgtable mapping the same
+// memory with 1024 small pages, so part of it can be unmapped or changed
+static void split_large_page(vm_translation_map *map, unsigned int index)
+{
+	pdentry *pd = map->arch_data->pgdir_virt;
+	pdentry large = pd[index];
+	ptentry *pt;
+	vm_page *page;
+	addr_t pgtable;
+	int err;
+	int i;
+
+	page = vm_page_allocate_page(PAGE_STATE_CLEAR);
+	vm_page_set_state(page, PAGE_STATE_WIRED);
+	pgtable = page->ppn * PAGE_SIZE;
+
+	do {
+		err = get_physical_page_tmap(pgtable, (addr_t *)&pt, PHYSICAL_PAGE_NO_WAIT);
+	} while(err < 0);
+
+	for(i = 0; i < 1024; i++) {
+		init_ptentry(&pt[i]);
+		pt[i].addr = large.addr + i;
+		pt[i].user = large.user;
+		pt[i].rw = large.rw;
+		pt[i].write_through = large.write_through;
+		pt[i].cache_disabled = large.cache_disabled;
+		pt[i].accessed = large.accessed;
+		pt[i].dirty = large.dirty;
+		pt[i].global = large.global;
+		pt[i].present = 1;
+	}
+
+	put_physical_page_tmap((addr_t)pt);
+
+	put_pgtable_in_pgdir(&pd[index], pgtable, LOCK_RW);
+	if(IS_KERNEL_PGDIR_ENT(index))
+		_update_all_pgdirs(index, pd[index]);
+
+	// counted the same way map_tmap would have, the pgtable and its pages
+	map->large_map_count--;
+	map->map_count += 1 + 1024;
+
+	invalidate_page(map, index * LARGE_PAGE_SIZE);
+}
+
 static int map_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int attributes)
 {
 	pdentry *pd;
@@ -200,6 +261,10 @@ static int map_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int
 
 	// check to see if a page table exists for this range
 	index = VADDR_TO_PDENT(va);
+	if(pd[index].present == 1 && pd[index].page_size == 1) {
+		// a 4MB page covers it, break that up first
+		split_large_page(map, index);
+	}
 	if(pd[index].present == 0) {
 		addr_t pgtable;
 		vm_page *page;
@@ -218,7 +283,7 @@ static int map_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int
 		put_pgtable_in_pgdir(&pd[index], pgtable, attributes | LOCK_RW);
 
 		// update any other page directories, if it maps kernel space
-		if(index >= FIRST_KERNEL_PGDIR_ENT && index < (FIRST_KERNEL_PGDIR_ENT + NUM_KERNEL_PGDIR_ENTS))
+		if(IS_KERNEL_PGDIR_ENT(index))
 			_update_all_pgdirs(index, pd[index]);
 
 		map->map_count++;
@@ -230,6 +295,10 @@ static int map_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int
 	} while(err < 0);
 	index = VADDR_TO_PTENT(va);
 
+	// replacing a mapping, like a copy on write fault does, doesn't add one
+	if(pt[index].present == 0)
+		map->map_count++;
+
 	init_ptentry(&pt[index]);
 	pt[index].addr = ADDR_SHIFT(pa);
 	pt[index].user = !(attributes & LOCK_KERNEL);
@@ -240,12 +309,72 @@ static int map_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int
 
 	put_physical_page_tmap((addr_t)pt);
 
-	if(map->arch_data->num_invalidate_pages < PAGE_INVALIDATE_CACHE_SIZE) {
-		map->arch_data->pages_to_invalidate[map->arch_data->num_invalidate_pages] = va;
+	invalidate_page(map, va);
+
+	return 0;
+}
+
+// maps a 4MB page straight from the pgdir. A pgtable that's already there
+// can only be replaced if nothing is mapped through it anymore.
+static int map_large_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int attributes)
+{
+	pdentry *pd = map->arch_data->pgdir_virt;
+	ptentry *pt;
+	unsigned int index;
+	int err;
+	int i;
+
+	if(!large_pages)
+		return ERR_NOT_ALLOWED;
+	if((va % LARGE_PAGE_SIZE) != 0 || (pa % LARGE_PAGE_SIZE) != 0)
+		return ERR_INVALID_ARGS;
+
+#if CHATTY_TMAP
+	dprintf("map_large_tmap: entry pa 0x%x va 0x%x\n", pa, va);
+#endif
+
+	index = VADDR_TO_PDENT(va);
+	if(pd[index].present == 1 && pd[index].page_size == 1) {
+		// replacing a 4MB page with another one
+		map->large_map_count--;
+	} else if(pd[index].present == 1) {
+		vm_page *page;
+
+		do {
+			err = get_physical_page_tmap(ADDR_REVERSE_SHIFT(pd[index].addr), (addr_t *)&pt, PHYSICAL_PAGE_NO_WAIT);
+		} while(err < 0);
+		for(i = 0; i < 1024; i++) {
+			if(pt[i].present)
+				break;
+		}
+		put_physical_page_tmap((addr_t)pt);
+		if(i < 1024)
+			return ERR_NOT_ALLOWED;
+
+		// the pgtable is empty, let it go. The flush when the map is unlocked
+		// gets rid of anything the cpus have cached from it.
+		page = vm_lookup_page(pd[index].addr);
+		if(!page)
+			panic("map_large_tmap: didn't find pgtable page\n");
+		vm_page_set_state(page, PAGE_STATE_FREE);
+		map->map_count--;
 	}
-	map->arch_data->num_invalidate_pages++;
 
-	map->map_count++;
+	init_pdentry(&pd[index]);
+	pd[index].addr = ADDR_SHIFT(pa);
+	pd[index].user = !(attributes & LOCK_KERNEL);
+	pd[index].rw = attributes & LOCK_RW;
+	pd[index].page_size = 1;
+	if(is_kernel_address(va))
+		pd[index].global = 1;
+	pd[index].present = 1;
+
+	if(IS_KERNEL_PGDIR_ENT(index))
+		_update_all_pgdirs(index, pd[index]);
+
+	map->large_map_count++;
+
+	invalidate_page(map, va);
 
 	return 0;
 }
@@ -275,6 +404,27 @@ restart:
 		goto restart;
 	}
 
+	if(pd[index].page_size == 1) {
+		if((start % LARGE_PAGE_SIZE) != 0 || end - start < LARGE_PAGE_SIZE) {
+			// only part of the 4MB page goes away
+			split_large_page(map, index);
+		} else {
+#if CHATTY_TMAP
+			dprintf("unmap_tmap: removing large page 0x%x\n", start);
+#endif
+			init_pdentry(&pd[index]);
+			if(IS_KERNEL_PGDIR_ENT(index))
+				_update_all_pgdirs(index, pd[index]);
+			map->large_map_count--;
+			invalidate_page(map, start);
+
+			start += LARGE_PAGE_SIZE;
+			if(start == 0)
+				return 0; // wrapped around the top of the address space
+			goto restart;
+		}
+	}
+
 	do {
 		err = get_physical_page_tmap(ADDR_REVERSE_SHIFT(pd[index].addr), (addr_t *)&pt, PHYSICAL_PAGE_NO_WAIT);
 	} while(err < 0);
@@ -290,10 +440,7 @@ restart:
 		pt[index].present = 0;
 		map->map_count--;
 
-		if(map->arch_data->num_invalidate_pages < PAGE_INVALIDATE_CACHE_SIZE) {
-			map->arch_data->pages_to_invalidate[map->arch_data->num_invalidate_pages] = start;
-		}
-		map->arch_data->num_invalidate_pages++;
+		invalidate_page(map, start);
 	}
 
 	put_physical_page_tmap((addr_t)pt);
@@ -318,6 +465,17 @@ static int query_tmap(vm_translation_map *map, addr_t va, addr_t *out_physical,
 		return NO_ERROR;
 	}
 
+	if(pd[index].page_size == 1) {
+		*out_physical = ADDR_REVERSE_SHIFT(pd[index].addr) + (va % LARGE_PAGE_SIZE);
+
+		*out_flags |= pd[index].rw ? LOCK_RW : LOCK_RO;
+		*out_flags |= pd[index].user ? 0 : LOCK_KERNEL;
+		*out_flags |= pd[index].dirty ? PAGE_MODIFIED : 0;
+		*out_flags |= pd[index].accessed ? PAGE_ACCESSED : 0;
+		*out_flags |= PAGE_PRESENT;
+		return 0;
+	}
+
 	do {
 		err = get_physical_page_tmap(ADDR_REVERSE_SHIFT(pd[index].addr), (addr_t *)&pt, PHYSICAL_PAGE_NO_WAIT);
 	} while(err < 0);
@@ -342,14 +500,70 @@ static int query_tmap(vm_translation_map *map, addr_t va, addr_t *out_physical,
 
 static addr_t get_mapped_size_tmap(vm_translation_map *map)
 {
-	return map->map_count;
+	return map->map_count + map->large_map_count * (LARGE_PAGE_SIZE / PAGE_SIZE);
 }
 
+// changes the protection of the pages already mapped between base and top,
+// leaving the rest of the entries, the dirty and accessed bits included, alone
 static int protect_tmap(vm_translation_map *map, addr_t base, addr_t top, unsigned int attributes)
 {
-	// XXX finish
-	panic("protect_tmap called, not implemented\n");
-	return ERR_UNIMPLEMENTED;
+	ptentry *pt;
+	pdentry *pd = map->arch_data->pgdir_virt;
+	int index;
+	int err;
+
+	base = ROUNDOWN(base, PAGE_SIZE);
+	top = ROUNDUP(top, PAGE_SIZE);
+
+restart:
+	if(base >= top)
+		return 0;
+
+	index = VADDR_TO_PDENT(base);
+	if(pd[index].present == 0) {
+		// no pagetable here, skip to the start of the next one
+		base = ROUNDUP(base + 1, PAGE_SIZE * 1024);
+		if(base == 0)
+			return 0;
+		goto restart;
+	}
+
+	if(pd[index].page_size == 1) {
+		if((base % LARGE_PAGE_SIZE) != 0 || top - base < LARGE_PAGE_SIZE) {
+			split_large_page(map, index);
+		} else {
+			pd[index].user = !(attributes & LOCK_KERNEL);
+			pd[index].rw = attributes & LOCK_RW;
+			if(IS_KERNEL_PGDIR_ENT(index))
+				_update_all_pgdirs(index, pd[index]);
+			invalidate_page(map, base);
+
+			base += LARGE_PAGE_SIZE;
+			if(base == 0)
+				return 0;
+			goto restart;
+		}
+	}
+
+	do {
+		err = get_physical_page_tmap(ADDR_REVERSE_SHIFT(pd[index].addr), (addr_t *)&pt, PHYSICAL_PAGE_NO_WAIT);
+	} while(err < 0);
+
+	for(index = VADDR_TO_PTENT(base); (index < 1024) && (base < top); index++, base += PAGE_SIZE) {
+		if(pt[index].present == 0)
+			continue;
+
+		pt[index].user = !(attributes & LOCK_KERNEL);
+		pt[index].rw = attributes & LOCK_RW;
+
+		invalidate_page(map, base);
+	}
+
+	put_physical_page_tmap((addr_t)pt);
+
+	if(base == 0)
+		return 0; // wrapped around the top of the address space
+	goto restart;
 }
 
 static int clear_flags_tmap(vm_translation_map *map, addr_t va, unsigned int flags)
@@ -366,6 +580,23 @@ static int clear_flags_tmap(vm_translation_map *map, addr_t va, unsigned int fla
 		return NO_ERROR;
 	}
 
+	if(pd[index].page_size == 1) {
+		// a 4MB page only has one set of flags, clear them for all of it rather
+		// than break it up. Large pages map device memory and wired memory,
+		// nothing that gets paged out.
+		if(flags & PAGE_MODIFIED) {
+			pd[index].dirty = 0;
+			tlb_flush = true;
+		}
+		if(flags & PAGE_ACCESSED) {
+			pd[index].accessed = 0;
+			tlb_flush = true;
+		}
+		if(tlb_flush)
+			invalidate_page(map, va);
+		return 0;
+	}
+
 	do {
 		err = get_physical_page_tmap(ADDR_REVERSE_SHIFT(pd[index].addr), (addr_t *)&pt, PHYSICAL_PAGE_NO_WAIT);
 	} while(err < 0);
@@ -383,12 +614,8 @@ static int clear_flags_tmap(vm_translation_map *map, addr_t va, unsigned int fla
 
 	put_physical_page_tmap((addr_t)pt);
 
-	if(tlb_flush) {
-		if(map->arch_data->num_invalidate_pages < PAGE_INVALIDATE_CACHE_SIZE) {
-			map->arch_data->pages_to_invalidate[map->arch_data->num_invalidate_pages] = va;
-		}
-		map->arch_data->num_invalidate_pages++;
-	}
+	if(tlb_flush)
+		invalidate_page(map, va);
 
 //	dprintf("query_tmap: returning pa 0x%x for va 0x%x\n", *out_physical, va);
 
@@ -550,6 +777,7 @@ static vm_translation_map_ops tmap_ops = {
 	lock_tmap,
 	unlock_tmap,
 	map_tmap,
+	map_large_tmap,
 	unmap_tmap,
 	query_tmap,
 	get_mapped_size_tmap,
@@ -568,6 +796,7 @@ int vm_translation_map_create(vm_translation_map *new_map, bool kernel)
 	// initialize the new object
 	new_map->ops = &tmap_ops;
 	new_map->map_count = 0;
+	new_map->large_map_count = 0;
 	if(recursive_lock_create(&new_map->lock) < 0)
 		return ERR_NO_MEMORY;
 
@@ -596,6 +825,16 @@ int vm_translation_map_create(vm_translation_map *new_map, bool kernel)
 		// we already know the kernel pgdir mapping
 		(addr_t)new_map->arch_data->pgdir_virt = kernel_pgdir_virt;
 		(addr_t)new_map->arch_data->pgdir_phys = kernel_pgdir_phys;
+
+		// count the 4MB pages mapped while booting, like the kernel heap
+		{
+			unsigned int i;
+
+			for(i = FIRST_KERNEL_PGDIR_ENT; i < FIRST_KERNEL_PGDIR_ENT + NUM_KERNEL_PGDIR_ENTS; i++) {
+				if(kernel_pgdir_virt[i].present && kernel_pgdir_virt[i].page_size)
+					new_map->large_map_count++;
+			}
+		}
 	}
 
 	// zero out the bottom portion of the new pgdir
@@ -685,6 +924,12 @@ int vm_translation_map_module_init(kernel_args *ka)
 		write_cr4(cr4 | (1<<7)); // PGE bit in cr4
 	}
 
+	// 4MB pages, the PSE bit in cr4 was turned on in arch_cpu_init_percpu
+	if(i386_check_feature(X86_PSE, FEATURE_COMMON)) {
+		dprintf("using 4MB pages\n");
+		large_pages = true;
+	}
+
 	dprintf("vm_translation_map_module_init: done\n");
 
 	return 0;
@@ -789,6 +1034,42 @@ int vm_translation_map_quick_map(kernel_args *ka, addr_t va, addr_t pa, unsigned
 	return 0;
 }
 
+int vm_translation_map_quick_map_large(kernel_args *ka, addr_t va, addr_t pa, unsigned int attributes)
+{
+	pdentry *e;
+
+	if(!large_pages)
+		return ERR_NOT_ALLOWED;
+	if((va % LARGE_PAGE_SIZE) != 0 || (pa % LARGE_PAGE_SIZE) != 0)
+		return ERR_INVALID_ARGS;
+
+#if CHATTY_TMAP
+	dprintf("quick_map_large: entry pa 0x%x va 0x%x\n", pa, va);
+#endif
+
+	e = &page_hole_pgdir[VADDR_TO_PDENT(va)];
+	if(e->present)
+		return ERR_NOT_ALLOWED; // something's already mapped through it
+
+	init_pdentry(e);
+	e->addr = ADDR_SHIFT(pa);
+	e->user = !(attributes & LOCK_KERNEL);
+	e->rw = attributes & LOCK_RW;
+	e->page_size = 1;
+	if(is_kernel_address(va))
+		e->global = 1;
+	e->present = 1;
+
+	arch_cpu_invalidate_TLB_range(va, va);
+
+	return 0;
+}
+
+addr_t vm_translation_map_large_page_size(void)
+{
+	return large_pages ? LARGE_PAGE_SIZE : 0;
+}
+
 // XXX currently assumes this translation map is active
 static int vm_translation_map_quick_query(addr_t va, addr_t *out_physical)
 {
@@ -799,6 +1080,11 @@ static int vm_translation_map_quick_query(addr_t va, addr_t *out_physical)
 		return ERR_VM_PAGE_NOT_PRESENT;
 	}
 
+	if(page_hole_pgdir[VADDR_TO_PDENT(va)].page_size == 1) {
+		*out_physical = ADDR_REVERSE_SHIFT(page_hole_pgdir[VADDR_TO_PDENT(va)].addr) + (va % LARGE_PAGE_SIZE);
+		return 0;
+	}
+
 	pentry = page_hole + va / PAGE_SIZE;
 	if(pentry->present == 0) {
 		// page mapping not valid
@@ -129,9 +129,7 @@ void ppc_exception_entry(int vector, struct iframe *iframe)
 
 	if(ret == INT_RESCHEDULE) {
 		int_disable_interrupts();
-		GRAB_THREAD_LOCK();
-		thread_resched();
-		RELEASE_THREAD_LOCK();
+		thread_preempt();
 		int_restore_interrupts();
 	}
 }
@@ -56,6 +56,17 @@ void arch_thread_enter_uspace(struct thread *t, addr_t entry, void *args, addr_t
 	PANIC_UNIMPLEMENTED();
 }
 
+// fork isn't supported here yet, proc_fork_proc turns this into ERR_UNIMPLEMENTED
+void *arch_thread_save_user_state(void)
+{
+	return NULL;
+}
+
+void arch_thread_enter_uspace_forked(struct thread *t, void *state)
+{
+	PANIC_UNIMPLEMENTED();
+}
+
 void arch_thread_context_switch(struct thread *t_from, struct thread *t_to)
 {
 #if 0
@@ -28,6 +28,11 @@ bigtime_t arch_get_time_delta(void)
 	return 0;
 }
 
+bool arch_time_has_counter(void)
+{
+	return false;
+}
+
 bigtime_t arch_get_rtc_delta(void)
 {
 	// XXX implement. Return RTC time in usecs since 0AD
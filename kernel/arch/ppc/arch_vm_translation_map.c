@@ -188,6 +188,12 @@ static struct ppc_pte *lookup_pagetable_entry(vm_translation_map *map, addr_t va
 	return NULL;
 }
 
+static int map_large_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int attributes)
+{
+	// XXX no large pages yet, callers fall back to mapping single pages
+	return ERR_NOT_ALLOWED;
+}
+
 static int unmap_tmap(vm_translation_map *map, addr_t start, addr_t end)
 {
 	struct ppc_pte *pte;
@@ -294,6 +300,7 @@ static vm_translation_map_ops tmap_ops = {
 	lock_tmap,
 	unlock_tmap,
 	map_tmap,
+	map_large_tmap,
 	unmap_tmap,
 	query_tmap,
 	get_mapped_size_tmap,
@@ -309,6 +316,7 @@ int vm_translation_map_create(vm_translation_map *new_map, bool kernel)
 	// initialize the new object
 	new_map->ops = &tmap_ops;
 	new_map->map_count = 0;
+	new_map->large_map_count = 0;
 	if(recursive_lock_create(&new_map->lock) < 0)
 		return ERR_NO_MEMORY;
 
@@ -444,6 +452,16 @@ int vm_translation_map_quick_map(kernel_args *ka, addr_t va, addr_t pa, unsigned
 	return 0;
 }
 
+int vm_translation_map_quick_map_large(kernel_args *ka, addr_t va, addr_t pa, unsigned int attributes)
+{
+	return ERR_NOT_ALLOWED;
+}
+
+addr_t vm_translation_map_large_page_size(void)
+{
+	return 0;
+}
+
 // XXX currently assumes this translation map is active
 static int vm_translation_map_quick_query(addr_t va, addr_t *out_physical)
 {
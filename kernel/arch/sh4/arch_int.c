@@ -156,9 +156,7 @@ static int sh4_handle_exception(void *_frame)
 	}
 	if(ret == INT_RESCHEDULE) {
 		int_disable_interrupts();
-		GRAB_THREAD_LOCK();
-		thread_resched();
-		RELEASE_THREAD_LOCK();
+		thread_preempt();
 		int_restore_interrupts();
 	}
 	if(!(frame->ssr & 0x40000000) || (frame->excode == 11)) {
@@ -126,6 +126,17 @@ void arch_thread_enter_uspace(struct thread *t, addr_t entry, void *args, addr_t
 	// never get to here
 }
 
+// fork isn't supported here yet, proc_fork_proc turns this into ERR_UNIMPLEMENTED
+void *arch_thread_save_user_state(void)
+{
+	return NULL;
+}
+
+void arch_thread_enter_uspace_forked(struct thread *t, void *state)
+{
+	PANIC_UNIMPLEMENTED();
+}
+
 void arch_thread_switch_kstack_and_call(addr_t new_kstack, void (*func)(void *), void *arg)
 {
 	sh4_switch_stack_and_call(new_kstack, func, arg);
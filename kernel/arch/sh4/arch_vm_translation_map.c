@@ -125,6 +125,12 @@ static int map_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int
 	return 0;
 }
 
+static int map_large_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int lock)
+{
+	// XXX no large pages yet, callers fall back to mapping single pages
+	return ERR_NOT_ALLOWED;
+}
+
 static int unmap_tmap(vm_translation_map *map, addr_t start, addr_t end)
 {
 	struct pdent *pd;
@@ -299,6 +305,7 @@ static vm_translation_map_ops tmap_ops = {
 	lock_tmap,
 	unlock_tmap,
 	map_tmap,
+	map_large_tmap,
 	unmap_tmap,
 	query_tmap,
 	get_mapped_size_tmap,
@@ -317,6 +324,7 @@ int vm_translation_map_create(vm_translation_map *new_map, bool kernel)
 	// initialize the new object
 	new_map->ops = &tmap_ops;
 	new_map->map_count = 0;
+	new_map->large_map_count = 0;
 	if(recursive_lock_create(&new_map->lock) < 0)
 		return ERR_NO_MEMORY;
 
@@ -416,6 +424,16 @@ int vm_translation_map_quick_map(kernel_args *ka, addr_t va, addr_t pa, unsigned
 	return 0;
 }
 
+int vm_translation_map_quick_map_large(kernel_args *ka, addr_t va, addr_t pa, unsigned int lock)
+{
+	return ERR_NOT_ALLOWED;
+}
+
+addr_t vm_translation_map_large_page_size(void)
+{
+	return 0;
+}
+
 addr_t vm_translation_map_get_pgdir(vm_translation_map *map)
 {
 	return (addr_t)map->arch_data->pgdir_phys;
@@ -181,6 +181,17 @@ void arch_thread_enter_uspace(struct thread *t, addr_t entry, void *args, addr_t
 	x86_64_enter_uspace(entry, args, ustack_top - 8);
 }
 
+// fork isn't supported here yet, proc_fork_proc turns this into ERR_UNIMPLEMENTED
+void *arch_thread_save_user_state(void)
+{
+	return NULL;
+}
+
+void arch_thread_enter_uspace_forked(struct thread *t, void *state)
+{
+	PANIC_UNIMPLEMENTED();
+}
+
 int
 arch_setup_signal_frame(struct thread *t, struct sigaction *sa, int sig, int sig_mask)
 {
@@ -42,6 +42,12 @@ bigtime_t arch_get_time_delta(void)
 	return x86_64_cycles_to_time(delta_rdtsc);
 }
 
+bool arch_time_has_counter(void)
+{
+	// not until x86_64_cycles_to_time() is filled in
+	return false;
+}
+
 /* MC146818 RTC code */
 static uint8 read_rtc(uint8 reg)
 {
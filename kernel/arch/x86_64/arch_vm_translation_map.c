@@ -35,6 +35,10 @@ static void *phys_to_virt(addr_t phys);
 #define PGENT_TO_ADDR(ent) ((ent) & 0x7ffffffffffff000UL)
 #define PGENT_PRESENT(ent) ((ent) & 0x1)
 
+// the third level can map 2MB pages directly
+#define LARGE_PAGE_SIZE (1UL << 21)
+#define LARGE_PGENT_TO_ADDR(ent) ((ent) & 0x7fffffffffe00000UL)
+
 // vm_translation object stuff
 typedef struct vm_translation_map_arch_info_struct {
 	unsigned long *pgdir_virt;
@@ -72,6 +76,40 @@ static void destroy_tmap(vm_translation_map *map)
 	PANIC_UNIMPLEMENTED();
 }
 
+// replaces the 2MB page at a third level entry with a fourth level table mapping
+// the same memory with 512 small pages, so part of it can be unmapped or changed.
+// returns the physical address of the new table
+static addr_t split_large_page(vm_translation_map *map, unsigned long *pgent)
+{
+	unsigned long large = *pgent;
+	unsigned long flags;
+	unsigned long *pgtable;
+	addr_t pgtable_phys;
+	vm_page *page;
+	int i;
+
+	TMAP_TRACE("split_large_page: ent @ %p = 0x%lx\n", pgent, large);
+
+	page = vm_page_allocate_page(PAGE_STATE_CLEAR);
+	pgtable_phys = page->ppn * PAGE_SIZE;
+	list_add_head(&map->arch_data->pagetable_list, &page->queue_node);
+
+	// same bits in the small entries, minus the size bit, which means PAT down there
+	flags = (large & 0x8000000000000fffUL) & ~PT_SIZE;
+
+	pgtable = phys_to_virt(pgtable_phys);
+	for (i = 0; i < 512; i++)
+		pgtable[i] = (LARGE_PGENT_TO_ADDR(large) + i * PAGE_SIZE) | flags;
+
+	*pgent = pgtable_phys | (PT_PRESENT|PT_WRITE|PT_USER);
+
+	// counted the same way map_tmap would have, the table and its pages
+	map->large_map_count--;
+	map->map_count += 1 + 512;
+
+	return pgtable_phys;
+}
+
 static int map_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int attributes)
 {
 	addr_t pgtable_phys;
@@ -129,6 +167,9 @@ static int map_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int
 		map->map_count++;
 
 		TMAP_TRACE("map_tmap: had to allocate level 3: paddr 0x%lx, ent @ %p = 0x%lx\n", pgtable_phys, &pgtable[index], pgtable[index]);
+	} else if (pgtable[index] & PT_SIZE) {
+		// a 2MB page covers it, break it up so the one page can be replaced
+		pgtable_phys = split_large_page(map, &pgtable[index]);
 	} else {
 		pgtable_phys = PGENT_TO_ADDR(pgtable[index]);
 		TMAP_TRACE("map_tmap level 3: paddr 0x%lx\n", pgtable_phys);
@@ -149,6 +190,68 @@ static int map_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int
 	return 0;
 }
 
+// maps a 2MB page from the third level table, which has to be empty
+static int map_large_tmap(vm_translation_map *map, addr_t va, addr_t pa, unsigned int attributes)
+{
+	addr_t pgtable_phys;
+	unsigned long *pgtable;
+	int index;
+	vm_page *page;
+
+	TMAP_TRACE("map_large_tmap: va 0x%lx pa 0x%lx, attributes 0x%x\n", va, pa, attributes);
+
+	if ((va % LARGE_PAGE_SIZE) != 0 || (pa % LARGE_PAGE_SIZE) != 0)
+		return ERR_INVALID_ARGS;
+
+	// level 1
+	pgtable = map->arch_data->pgdir_virt;
+	ASSERT(pgtable);
+	index = PGTABLE0_ENTRY(va);
+	if (!PGENT_PRESENT(pgtable[index])) {
+		page = vm_page_allocate_page(PAGE_STATE_CLEAR);
+		pgtable_phys = page->ppn * PAGE_SIZE;
+		list_add_head(&map->arch_data->pagetable_list, &page->queue_node);
+
+		pgtable[index] = pgtable_phys | (PT_PRESENT|PT_WRITE|PT_USER);
+		map->map_count++;
+	} else {
+		pgtable_phys = PGENT_TO_ADDR(pgtable[index]);
+	}
+
+	// level 2
+	pgtable = phys_to_virt(pgtable_phys);
+	index = PGTABLE1_ENTRY(va);
+	if (!PGENT_PRESENT(pgtable[index])) {
+		page = vm_page_allocate_page(PAGE_STATE_CLEAR);
+		pgtable_phys = page->ppn * PAGE_SIZE;
+		list_add_head(&map->arch_data->pagetable_list, &page->queue_node);
+
+		pgtable[index] = pgtable_phys | (PT_PRESENT|PT_WRITE|PT_USER);
+		map->map_count++;
+	} else {
+		pgtable_phys = PGENT_TO_ADDR(pgtable[index]);
+	}
+
+	// level 3, map the page here instead of pointing at a level 4 table
+	pgtable = phys_to_virt(pgtable_phys);
+	index = PGTABLE2_ENTRY(va);
+	if (PGENT_PRESENT(pgtable[index])) {
+		if (!(pgtable[index] & PT_SIZE))
+			return ERR_NOT_ALLOWED;
+		map->large_map_count--;
+	}
+	pgtable[index] = pa
+		| ((attributes & LOCK_RW) ? PT_WRITE : 0)
+		| ((attributes & LOCK_KERNEL) ? 0 : PT_USER)
+		| PT_SIZE
+		| PT_PRESENT;
+	map->large_map_count++;
+
+	TMAP_TRACE("map_large_tmap: ent @ %p = 0x%lx\n", &pgtable[index], pgtable[index]);
+
+	return 0;
+}
+
 static int unmap_tmap(vm_translation_map *map, addr_t start, addr_t end)
 {	
 	TMAP_TRACE("unmap_tmap: start 0x%lx, end 0x%lx\n", start, end);
@@ -191,6 +294,25 @@ static int unmap_tmap(vm_translation_map *map, addr_t start, addr_t end)
 					addr = ROUNDUP(addr, 1UL << 21);
 					continue;
 				}
+
+				if ((pgtable2[index2] & PT_SIZE)
+					&& ROUNDOWN(addr, LARGE_PAGE_SIZE) >= start
+					&& ROUNDOWN(addr, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE <= end) {
+					// the whole 2MB page goes
+					TMAP_TRACE("unmap_tmap: unmapping large page at va 0x%lx\n", addr);
+
+					pgtable2[index2] &= ~PT_PRESENT;
+					map->large_map_count--;
+
+					addr = ROUNDUP(addr + 1, 1UL << 21);
+					continue;
+				}
+
+				if (pgtable2[index2] & PT_SIZE) {
+					// only part of the 2MB page goes, so it can't be walked as a
+					// table until it's been broken up into small pages
+					split_large_page(map, &pgtable2[index2]);
+				}
 				
 				pgtable3 = phys_to_virt(PGENT_TO_ADDR(pgtable2[index2]));
 				for (index3 = PGTABLE3_ENTRY(addr); index3 <= PGTABLE3_ENTRY(end); index3++) {
@@ -240,6 +362,17 @@ static int query_tmap(vm_translation_map *map, addr_t va, addr_t *out_physical,
 	if (!PGENT_PRESENT(pgtable[index]))
 		return NO_ERROR;
 
+	if (pgtable[index] & PT_SIZE) {
+		// a 2MB page
+		*out_physical = LARGE_PGENT_TO_ADDR(pgtable[index]) + (va % LARGE_PAGE_SIZE);
+		*out_flags |= PAGE_PRESENT;
+		*out_flags |= pgtable[index] & PT_WRITE ? LOCK_RW : LOCK_RO;
+		*out_flags |= pgtable[index] & PT_USER ? 0 : LOCK_KERNEL;
+		*out_flags |= pgtable[index] & PT_ACCESSED ? PAGE_ACCESSED : 0;
+		*out_flags |= pgtable[index] & PT_DIRTY ? PAGE_MODIFIED : 0;
+		return NO_ERROR;
+	}
+
 	pgtable = (unsigned long *)phys_to_virt(PGENT_TO_ADDR(pgtable[index]));
 	index = PGTABLE3_ENTRY(va);
 	if (!PGENT_PRESENT(pgtable[index]))
@@ -258,7 +391,7 @@ static int query_tmap(vm_translation_map *map, addr_t va, addr_t *out_physical,
 
 static addr_t get_mapped_size_tmap(vm_translation_map *map)
 {
-	return map->map_count++;
+	return map->map_count + map->large_map_count * (LARGE_PAGE_SIZE / PAGE_SIZE);
 }
 
 static int protect_tmap(vm_translation_map *map, addr_t base, addr_t top, unsigned int attributes)
@@ -305,6 +438,7 @@ static vm_translation_map_ops tmap_ops = {
 	lock_tmap,
 	unlock_tmap,
 	map_tmap,
+	map_large_tmap,
 	unmap_tmap,
 	query_tmap,
 	get_mapped_size_tmap,
@@ -322,6 +456,7 @@ int vm_translation_map_create(vm_translation_map *new_map, bool kernel)
 	// initialize the new object
 	new_map->ops = &tmap_ops;
 	new_map->map_count = 0;
+	new_map->large_map_count = 0;
 	if(recursive_lock_create(&new_map->lock) < 0)
 		return ERR_NO_MEMORY;
 
@@ -467,6 +602,9 @@ int vm_translation_map_quick_map(kernel_args *ka, addr_t va, addr_t pa, unsigned
 		pgtable_phys = get_free_page(ka);
 		pgtable[index] = pgtable_phys | 3;
 		TMAP_TRACE("had to allocate level 3: paddr 0x%lx\n", pgtable_phys);
+	} else if (pgtable[index] & PT_SIZE) {
+		// already covered by a 2MB page, which isn't a table to map into
+		return ERR_NOT_ALLOWED;
 	} else {
 		pgtable_phys = PGENT_TO_ADDR(pgtable[index]);
 //		dprintf("level 3: paddr 0x%lx\n", pgtable_phys);
@@ -481,6 +619,50 @@ int vm_translation_map_quick_map(kernel_args *ka, addr_t va, addr_t pa, unsigned
 	return 0;
 }
 
+int vm_translation_map_quick_map_large(kernel_args *ka, addr_t va, addr_t pa, unsigned int attributes)
+{
+	addr_t pgtable_phys;
+	unsigned long *pgtable;
+	int index;
+
+	TMAP_TRACE("quick_map_large: va 0x%lx pa 0x%lx, attributes 0x%x\n", va, pa, attributes);
+
+	if ((va % LARGE_PAGE_SIZE) != 0 || (pa % LARGE_PAGE_SIZE) != 0)
+		return ERR_INVALID_ARGS;
+
+	// look up and dereference the first entry
+	pgtable_phys = ka->arch_args.phys_pgdir;
+	get_physical_page_tmap(pgtable_phys, (addr_t *)&pgtable, PHYSICAL_PAGE_NO_WAIT);
+	index = PGTABLE0_ENTRY(va);
+	ASSERT(PGENT_PRESENT(pgtable[index]));
+
+	// level 2
+	pgtable_phys = PGENT_TO_ADDR(pgtable[index]);
+	get_physical_page_tmap(pgtable_phys, (addr_t *)&pgtable, PHYSICAL_PAGE_NO_WAIT);
+	index = PGTABLE1_ENTRY(va);
+	if (!PGENT_PRESENT(pgtable[index])) {
+		pgtable_phys = vm_alloc_ppage_from_kernel_struct(ka) * PAGE_SIZE;
+		pgtable[index] = pgtable_phys | 3;
+	} else {
+		pgtable_phys = PGENT_TO_ADDR(pgtable[index]);
+	}
+
+	// level 3
+	get_physical_page_tmap(pgtable_phys, (addr_t *)&pgtable, PHYSICAL_PAGE_NO_WAIT);
+	index = PGTABLE2_ENTRY(va);
+	if (PGENT_PRESENT(pgtable[index]))
+		return ERR_NOT_ALLOWED;
+	pgtable[index] = pa | ((attributes & LOCK_RW) ? PT_WRITE : 0) | ((attributes & LOCK_KERNEL) ? 0 : PT_USER) | PT_SIZE | PT_PRESENT;
+
+	return 0;
+}
+
+addr_t vm_translation_map_large_page_size(void)
+{
+	// every long mode cpu has them
+	return LARGE_PAGE_SIZE;
+}
+
 // XXX currently assumes this translation map is active
 static int vm_translation_map_quick_query(addr_t va, addr_t *out_physical)
 {
@@ -96,6 +96,7 @@ static struct dev_calls rtl8139_hooks = {
 	/* no paging here */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -225,6 +225,7 @@ struct dev_calls keyboard_hooks = {
 	/* cannot page from keyboard */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -302,6 +302,7 @@ struct dev_calls maple_hooks = {
 	/* cannot page from maple devices */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -56,6 +56,7 @@ static struct dev_calls null_hooks = {
 	/* no paging from /dev/null */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
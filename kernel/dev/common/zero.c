@@ -63,6 +63,7 @@ static struct dev_calls zero_hooks = {
 	/* no paging from /dev/zero */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -74,6 +74,7 @@ static struct dev_calls dprint_hooks = {
 	/* no paging from /dev/dprint */
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -840,6 +840,7 @@ static int bootfs_canpage(fs_cookie _fs, fs_vnode _v)
 static ssize_t bootfs_readpage(fs_cookie _fs, fs_vnode _v, iovecs *vecs, off_t pos)
 {
 	struct bootfs_vnode *v = _v;
+	off_t start = pos;
 	unsigned int i;
 
 	TRACE(("bootfs_readpage: vnode 0x%x, vecs 0x%x, pos 0x%x 0x%x\n", v, vecs, pos));
@@ -862,7 +863,7 @@ static ssize_t bootfs_readpage(fs_cookie _fs, fs_vnode _v, iovecs *vecs, off_t p
 		}
 	}
 
-	return ERR_NOT_ALLOWED;
+	return pos - start;
 }
 
 static ssize_t bootfs_writepage(fs_cookie _fs, fs_vnode _v, iovecs *vecs, off_t pos)
@@ -983,6 +984,8 @@ static struct fs_calls bootfs_calls = {
 
 	&bootfs_rstat,
 	&bootfs_wstat,
+
+	NULL,
 };
 
 int bootstrap_bootfs(void)
@@ -18,6 +18,7 @@
 #include <kernel/arch/cpu.h>
 
 #include <kernel/fs/devfs.h>
+#include <kernel/wait_set.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -224,6 +225,9 @@ static int devfs_insert_in_dir(struct devfs_vnode *dir, struct devfs_vnode *v)
 	dir->stream.u.dir.dir_head = v;
 
 	v->parent = dir;
+
+	// devices get published at any time, a lookup may have already cached the name as missing
+	vfs_name_cache_purge(thedevfs->id, dir->id, v->name);
 	return 0;
 }
 
@@ -242,6 +246,8 @@ static int devfs_remove_from_dir(struct devfs_vnode *dir, struct devfs_vnode *fi
 			else
 				dir->stream.u.dir.dir_head = v->dir_next;
 			v->dir_next = NULL;
+
+			vfs_name_cache_purge(thedevfs->id, dir->id, v->name);
 			return 0;
 		}
 	}
@@ -884,6 +890,24 @@ static int devfs_ioctl(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, int op,
 	}
 }
 
+static int devfs_poll(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, struct wait_watch *watch)
+{
+	struct devfs_vnode *v = _v;
+	struct devfs_cookie *cookie = _cookie;
+
+	TRACE(("devfs_poll: vnode 0x%x, cookie 0x%x, watch 0x%x\n", _v, _cookie, watch));
+
+	if(v->stream.type == STREAM_TYPE_DEVICE) {
+		// devices that don't say otherwise never block
+		if(!v->stream.u.dev.calls->dev_poll)
+			return WAIT_EVENT_READ | WAIT_EVENT_WRITE;
+
+		return v->stream.u.dev.calls->dev_poll(cookie->u.dev.dcookie, watch);
+	} else {
+		return WAIT_EVENT_READ;
+	}
+}
+
 static int devfs_canpage(fs_cookie _fs, fs_vnode _v)
 {
 	struct devfs_vnode *v = _v;
@@ -1077,6 +1101,8 @@ static struct fs_calls devfs_calls = {
 
 	&devfs_rstat,
 	&devfs_wstat,
+
+	&devfs_poll,
 };
 
 int bootstrap_devfs(void)
@@ -19,6 +19,7 @@
 #include <kernel/arch/cpu.h>
 
 #include <kernel/fs/pipefs.h>
+#include <kernel/wait_set.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -58,6 +59,8 @@ struct pipefs_stream {
 			int buf_len;
 			int head;
 			int tail;
+
+			struct wait_object waiters;
 		} pipe;
 	} u;
 };
@@ -148,6 +151,7 @@ static struct pipefs_vnode *pipefs_create_vnode(struct pipefs *fs, const char *n
 			if(v->stream.u.pipe.buf == NULL)
 				goto err;
 			v->stream.u.pipe.buf_len = PIPE_BUFFER_LEN;
+			wait_object_init(&v->stream.u.pipe.waiters);
 
 			if(mutex_init(&v->stream.u.pipe.lock, "pipe_lock") < 0) {
 				kfree(v->stream.u.pipe.buf);
@@ -694,6 +698,7 @@ static int pipefs_close(fs_cookie _fs, fs_vnode _v, file_cookie _cookie)
 			v->stream.u.pipe.write_sem = -1;
 			sem_delete(v->stream.u.pipe.read_sem);
 			v->stream.u.pipe.read_sem = -1;
+			wait_object_notify(&v->stream.u.pipe.waiters, WAIT_EVENT_ERROR);
 		}
 	}
 	mutex_unlock(&v->stream.u.pipe.lock);
@@ -811,6 +816,8 @@ static ssize_t pipefs_read(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, void
 	if(data_len == v->stream.u.pipe.buf_len - 1)
 		sem_release(v->stream.u.pipe.write_sem, 1);
 
+	wait_object_notify(&v->stream.u.pipe.waiters, WAIT_EVENT_WRITE);
+
 	err = read_len;
 
 done_pipe:
@@ -913,6 +920,8 @@ static ssize_t pipefs_write(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, con
 	if(free_space == v->stream.u.pipe.buf_len - 1)
 		sem_release(v->stream.u.pipe.read_sem, 1);
 
+	wait_object_notify(&v->stream.u.pipe.waiters, WAIT_EVENT_READ);
+
 	err = written;
 
 done_pipe:
@@ -922,6 +931,48 @@ err:
 	return err;
 }
 
+static int pipefs_poll(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, struct wait_watch *watch)
+{
+	struct pipefs *fs = _fs;
+	struct pipefs_vnode *v = _v;
+	struct pipefs_cookie *cookie = _cookie;
+	ssize_t data_len;
+	int events = 0;
+
+	TRACE(("pipefs_poll: vnode 0x%x, cookie 0x%x, watch 0x%x\n", v, cookie, watch));
+
+	if(v->stream.type == STREAM_TYPE_DIR)
+		return WAIT_EVENT_READ;
+
+	ASSERT(cookie->s == &v->stream);
+
+	if(v == fs->anon_vnode)
+		return ERR_NOT_ALLOWED;
+
+	mutex_lock(&v->stream.u.pipe.lock);
+
+	wait_object_attach(&v->stream.u.pipe.waiters, watch);
+
+	if((v->stream.u.pipe.flags & PIPE_FLAGS_ANONYMOUS) && v->stream.u.pipe.open_count < 2) {
+		// the other end is gone, a read or write would fail right away
+		events = WAIT_EVENT_READ | WAIT_EVENT_WRITE | WAIT_EVENT_ERROR;
+	} else {
+		if(v->stream.u.pipe.head >= v->stream.u.pipe.tail)
+			data_len = v->stream.u.pipe.head - v->stream.u.pipe.tail;
+		else
+			data_len = (v->stream.u.pipe.head + v->stream.u.pipe.buf_len) - v->stream.u.pipe.tail;
+
+		if(data_len > 0)
+			events |= WAIT_EVENT_READ;
+		if(data_len < v->stream.u.pipe.buf_len - 1)
+			events |= WAIT_EVENT_WRITE;
+	}
+
+	mutex_unlock(&v->stream.u.pipe.lock);
+
+	return events;
+}
+
 static int pipefs_seek(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, off_t pos, seek_type st)
 {
 	struct pipefs_vnode *v = _v;
@@ -1137,6 +1188,8 @@ static struct fs_calls pipefs_calls = {
 
 	&pipefs_rstat,
 	&pipefs_wstat,
+
+	&pipefs_poll,
 };
 
 int bootstrap_pipefs(void)
@@ -782,6 +782,8 @@ static struct fs_calls rootfs_calls = {
 
 	&rootfs_rstat,
 	&rootfs_wstat,
+
+	NULL,
 };
 
 int bootstrap_rootfs(void)
@@ -6,6 +6,7 @@
 #include <kernel/vm.h>
 #include <kernel/lock.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/debug.h>
 
 #include <kernel/arch/cpu.h>
@@ -24,6 +25,9 @@
 
 // heap stuff
 // ripped mostly from nujeffos
+// allocations up to SLAB_KMALLOC_MAX are handed to the slab allocator, which
+// gets its slabs out of the page bins here. Pages belonging to a slab are
+// marked with HEAP_SLAB_BIN and carry their page offset in the slab in free_count.
 
 struct heap_page {
 	unsigned short bin_index : 5;
@@ -32,6 +36,8 @@ struct heap_page {
 	unsigned short in_use : 1;
 };
 
+#define HEAP_SLAB_BIN 31
+
 static struct heap_page *heap_alloc_table;
 static addr_t heap_base_ptr;
 static addr_t heap_base;
@@ -47,14 +53,6 @@ struct heap_bin {
 	unsigned int raw_count;
 };
 static struct heap_bin bins[] = {
-	{16, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{32, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{64, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{128, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{256, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{512, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{1024, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{2048, PAGE_SIZE, 0, 0, 0, 0, 0},
 	{0x1000, 0x1000, 0, 0, 0, 0, 0},
 	{0x2000, 0x2000, 0, 0, 0, 0, 0},
 	{0x3000, 0x3000, 0, 0, 0, 0, 0},
@@ -126,6 +124,8 @@ int heap_init(addr_t new_heap_base, unsigned int new_heap_size)
 	dbg_add_command(&dump_bin_list, "heap_bindump", "dump stats about bin usage");
 	dprintf("done debug commands\n");
 
+	slab_init();
+
 	return 0;
 }
 
@@ -165,85 +165,52 @@ static char *raw_alloc(unsigned int size, int bin_index)
 	return retval;
 }
 
-void *kmalloc(unsigned int size)
+// NOTE: expects the heap lock to be held
+static void *bin_alloc(int bin_index)
 {
-	void *address = NULL;
-	int bin_index;
-	unsigned int i;
+	struct heap_bin *bin = &bins[bin_index];
 	struct heap_page *page;
+	void *address;
+	unsigned int i;
 
-#if MAKE_NOIZE
-	dprintf("kmalloc: asked to allocate size %d\n", size);
-#endif
-
-	mutex_lock(&heap_lock);
-
-	for (bin_index = 0; bin_index < bin_count; bin_index++)
-		if (size <= bins[bin_index].element_size)
-			break;
-
-	if (bin_index == bin_count) {
-		// XXX fix the raw alloc later.
-		//address = raw_alloc(size, bin_index);
-		panic("kmalloc: asked to allocate too much for now!\n");
-		goto out;
+	if (bin->free_list != NULL) {
+		address = bin->free_list;
+		bin->free_list = (void *)(*(unsigned long *)bin->free_list);
+		bin->free_count--;
 	} else {
-		if (bins[bin_index].free_list != NULL) {
-			address = bins[bin_index].free_list;
-			bins[bin_index].free_list = (void *)(*(unsigned long *)bins[bin_index].free_list);
-			bins[bin_index].free_count--;
-		} else {
-			if (bins[bin_index].raw_count == 0) {
-				bins[bin_index].raw_list = raw_alloc(bins[bin_index].grow_size, bin_index);
-				bins[bin_index].raw_count = bins[bin_index].grow_size / bins[bin_index].element_size;
-			}
-
-			bins[bin_index].raw_count--;
-			address = bins[bin_index].raw_list;
-			bins[bin_index].raw_list += bins[bin_index].element_size;
+		if (bin->raw_count == 0) {
+			bin->raw_list = raw_alloc(bin->grow_size, bin_index);
+			bin->raw_count = bin->grow_size / bin->element_size;
 		}
 
-		bins[bin_index].alloc_count++;
-		page = &heap_alloc_table[((addr_t)address - heap_base) / PAGE_SIZE];
-		page[0].free_count--;
+		bin->raw_count--;
+		address = bin->raw_list;
+		bin->raw_list += bin->element_size;
+	}
+
+	bin->alloc_count++;
+	page = &heap_alloc_table[((addr_t)address - heap_base) / PAGE_SIZE];
+	page[0].free_count--;
 #if MAKE_NOIZE
-		dprintf("kmalloc0: page %p: bin_index %d, free_count %d\n", page, page->bin_index, page->free_count);
+	dprintf("kmalloc0: page %p: bin_index %d, free_count %d\n", page, page->bin_index, page->free_count);
 #endif
-		for(i = 1; i < bins[bin_index].element_size / PAGE_SIZE; i++) {
-			page[i].free_count--;
+	for(i = 1; i < bin->element_size / PAGE_SIZE; i++) {
+		page[i].free_count--;
 #if MAKE_NOIZE
-			dprintf("kmalloc1: page 0x%x: bin_index %d, free_count %d\n", *(unsigned long *)&page[i], page[i].bin_index, page[i].free_count);
+		dprintf("kmalloc1: page 0x%x: bin_index %d, free_count %d\n", *(unsigned long *)&page[i], page[i].bin_index, page[i].free_count);
 #endif
-		}
 	}
 
-out:
-	mutex_unlock(&heap_lock);
-
-#if MAKE_NOIZE
-	dprintf("kmalloc: asked to allocate size %d, returning ptr = %p\n", size, address);
-#endif
 	return address;
 }
 
-void kfree(void *address)
+// NOTE: expects the heap lock to be held
+static void bin_free(void *address)
 {
 	struct heap_page *page;
 	struct heap_bin *bin;
 	unsigned int i;
 
-	if (address == NULL)
-		return;
-
-	if ((addr_t)address < heap_base || (addr_t)address >= (heap_base + heap_size))
-		panic("kfree: asked to free invalid address %p\n", address);
-
-	mutex_lock(&heap_lock);
-
-#if MAKE_NOIZE
-	dprintf("kfree: asked to free at ptr = %p\n", address);
-#endif
-
 	page = &heap_alloc_table[((addr_t)address - heap_base) / PAGE_SIZE];
 
 #if MAKE_NOIZE
@@ -283,8 +250,121 @@ void kfree(void *address)
 	bin->free_list = address;
 	bin->alloc_count--;
 	bin->free_count++;
+}
+
+void *kmalloc(unsigned int size)
+{
+	void *address = NULL;
+	int bin_index;
+
+#if MAKE_NOIZE
+	dprintf("kmalloc: asked to allocate size %d\n", size);
+#endif
+
+	if (size <= SLAB_KMALLOC_MAX)
+		return slab_kmalloc(size);
+
+	mutex_lock(&heap_lock);
+
+	for (bin_index = 0; bin_index < bin_count; bin_index++)
+		if (size <= bins[bin_index].element_size)
+			break;
+
+	if (bin_index == bin_count) {
+		// XXX fix the raw alloc later.
+		//address = raw_alloc(size, bin_index);
+		panic("kmalloc: asked to allocate too much for now!\n");
+	} else {
+		address = bin_alloc(bin_index);
+	}
+
+	mutex_unlock(&heap_lock);
+
+#if MAKE_NOIZE
+	dprintf("kmalloc: asked to allocate size %d, returning ptr = %p\n", size, address);
+#endif
+	return address;
+}
+
+void kfree(void *address)
+{
+	struct heap_page *page;
+
+	if (address == NULL)
+		return;
+
+	if ((addr_t)address < heap_base || (addr_t)address >= (heap_base + heap_size))
+		panic("kfree: asked to free invalid address %p\n", address);
+
+#if MAKE_NOIZE
+	dprintf("kfree: asked to free at ptr = %p\n", address);
+#endif
+
+	// the page can't change under us while it holds a live slab object
+	page = &heap_alloc_table[((addr_t)address - heap_base) / PAGE_SIZE];
+	if(page->bin_index == HEAP_SLAB_BIN) {
+		slab_kfree((void *)(ROUNDOWN((addr_t)address, PAGE_SIZE) - page->free_count * PAGE_SIZE), address);
+		return;
+	}
+
+	mutex_lock(&heap_lock);
+	bin_free(address);
+	mutex_unlock(&heap_lock);
+}
+
+void *heap_alloc_slab_pages(unsigned int pages)
+{
+	struct heap_page *page;
+	char *address;
+	unsigned int i;
+
+	if (pages == 0 || pages > bin_count || bins[pages - 1].element_size != pages * PAGE_SIZE)
+		panic("heap_alloc_slab_pages: bad slab size %d pages\n", pages);
+
+	mutex_lock(&heap_lock);
+
+	address = bin_alloc(pages - 1);
+	page = &heap_alloc_table[((addr_t)address - heap_base) / PAGE_SIZE];
+	for(i = 0; i < pages; i++) {
+		page[i].bin_index = HEAP_SLAB_BIN;
+		page[i].free_count = i;
+	}
 
 	mutex_unlock(&heap_lock);
+
+	return address;
+}
+
+void heap_free_slab_pages(void *address, unsigned int pages)
+{
+	struct heap_page *page;
+	unsigned int i;
+
+	mutex_lock(&heap_lock);
+
+	// turn the pages back into an allocation out of their bin and free that
+	page = &heap_alloc_table[((addr_t)address - heap_base) / PAGE_SIZE];
+	for(i = 0; i < pages; i++) {
+		page[i].bin_index = pages - 1;
+		page[i].free_count = 0;
+	}
+	bin_free(address);
+
+	mutex_unlock(&heap_lock);
+}
+
+void *heap_find_slab(void *address)
+{
+	struct heap_page *page;
+
+	if ((addr_t)address < heap_base || (addr_t)address >= (heap_base + heap_size))
+		return NULL;
+
+	page = &heap_alloc_table[((addr_t)address - heap_base) / PAGE_SIZE];
+	if(page->bin_index != HEAP_SLAB_BIN)
+		return NULL;
+
+	return (void *)(ROUNDOWN((addr_t)address, PAGE_SIZE) - page->free_count * PAGE_SIZE);
 }
 
 char *kstrdup(const char *text)
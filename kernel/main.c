@@ -15,6 +15,7 @@
 #include <kernel/smp.h>
 #include <kernel/sem.h>
 #include <kernel/port.h>
+#include <kernel/wait_set.h>
 #include <kernel/vfs.h>
 #include <kernel/dev.h>
 #include <kernel/net/net.h>
@@ -24,6 +25,7 @@
 #include <kernel/dev/beos.h>
 #include <kernel/dev/fixed.h>
 #include <kernel/module.h>
+#include <kernel/khash.h>
 
 #include <kernel/bus/usb/usb.h>
 
@@ -93,8 +95,10 @@ int _start(kernel_args *oldka, int cpu_num)
 		vfs_init(&global_kernel_args);
 		thread_init(&global_kernel_args);
 		port_init(&global_kernel_args);
+		wait_set_init();
 
 		vm_init_postthread(&global_kernel_args);
+		hash_init_postthread();
 		elf_init(&global_kernel_args);
 		module_init(&global_kernel_args, NULL);
 
@@ -184,6 +188,9 @@ static int main2(void *unused)
 #endif
 #if 0
 	port_test();
+#endif
+#if 0
+	port_stress_test();
 #endif
 	// start the init process
 	{
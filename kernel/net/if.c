@@ -21,6 +21,16 @@
 
 #define TX_QUEUE_SIZE 64
 
+// take received frames from drivers that hand them up in cbufs,
+// turn it off to measure the old read() and copy path against it
+#define ZERO_COPY_RX 1
+
+// hand drivers that can take them everything queued up for sending in one call
+#define BATCH_TX 1
+
+// most frames the rx thread takes from the driver per wakeup
+#define RX_BATCH_SIZE 16
+
 #define LOSE_RX_PACKETS 0
 #define LOSE_RX_PERCENTAGE 5
 
@@ -137,6 +147,16 @@ int if_register_interface(const char *path, ifnet **_i)
 			memset(&address->broadcast.addr[0], 0xff, 6);
 			address->netmask.type = ADDR_TYPE_NULL;
 			if_bind_link_address(i, address);
+
+#if ZERO_COPY_RX
+			// see if the driver can give us received frames in cbufs
+			if(sys_ioctl(i->fd, IOCTL_NET_IF_GET_RX_HOOKS, &i->rx_hooks, sizeof(i->rx_hooks)) < 0)
+				i->rx_hooks.rx = NULL;
+#endif
+#if BATCH_TX
+			if(sys_ioctl(i->fd, IOCTL_NET_IF_GET_TX_HOOKS, &i->tx_hooks, sizeof(i->tx_hooks)) < 0)
+				i->tx_hooks.tx = NULL;
+#endif
 			break;
 		default:
 			err = ERR_NET_GENERAL;
@@ -213,6 +233,9 @@ static int if_tx_thread(void *args)
 {
 	ifnet *i = args;
 	cbuf *buf;
+	cbuf *chain;
+	cbuf *tail;
+	int count;
 	ssize_t len;
 
 	if(i->fd < 0)
@@ -221,6 +244,43 @@ static int if_tx_thread(void *args)
 	for(;;) {
  		sem_acquire(i->tx_queue_sem, 1);
 
+		if(i->tx_hooks.tx != NULL) {
+			// take everything that's queued up and give it to the driver in one go
+			chain = tail = NULL;
+			count = 0;
+
+			mutex_lock(&i->tx_queue_lock);
+			// the whole queue goes on this wakeup, so eat the counts of any others it
+			// would have had. Done under the lock, so packets queued after the
+			// drain still get theirs.
+			while(sem_acquire_etc(i->tx_queue_sem, 1, SEM_FLAG_TIMEOUT, 0, NULL) == NO_ERROR)
+				;
+			while((buf = fixed_queue_dequeue(&i->tx_queue)) != NULL) {
+#if LOSE_TX_PACKETS
+				if(rand() % 100 < LOSE_TX_PERCENTAGE) {
+					cbuf_free_chain(buf);
+					continue;
+				}
+#endif
+				buf->packet_next = NULL;
+				if(tail)
+					tail->packet_next = buf;
+				else
+					chain = buf;
+				tail = buf;
+				count++;
+			}
+			mutex_unlock(&i->tx_queue_lock);
+
+			if(chain) {
+				i->tx_wakeups++;
+				i->tx_packets += count;
+				i->tx_hooks.tx(i->tx_hooks.cookie, chain);
+			}
+			continue;
+		}
+
+		i->tx_wakeups++;
 		for(;;) {
 	 		// pull a packet out of the queue
 			mutex_lock(&i->tx_queue_lock);
@@ -245,15 +305,53 @@ static int if_tx_thread(void *args)
 #if NET_CHATTY
 		dprintf("if_tx_thread: sending packet size %Ld\n", (long long)len);
 #endif
+			i->tx_packets++;
 			sys_write(i->fd, i->tx_buf, 0, len);
 		}
 	}
 }
 
+bool if_lose_rx_packet(cbuf *b)
+{
+#if LOSE_RX_PACKETS
+	if(rand() % 100 < LOSE_RX_PERCENTAGE) {
+		dprintf("if_rx: purposely lost packet, size %ld\n", (long)cbuf_get_len(b));
+		return true;
+	}
+#endif
+	return false;
+}
+
+static void if_rx_packet(ifnet *i, cbuf *b)
+{
+#if NET_CHATTY
+	dprintf("if_rx_thread: got ethernet packet, size %Ld\n", (long long)cbuf_get_len(b));
+#endif
+
+	if(if_lose_rx_packet(b)) {
+		cbuf_free_chain(b);
+		return;
+	}
+
+	// check to see if we have a link layer address attached to us
+	if(!i->link_addr) {
+#if NET_CHATTY
+		dprintf("if_rx_thread: dumping packet because of no link address (%p)\n", i);
+#endif
+		cbuf_free_chain(b);
+		return;
+	}
+
+	i->rx_packets++;
+	i->link_input(b, i);
+}
+
 static int if_rx_thread(void *args)
 {
 	ifnet *i = args;
 	cbuf *b;
+	cbuf *next;
+	int count;
 
 	if(i->fd < 0)
 		return -1;
@@ -261,33 +359,33 @@ static int if_rx_thread(void *args)
 	for(;;) {
 		ssize_t len;
 
+		if(i->rx_hooks.rx != NULL) {
+			// the driver gives us everything that came in, up to a batch, already in cbufs
+			count = i->rx_hooks.rx(i->rx_hooks.cookie, &b, RX_BATCH_SIZE);
+			if(count < 0) {
+				thread_snooze(10000);
+				continue;
+			}
+			i->rx_wakeups++;
+
+			for(; b; b = next) {
+				next = b->packet_next;
+				b->packet_next = NULL;
+				if_rx_packet(i, b);
+			}
+			continue;
+		}
+
 		len = sys_read(i->fd, i->rx_buf, 0, sizeof(i->rx_buf));
-#if NET_CHATTY
-		dprintf("if_rx_thread: got ethernet packet, size %Ld\n", (long long)len);
-#endif
 		if(len < 0) {
 			thread_snooze(10000);
 			continue;
 		}
 		if(len == 0)
 			continue;
+		i->rx_wakeups++;
 
-#if LOSE_RX_PACKETS
-		if(rand() % 100 < LOSE_RX_PERCENTAGE) {
-			dprintf("if_rx_thread: purposely lost packet, size %d\n", len);
-			continue;
-		}
-#endif
-
-		// check to see if we have a link layer address attached to us
-		if(!i->link_addr) {
-#if NET_CHATTY
-			dprintf("if_rx_thread: dumping packet because of no link address (%p)\n", i);
-#endif
-			continue;
-		}
-
-		// for now just move it over into a cbuf
+		// move it over into a cbuf
 		b = cbuf_get_chain(len);
 		if(!b) {
 			dprintf("if_rx_thread: could not allocate cbuf to hold ethernet packet\n");
@@ -295,7 +393,7 @@ static int if_rx_thread(void *args)
 		}
 		cbuf_memcpy_to_chain(b, 0, i->rx_buf, len);
 
-		i->link_input(b, i);
+		if_rx_packet(i, b);
 	}
 
 	return 0;
@@ -333,6 +431,39 @@ err1:
 	return err;
 }
 
+static void dump_if_list(int argc, char **argv)
+{
+	ifnet *i;
+	struct thread *t;
+	struct hash_iterator iter;
+
+	dprintf("id  path                           rx path  rx packets  pkts/wakeup  usecs/packet  tx path  tx packets  pkts/wakeup\n");
+
+	hash_open(ifhash, &iter);
+	while((i = hash_next(ifhash, &iter)) != NULL) {
+		bigtime_t rx_time = 0;
+		uint32 rx_ppw = 0;
+		uint32 tx_ppw = 0;
+
+		// in tenths
+		if(i->rx_wakeups)
+			rx_ppw = i->rx_packets * 10 / i->rx_wakeups;
+		if(i->tx_wakeups)
+			tx_ppw = i->tx_packets * 10 / i->tx_wakeups;
+
+		// the rx thread's time covers getting each frame and running it up the stack
+		t = thread_get_thread_struct_locked(i->rx_thread);
+		if(t)
+			rx_time = t->kernel_time;
+
+		dprintf("%-3d %-30s %-8s %10d %10d.%d %13Ld  %-8s %10d %10d.%d\n", i->id, i->path,
+			i->rx_hooks.rx ? "cbuf" : "read", i->rx_packets, rx_ppw / 10, rx_ppw % 10,
+			i->rx_packets ? rx_time / i->rx_packets : 0,
+			i->tx_hooks.tx ? "batch" : "write", i->tx_packets, tx_ppw / 10, tx_ppw % 10);
+	}
+	hash_close(ifhash, &iter, false);
+}
+
 int if_init(void)
 {
 	int err;
@@ -346,6 +477,8 @@ int if_init(void)
 	if(err < 0)
 		return err;
 
+	dbg_add_command(&dump_if_list, "ifs", "list the network interfaces with their packet counts and costs");
+
 	return NO_ERROR;
 }
 
@@ -38,6 +38,12 @@ int loopback_input(cbuf *buf, ifnet *i)
 
 int loopback_output(cbuf *buf, ifnet *i, netaddr *target, int protocol_type)
 {
+	// there's no rx thread in the way, so loss is simulated here
+	if(if_lose_rx_packet(buf)) {
+		cbuf_free_chain(buf);
+		return NO_ERROR;
+	}
+
 	_loopback_input(buf, i, protocol_type);
 
 	return NO_ERROR;
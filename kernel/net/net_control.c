@@ -197,6 +197,7 @@ static struct dev_calls net_control_dev_hooks = {
 	&net_control_dev_write,
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
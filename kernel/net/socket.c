@@ -289,6 +289,74 @@ ssize_t socket_sendto(sock_id id, const void *buf, ssize_t len, sockaddr *addr)
 	return err;
 }
 
+int socket_setopt(sock_id id, int opt, int value)
+{
+	netsocket *s;
+	int err;
+
+	s = lookup_socket(id);
+	if(!s)
+		return ERR_INVALID_HANDLE;
+
+	switch(s->type) {
+		case SOCK_PROTO_TCP:
+			err = tcp_setopt(s->prot_data, opt, value);
+			break;
+		case SOCK_PROTO_UDP:
+			// no options yet
+			err = ERR_UNIMPLEMENTED;
+			break;
+		default:
+			err = ERR_INVALID_ARGS;
+	}
+	return err;
+}
+
+int socket_getopt(sock_id id, int opt)
+{
+	netsocket *s;
+	int err;
+
+	s = lookup_socket(id);
+	if(!s)
+		return ERR_INVALID_HANDLE;
+
+	switch(s->type) {
+		case SOCK_PROTO_TCP:
+			err = tcp_getopt(s->prot_data, opt);
+			break;
+		case SOCK_PROTO_UDP:
+			// no options yet
+			err = ERR_UNIMPLEMENTED;
+			break;
+		default:
+			err = ERR_INVALID_ARGS;
+	}
+	return err;
+}
+
+int socket_poll(sock_id id, struct wait_watch *watch)
+{
+	netsocket *s;
+	ssize_t err;
+
+	s = lookup_socket(id);
+	if(!s)
+		return ERR_INVALID_HANDLE;
+
+	switch(s->type) {
+		case SOCK_PROTO_UDP:
+			err = udp_poll(s->prot_data, watch);
+			break;
+		case SOCK_PROTO_TCP:
+			err = tcp_poll(s->prot_data, watch);
+			break;
+		default:
+			err = ERR_INVALID_ARGS;
+	}
+	return err;
+}
+
 int socket_close(sock_id id)
 {
 	netsocket *s;
@@ -9,6 +9,7 @@
 #include <kernel/vm.h>
 #include <kernel/fs/devfs.h>
 #include <kernel/net/socket.h>
+#include <kernel/wait_set.h>
 #include <newos/socket_api.h>
 #include <string.h>
 
@@ -128,6 +129,12 @@ static int socket_dev_ioctl(dev_cookie cookie, int op, void *buf, size_t len)
 			case _SOCKET_API_SENDTO:
 				err = socket_sendto(s->id, args.u.transfer.buf, args.u.transfer.len, args.u.transfer.saddr);
 				break;
+			case _SOCKET_API_SETOPT:
+				err = socket_setopt(s->id, args.u.opt.opt, args.u.opt.value);
+				break;
+			case _SOCKET_API_GETOPT:
+				err = socket_getopt(s->id, args.u.opt.opt);
+				break;
 			default:
 				err = ERR_INVALID_ARGS;
 		}
@@ -156,6 +163,16 @@ static ssize_t socket_dev_write(dev_cookie cookie, const void *buf, off_t pos, s
 		return ERR_NET_NOT_CONNECTED;
 }
 
+static int socket_dev_poll(dev_cookie cookie, struct wait_watch *watch)
+{
+	socket_dev *s = (socket_dev *)cookie;
+
+	if(s->id >= 0)
+		return socket_poll(s->id, watch);
+	else
+		return WAIT_EVENT_ERROR;
+}
+
 static struct dev_calls socket_dev_hooks = {
 	&socket_dev_open,
 	&socket_dev_close,
@@ -167,7 +184,8 @@ static struct dev_calls socket_dev_hooks = {
 	/* no paging from /dev/null */
 	NULL,
 	NULL,
-	NULL
+	NULL,
+	&socket_dev_poll
 };
 
 int socket_dev_init(void)
@@ -7,12 +7,15 @@
 #include <kernel/lock.h>
 #include <kernel/debug.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/khash.h>
 #include <kernel/sem.h>
 #include <kernel/queue.h>
 #include <kernel/time.h>
+#include <kernel/wait_set.h>
 #include <kernel/arch/cpu.h>
 #include <kernel/net/tcp.h>
+#include <kernel/net/tcp_cc.h>
 #include <kernel/net/ipv4.h>
 #include <kernel/net/misc.h>
 #include <kernel/net/net_timer.h>
@@ -21,6 +24,11 @@
 
 #define DEBUG_REF_COUNT 0
 
+// options offered in our SYNs
+#define TCP_SACK 1
+#define TCP_TIMESTAMPS 1
+#define TCP_WINDOW_SCALE 1
+
 typedef struct tcp_header {
 	uint16 source_port;
 	uint16 dest_port;
@@ -52,6 +60,52 @@ typedef struct tcp_window_scale_option {
 	uint8 shift_count;
 } _PACKED tcp_window_scale_option;
 
+typedef struct tcp_timestamp_option {
+	uint8 kind; /* 0x8 */
+	uint8 len;  /* 0xa */
+	uint32 ts_val;
+	uint32 ts_ecr;
+} _PACKED tcp_timestamp_option;
+
+typedef struct tcp_sack_option_block {
+	uint32 start;
+	uint32 end;
+} _PACKED tcp_sack_option_block;
+
+enum {
+	TCP_OPT_END = 0,
+	TCP_OPT_NOP = 1,
+	TCP_OPT_MSS = 2,
+	TCP_OPT_WINDOW_SCALE = 3,
+	TCP_OPT_SACK_PERMITTED = 4,
+	TCP_OPT_SACK = 5,
+	TCP_OPT_TIMESTAMP = 8
+};
+
+#define TCP_MAX_OPTIONS_LEN 40
+#define TCP_TIMESTAMP_OPTIONS_LEN 12 /* padded with 2 nops */
+#define TCP_MAX_SACK_OPTION_BLOCKS 4
+#define TCP_SACK_SCOREBOARD_SIZE 8
+#define TCP_MAX_WINDOW_SHIFT 14 /* as per rfc 7323 */
+
+typedef struct tcp_sack_block {
+	uint32 start;
+	uint32 end; // one past the last sequence
+} tcp_sack_block;
+
+// what was found in the options of an incoming segment
+typedef struct tcp_options {
+	uint16 mss; // 0 if not there
+	bool sack_permitted;
+	bool has_timestamp;
+	uint32 ts_val;
+	uint32 ts_ecr;
+	bool has_window_scale;
+	uint8 window_scale;
+	int num_sacks;
+	tcp_sack_block sacks[TCP_MAX_SACK_OPTION_BLOCKS];
+} tcp_options;
+
 typedef enum tcp_state {
 	STATE_CLOSED,
 	STATE_LISTEN,
@@ -89,6 +143,15 @@ typedef struct tcp_socket {
 	uint16 remote_port;
 
 	uint32 mss;
+	uint32 local_mss; // what we told the other side in our SYN
+
+	/* options agreed on in the handshake */
+	bool sack_ok;
+	bool ts_ok;
+	uint32 ts_recent; // the last timestamp to echo back
+	bool ws_ok;
+	uint8 rx_win_shift; // what the windows we advertise are scaled by
+	uint8 tx_win_shift; // what the windows they advertise are scaled by
 
 	/* rx */
 	sem_id read_sem;
@@ -96,8 +159,15 @@ typedef struct tcp_socket {
 	uint32 rx_win_low;
 	uint32 rx_win_high;
 	cbuf *reassembly_q;
+	uint32 rx_last_ooo_seq; // the last segment put on the reassembly queue, reported first in SACKs
 	cbuf *read_buffer;
 	net_timer_event ack_delay_timer;
+	int ack_delay; // msecs, 0 acks every segment
+	uint32 rx_acked_seq; // the last ack we sent
+	bool rx_autotune;
+	bigtime_t rx_rtt; // as seen from the receiving side, from the timestamps they echo
+	bigtime_t rx_autotune_time;
+	uint32 rx_autotune_seq;
 
 	/* tx */
 	mutex write_lock;
@@ -105,9 +175,10 @@ typedef struct tcp_socket {
 	bool writers_waiting;
 	uint32 tx_win_low;
 	uint32 tx_win_high;
+	uint32 tx_max_seq; // highest sequence ever sent, tx_win_low backs up on a retransmit timeout
 	uint32 retransmit_tx_seq;
-	int retransmit_timeout;
 	int tx_write_buf_size;
+	bool tx_autotune;
 	uint32 unacked_data_len;
 	int duplicate_ack_count;
 	cbuf *write_buffer;
@@ -116,21 +187,33 @@ typedef struct tcp_socket {
 	net_timer_event fin_retransmit_timer;
 	net_timer_event time_wait_timer;
 
-	/* as per example in tcp/ip illustrated */
-	uint32 cwnd;
-	uint32 ssthresh;
+	/* congestion control */
+	tcp_cc cc;
 
-	/* rtt */
+	/* loss recovery */
+	bool in_recovery;
+	uint32 recover_seq; // recovery is over once this is acked
+	uint32 rexmit_high; // retransmitted up to here in this recovery
+	int num_sacked;
+	tcp_sack_block sacked[TCP_SACK_SCOREBOARD_SIZE]; // sorted, above retransmit_tx_seq
+
+	/* rtt, used when there are no timestamps */
 	bool tracking_rtt;
 	uint32 rtt_seq;
 	bigtime_t rtt_seq_timestamp;
-	long smoothed_rtt;
-	long smoothed_deviation;
-	long rto;
+
+	/* retransmit timeout, as per rfc 6298 */
+	bool have_rtt;
+	bigtime_t srtt;
+	bigtime_t rttvar;
+	int rto; // msecs, includes the backoff
 
 	/* accept queue */
 	queue accept_queue;
 	sem_id accept_sem;
+
+	/* wait set watches */
+	struct wait_object waiters;
 } tcp_socket;
 
 typedef struct tcp_socket_key {
@@ -141,19 +224,30 @@ typedef struct tcp_socket_key {
 } tcp_socket_key;
 
 static tcp_socket *socket_table;
+static struct slab_cache *socket_cache;
 static mutex socket_table_lock;
 static int next_ephemeral_port = 1024;
 
 /* the following are in bigtime_t units (microseconds) */
 #define SYN_RETRANSMIT_TIMEOUT 1000000
-#define MAX_RETRANSMIT_TIMEOUT 90000000 /* 90 secs */
+#define CLOCK_GRANULARITY 1000
 
+/* the following are in net timer units (milliseconds) */
+#define INITIAL_RETRANSMIT_TIMEOUT 1000
+#define MIN_RETRANSMIT_TIMEOUT 200
+#define MAX_RETRANSMIT_TIMEOUT 60000
 #define FIN_RETRANSMIT_TIMEOUT 5000
 #define PERSIST_TIMEOUT 500
-#define ACK_DELAY 200
+#define ACK_DELAY 50
+#define MAX_ACK_DELAY 500 /* as per rfc 1122 */
 #define DEFAULT_RX_WINDOW_SIZE (32*1024)
 #define DEFAULT_TX_WRITE_BUF_SIZE (128*1024)
+#define TCP_MIN_BUF_SIZE (4*1024)
+#define TCP_MAX_BUF_SIZE (4*1024*1024)
+#define TCP_AUTOTUNE_MAX_BUF_SIZE (1024*1024) /* what the buffers grow to on their own */
+#define DEFAULT_AUTOTUNE_RTT 100000 /* usecs, until there is a measurement */
 #define DEFAULT_MAX_SEGMENT_SIZE 536
+#define MIN_MAX_SEGMENT_SIZE 64 /* smallest mss a peer gets to talk us down to */
 #define MSL 30000 /* 30 seconds */
 
 #define SEQUENCE_GTE(a, b) ((int)((a) - (b)) >= 0)
@@ -164,8 +258,8 @@ static int next_ephemeral_port = 1024;
 // forward decls
 static void tcp_send(ipv4_addr dest_addr, uint16 dest_port, ipv4_addr src_addr, uint16 source_port, cbuf *buf, tcp_flags flags,
 	uint32 ack, const void *options, uint16 options_length, uint32 sequence, uint16 window_size);
-static void tcp_socket_send(tcp_socket *s, cbuf *data, tcp_flags flags, const void *options, uint16 options_length, uint32 sequence);
-static void handle_ack(tcp_socket *s, uint32 sequence, uint32 window_size, bool with_data);
+static void tcp_socket_send(tcp_socket *s, cbuf *data, tcp_flags flags, uint32 sequence);
+static void handle_ack(tcp_socket *s, uint32 sequence, uint32 window_size, bool with_data, tcp_options *opts);
 static void handle_data(tcp_socket *s, cbuf *buf);
 static void handle_ack_delay_timeout(void *_socket);
 static void handle_persist_timeout(void *_socket);
@@ -178,6 +272,8 @@ static void send_ack(tcp_socket *s);
 static void tcp_remote_close(tcp_socket *s);
 static int tcp_flush_pending_data(tcp_socket *s);
 static void tcp_retransmit(tcp_socket *s);
+static int tcp_retransmit_range(tcp_socket *s, uint32 seq, uint32 len);
+static void tcp_set_retransmit_timer(tcp_socket *s);
 
 static int tcp_socket_compare_func(void *_s, const void *_key)
 {
@@ -288,7 +384,7 @@ static tcp_socket *create_tcp_socket(void)
 {
 	tcp_socket *s;
 
-	s = kmalloc(sizeof(tcp_socket));
+	s = slab_alloc(socket_cache);
 	if(!s)
 		return NULL;
 
@@ -316,24 +412,28 @@ static tcp_socket *create_tcp_socket(void)
 	s->remote_addr = 0;
 	s->remote_port = 0;
 	s->mss = DEFAULT_MAX_SEGMENT_SIZE;
+	s->local_mss = DEFAULT_MAX_SEGMENT_SIZE;
 	s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
 	s->rx_win_low = 0;
 	s->rx_win_high = 0;
 	s->tx_win_low = rand();
 	s->tx_win_high = s->tx_win_low;
+	s->tx_max_seq = s->tx_win_low;
 	s->retransmit_tx_seq = s->tx_win_low;
 	s->tx_write_buf_size = DEFAULT_TX_WRITE_BUF_SIZE;
+	s->rx_autotune = true;
+	s->tx_autotune = true;
+	s->ack_delay = ACK_DELAY;
 	s->write_buffer = NULL;
 	s->writers_waiting = false;
 
-	s->smoothed_deviation = 0;
-	s->smoothed_rtt = 500;
-	s->rto = 500;
+	s->have_rtt = false;
+	s->rto = INITIAL_RETRANSMIT_TIMEOUT;
 
-	s->cwnd = s->mss;
-	s->ssthresh = 0x10000;
+	tcp_cc_init(&s->cc, s->mss);
 
 	queue_init(&s->accept_queue);
+	wait_object_init(&s->waiters);
 
 	return s;
 
@@ -346,7 +446,7 @@ err2:
 err1:
 	mutex_destroy(&s->lock);
 err:
-	kfree(s);
+	slab_free(socket_cache, s);
 	return NULL;
 }
 
@@ -359,11 +459,13 @@ static int destroy_tcp_socket(tcp_socket *s)
 	sem_delete(s->write_sem);
 	sem_delete(s->read_sem);
 	mutex_destroy(&s->lock);
-	kfree(s);
+	slab_free(socket_cache, s);
 }
 
 static void dump_socket(tcp_socket *s)
 {
+	int i;
+
 	dprintf("tcp dump_socket on socket @ %p\n", s);
 	dprintf("\tstate %d ref_count %d\n", s->state, s->ref_count);
 	dprintf("\tlocal_addr: "); dump_ipv4_addr(s->local_addr); dprintf(".%d\n", s->local_port);
@@ -377,6 +479,15 @@ static void dump_socket(tcp_socket *s)
 	dprintf("\ttx_win_low %u tx_win_high %u retransmit_tx_seq %u write_buf_size %d\n",
 		s->tx_win_low, s->tx_win_high, s->retransmit_tx_seq, s->tx_write_buf_size);
 	dprintf("\tunacked_data_len %d write_buffer %p (%ld)\n", s->unacked_data_len, s->write_buffer, cbuf_get_len(s->write_buffer));
+	dprintf("\ttx_max_seq %u sack_ok %d ts_ok %d ts_recent %u\n", s->tx_max_seq, s->sack_ok, s->ts_ok, s->ts_recent);
+	dprintf("\tws_ok %d rx_win_shift %d tx_win_shift %d rx_autotune %d tx_autotune %d rx_rtt %Ld usecs ack_delay %d msecs\n",
+		s->ws_ok, s->rx_win_shift, s->tx_win_shift, s->rx_autotune, s->tx_autotune, s->rx_rtt, s->ack_delay);
+	tcp_cc_dump(&s->cc);
+	dprintf("\tin_recovery %d recover_seq %u rexmit_high %u duplicate_ack_count %d\n",
+		s->in_recovery, s->recover_seq, s->rexmit_high, s->duplicate_ack_count);
+	for(i = 0; i < s->num_sacked; i++)
+		dprintf("\t\tsacked %u - %u\n", s->sacked[i].start, s->sacked[i].end);
+	dprintf("\tsrtt %Ld usecs rttvar %Ld usecs rto %d msecs\n", s->srtt, s->rttvar, s->rto);
 }
 
 static void dump_socket_info(int argc, char **argv)
@@ -434,6 +545,198 @@ static int bind_local_address(tcp_socket *s, netaddr *remote_addr)
 	return err;
 }
 
+// the clock the timestamp option runs on, in msecs
+static uint32 tcp_timestamp(void)
+{
+	return system_time() / 1000;
+}
+
+static void tcp_parse_options(const uint8 *opt, int len, tcp_options *opts)
+{
+	memset(opts, 0, sizeof(tcp_options));
+
+	while(len > 0) {
+		int opt_len;
+
+		if(opt[0] == TCP_OPT_END)
+			break;
+		if(opt[0] == TCP_OPT_NOP) {
+			opt++;
+			len--;
+			continue;
+		}
+
+		opt_len = (len >= 2) ? opt[1] : 0;
+		if(opt_len < 2 || opt_len > len)
+			break; // bogus option, ignore the rest
+
+		switch(opt[0]) {
+			case TCP_OPT_MSS:
+				if(opt_len == sizeof(tcp_mss_option))
+					opts->mss = ntohs(((const tcp_mss_option *)opt)->mss);
+				break;
+			case TCP_OPT_WINDOW_SCALE:
+				if(opt_len == sizeof(tcp_window_scale_option)) {
+					opts->has_window_scale = true;
+					opts->window_scale = ((const tcp_window_scale_option *)opt)->shift_count;
+				}
+				break;
+			case TCP_OPT_SACK_PERMITTED:
+				opts->sack_permitted = true;
+				break;
+			case TCP_OPT_SACK: {
+				const tcp_sack_option_block *block = (const tcp_sack_option_block *)(opt + 2);
+				int count = (opt_len - 2) / sizeof(tcp_sack_option_block);
+
+				for(opts->num_sacks = 0; opts->num_sacks < min(count, TCP_MAX_SACK_OPTION_BLOCKS); opts->num_sacks++) {
+					opts->sacks[opts->num_sacks].start = ntohl(block[opts->num_sacks].start);
+					opts->sacks[opts->num_sacks].end = ntohl(block[opts->num_sacks].end);
+				}
+				break;
+			}
+			case TCP_OPT_TIMESTAMP:
+				if(opt_len == sizeof(tcp_timestamp_option)) {
+					opts->has_timestamp = true;
+					opts->ts_val = ntohl(((const tcp_timestamp_option *)opt)->ts_val);
+					opts->ts_ecr = ntohl(((const tcp_timestamp_option *)opt)->ts_ecr);
+				}
+				break;
+		}
+
+		opt += opt_len;
+		len -= opt_len;
+	}
+}
+
+// the smallest shift that lets the receive window grow as far as it may go
+static uint8 tcp_rx_window_shift(tcp_socket *s)
+{
+	uint32 size = s->rx_win_size;
+	uint8 shift = 0;
+
+	if(s->rx_autotune)
+		size = max(size, (uint32)TCP_AUTOTUNE_MAX_BUF_SIZE);
+	while((size >> shift) > 0xffff && shift < TCP_MAX_WINDOW_SHIFT)
+		shift++;
+
+	return shift;
+}
+
+// picks up the options the other side agreed to in its SYN or SYN|ACK
+// NOTE: expects the socket lock to be held
+static void tcp_negotiate_options(tcp_socket *s, tcp_options *opts)
+{
+	ASSERT_LOCKED_MUTEX(&s->lock);
+
+	s->sack_ok = s->sack_ok && opts->sack_permitted;
+	s->ts_ok = s->ts_ok && opts->has_timestamp;
+	if(s->ts_ok)
+		s->ts_recent = opts->ts_val;
+
+	// window scaling only happens if both sides asked for it
+	s->ws_ok = s->ws_ok && opts->has_window_scale;
+	if(s->ws_ok) {
+		s->tx_win_shift = min(opts->window_scale, TCP_MAX_WINDOW_SHIFT);
+	} else {
+		s->rx_win_shift = 0;
+		s->tx_win_shift = 0;
+		if(s->rx_win_size > 0xffff) {
+			s->rx_win_size = 0xffff;
+			s->rx_win_high = s->rx_win_low + s->rx_win_size - 1;
+		}
+	}
+
+	if(opts->mss != 0 && opts->mss < s->mss)
+		s->mss = opts->mss;
+
+	// a tiny or bogus mss would leave no room for data once the options are
+	// taken out, and congestion control divides by it
+	if(s->mss < MIN_MAX_SEGMENT_SIZE)
+		s->mss = MIN_MAX_SEGMENT_SIZE;
+
+	// the mss doesn't count options, leave room for the timestamp on every segment
+	if(s->ts_ok)
+		s->mss -= TCP_TIMESTAMP_OPTIONS_LEN;
+
+	tcp_cc_set_mss(&s->cc, s->mss);
+}
+
+// a receiver has no acks to time, so it goes by how long our timestamps take to be echoed
+// NOTE: expects the socket lock to be held
+static void tcp_rx_rtt_sample(tcp_socket *s, bigtime_t rtt)
+{
+	ASSERT_LOCKED_MUTEX(&s->lock);
+
+	if(rtt < CLOCK_GRANULARITY)
+		rtt = CLOCK_GRANULARITY;
+
+	// the echo is late when the sender had nothing to send, so lean towards the smallest
+	if(s->rx_rtt == 0 || rtt < s->rx_rtt)
+		s->rx_rtt = rtt;
+	else
+		s->rx_rtt += (rtt - s->rx_rtt) / 8;
+}
+
+// once an rtt, doubles the receive window if the sender came close to filling it
+// NOTE: expects the socket lock to be held
+static void tcp_rx_autotune(tcp_socket *s)
+{
+	bigtime_t now;
+	bigtime_t elapsed;
+	bigtime_t rtt;
+	uint32 max_size;
+
+	ASSERT_LOCKED_MUTEX(&s->lock);
+
+	if(!s->rx_autotune)
+		return;
+
+	now = system_time();
+	if(s->rx_autotune_time == 0) {
+		s->rx_autotune_time = now;
+		s->rx_autotune_seq = s->rx_win_low;
+		return;
+	}
+
+	if(s->rx_rtt != 0)
+		rtt = s->rx_rtt;
+	else if(s->have_rtt)
+		rtt = s->srtt;
+	else
+		rtt = DEFAULT_AUTOTUNE_RTT;
+
+	elapsed = now - s->rx_autotune_time;
+	if(elapsed < rtt)
+		return;
+
+	// more than 3/4 of the window per rtt, the window is what's holding the sender back
+	if((uint64)(s->rx_win_low - s->rx_autotune_seq) * rtt * 4 >= (uint64)s->rx_win_size * 3 * elapsed) {
+		max_size = min((uint32)TCP_AUTOTUNE_MAX_BUF_SIZE, (uint32)0xffff << s->rx_win_shift);
+		if(s->rx_win_size < max_size)
+			s->rx_win_size = min(s->rx_win_size * 2, max_size);
+	}
+
+	s->rx_autotune_time = now;
+	s->rx_autotune_seq = s->rx_win_low;
+}
+
+// lets the write buffer hold a couple of windows, so there is always something to send as acks come back
+// NOTE: expects the socket lock to be held
+static void tcp_tx_autotune(tcp_socket *s)
+{
+	int size;
+
+	ASSERT_LOCKED_MUTEX(&s->lock);
+
+	if(!s->tx_autotune)
+		return;
+
+	size = 2 * min(s->cc.cwnd, s->tx_win_high - s->retransmit_tx_seq);
+	size = min(size, TCP_AUTOTUNE_MAX_BUF_SIZE);
+	if(size > s->tx_write_buf_size)
+		s->tx_write_buf_size = size;
+}
+
 int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_address)
 {
 	tcp_header *header;
@@ -444,6 +747,8 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 	uint16 header_len;
 	uint16 data_len;
 	uint32 highest_sequence;
+	uint32 window;
+	tcp_options opts;
 
 	header = cbuf_get_ptr(buf, 0);
 	header_len = ((ntohs(header->length_flags) >> 12) & 0x0f) * 4;
@@ -454,7 +759,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 #endif
 
 	// check to see if the length looks correct
-	if(header_len > cbuf_get_len(buf)) {
+	if(header_len < sizeof(tcp_header) || header_len > cbuf_get_len(buf)) {
 		// bogus packet length
 		dprintf("tcp_input: received packet with bad length: header len %d, len %ld\n", header_len, cbuf_get_len(buf));
 		goto ditch_packet;
@@ -491,10 +796,19 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 	header->win_size = ntohs(header->win_size);
 	header->urg_pointer = ntohs(header->urg_pointer);
 
+	// pull out the options
+	{
+		uint8 opt_buf[TCP_MAX_OPTIONS_LEN];
+		int opt_len = header_len - sizeof(tcp_header);
+
+		cbuf_memcpy_from_chain(opt_buf, buf, sizeof(tcp_header), opt_len);
+		tcp_parse_options(opt_buf, opt_len, &opts);
+	}
+
 	// get some data from the packet
 	packet_flags = header->length_flags & 0x3f;
 	data_len = cbuf_get_len(buf) - header_len;
-	highest_sequence = header->seq_num + (data_len > 0) ? (data_len - 1) : 0;
+	highest_sequence = header->seq_num + data_len - 1; // the last byte of data, a FIN comes right after it
 
 	// see if it matches a socket we have
 	s = lookup_socket(source_address, target_address, header->source_port, header->dest_port);
@@ -506,6 +820,12 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 	// lock the socket
 	mutex_lock(&s->lock);
 
+	// the window in a SYN is never scaled
+	if(packet_flags & PKT_SYN)
+		window = header->win_size;
+	else
+		window = (uint32)header->win_size << s->tx_win_shift;
+
 	// see if the other side wants to reset the connection
 	if(packet_flags & PKT_RST) {
 		if(s->state != STATE_CLOSED && s->state != STATE_LISTEN) {
@@ -516,6 +836,12 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 
 	// check for out of window packets
 	if(!(packet_flags & PKT_SYN)) {
+		// an old duplicate from before the sequence numbers wrapped, as per rfc 7323
+		if(s->ts_ok && opts.has_timestamp && SEQUENCE_LT(opts.ts_val, s->ts_recent)) {
+			send_ack(s);
+			goto ditch_packet;
+		}
+
 		if(SEQUENCE_LT(header->seq_num, s->rx_win_low)
 			|| (SEQUENCE_GT(header->seq_num, s->rx_win_high)
 				&& (!((data_len == 0) && (header->seq_num != s->rx_win_high + 1))))) {
@@ -523,6 +849,13 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 			send_ack(s);
 			goto ditch_packet;
 		}
+
+		// remember the timestamp to echo, but only from segments that don't leave a hole
+		if(s->ts_ok && opts.has_timestamp && SEQUENCE_LTE(header->seq_num, s->rx_win_low))
+			s->ts_recent = opts.ts_val;
+
+		if(s->ts_ok && opts.has_timestamp && opts.ts_ecr != 0 && data_len > 0)
+			tcp_rx_rtt_sample(s, (bigtime_t)(tcp_timestamp() - opts.ts_ecr) * 1000);
 	}
 
 #if NET_CHATTY
@@ -535,8 +868,9 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 			goto send_reset;
 		case STATE_SYN_SENT:
 			s->tx_win_low++;
+			s->tx_max_seq = s->tx_win_low;
 			s->retransmit_tx_seq = s->tx_win_low;
-			s->tx_win_high = s->tx_win_low + header->win_size;
+			s->tx_win_high = s->tx_win_low + window;
 			if(packet_flags & PKT_SYN) {
 				s->rx_win_low = header->seq_num + 1;
 				s->rx_win_high = s->rx_win_low + s->rx_win_size - 1;
@@ -545,9 +879,11 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 					if(header->ack_num != s->tx_win_low)
 						goto send_reset;
 
-					tcp_socket_send(s, NULL, PKT_ACK, NULL, 0, s->tx_win_low);
+					tcp_negotiate_options(s, &opts);
+					tcp_socket_send(s, NULL, PKT_ACK, s->tx_win_low);
 					s->state = STATE_ESTABLISHED;
 					sem_release(s->read_sem, 1);
+					wait_object_notify(&s->waiters, WAIT_EVENT_WRITE);
 				} else {
 					// simultaneous open
 					// XXX handle
@@ -560,7 +896,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 			break;
 		case STATE_ESTABLISHED: {
 			if(packet_flags & PKT_ACK)
-				handle_ack(s, header->ack_num, header->win_size, data_len > 0);
+				handle_ack(s, header->ack_num, window, data_len > 0, &opts);
 
 			if(data_len > 0) {
 				handle_data(s, buf);
@@ -579,6 +915,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 
 				// wake up any readers
 				sem_release(s->read_sem, 1);
+				wait_object_notify(&s->waiters, WAIT_EVENT_READ);
 			}
 			break;
 		}
@@ -606,7 +943,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 				s->tx_win_low++;
 
 				s->state = STATE_TIME_WAIT;
-				tcp_socket_send(s, NULL, PKT_ACK, NULL, 0, s->tx_win_low);
+				tcp_socket_send(s, NULL, PKT_ACK, s->tx_win_low);
 				if(set_net_timer(&s->time_wait_timer, 2*MSL, &handle_time_wait_timeout, s, 0) >= 0)
 					inc_socket_ref(s);
 			} else if(packet_flags & PKT_ACK
@@ -625,9 +962,9 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 				s->tx_win_low++;
 
 				s->state = STATE_CLOSING;
-				tcp_socket_send(s, NULL, PKT_ACK, NULL, 0, s->tx_win_low);
+				tcp_socket_send(s, NULL, PKT_ACK, s->tx_win_low);
 			} else if(packet_flags & PKT_ACK)
-				handle_ack(s, header->ack_num, header->win_size, data_len > 0);
+				handle_ack(s, header->ack_num, window, data_len > 0, &opts);
 			break;
 		case STATE_FIN_WAIT_2:
 			if(packet_flags & PKT_FIN) {
@@ -635,7 +972,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 				s->rx_win_low ++;
 
 				s->state = STATE_TIME_WAIT;
-				tcp_socket_send(s, NULL, PKT_ACK, NULL, 0, s->tx_win_low);
+				tcp_socket_send(s, NULL, PKT_ACK, s->tx_win_low);
 				if(set_net_timer(&s->time_wait_timer, 2*MSL, &handle_time_wait_timeout, s, 0) >= 0)
 					inc_socket_ref(s);
 			}
@@ -644,7 +981,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 			if(packet_flags & PKT_ACK) {
 				// XXX do we need to make sure it's a valid ack?
 				s->state = STATE_TIME_WAIT;
-				tcp_socket_send(s, NULL, PKT_ACK, NULL, 0, s->tx_win_low);
+				tcp_socket_send(s, NULL, PKT_ACK, s->tx_win_low);
 				if(set_net_timer(&s->time_wait_timer, 2*MSL, &handle_time_wait_timeout, s, 0) >= 0)
 					inc_socket_ref(s);
 			}
@@ -653,7 +990,6 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 	/* passive open states */
 		case STATE_LISTEN: {
 			tcp_socket *accept_socket;
-			tcp_mss_option mss_option;
 
 			if(!(packet_flags & PKT_SYN)) {
 				// didn't have a SYN flag, send a reset
@@ -674,12 +1010,19 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 			// put it in the right state
 			accept_socket->state = STATE_SYN_RCVD;
 
+			// it gets the buffer settings of the listening socket
+			accept_socket->rx_win_size = s->rx_win_size;
+			accept_socket->rx_autotune = s->rx_autotune;
+			accept_socket->tx_write_buf_size = s->tx_write_buf_size;
+			accept_socket->tx_autotune = s->tx_autotune;
+			accept_socket->ack_delay = s->ack_delay;
+
 			// add it to the hash table
 			mutex_lock(&socket_table_lock);
 			hash_insert(socket_table, accept_socket);
 			mutex_unlock(&socket_table_lock);
 
-			// add it to the accept queue
+			// add it to the accept queue, pollers hear about it once it's established
 			queue_enqueue(&s->accept_queue, accept_socket);
 			sem_release(s->accept_sem, 1);
 
@@ -687,29 +1030,34 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 			accept_socket->rx_win_low = header->seq_num + 1;
 			accept_socket->rx_win_high = accept_socket->rx_win_low + accept_socket->rx_win_size - 1;
 
+			// grab a lock on the new socket
+			inc_socket_ref(accept_socket);
+			mutex_lock(&accept_socket->lock);
+
 			// figure out what the mss will be
-			err = ipv4_get_mss_for_dest(accept_socket->remote_addr, &s->mss);
+			err = ipv4_get_mss_for_dest(accept_socket->remote_addr, &accept_socket->mss);
 			if(err < 0)
-				accept_socket->mss = DEFAULT_MAX_SEGMENT_SIZE;
-
+				accept_socket->mss = DEFAULT_MAX_SEGMENT_SIZE + sizeof(tcp_header);
 			accept_socket->mss -= sizeof(tcp_header);
-			accept_socket->cwnd = accept_socket->mss;
+			accept_socket->local_mss = accept_socket->mss;
 
-			// set up the mss option
-			mss_option.kind = 0x2;
-			mss_option.len = 0x4;
-			mss_option.mss = htons(s->mss);
+			// take whatever options they offered that we do too
+			accept_socket->sack_ok = TCP_SACK;
+			accept_socket->ts_ok = TCP_TIMESTAMPS;
+			accept_socket->ws_ok = TCP_WINDOW_SCALE;
+			accept_socket->rx_win_shift = tcp_rx_window_shift(accept_socket);
+			tcp_negotiate_options(accept_socket, &opts);
 
-			// grab a lock on the new socket and send an ack to the syn
-			inc_socket_ref(accept_socket);
-			mutex_lock(&accept_socket->lock);
-			tcp_socket_send(accept_socket, NULL, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option), accept_socket->tx_win_low);
+			// send an ack to the syn
+			tcp_socket_send(accept_socket, NULL, PKT_ACK|PKT_SYN, accept_socket->tx_win_low);
 			mutex_unlock(&accept_socket->lock);
 			dec_socket_ref(accept_socket);
 
 			break;
 		}
 		case STATE_SYN_RCVD: {
+			tcp_socket *listen_socket;
+
 			if(packet_flags & PKT_SYN) {
 				// they must have not received our ack to their syn, retransmit
 				// XXX implement
@@ -722,11 +1070,20 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 				if(header->ack_num != s->tx_win_low + 1)
 					goto send_reset;
 				s->tx_win_low++;
+				s->tx_max_seq = s->tx_win_low;
 				s->retransmit_tx_seq = s->tx_win_low;
-				s->tx_win_high = s->tx_win_low + header->win_size;
+				s->tx_win_high = s->tx_win_low + window;
 
 				s->state = STATE_ESTABLISHED;
 				sem_release(s->read_sem, 1);
+				wait_object_notify(&s->waiters, WAIT_EVENT_WRITE);
+
+				// it can be accepted without waiting now, let the listener's pollers know
+				listen_socket = lookup_socket(0, s->local_addr, 0, s->local_port);
+				if(listen_socket) {
+					wait_object_notify(&listen_socket->waiters, WAIT_EVENT_READ);
+					dec_socket_ref(listen_socket);
+				}
 			} else {
 				goto send_reset;
 			}
@@ -805,7 +1162,6 @@ int tcp_connect(void *prot_data, sockaddr *addr)
 	tcp_socket *s = prot_data;
 	int err;
 	int i;
-	tcp_mss_option mss_option;
 
 	inc_socket_ref(s);
 	mutex_lock(&s->lock);
@@ -841,18 +1197,20 @@ int tcp_connect(void *prot_data, sockaddr *addr)
 		s->mss = DEFAULT_MAX_SEGMENT_SIZE;
 
 	s->mss -= sizeof(tcp_header);
-	s->cwnd = s->mss;
+	s->local_mss = s->mss;
+	tcp_cc_set_mss(&s->cc, s->mss);
 
-	// set up the mss option
-	mss_option.kind = 0x2;
-	mss_option.len = 0x4;
-	mss_option.mss = htons(s->mss);
+	// offer the options we know, the SYN|ACK says which ones they took
+	s->sack_ok = TCP_SACK;
+	s->ts_ok = TCP_TIMESTAMPS;
+	s->ws_ok = TCP_WINDOW_SCALE;
+	s->rx_win_shift = tcp_rx_window_shift(s);
 
 	// welcome to the machine
 	s->state = STATE_SYN_SENT;
 	for(i=0; i < 3 && s->state != STATE_ESTABLISHED && s->state != STATE_CLOSED; i++) {
 		if(s->state == STATE_SYN_SENT)
-			tcp_socket_send(s, NULL, PKT_SYN, &mss_option, sizeof(mss_option), s->tx_win_low);
+			tcp_socket_send(s, NULL, PKT_SYN, s->tx_win_low);
 		mutex_unlock(&s->lock);
 		sem_acquire_etc(s->read_sem, 1, SEM_FLAG_TIMEOUT, SYN_RETRANSMIT_TIMEOUT, NULL);
 		mutex_lock(&s->lock);
@@ -897,6 +1255,20 @@ out:
 	return err;
 }
 
+// the first socket in the accept queue that's established, or NULL
+// NOTE: expects the listening socket's lock to be held
+static tcp_socket *accept_queue_find_established(tcp_socket *s)
+{
+	tcp_socket *t;
+
+	for(t = s->accept_queue.head; t != NULL; t = t->accept_next.next) {
+		if(t->state == STATE_ESTABLISHED)
+			return t;
+	}
+
+	return NULL;
+}
+
 int tcp_accept(void *prot_data, sockaddr *saddr, void **_new_socket)
 {
 	tcp_socket *s = prot_data;
@@ -923,8 +1295,13 @@ retry:
 		goto out;
 	}
 
-	// pull something from the head of the accept queue
-	new_socket = queue_dequeue(&s->accept_queue);
+	// take the first connection that's made it through the handshake, so a
+	// half open one at the head doesn't hold up ones that are ready
+	new_socket = accept_queue_find_established(s);
+	if(new_socket != NULL)
+		queue_remove_item(&s->accept_queue, new_socket);
+	else
+		new_socket = queue_dequeue(&s->accept_queue);
 	ASSERT(new_socket != NULL);
 	ASSERT(new_socket->ref_count > 0);
 
@@ -963,6 +1340,46 @@ out:
 	return err;
 }
 
+int tcp_poll(void *prot_data, struct wait_watch *watch)
+{
+	tcp_socket *s = prot_data;
+	int events = 0;
+
+	inc_socket_ref(s);
+	mutex_lock(&s->lock);
+
+	wait_object_attach(&s->waiters, watch);
+
+	switch(s->state) {
+		case STATE_LISTEN:
+			// only once accept won't have to wait for a handshake to finish
+			if(accept_queue_find_established(s) != NULL)
+				events |= WAIT_EVENT_READ;
+			break;
+		case STATE_ESTABLISHED:
+		case STATE_CLOSE_WAIT:
+			// in CLOSE_WAIT a read returns end of file right away
+			if(s->read_buffer != NULL || s->state == STATE_CLOSE_WAIT)
+				events |= WAIT_EVENT_READ;
+			if((int)cbuf_get_len(s->write_buffer) < s->tx_write_buf_size)
+				events |= WAIT_EVENT_WRITE;
+			break;
+		case STATE_SYN_SENT:
+		case STATE_SYN_RCVD:
+			break;
+		default:
+			// reads return right away
+			events |= WAIT_EVENT_READ;
+			if(s->last_error < 0)
+				events |= WAIT_EVENT_ERROR;
+	}
+
+	mutex_unlock(&s->lock);
+	dec_socket_ref(s);
+
+	return events;
+}
+
 int tcp_close(void *prot_data)
 {
 	tcp_socket *s = prot_data;
@@ -973,14 +1390,14 @@ int tcp_close(void *prot_data)
 	// handle some special cases
 	switch(s->state) {
 		case STATE_ESTABLISHED:
-			tcp_socket_send(s, NULL, PKT_FIN|PKT_ACK, NULL, 0, s->tx_win_low);
+			tcp_socket_send(s, NULL, PKT_FIN|PKT_ACK, s->tx_win_low);
 
 			if(set_net_timer(&s->fin_retransmit_timer, FIN_RETRANSMIT_TIMEOUT, &handle_fin_retransmit, s, 0) >= 0)
 				inc_socket_ref(s);
 			s->state = STATE_FIN_WAIT_1;
 			break;
 		case STATE_CLOSE_WAIT:
-			tcp_socket_send(s, NULL, PKT_FIN|PKT_ACK, NULL, 0, s->tx_win_low);
+			tcp_socket_send(s, NULL, PKT_FIN|PKT_ACK, s->tx_win_low);
 
 			if(set_net_timer(&s->fin_retransmit_timer, FIN_RETRANSMIT_TIMEOUT, &handle_fin_retransmit, s, 0) >= 0)
 				inc_socket_ref(s);
@@ -1107,8 +1524,8 @@ ssize_t tcp_sendto(void *prot_data, const void *_inbuf, ssize_t len, sockaddr *t
 		// figure out how much of this buffer we can add to the transmit queue
 		buf_size = cbuf_get_len(s->write_buffer);
 		chunk_size = min(len - sent, s->tx_write_buf_size - buf_size);
-		if(chunk_size == 0) {
-			// wait for some space to free
+		if(chunk_size <= 0) {
+			// wait for some space to free, the buffer may also have been made smaller than what's in it
 			ASSERT(s->write_buffer != NULL);
 			s->writers_waiting = true;
 			mutex_unlock(&s->lock);
@@ -1160,6 +1577,83 @@ out:
 	return sent;
 }
 
+int tcp_setopt(void *prot_data, int opt, int value)
+{
+	tcp_socket *s = prot_data;
+	uint32 max_size;
+	bool wake_writers = false;
+	int err = NO_ERROR;
+
+	if(value < 0)
+		return ERR_INVALID_ARGS;
+
+	inc_socket_ref(s);
+	mutex_lock(&s->lock);
+
+	switch(opt) {
+		case SOCK_OPT_SNDBUF:
+			// 0 lets the buffer size itself to the connection
+			s->tx_autotune = (value == 0);
+			if(value != 0)
+				s->tx_write_buf_size = min(max(value, TCP_MIN_BUF_SIZE), TCP_MAX_BUF_SIZE);
+			if(s->writers_waiting) {
+				s->writers_waiting = false;
+				wake_writers = true;
+			}
+			break;
+		case SOCK_OPT_RCVBUF:
+			s->rx_autotune = (value == 0);
+			if(value != 0) {
+				// once the SYNs are out the window scale is set, and caps the window
+				max_size = TCP_MAX_BUF_SIZE;
+				if(s->state != STATE_CLOSED && s->state != STATE_LISTEN)
+					max_size = min(max_size, (uint32)0xffff << s->rx_win_shift);
+				s->rx_win_size = min((uint32)max(value, TCP_MIN_BUF_SIZE), max_size);
+			}
+			break;
+		case SOCK_OPT_TCP_ACK_DELAY:
+			s->ack_delay = min(value, MAX_ACK_DELAY);
+			break;
+		default:
+			err = ERR_INVALID_ARGS;
+	}
+
+	mutex_unlock(&s->lock);
+	if(wake_writers)
+		sem_release(s->write_sem, 1);
+	dec_socket_ref(s);
+
+	return err;
+}
+
+int tcp_getopt(void *prot_data, int opt)
+{
+	tcp_socket *s = prot_data;
+	int err;
+
+	inc_socket_ref(s);
+	mutex_lock(&s->lock);
+
+	switch(opt) {
+		case SOCK_OPT_SNDBUF:
+			err = s->tx_write_buf_size;
+			break;
+		case SOCK_OPT_RCVBUF:
+			err = s->rx_win_size;
+			break;
+		case SOCK_OPT_TCP_ACK_DELAY:
+			err = s->ack_delay;
+			break;
+		default:
+			err = ERR_INVALID_ARGS;
+	}
+
+	mutex_unlock(&s->lock);
+	dec_socket_ref(s);
+
+	return err;
+}
+
 static void send_ack(tcp_socket *s)
 {
 	ASSERT_LOCKED_MUTEX(&s->lock);
@@ -1172,14 +1666,191 @@ static void send_ack(tcp_socket *s)
 
 	// XXX handle sending any pending data here, have the ack piggyback that
 	if(tcp_flush_pending_data(s) == 0)
-		tcp_socket_send(s, NULL, PKT_ACK, NULL, 0, s->tx_win_low);
+		tcp_socket_send(s, NULL, PKT_ACK, s->tx_win_low);
 }
 
 
-static void handle_ack(tcp_socket *s, uint32 sequence, uint32 window_size, bool with_data)
+// as per rfc 6298, rtt is in usecs
+// NOTE: expects the socket lock to be held
+static void tcp_rtt_sample(tcp_socket *s, bigtime_t rtt)
+{
+	bigtime_t rto;
+
+	ASSERT_LOCKED_MUTEX(&s->lock);
+
+	if(!s->have_rtt) {
+		s->srtt = rtt;
+		s->rttvar = rtt / 2;
+		s->have_rtt = true;
+	} else {
+		bigtime_t delta = s->srtt - rtt;
+
+		s->rttvar = (3 * s->rttvar + (delta < 0 ? -delta : delta)) / 4;
+		s->srtt = (7 * s->srtt + rtt) / 8;
+	}
+
+	// this also takes back any backoff
+	rto = (s->srtt + max(CLOCK_GRANULARITY, 4 * s->rttvar)) / 1000;
+	if(rto < MIN_RETRANSMIT_TIMEOUT)
+		rto = MIN_RETRANSMIT_TIMEOUT;
+	if(rto > MAX_RETRANSMIT_TIMEOUT)
+		rto = MAX_RETRANSMIT_TIMEOUT;
+	s->rto = rto;
+}
+
+// NOTE: expects the socket lock to be held
+static void tcp_set_retransmit_timer(tcp_socket *s)
+{
+	ASSERT_LOCKED_MUTEX(&s->lock);
+
+	if(cancel_net_timer(&s->retransmit_timer) >= 0)
+		dec_socket_ref(s);
+	if(set_net_timer(&s->retransmit_timer, s->rto, &handle_retransmit_timeout, s, 0) >= 0)
+		inc_socket_ref(s);
+}
+
+// adds a block from an incoming SACK to the scoreboard, merging it with any it touches
+// NOTE: expects the socket lock to be held
+static void tcp_add_sacked(tcp_socket *s, uint32 start, uint32 end)
+{
+	int i;
+
+	for(i = 0; i < s->num_sacked; ) {
+		if(SEQUENCE_LTE(s->sacked[i].start, end) && SEQUENCE_GTE(s->sacked[i].end, start)) {
+			if(SEQUENCE_LT(s->sacked[i].start, start))
+				start = s->sacked[i].start;
+			if(SEQUENCE_GT(s->sacked[i].end, end))
+				end = s->sacked[i].end;
+			memmove(&s->sacked[i], &s->sacked[i + 1], (s->num_sacked - i - 1) * sizeof(tcp_sack_block));
+			s->num_sacked--;
+		} else {
+			i++;
+		}
+	}
+
+	// keep it sorted, if it's full the highest block goes
+	for(i = 0; i < s->num_sacked && SEQUENCE_LT(s->sacked[i].start, start); i++)
+		;
+	if(s->num_sacked == TCP_SACK_SCOREBOARD_SIZE) {
+		if(i == s->num_sacked)
+			return;
+		s->num_sacked--;
+	}
+	memmove(&s->sacked[i + 1], &s->sacked[i], (s->num_sacked - i) * sizeof(tcp_sack_block));
+	s->sacked[i].start = start;
+	s->sacked[i].end = end;
+	s->num_sacked++;
+}
+
+// drops whatever the cumulative ack now covers from the scoreboard
+// NOTE: expects the socket lock to be held
+static void tcp_trim_sacked(tcp_socket *s)
+{
+	while(s->num_sacked > 0 && SEQUENCE_LTE(s->sacked[0].end, s->retransmit_tx_seq)) {
+		memmove(&s->sacked[0], &s->sacked[1], (s->num_sacked - 1) * sizeof(tcp_sack_block));
+		s->num_sacked--;
+	}
+	if(s->num_sacked > 0 && SEQUENCE_LT(s->sacked[0].start, s->retransmit_tx_seq))
+		s->sacked[0].start = s->retransmit_tx_seq;
+}
+
+// finds the first hole at or past seq with sacked data above it, that data must have been lost
+// NOTE: expects the socket lock to be held
+static bool tcp_next_lost(tcp_socket *s, uint32 seq, uint32 *start, uint32 *len)
+{
+	int i;
+
+	for(i = 0; i < s->num_sacked; i++) {
+		if(SEQUENCE_LT(seq, s->sacked[i].start)) {
+			*start = seq;
+			*len = s->sacked[i].start - seq;
+			return true;
+		}
+		if(SEQUENCE_LT(seq, s->sacked[i].end))
+			seq = s->sacked[i].end;
+	}
+
+	return false;
+}
+
+// how much data is still out on the network, as per the pipe of rfc 6675
+// NOTE: expects the socket lock to be held
+static uint32 tcp_flight_size(tcp_socket *s)
+{
+	uint32 pipe;
+	uint32 seq;
+	int i;
+
+	if(!s->in_recovery || !s->sack_ok || s->num_sacked == 0)
+		return s->unacked_data_len;
+
+	// everything past the highest sacked block
+	seq = s->sacked[s->num_sacked - 1].end;
+	pipe = SEQUENCE_GT(s->tx_win_low, seq) ? s->tx_win_low - seq : 0;
+
+	// and the retransmissions into the holes below it, the rest of the holes were lost
+	seq = s->retransmit_tx_seq;
+	for(i = 0; i < s->num_sacked && SEQUENCE_LT(seq, s->rexmit_high); i++) {
+		uint32 hole_end = SEQUENCE_LT(s->sacked[i].start, s->rexmit_high) ? s->sacked[i].start : s->rexmit_high;
+
+		if(SEQUENCE_GT(hole_end, seq))
+			pipe += hole_end - seq;
+		seq = s->sacked[i].end;
+	}
+
+	return pipe;
+}
+
+// fills the holes the scoreboard says were lost, as far as the congestion window lets us
+// NOTE: expects the socket lock to be held
+static void tcp_sack_retransmit(tcp_socket *s)
+{
+	uint32 start, len;
+
+	ASSERT_LOCKED_MUTEX(&s->lock);
+
+	while(s->in_recovery && tcp_flight_size(s) < s->cc.cwnd) {
+		uint32 seq = SEQUENCE_GT(s->rexmit_high, s->retransmit_tx_seq) ? s->rexmit_high : s->retransmit_tx_seq;
+
+		if(!tcp_next_lost(s, seq, &start, &len))
+			break;
+		if(tcp_retransmit_range(s, start, min(len, s->mss)) <= 0)
+			break;
+	}
+}
+
+// a loss was detected by duplicate acks, start fast recovery
+// NOTE: expects the socket lock to be held
+static void tcp_enter_recovery(tcp_socket *s)
+{
+	ASSERT_LOCKED_MUTEX(&s->lock);
+
+	s->cc.ssthresh = s->cc.ops->loss(&s->cc, s->unacked_data_len);
+	s->in_recovery = true;
+	s->recover_seq = s->tx_max_seq;
+	s->rexmit_high = s->retransmit_tx_seq;
+
+	if(s->sack_ok) {
+		s->cc.cwnd = s->cc.ssthresh;
+	} else {
+		// newreno, inflate the window by the segments that have left the network
+		s->cc.cwnd = s->cc.ssthresh + 3 * s->mss;
+	}
+
+	tcp_set_retransmit_timer(s);
+
+	// the first unacked segment always goes right away
+	tcp_retransmit(s);
+	if(s->sack_ok)
+		tcp_sack_retransmit(s);
+}
+
+static void handle_ack(tcp_socket *s, uint32 sequence, uint32 window_size, bool with_data, tcp_options *opts)
 {
 	bool wake_writers = false;
 	uint32 ack_len = 0;
+	bool cwnd_limited;
+	int i;
 
 	ASSERT_LOCKED_MUTEX(&s->lock);
 
@@ -1187,93 +1858,118 @@ static void handle_ack(tcp_socket *s, uint32 sequence, uint32 window_size, bool
 //	dprintf("\tretransmit_tx_seq %d tx_win_low %d tx_win_high %d tx_write_buf_size %d\n",
 //		s->retransmit_tx_seq, s->tx_win_low, s->tx_win_high, s->tx_write_buf_size);
 
-	if(sequence == s->retransmit_tx_seq
-		&& sequence + window_size == s->tx_win_high
-		&& !with_data) {
-		// the other side is telling us it got a packet out of date, do fast retransmit
-		if(++s->duplicate_ack_count == 3) {
-			s->retransmit_timeout = s->rto;
-			if(set_net_timer(&s->retransmit_timer, s->retransmit_timeout, &handle_retransmit_timeout, s, 0) >= 0)
-				inc_socket_ref(s);
-
-			tcp_retransmit(s);
-			s->duplicate_ack_count = 0;
-
-			// save 1/2 of the congestion window into ssthresh
-			s->ssthresh = min(s->mss * 2, s->cwnd / 2);
+	if(SEQUENCE_LT(sequence, s->retransmit_tx_seq) || SEQUENCE_GT(sequence, s->tx_max_seq)) {
+		// old, or for data we never sent
+		return;
+	}
 
-			return;
+	if(s->sack_ok) {
+		for(i = 0; i < opts->num_sacks; i++) {
+			// only blocks that make sense, this also skips D-SACKs
+			if(SEQUENCE_GT(opts->sacks[i].start, sequence)
+				&& SEQUENCE_GT(opts->sacks[i].end, opts->sacks[i].start)
+				&& SEQUENCE_LTE(opts->sacks[i].end, s->tx_max_seq))
+				tcp_add_sacked(s, opts->sacks[i].start, opts->sacks[i].end);
 		}
 	}
-	s->duplicate_ack_count = 0;
 
-	if(SEQUENCE_GTE(sequence, s->retransmit_tx_seq)) {
-		if(s->tracking_rtt && SEQUENCE_GTE(sequence, s->rtt_seq)) {
-			// this sequence acked the data we are tracking to recalc rtt
-			// as per Jacobson
-			long Err = ((long)(system_time() - s->rtt_seq_timestamp) / 1000) - s->smoothed_rtt;
-			s->smoothed_rtt = s->smoothed_rtt + Err / 8;
-			s->smoothed_deviation = s->smoothed_deviation + ((Err < 0 ? -Err : Err) - s->smoothed_deviation) / 4;
-			s->rto = s->smoothed_rtt + 4 * s->smoothed_deviation;
-			s->tracking_rtt = false;
+	if(sequence == s->retransmit_tx_seq) {
+		if(s->unacked_data_len > 0 && !with_data && window_size > 0
+			&& (sequence + window_size == s->tx_win_high || opts->num_sacks > 0)) {
+			// the other side is telling us it got a packet out of order
+			s->duplicate_ack_count++;
+			if(s->in_recovery) {
+				if(s->sack_ok) {
+					tcp_sack_retransmit(s);
+				} else {
+					// another segment has left the network
+					s->cc.cwnd += s->mss;
+				}
+			} else if(s->duplicate_ack_count == 3) {
+				tcp_enter_recovery(s);
+			}
 		}
+		goto out;
+	}
 
+	// new data is being acked
+	if(s->ts_ok && opts->has_timestamp && opts->ts_ecr != 0) {
+		tcp_rtt_sample(s, (bigtime_t)(tcp_timestamp() - opts->ts_ecr) * 1000);
+	} else if(s->tracking_rtt && SEQUENCE_GT(sequence, s->rtt_seq)) {
+		// this sequence acked the data we are tracking to recalc rtt
+		tcp_rtt_sample(s, system_time() - s->rtt_seq_timestamp);
+	}
+	if(s->tracking_rtt && SEQUENCE_GT(sequence, s->rtt_seq))
+		s->tracking_rtt = false;
 
-		if(SEQUENCE_GT(sequence, s->retransmit_tx_seq)) {
-			if(!s->write_buffer) {
-				dprintf("tcp: data was acked that we didn't send\n");
-				goto out;
-			}
+	if(!s->write_buffer) {
+		dprintf("tcp: data was acked that we didn't send\n");
+		goto out;
+	}
 
-			ASSERT(cbuf_get_len(s->write_buffer) >= s->unacked_data_len);
+	cwnd_limited = s->unacked_data_len + s->mss > s->cc.cwnd;
+
+	// remove acked data from the transmit queue
+	ack_len = sequence - s->retransmit_tx_seq;
+	ASSERT(cbuf_get_len(s->write_buffer) >= ack_len);
+	s->write_buffer = cbuf_truncate_head(s->write_buffer, ack_len, true);
+	s->retransmit_tx_seq = sequence;
+	if(SEQUENCE_GT(sequence, s->tx_win_low)) {
+		// after a timeout, acks for what was sent before it
+		s->tx_win_low = sequence;
+		s->unacked_data_len = 0;
+	} else {
+		s->unacked_data_len -= ack_len;
+	}
+	s->duplicate_ack_count = 0;
+	tcp_trim_sacked(s);
+
+	if(s->in_recovery) {
+		if(SEQUENCE_GTE(sequence, s->recover_seq)) {
+			// everything outstanding when the loss was seen made it, deflate the window
+			s->in_recovery = false;
+			s->cc.cwnd = min(s->cc.ssthresh, s->unacked_data_len + s->mss);
+		} else if(s->sack_ok) {
+			tcp_sack_retransmit(s);
+		} else {
+			// a partial ack, as per newreno the next hole starts right here
+			s->cc.cwnd = (s->cc.cwnd > ack_len) ? s->cc.cwnd - ack_len : 0;
+			if(ack_len >= s->mss)
+				s->cc.cwnd += s->mss;
+			s->rexmit_high = s->retransmit_tx_seq;
+			tcp_retransmit(s);
+		}
+	} else if(cwnd_limited) {
+		// only open the window if it's what's holding us back
+		s->cc.ops->ack(&s->cc, ack_len, s->srtt);
+	}
 
-			// remove acked data from the transmit queue
-			ack_len = sequence - s->retransmit_tx_seq;
-			if(ack_len == 0)
-				goto out;
-			if(ack_len > s->unacked_data_len)
-				ack_len = s->unacked_data_len;
-			s->write_buffer = cbuf_truncate_head(s->write_buffer, ack_len, true);
-			s->unacked_data_len -= ack_len;
-
-			s->retransmit_tx_seq = sequence;
-
-			// reset the retransmit timer
-			if(cancel_net_timer(&s->retransmit_timer) >= 0)
-				dec_socket_ref(s);
-			if(s->unacked_data_len > 0) {
-				s->retransmit_timeout = s->rto;
-				set_net_timer(&s->retransmit_timer, s->retransmit_timeout, &handle_retransmit_timeout, s, 0);
-				inc_socket_ref(s);
-			}
+	// reset the retransmit timer
+	if(s->unacked_data_len > 0) {
+		tcp_set_retransmit_timer(s);
+	} else if(cancel_net_timer(&s->retransmit_timer) >= 0) {
+		dec_socket_ref(s);
+	}
 
-			// see if we need to wake up any writers
-			if(s->writers_waiting) {
-				if(s->write_buffer == NULL || cbuf_get_len(s->write_buffer) < s->tx_write_buf_size - s->mss) {
-					s->writers_waiting = false;
-					wake_writers = true;
-				}
-			}
+	tcp_tx_autotune(s);
 
-			// open the congestion window
-			if(s->cwnd <= s->ssthresh) {
-				// doing slow start, increment the window by a mss per ack received
-				s->cwnd += s->mss;
-			} else {
-				// congestion avoidance, increment the congestion window by 1/cwnd
-				s->cwnd += s->mss * s->mss / s->cwnd;
-			}
-			// XXX need to clamp to max observed window
-			if(s->cwnd > 0xffff)
-				s->cwnd = 0xffff;
+	// see if we need to wake up any writers
+	if(s->writers_waiting) {
+		if(s->write_buffer == NULL || cbuf_get_len(s->write_buffer) < s->tx_write_buf_size - s->mss) {
+			s->writers_waiting = false;
+			wake_writers = true;
 		}
 	}
 
 out:
-	s->tx_win_high += ack_len;
+	// the right edge of their window never moves back
+	if(SEQUENCE_GT(sequence + window_size, s->tx_win_high))
+		s->tx_win_high = sequence + window_size;
 	tcp_flush_pending_data(s);
 	if(wake_writers)
 		sem_release(s->write_sem, 1);
+	if(ack_len > 0)
+		wait_object_notify(&s->waiters, WAIT_EVENT_WRITE);
 }
 
 static void handle_ack_delay_timeout(void *_socket)
@@ -1281,7 +1977,9 @@ static void handle_ack_delay_timeout(void *_socket)
 	tcp_socket *s = (tcp_socket *)_socket;
 
 	mutex_lock(&s->lock);
-	send_ack(s);
+	// something else may have carried the ack in the meantime
+	if(s->rx_win_low != s->rx_acked_seq)
+		send_ack(s);
 	mutex_unlock(&s->lock);
 	dec_socket_ref(s);
 }
@@ -1295,19 +1993,21 @@ static void handle_persist_timeout(void *_socket)
 	mutex_lock(&s->lock);
 
 	if(s->write_buffer != NULL
-		&& s->unacked_data_len < cbuf_get_len(s->write_buffer)
+		&& s->unacked_data_len == 0
 		&& s->state == STATE_ESTABLISHED) {
 
-		// reset this timer
-		if(set_net_timer(&s->persist_timer, PERSIST_TIMEOUT, &handle_persist_timeout, s, 0) >= 0)
-			inc_socket_ref(s);
-
 		if(tcp_flush_pending_data(s) == 0) {
-			// we've flushed everything, send one byte past the end of the window
-			cbuf *data = cbuf_duplicate_chain(s->write_buffer, s->unacked_data_len, 1, 0);
+			// the window is still closed, send one byte past the end of it. From here on
+			// it's retransmitted like any other data, until the ack brings a window update.
+			cbuf *data = cbuf_duplicate_chain(s->write_buffer, 0, 1, 0);
 			if(data == NULL)
 				goto out;
-			tcp_socket_send(s, data, PKT_PSH | PKT_ACK, NULL, 0, s->tx_win_low);
+			s->unacked_data_len = 1;
+			s->tx_win_low++;
+			if(SEQUENCE_GT(s->tx_win_low, s->tx_max_seq))
+				s->tx_max_seq = s->tx_win_low;
+			tcp_set_retransmit_timer(s);
+			tcp_socket_send(s, data, PKT_PSH | PKT_ACK, s->tx_win_low - 1);
 		}
 	}
 
@@ -1324,20 +2024,46 @@ static void handle_retransmit_timeout(void *_socket)
 
 	// XXX check here to see if we've retransmitted too many times
 
-	tcp_retransmit(s);
-
-	// save 1/2 of the congestion window into ssthresh
-	s->ssthresh = max(s->mss * 2, s->cwnd / 2);
-	s->cwnd = s->mss; // slow start
+	if(s->unacked_data_len == 0)
+		goto out;
 
 	// exponentially backoff the retransmit timeout
-	s->retransmit_timeout *= 2;
-	if(s->retransmit_timeout > MAX_RETRANSMIT_TIMEOUT)
-		s->retransmit_timeout = MAX_RETRANSMIT_TIMEOUT;
+	s->rto *= 2;
+	if(s->rto > MAX_RETRANSMIT_TIMEOUT)
+		s->rto = MAX_RETRANSMIT_TIMEOUT;
+
+	if(SEQUENCE_LTE(s->tx_win_high, s->retransmit_tx_seq)) {
+		// probing a closed window, not a loss
+		if(set_net_timer(&s->retransmit_timer, s->rto, &handle_retransmit_timeout, s, NET_TIMER_PENDING_IGNORE) >= 0)
+			inc_socket_ref(s);
+		tcp_retransmit(s);
+		goto out;
+	}
+
+	// everything in flight is presumed lost, back to slow start
+	s->cc.ssthresh = s->cc.ops->loss(&s->cc, s->unacked_data_len);
+	s->cc.ops->timeout(&s->cc);
+	s->cc.cwnd = s->mss;
+	s->in_recovery = false;
+	s->duplicate_ack_count = 0;
+	s->tracking_rtt = false;
+
+	// the other side is allowed to throw away data it sacked
+	s->num_sacked = 0;
 
-	if(set_net_timer(&s->retransmit_timer, s->retransmit_timeout, &handle_retransmit_timeout, s, NET_TIMER_PENDING_IGNORE) >= 0)
+	if(set_net_timer(&s->retransmit_timer, s->rto, &handle_retransmit_timeout, s, NET_TIMER_PENDING_IGNORE) >= 0)
 		inc_socket_ref(s);
 
+	if(s->state == STATE_ESTABLISHED) {
+		// go back and resend everything past the last ack as the window opens up again
+		s->tx_win_low = s->retransmit_tx_seq;
+		s->unacked_data_len = 0;
+		tcp_flush_pending_data(s);
+	} else {
+		tcp_retransmit(s);
+	}
+
+out:
 	mutex_unlock(&s->lock);
 	dec_socket_ref(s);
 }
@@ -1354,7 +2080,7 @@ static void handle_fin_retransmit(void *_socket)
 	if(set_net_timer(&s->fin_retransmit_timer, FIN_RETRANSMIT_TIMEOUT, &handle_fin_retransmit, s, NET_TIMER_PENDING_IGNORE) >= 0)
 		inc_socket_ref(s);
 
-	tcp_socket_send(s, NULL, PKT_FIN | PKT_ACK, NULL, 0, s->tx_win_low);
+	tcp_socket_send(s, NULL, PKT_FIN | PKT_ACK, s->tx_win_low);
 
 out:
 	mutex_unlock(&s->lock);
@@ -1381,12 +2107,13 @@ static void handle_data(tcp_socket *s, cbuf *buf)
 	tcp_header header;
 	int header_length;
 	uint32 seq_low, seq_high;
+	bool filled_hole;
 
 	ASSERT_LOCKED_MUTEX(&s->lock);
 
 	// copy the header
 	memcpy(&header, cbuf_get_ptr(buf, 0), sizeof(header));
-	header_length = ((header.length_flags >> 12) % 0xf) * 4;
+	header_length = ((header.length_flags >> 12) & 0xf) * 4;
 	seq_low = header.seq_num;
 	seq_high = seq_low + cbuf_get_len(buf) - header_length - 1;
 
@@ -1397,11 +2124,13 @@ static void handle_data(tcp_socket *s, cbuf *buf)
 		s->read_buffer = cbuf_merge_chains(s->read_buffer, buf);
 
 		sem_release(s->read_sem, 1);
+		wait_object_notify(&s->waiters, WAIT_EVENT_READ);
 
 		// see if any reassembly packets can now be dealt with
+		filled_hole = (s->reassembly_q != NULL);
 		while(s->reassembly_q) {
 			tcp_header *q_header = (tcp_header *)cbuf_get_ptr(s->reassembly_q, 0);
-			int packet_header_len = ((q_header->length_flags >> 12) % 0xf) * 4;
+			int packet_header_len = ((q_header->length_flags >> 12) & 0xf) * 4;
 			uint32 packet_low = q_header->seq_num;
 			uint32 packet_high = packet_low + cbuf_get_len(s->reassembly_q) - packet_header_len;
 
@@ -1428,15 +2157,20 @@ static void handle_data(tcp_socket *s, cbuf *buf)
 			}
 		}
 
-		// set up a delayed ack
-		if((int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
+		tcp_rx_autotune(s);
+
+		// set up a delayed ack, unless this filled in a hole and the sender is waiting to hear about it,
+		// or there are two full segments unacked, as per rfc 5681
+		if(filled_hole || s->ack_delay == 0 || s->rx_win_low - s->rx_acked_seq >= 2 * s->mss
+			|| (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
 			send_ack(s);
-		} else if(set_net_timer(&s->ack_delay_timer, ACK_DELAY, handle_ack_delay_timeout, s, NET_TIMER_PENDING_IGNORE) >= 0) {
+		} else if(set_net_timer(&s->ack_delay_timer, s->ack_delay, handle_ack_delay_timeout, s, NET_TIMER_PENDING_IGNORE) >= 0) {
 			// a delayed ack timeout was set
 			inc_socket_ref(s);
 		}
 	} else {
 		// packet is out of order, stick it on the reassembly queue
+		s->rx_last_ooo_seq = seq_low;
 		if(s->reassembly_q == NULL ||
 		   SEQUENCE_GT(((tcp_header *)cbuf_get_ptr(s->reassembly_q, 0))->seq_num, seq_low)) {
 			// stick it on the head of the queue
@@ -1463,28 +2197,44 @@ static void handle_data(tcp_socket *s, cbuf *buf)
 
 static void tcp_retransmit(tcp_socket *s)
 {
-	cbuf *retransmit_data;
-	int retransmit_len;
-	tcp_flags flags = PKT_PSH | PKT_ACK;
-
 	ASSERT_LOCKED_MUTEX(&s->lock);
 
 	if((s->state != STATE_ESTABLISHED && s->state != STATE_FIN_WAIT_1)
 		|| s->unacked_data_len == 0)
 		return;
 
+	// resend the first unacked segment
+	tcp_retransmit_range(s, s->retransmit_tx_seq, min(s->unacked_data_len, s->mss));
+}
+
+// returns how much was sent
+// NOTE: expects the socket lock to be held
+static int tcp_retransmit_range(tcp_socket *s, uint32 seq, uint32 len)
+{
+	cbuf *retransmit_data;
+
+	ASSERT_LOCKED_MUTEX(&s->lock);
+	ASSERT(SEQUENCE_GTE(seq, s->retransmit_tx_seq));
+
 	// slice off some data to retransmit
-	retransmit_len = min(s->unacked_data_len, s->mss);
-	retransmit_data = cbuf_duplicate_chain(s->write_buffer, 0, retransmit_len, 0);
-	tcp_socket_send(s, retransmit_data, flags, NULL, 0, s->retransmit_tx_seq);
+	retransmit_data = cbuf_duplicate_chain(s->write_buffer, seq - s->retransmit_tx_seq, len, 0);
+	if(retransmit_data == NULL)
+		return 0;
+
+	if(SEQUENCE_GT(seq + len, s->rexmit_high))
+		s->rexmit_high = seq + len;
 
 	if(s->tracking_rtt) {
-		if(SEQUENCE_LTE(s->retransmit_tx_seq, s->rtt_seq)
-			&& SEQUENCE_GTE(s->retransmit_tx_seq + retransmit_len, s->rtt_seq)) {
+		if(SEQUENCE_LTE(seq, s->rtt_seq)
+			&& SEQUENCE_GT(seq + len, s->rtt_seq)) {
 			// Karn sez dont follow this sequence when calculating rtt
 			s->tracking_rtt = false;
 		}
 	}
+
+	tcp_socket_send(s, retransmit_data, PKT_PSH | PKT_ACK, seq);
+
+	return len;
 }
 
 static int tcp_flush_pending_data(tcp_socket *s)
@@ -1498,14 +2248,15 @@ static int tcp_flush_pending_data(tcp_socket *s)
 
 	while(s->write_buffer != NULL
 		&& s->unacked_data_len < cbuf_get_len(s->write_buffer)
-		&& s->unacked_data_len < s->cwnd
+		&& tcp_flight_size(s) < s->cc.cwnd
 		&& s->state == STATE_ESTABLISHED) {
 		size_t send_len;
+		uint32 window;
 		cbuf *packet;
 
-		ASSERT(s->tx_win_high >= s->tx_win_low);
-		ASSERT(s->cwnd >= s->unacked_data_len);
-		send_len = min(min(s->mss, s->tx_win_high - s->tx_win_low), s->cwnd - s->unacked_data_len);
+		// a zero window probe may have gone one past the window
+		window = SEQUENCE_GT(s->tx_win_high, s->tx_win_low) ? s->tx_win_high - s->tx_win_low : 0;
+		send_len = min(min(s->mss, window), s->cc.cwnd - tcp_flight_size(s));
 
 		// XXX take care of silly window
 
@@ -1532,22 +2283,23 @@ static int tcp_flush_pending_data(tcp_socket *s)
 		s->unacked_data_len += send_len;
 		ASSERT(s->unacked_data_len <= cbuf_get_len(s->write_buffer));
 		s->tx_win_low += send_len;
-		if(s->tx_win_low > s->tx_win_high)
-			dump_socket(s);
-		ASSERT(s->tx_win_low <= s->tx_win_high);
 		data_flushed += send_len;
-		if(!s->tracking_rtt) {
-			// track this packet
-			s->tracking_rtt = true;
-			s->rtt_seq = s->tx_win_low - send_len;
-			s->rtt_seq_timestamp = system_time();
+		if(SEQUENCE_GT(s->tx_win_low, s->tx_max_seq)) {
+			// new data, track it for the rtt unless the timestamps take care of that.
+			// data resent after a timeout isn't, as per Karn.
+			if(!s->tracking_rtt && !s->ts_ok) {
+				s->tracking_rtt = true;
+				s->rtt_seq = s->tx_win_low - send_len;
+				s->rtt_seq_timestamp = system_time();
+			}
+			s->tx_max_seq = s->tx_win_low;
 		}
-		tcp_socket_send(s, packet, PKT_ACK, NULL, 0, s->tx_win_low - send_len);
-		s->retransmit_timeout = s->rto;
-		if(cancel_net_timer(&s->retransmit_timer) >= 0)
-			dec_socket_ref(s);
-		if(set_net_timer(&s->retransmit_timer, s->retransmit_timeout, &handle_retransmit_timeout, s, 0) >= 0)
+
+		// start the retransmit timer if it isn't already running
+		if(set_net_timer(&s->retransmit_timer, s->rto, &handle_retransmit_timeout, s, NET_TIMER_PENDING_IGNORE) >= 0)
 			inc_socket_ref(s);
+
+		tcp_socket_send(s, packet, PKT_ACK, s->tx_win_low - send_len);
 	}
 
 	return data_flushed;
@@ -1595,10 +2347,125 @@ error:
 	cbuf_free_chain(buf);
 }
 
-static void tcp_socket_send(tcp_socket *s, cbuf *data, tcp_flags flags, const void *options, uint16 options_length, uint32 sequence)
+// reports the out of order data sitting on the reassembly queue, returns the option's length
+// NOTE: expects the socket lock to be held
+static int tcp_build_sack_option(tcp_socket *s, uint8 *opt, int max_blocks)
 {
+	tcp_sack_block ranges[TCP_SACK_SCOREBOARD_SIZE];
+	tcp_sack_option_block *block;
+	int num_ranges = 0;
+	int first = 0;
+	int count;
+	int i;
+	cbuf *buf;
+
+	// the queue is sorted, merge it into contiguous ranges
+	for(buf = s->reassembly_q; buf; buf = buf->packet_next) {
+		tcp_header *header = (tcp_header *)cbuf_get_ptr(buf, 0);
+		uint32 start = header->seq_num;
+		uint32 end = start + cbuf_get_len(buf) - ((header->length_flags >> 12) & 0xf) * 4;
+
+		if(num_ranges > 0 && SEQUENCE_LTE(start, ranges[num_ranges - 1].end)) {
+			if(SEQUENCE_GT(end, ranges[num_ranges - 1].end))
+				ranges[num_ranges - 1].end = end;
+		} else if(num_ranges < TCP_SACK_SCOREBOARD_SIZE) {
+			ranges[num_ranges].start = start;
+			ranges[num_ranges].end = end;
+			num_ranges++;
+		} else {
+			break;
+		}
+
+		if(SEQUENCE_GTE(s->rx_last_ooo_seq, ranges[num_ranges - 1].start)
+			&& SEQUENCE_LT(s->rx_last_ooo_seq, ranges[num_ranges - 1].end))
+			first = num_ranges - 1;
+	}
+
+	count = min(num_ranges, max_blocks);
+	if(count == 0)
+		return 0;
+
+	opt[0] = TCP_OPT_NOP;
+	opt[1] = TCP_OPT_NOP;
+	opt[2] = TCP_OPT_SACK;
+	opt[3] = 2 + count * sizeof(tcp_sack_option_block);
+	block = (tcp_sack_option_block *)&opt[4];
+
+	// the range with the latest segment goes first, as per rfc 2018
+	block->start = htonl(ranges[first].start);
+	block->end = htonl(ranges[first].end);
+	block++;
+	for(i = 0; i < num_ranges && block < (tcp_sack_option_block *)&opt[4] + count; i++) {
+		if(i == first)
+			continue;
+		block->start = htonl(ranges[i].start);
+		block->end = htonl(ranges[i].end);
+		block++;
+	}
+
+	return 4 + count * sizeof(tcp_sack_option_block);
+}
+
+// builds the options that go out on a segment, returns their length
+// NOTE: expects the socket lock to be held
+static int tcp_build_options(tcp_socket *s, uint8 *opt, tcp_flags flags, bool with_data)
+{
+	int len = 0;
+
+	if(flags & PKT_SYN) {
+		tcp_mss_option *mss_option = (tcp_mss_option *)opt;
+
+		mss_option->kind = TCP_OPT_MSS;
+		mss_option->len = sizeof(tcp_mss_option);
+		mss_option->mss = htons(s->local_mss);
+		len += sizeof(tcp_mss_option);
+
+		if(s->sack_ok) {
+			opt[len++] = TCP_OPT_NOP;
+			opt[len++] = TCP_OPT_NOP;
+			opt[len++] = TCP_OPT_SACK_PERMITTED;
+			opt[len++] = 2;
+		}
+
+		if(s->ws_ok) {
+			tcp_window_scale_option *ws_option;
+
+			opt[len++] = TCP_OPT_NOP;
+			ws_option = (tcp_window_scale_option *)&opt[len];
+			ws_option->kind = TCP_OPT_WINDOW_SCALE;
+			ws_option->len = sizeof(tcp_window_scale_option);
+			ws_option->shift_count = s->rx_win_shift;
+			len += sizeof(tcp_window_scale_option);
+		}
+	}
+
+	if(s->ts_ok) {
+		tcp_timestamp_option *ts_option;
+
+		opt[len++] = TCP_OPT_NOP;
+		opt[len++] = TCP_OPT_NOP;
+		ts_option = (tcp_timestamp_option *)&opt[len];
+		ts_option->kind = TCP_OPT_TIMESTAMP;
+		ts_option->len = sizeof(tcp_timestamp_option);
+		ts_option->ts_val = htonl(tcp_timestamp());
+		ts_option->ts_ecr = htonl((flags & PKT_ACK) ? s->ts_recent : 0);
+		len += sizeof(tcp_timestamp_option);
+	}
+
+	// only pure acks carry SACKs, so a full sized segment never goes over the mss
+	if(s->sack_ok && s->reassembly_q != NULL && !(flags & PKT_SYN) && !with_data)
+		len += tcp_build_sack_option(s, &opt[len], (TCP_MAX_OPTIONS_LEN - len - 4) / sizeof(tcp_sack_option_block));
+
+	return len;
+}
+
+static void tcp_socket_send(tcp_socket *s, cbuf *data, tcp_flags flags, uint32 sequence)
+{
+	uint8 options[TCP_MAX_OPTIONS_LEN];
+	int options_length;
 	uint32 rx_win_high;
-	uint16 win_size;
+	uint32 win_size;
+	uint32 ack;
 
 	ASSERT_LOCKED_MUTEX(&s->lock);
 
@@ -1618,14 +2485,25 @@ static void tcp_socket_send(tcp_socket *s, cbuf *data, tcp_flags flags, const vo
 		win_size = s->rx_win_high - s->rx_win_low;
 	}
 
+	// the window field is 16 bits, and only gets scaled once the SYNs are out of the way
+	if(flags & PKT_SYN)
+		win_size = min(win_size, (uint32)0xffff);
+	else
+		win_size = min(win_size >> s->rx_win_shift, (uint32)0xffff);
+
+	ack = s->rx_win_low;
+
 	// we are piggybacking a pending ACK, so clear the delayed ACK timer
 	if(flags & PKT_ACK) {
 		if(cancel_net_timer(&s->ack_delay_timer) == 0)
 			dec_socket_ref(s);
+		s->rx_acked_seq = ack;
 	}
 
+	options_length = tcp_build_options(s, options, flags, data != NULL);
+
 	mutex_unlock(&s->lock);
-	tcp_send(s->remote_addr, s->remote_port, s->local_addr, s->local_port, data, flags, s->rx_win_low,
+	tcp_send(s->remote_addr, s->remote_port, s->local_addr, s->local_port, data, flags, ack,
 			options, options_length, sequence, win_size);
 	mutex_lock(&s->lock);
 }
@@ -1651,6 +2529,8 @@ static void tcp_remote_close(tcp_socket *s)
 	s->last_error = ERR_NET_REMOTE_CLOSE;
 	s->state = STATE_CLOSED;
 
+	wait_object_notify(&s->waiters, WAIT_EVENT_READ | WAIT_EVENT_ERROR);
+
 	dec_socket_ref(s);
 }
 
@@ -1662,11 +2542,17 @@ int tcp_init(void)
 	if(!socket_table)
 		return ERR_NO_MEMORY;
 
+	socket_cache = slab_cache_create("tcp_socket", sizeof(tcp_socket), 0, 0);
+	if(!socket_cache)
+		return ERR_NO_MEMORY;
+
 	next_ephemeral_port = rand() % 32000 + 1024;
 
 	dbg_add_command(&dump_socket_info, "tcp_socket", "dump info about socket at address");
 	dbg_add_command(&list_sockets, "tcp_sockets", "list all active tcp sockets");
 
+	tcp_cc_module_init();
+
 	return 0;
 }
 
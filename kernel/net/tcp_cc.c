@@ -0,0 +1,232 @@
+/*
+** Copyright 2001-2006, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/debug.h>
+#include <kernel/time.h>
+#include <kernel/net/tcp_cc.h>
+#include <string.h>
+
+/* cubic constants, in tenths */
+#define CUBIC_BETA 7 // the window is cut to 0.7 on a loss
+#define CUBIC_C 4    // 0.4 segments/sec^3
+#define CUBIC_MAX_T 60000 // msecs, the curve is cut off here, well past any real window
+
+static uint32 initial_window(uint32 mss)
+{
+	// as per rfc 3390
+	return min(4 * mss, max(2 * mss, 4380));
+}
+
+static void slow_start(tcp_cc *cc, uint32 acked)
+{
+	// appropriate byte counting, with the rfc 3465 limit of 2 segments per ack
+	cc->cwnd += min(acked, 2 * cc->mss);
+}
+
+static void newreno_init(tcp_cc *cc)
+{
+	cc->bytes_acked = 0;
+}
+
+static void newreno_ack(tcp_cc *cc, uint32 acked, bigtime_t srtt)
+{
+	if(cc->cwnd < cc->ssthresh) {
+		slow_start(cc, acked);
+		return;
+	}
+
+	// congestion avoidance, a segment per window's worth of acked data
+	cc->bytes_acked += acked;
+	if(cc->bytes_acked >= cc->cwnd) {
+		cc->bytes_acked -= cc->cwnd;
+		cc->cwnd += cc->mss;
+	}
+}
+
+static uint32 newreno_loss(tcp_cc *cc, uint32 flight_size)
+{
+	cc->bytes_acked = 0;
+	return max(flight_size / 2, 2 * cc->mss);
+}
+
+static void newreno_timeout(tcp_cc *cc)
+{
+	cc->bytes_acked = 0;
+}
+
+static const tcp_cc_ops newreno_ops = {
+	"newreno",
+	&newreno_init,
+	&newreno_ack,
+	&newreno_loss,
+	&newreno_timeout
+};
+
+static uint32 cube_root(uint64 a)
+{
+	uint32 x = 0;
+	int b;
+
+	// a bit at a time from the top, a is always well under 2^60
+	for(b = 20; b >= 0; b--) {
+		uint64 y = x | (1 << b);
+		if(y * y * y <= a)
+			x = y;
+	}
+
+	return x;
+}
+
+static void cubic_init(tcp_cc *cc)
+{
+	cc->w_max = 0;
+	cc->w_last_max = 0;
+	cc->w_est = 0;
+	cc->k = 0;
+	cc->epoch_start = 0;
+}
+
+static void cubic_ack(tcp_cc *cc, uint32 acked, bigtime_t srtt)
+{
+	bigtime_t now;
+	int64 t;
+	int64 target;
+
+	if(cc->cwnd < cc->ssthresh) {
+		slow_start(cc, acked);
+		return;
+	}
+
+	now = system_time();
+	if(cc->epoch_start == 0) {
+		// first ack since the last loss, start a new epoch
+		cc->epoch_start = now;
+		cc->w_est = cc->cwnd;
+		if(cc->cwnd < cc->w_max) {
+			// K = cbrt((w_max - cwnd) / C), in msecs
+			cc->k = cube_root((uint64)(cc->w_max - cc->cwnd) * 10 * 1000000000 / (CUBIC_C * cc->mss));
+		} else {
+			cc->k = 0;
+			cc->w_max = cc->cwnd;
+		}
+	}
+
+	// where the cubic curve puts the window an rtt from now
+	t = (now - cc->epoch_start + srtt) / 1000 - cc->k;
+	if(t > CUBIC_MAX_T)
+		t = CUBIC_MAX_T;
+	else if(t < -CUBIC_MAX_T)
+		t = -CUBIC_MAX_T;
+	// the cube is taken in thousandths of a segment and only then scaled by the
+	// mss, t^3 * mss runs out of int64 at about 33 secs with a loopback mss
+	target = (int64)cc->w_max + t * t * t * CUBIC_C / 10000000 * cc->mss / 1000;
+
+	// stay at least as aggressive as reno would be, which grows
+	// 3 * (1 - beta) / (1 + beta) segments per rtt
+	cc->w_est += (uint64)acked * cc->mss * 3 * (10 - CUBIC_BETA) / ((10 + CUBIC_BETA) * (uint64)cc->cwnd);
+	if(target < cc->w_est)
+		target = cc->w_est;
+
+	if(target > cc->cwnd) {
+		if(target > cc->cwnd + cc->cwnd / 2)
+			target = cc->cwnd + cc->cwnd / 2;
+		// spread the climb to the target over the next window's worth of acks
+		cc->cwnd += (uint64)(target - cc->cwnd) * acked / cc->cwnd;
+	}
+}
+
+static uint32 cubic_loss(tcp_cc *cc, uint32 flight_size)
+{
+	cc->epoch_start = 0;
+	cc->bytes_acked = 0;
+
+	// fast convergence, let go of some bandwidth if the last loss came at a smaller window
+	if(cc->cwnd < cc->w_last_max) {
+		cc->w_last_max = cc->cwnd;
+		cc->w_max = cc->cwnd * (10 + CUBIC_BETA) / 20;
+	} else {
+		cc->w_last_max = cc->cwnd;
+		cc->w_max = cc->cwnd;
+	}
+
+	return max(cc->cwnd * CUBIC_BETA / 10, 2 * cc->mss);
+}
+
+static void cubic_timeout(tcp_cc *cc)
+{
+	cc->epoch_start = 0;
+	cc->w_est = 0;
+}
+
+static const tcp_cc_ops cubic_ops = {
+	"cubic",
+	&cubic_init,
+	&cubic_ack,
+	&cubic_loss,
+	&cubic_timeout
+};
+
+static const tcp_cc_ops *cc_algorithms[] = {
+	&newreno_ops,
+	&cubic_ops,
+	NULL
+};
+
+// what new sockets get
+static const tcp_cc_ops *default_ops = &cubic_ops;
+
+void tcp_cc_init(tcp_cc *cc, uint32 mss)
+{
+	memset(cc, 0, sizeof(tcp_cc));
+
+	cc->ops = default_ops;
+	cc->mss = mss;
+	cc->cwnd = initial_window(mss);
+	cc->ssthresh = 0xffffffff;
+	cc->ops->init(cc);
+}
+
+void tcp_cc_set_mss(tcp_cc *cc, uint32 mss)
+{
+	// only happens while the connection is being set up, nothing has been sent yet
+	cc->mss = mss;
+	cc->cwnd = initial_window(mss);
+}
+
+void tcp_cc_dump(tcp_cc *cc)
+{
+	dprintf("\tcc %s cwnd %u ssthresh %u bytes_acked %u\n", cc->ops->name, cc->cwnd, cc->ssthresh, cc->bytes_acked);
+	if(cc->ops == &cubic_ops)
+		dprintf("\tcubic w_max %u w_last_max %u w_est %u k %u epoch_start %Ld\n",
+			cc->w_max, cc->w_last_max, cc->w_est, cc->k, cc->epoch_start);
+}
+
+static void dbg_tcp_cc(int argc, char **argv)
+{
+	int i;
+
+	if(argc >= 2) {
+		for(i = 0; cc_algorithms[i]; i++) {
+			if(!strcmp(argv[1], cc_algorithms[i]->name)) {
+				default_ops = cc_algorithms[i];
+				break;
+			}
+		}
+		if(!cc_algorithms[i])
+			dprintf("tcp_cc: unknown algorithm '%s'\n", argv[1]);
+	}
+
+	dprintf("tcp congestion control algorithms:\n");
+	for(i = 0; cc_algorithms[i]; i++)
+		dprintf("\t%s%s\n", cc_algorithms[i]->name, cc_algorithms[i] == default_ops ? " (default)" : "");
+}
+
+int tcp_cc_module_init(void)
+{
+	dbg_add_command(&dbg_tcp_cc, "tcp_cc", "list the tcp congestion control algorithms, or pick the one new sockets use");
+
+	return 0;
+}
+
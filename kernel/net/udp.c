@@ -9,6 +9,7 @@
 #include <kernel/heap.h>
 #include <kernel/khash.h>
 #include <kernel/sem.h>
+#include <kernel/wait_set.h>
 #include <kernel/arch/cpu.h>
 #include <kernel/net/udp.h>
 #include <kernel/net/ipv4.h>
@@ -54,6 +55,7 @@ typedef struct udp_endpoint {
 	uint16 port;
 	udp_queue q;
 	int ref_count;
+	struct wait_object waiters;
 } udp_endpoint;
 
 static udp_endpoint *endpoints;
@@ -212,6 +214,7 @@ int udp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 
 	mutex_lock(&e->lock);
 	udp_queue_push(&e->q, qe);
+	wait_object_notify(&e->waiters, WAIT_EVENT_READ);
 	mutex_unlock(&e->lock);
 
 	sem_release(e->blocking_sem, 1);
@@ -240,6 +243,7 @@ int udp_open(void **prot_data)
 	e->port = 0;
 	e->ref_count = 1;
 	udp_init_queue(&e->q);
+	wait_object_init(&e->waiters);
 
 	mutex_lock(&endpoints_lock);
 	hash_insert(endpoints, e);
@@ -368,6 +372,25 @@ out:
 	return ret;
 }
 
+int udp_poll(void *prot_data, struct wait_watch *watch)
+{
+	udp_endpoint *e = prot_data;
+	int events;
+
+	mutex_lock(&e->lock);
+
+	wait_object_attach(&e->waiters, watch);
+
+	// sends never block
+	events = WAIT_EVENT_WRITE;
+	if(e->q.count > 0)
+		events |= WAIT_EVENT_READ;
+
+	mutex_unlock(&e->lock);
+
+	return events;
+}
+
 ssize_t udp_sendto(void *prot_data, const void *inbuf, ssize_t len, sockaddr *toaddr)
 {
 	udp_endpoint *e = prot_data;
@@ -10,16 +10,21 @@
 #include <kernel/debug.h>
 #include <kernel/heap.h>
 #include <kernel/vm.h>
+#include <kernel/smp.h>
+#include <kernel/time.h>
 #include <kernel/cbuf.h>
+#include <kernel/id_table.h>
+#include <kernel/wait_set.h>
 #include <newos/errors.h>
 
 #include <string.h>
 #include <stdlib.h>
 
 struct port_msg {
-	int		msg_code;
-	cbuf*	data_cbuf;
-	size_t	data_len;
+	int			msg_code;
+	cbuf*		data_cbuf;
+	region_id	data_region;	// PORT_FLAG_REMAP messages, pages parked in the kernel aspace
+	size_t		data_len;
 };
 
 struct port_entry {
@@ -35,6 +40,8 @@ struct port_entry {
 	int					total_count;
 	bool				closed;
 	struct port_msg*	msg_queue;
+	struct id_table_link slot_link;
+	struct wait_object	waiters;	// wait set watches, these outlive the port in the slot
 };
 
 // internal API
@@ -43,41 +50,45 @@ static void _dump_port_info(struct port_entry *port);
 static void dump_port_info(int argc, char **argv);
 
 
-// MAX_PORTS must be power of 2
-#define MAX_PORTS 4096
+// the table starts out at PORT_TABLE_INITIAL entries and grows a chunk at a time
+// MAX_PORTS and PORT_TABLE_CHUNK must be powers of 2
+#define MAX_PORTS 32768
+#define PORT_TABLE_INITIAL 4096
+#define PORT_TABLE_CHUNK 512
 #define MAX_QUEUE_LENGTH 4096
 #define PORT_MAX_MESSAGE_SIZE 65536
 
-static struct port_entry *ports = NULL;
-static region_id port_region = 0;
-static bool ports_active = false;
+// PORT_FLAG_REMAP messages at least this big move their pages instead of being copied
+#define PORT_REMAP_THRESHOLD (16*1024)
 
-static port_id next_port = 0;
+static void *port_table = NULL;
+static bool ports_active = false;
 
-static int port_spinlock = 0;
-#define GRAB_PORT_LIST_LOCK() acquire_spinlock(&port_spinlock)
-#define RELEASE_PORT_LIST_LOCK() release_spinlock(&port_spinlock)
 #define GRAB_PORT_LOCK(s) acquire_spinlock(&(s).lock)
 #define RELEASE_PORT_LOCK(s) release_spinlock(&(s).lock)
 
-int port_init(kernel_args *ka)
+static void port_init_entry(void *e)
 {
-	int i;
-	int sz;
+	((struct port_entry *)e)->id = -1;
+	wait_object_init(&((struct port_entry *)e)->waiters);
+}
 
-	sz = sizeof(struct port_entry) * MAX_PORTS;
+// gives back a read or write slot and tells wait sets watching the port
+static void port_release_sem(struct port_entry *port, sem_id sem, int events)
+{
+	sem_release(sem, 1);
+	wait_object_notify(&port->waiters, events);
+}
 
-	// create and initialize semaphore table
-	port_region = vm_create_anonymous_region(vm_get_kernel_aspace_id(), "port_table", (void **)&ports,
-		REGION_ADDR_ANY_ADDRESS, sz, REGION_WIRING_WIRED, LOCK_RW|LOCK_KERNEL);
-	if(port_region < 0) {
+int port_init(kernel_args *ka)
+{
+	// create and initialize port table
+	port_table = id_table_create("port", sizeof(struct port_entry), offsetof(struct port_entry, slot_link),
+		PORT_TABLE_CHUNK, PORT_TABLE_INITIAL, MAX_PORTS, &port_init_entry);
+	if(port_table == NULL || id_table_capacity(port_table) < PORT_TABLE_INITIAL) {
 		panic("unable to allocate kernel port table!\n");
 	}
 
-	memset(ports, 0, sz);
-	for(i=0; i<MAX_PORTS; i++)
-		ports[i].id = -1;
-
 	// add debugger commands
 	dbg_add_command(&dump_port_list, "ports", "Dump a list of all active ports");
 	dbg_add_command(&dump_port_info, "port", "Dump info about a particular port");
@@ -89,13 +100,16 @@ int port_init(kernel_args *ka)
 
 void dump_port_list(int argc, char **argv)
 {
-	int i;
+	unsigned int i;
+	struct port_entry *port;
 
-	for(i=0; i<MAX_PORTS; i++) {
-		if(ports[i].id >= 0) {
-			dprintf("%p\tid: 0x%x\t\tname: '%s'\n", &ports[i], ports[i].id, ports[i].name);
+	for(i=0; i<id_table_capacity(port_table); i++) {
+		port = id_table_lookup(port_table, i);
+		if(port->id >= 0) {
+			dprintf("%p\tid: 0x%x\t\tname: '%s'\n", port, port->id, port->name);
 		}
 	}
+	id_table_dump(port_table);
 }
 
 static void _dump_port_info(struct port_entry *port)
@@ -115,7 +129,8 @@ static void _dump_port_info(struct port_entry *port)
 
 static void dump_port_info(int argc, char **argv)
 {
-	int i;
+	unsigned int i;
+	struct port_entry *port;
 
 	if(argc < 2) {
 		dprintf("port: not enough arguments\n");
@@ -132,21 +147,22 @@ static void dump_port_info(int argc, char **argv)
 			_dump_port_info((struct port_entry *)num);
 			return;
 		} else {
-			unsigned slot = num % MAX_PORTS;
-			if(ports[slot].id != (int)num) {
+			port = id_table_lookup(port_table, num);
+			if(port == NULL || port->id != (int)num) {
 				dprintf("port 0x%lx doesn't exist!\n", num);
 				return;
 			}
-			_dump_port_info(&ports[slot]);
+			_dump_port_info(port);
 			return;
 		}
 	}
 
 	// walk through the ports list, trying to match name
-	for(i=0; i<MAX_PORTS; i++) {
-		if (ports[i].name != NULL)
-			if(strcmp(argv[1], ports[i].name) == 0) {
-				_dump_port_info(&ports[i]);
+	for(i=0; i<id_table_capacity(port_table); i++) {
+		port = id_table_lookup(port_table, i);
+		if (port->name != NULL)
+			if(strcmp(argv[1], port->name) == 0) {
+				_dump_port_info(port);
 				return;
 			}
 	}
@@ -155,9 +171,10 @@ static void dump_port_info(int argc, char **argv)
 port_id
 port_create(int32 queue_length, const char *name)
 {
-	int 	i;
+	struct port_entry *port;
+	int		i;
 	sem_id 	sem_r, sem_w;
-	port_id retval;
+	port_id id;
 	char 	*temp_name;
 	int 	name_len;
 	void 	*q;
@@ -190,6 +207,10 @@ port_create(int32 queue_length, const char *name)
 		kfree(temp_name); // dealloc name, too
 		return ERR_NO_MEMORY;
 	}
+	for (i = 0; i < queue_length; i++) {
+		((struct port_msg *)q)[i].data_cbuf = NULL;
+		((struct port_msg *)q)[i].data_region = -1;
+	}
 
 	// create sem_r with owner set to -1
 	sem_r = sem_create_etc(0, temp_name, -1);
@@ -211,92 +232,81 @@ port_create(int32 queue_length, const char *name)
 	}
 	owner = proc_get_current_proc_id();
 
-	int_disable_interrupts();
-	GRAB_PORT_LIST_LOCK();
-
-	// find the first empty spot
-	for(i=0; i<MAX_PORTS; i++) {
-		if(ports[i].id == -1) {
-			// make the port_id be a multiple of the slot it's in
-			if(i >= next_port % MAX_PORTS) {
-				next_port += i - next_port % MAX_PORTS;
-			} else {
-				next_port += MAX_PORTS - (next_port % MAX_PORTS - i);
-			}
-			ports[i].id		= next_port++;
-			ports[i].lock	= 0;
-			GRAB_PORT_LOCK(ports[i]);
-			RELEASE_PORT_LIST_LOCK();
-
-			ports[i].capacity	= queue_length;
-			ports[i].name 		= temp_name;
-
-			// assign sem
-			ports[i].read_sem	= sem_r;
-			ports[i].write_sem	= sem_w;
-			ports[i].msg_queue	= q;
-			ports[i].head 		= 0;
-			ports[i].tail 		= 0;
-			ports[i].total_count= 0;
-			ports[i].owner 		= owner;
-			retval = ports[i].id;
-			RELEASE_PORT_LOCK(ports[i]);
-			goto out;
-		}
+	// grab a free slot, the id encodes the slot it's in
+	id = id_table_alloc(port_table);
+	if(id < 0) {
+		dprintf("port_create(): ERR_PORT_OUT_OF_SLOTS\n");
+
+		// cleanup
+		sem_delete(sem_w);
+		sem_delete(sem_r);
+		kfree(temp_name);
+		kfree(q);
+		return (id == ERR_NO_MORE_HANDLES) ? ERR_PORT_OUT_OF_SLOTS : id;
 	}
-	// not enough ports...
-	RELEASE_PORT_LIST_LOCK();
-	kfree(q);
-	kfree(temp_name);
-	retval = ERR_PORT_OUT_OF_SLOTS;
-	dprintf("port_create(): ERR_PORT_OUT_OF_SLOTS\n");
-
-	// cleanup
-	sem_delete(sem_w);
-	sem_delete(sem_r);
-	kfree(temp_name);
-	kfree(q);
+	port = id_table_lookup(port_table, id);
 
-out:
+	int_disable_interrupts();
+	GRAB_PORT_LOCK(*port);
+
+	port->capacity		= queue_length;
+	port->name 			= temp_name;
+
+	// assign sem
+	port->read_sem		= sem_r;
+	port->write_sem		= sem_w;
+	port->msg_queue		= q;
+	port->head 			= 0;
+	port->tail 			= 0;
+	port->total_count	= 0;
+	port->closed		= false;
+	port->owner 		= owner;
+	port->id			= id;
+
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
-	return retval;
+	return id;
 }
 
 int
 port_close(port_id id)
 {
-	int		slot;
+	struct port_entry *port;
 
 	if(ports_active == false)
 		return ERR_PORT_NOT_ACTIVE;
 	if(id < 0)
 		return ERR_INVALID_HANDLE;
-	slot = id % MAX_PORTS;
+	port = id_table_lookup(port_table, id);
+	if(port == NULL)
+		return ERR_INVALID_HANDLE;
 
 	// walk through the sem list, trying to match name
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if (ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if (port->id != id) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		return ERR_INVALID_HANDLE;
 	}
 
 	// mark port to disable writing
-	ports[slot].closed = true;
+	port->closed = true;
 
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
+	wait_object_notify(&port->waiters, WAIT_EVENT_ERROR);
+
 	return NO_ERROR;
 }
 
 int
 port_delete(port_id id)
 {
-	int slot;
+	struct port_entry *port;
 	sem_id	r_sem, w_sem;
 	int capacity;
 	int i;
@@ -309,34 +319,43 @@ port_delete(port_id id)
 	if(id < 0)
 		return ERR_INVALID_HANDLE;
 
-	slot = id % MAX_PORTS;
+	port = id_table_lookup(port_table, id);
+	if(port == NULL)
+		return ERR_INVALID_HANDLE;
 
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if(port->id != id) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		dprintf("port_delete: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
 	/* mark port as invalid */
-	ports[slot].id	 = -1;
-	old_name 		 = ports[slot].name;
-	q				 = ports[slot].msg_queue;
-	r_sem			 = ports[slot].read_sem;
-	w_sem			 = ports[slot].write_sem;
-	capacity		 = ports[slot].capacity;
-	ports[slot].name = NULL;
-
-	RELEASE_PORT_LOCK(ports[slot]);
+	port->id		 = -1;
+	old_name 		 = port->name;
+	q				 = port->msg_queue;
+	r_sem			 = port->read_sem;
+	w_sem			 = port->write_sem;
+	capacity		 = port->capacity;
+	port->name		 = NULL;
+
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
-	// delete the cbuf's that are left in the queue (if any)
+	wait_object_detach_all(&port->waiters);
+
+	// the slot can be handed out again now
+	id_table_free(port_table, id);
+
+	// delete the cbuf's and remapped pages that are left in the queue (if any)
 	for (i=0; i<capacity; i++) {
 		if (q[i].data_cbuf != NULL)
 	 		cbuf_free_chain(q[i].data_cbuf);
+		if (q[i].data_region >= 0)
+			vm_delete_region(vm_get_kernel_aspace_id(), q[i].data_region);
 	}
 
 	kfree(q);
@@ -353,7 +372,9 @@ port_delete(port_id id)
 port_id
 port_find(const char *port_name)
 {
-	int i;
+	unsigned int i;
+	unsigned int capacity;
+	struct port_entry *port;
 	int ret_val = ERR_INVALID_HANDLE;
 
 	if(ports_active == false)
@@ -361,23 +382,25 @@ port_find(const char *port_name)
 	if(port_name == NULL)
 		return ERR_INVALID_HANDLE;
 
-	// lock list of ports
+	// the table only ever grows, slots past this didn't exist when we started
+	capacity = id_table_capacity(port_table);
+
 	int_disable_interrupts();
-	GRAB_PORT_LIST_LOCK();
 
-	// loop over list
-	for(i=0; i<MAX_PORTS; i++) {
+	// loop over the table
+	for(i=0; i<capacity; i++) {
+		port = id_table_lookup(port_table, i);
+
 		// lock every individual port before comparing
-		GRAB_PORT_LOCK(ports[i]);
-		if(ports[i].id >= 0 && strcmp(port_name, ports[i].name) == 0) {
-			ret_val = ports[i].id;
-			RELEASE_PORT_LOCK(ports[i]);
+		GRAB_PORT_LOCK(*port);
+		if(port->id >= 0 && strcmp(port_name, port->name) == 0) {
+			ret_val = port->id;
+			RELEASE_PORT_LOCK(*port);
 			break;
 		}
-		RELEASE_PORT_LOCK(ports[i]);
+		RELEASE_PORT_LOCK(*port);
 	}
 
-	RELEASE_PORT_LIST_LOCK();
 	int_restore_interrupts();
 
 	return ret_val;
@@ -386,7 +409,7 @@ port_find(const char *port_name)
 int
 port_get_info(port_id id, struct port_info *info)
 {
-	int slot;
+	struct port_entry *port;
 
 	if(ports_active == false)
 		return ERR_PORT_NOT_ACTIVE;
@@ -395,27 +418,29 @@ port_get_info(port_id id, struct port_info *info)
 	if(id < 0)
 		return ERR_INVALID_HANDLE;
 
-	slot = id % MAX_PORTS;
+	port = id_table_lookup(port_table, id);
+	if(port == NULL)
+		return ERR_INVALID_HANDLE;
 
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if(port->id != id) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		dprintf("port_get_info: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
 	// fill a port_info struct with info
-	info->id			= ports[slot].id;
-	info->owner 		= ports[slot].owner;
-	strncpy(info->name, ports[slot].name, min(strlen(ports[slot].name),SYS_MAX_OS_NAME_LEN-1));
-	info->capacity		= ports[slot].capacity;
-	sem_get_count(ports[slot].read_sem, &info->queue_count);
-	info->total_count	= ports[slot].total_count;
-
-	RELEASE_PORT_LOCK(ports[slot]);
+	info->id			= port->id;
+	info->owner 		= port->owner;
+	strncpy(info->name, port->name, min(strlen(port->name),SYS_MAX_OS_NAME_LEN-1));
+	info->capacity		= port->capacity;
+	sem_get_count(port->read_sem, &info->queue_count);
+	info->total_count	= port->total_count;
+
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
 	// from our port_entry
@@ -427,7 +452,9 @@ port_get_next_port_info(proc_id proc,
 						uint32 *cookie,
 						struct port_info *info)
 {
-	int slot;
+	unsigned int slot;
+	unsigned int capacity;
+	struct port_entry *port;
 
 	if(ports_active == false)
 		return ERR_PORT_NOT_ACTIVE;
@@ -444,31 +471,32 @@ port_get_next_port_info(proc_id proc,
 			return ERR_INVALID_HANDLE;
 	}
 
-	// spinlock
+	// the table only ever grows, so anything past this was created after we started
+	capacity = id_table_capacity(port_table);
+
 	int_disable_interrupts();
-	GRAB_PORT_LIST_LOCK();
 
 	info->id = -1; // used as found flag
-	while (slot < MAX_PORTS) {
-		GRAB_PORT_LOCK(ports[slot]);
-		if (ports[slot].id != -1)
-			if (ports[slot].owner == proc) {
+	while (slot < capacity) {
+		port = id_table_lookup(port_table, slot);
+		GRAB_PORT_LOCK(*port);
+		if (port->id != -1)
+			if (port->owner == proc) {
 				// found one!
 				// copy the info
-				info->id			= ports[slot].id;
-				info->owner 		= ports[slot].owner;
-				strncpy(info->name, ports[slot].name, min(strlen(ports[slot].name),SYS_MAX_OS_NAME_LEN-1));
-				info->capacity		= ports[slot].capacity;
-				sem_get_count(ports[slot].read_sem, &info->queue_count);
-				info->total_count	= ports[slot].total_count;
-				RELEASE_PORT_LOCK(ports[slot]);
+				info->id			= port->id;
+				info->owner 		= port->owner;
+				strncpy(info->name, port->name, min(strlen(port->name),SYS_MAX_OS_NAME_LEN-1));
+				info->capacity		= port->capacity;
+				sem_get_count(port->read_sem, &info->queue_count);
+				info->total_count	= port->total_count;
+				RELEASE_PORT_LOCK(*port);
 				slot++;
 				break;
 			}
-		RELEASE_PORT_LOCK(ports[slot]);
+		RELEASE_PORT_LOCK(*port);
 		slot++;
 	}
-	RELEASE_PORT_LIST_LOCK();
 	int_restore_interrupts();
 
 	if (info->id == -1)
@@ -488,7 +516,7 @@ port_buffer_size_etc(port_id id,
 					uint32 flags,
 					bigtime_t timeout)
 {
-	int slot;
+	struct port_entry *port;
 	int res;
 	int t;
 	int len;
@@ -498,18 +526,20 @@ port_buffer_size_etc(port_id id,
 	if(id < 0)
 		return ERR_INVALID_HANDLE;
 
-	slot = id % MAX_PORTS;
+	port = id_table_lookup(port_table, id);
+	if(port == NULL)
+		return ERR_INVALID_HANDLE;
 
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if(port->id != id) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		dprintf("port_get_info: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
 	// block if no message,
@@ -518,16 +548,16 @@ port_buffer_size_etc(port_id id,
 	// XXX - is it a race condition to acquire a sem just after we
 	// unlocked the port ?
 	// XXX: call an acquire_sem which does the release lock, restore int & block the right way
-	res = sem_acquire_etc(ports[slot].read_sem, 1, flags & (SEM_FLAG_TIMEOUT | SEM_FLAG_INTERRUPTABLE), timeout, NULL);
+	res = sem_acquire_etc(port->read_sem, 1, flags & (SEM_FLAG_TIMEOUT | SEM_FLAG_INTERRUPTABLE), timeout, NULL);
 
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 	if (res == ERR_SEM_DELETED) {
 		// somebody deleted the port
-		RELEASE_PORT_LOCK(ports[slot]);
+		RELEASE_PORT_LOCK(*port);
 		return ERR_PORT_DELETED;
 	}
 	if (res == ERR_SEM_TIMED_OUT) {
-		RELEASE_PORT_LOCK(ports[slot]);
+		RELEASE_PORT_LOCK(*port);
 		return ERR_PORT_TIMED_OUT;
 	}
 
@@ -535,26 +565,69 @@ port_buffer_size_etc(port_id id,
 
 	// determine tail
 	// read data's head length
-	t = ports[slot].head;
+	t = port->head;
 	if (t < 0)
-		panic("port %id: tail < 0", ports[slot].id);
-	if (t > ports[slot].capacity)
-		panic("port %id: tail > cap %d", ports[slot].id, ports[slot].capacity);
-	len = ports[slot].msg_queue[t].data_len;
+		panic("port %id: tail < 0", port->id);
+	if (t > port->capacity)
+		panic("port %id: tail > cap %d", port->id, port->capacity);
+	len = port->msg_queue[t].data_len;
 
 	// restore readsem
-	sem_release(ports[slot].read_sem, 1);
+	sem_release(port->read_sem, 1);
 
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
 
 	// return length of item at end of queue
 	return len;
 }
 
+int
+port_poll(port_id id, struct wait_watch *watch)
+{
+	struct port_entry *port;
+	int32 count;
+	int events = 0;
+
+	if(ports_active == false)
+		return ERR_PORT_NOT_ACTIVE;
+	if(id < 0)
+		return ERR_INVALID_HANDLE;
+
+	port = id_table_lookup(port_table, id);
+	if(port == NULL)
+		return ERR_INVALID_HANDLE;
+
+	int_disable_interrupts();
+	GRAB_PORT_LOCK(*port);
+
+	if(port->id != id) {
+		RELEASE_PORT_LOCK(*port);
+		int_restore_interrupts();
+		return ERR_INVALID_HANDLE;
+	}
+
+	wait_object_attach(&port->waiters, watch);
+
+	sem_get_count(port->read_sem, &count);
+	if(count > 0)
+		events |= WAIT_EVENT_READ;
+	else if(port->closed)
+		events |= WAIT_EVENT_ERROR;	// nothing left to read and nothing more coming
+
+	sem_get_count(port->write_sem, &count);
+	if(count > 0 && !port->closed)
+		events |= WAIT_EVENT_WRITE;
+
+	RELEASE_PORT_LOCK(*port);
+	int_restore_interrupts();
+
+	return events;
+}
+
 int32
 port_count(port_id id)
 {
-	int slot;
+	struct port_entry *port;
 	int count;
 
 	if(ports_active == false)
@@ -562,30 +635,101 @@ port_count(port_id id)
 	if(id < 0)
 		return ERR_INVALID_HANDLE;
 
-	slot = id % MAX_PORTS;
+	port = id_table_lookup(port_table, id);
+	if(port == NULL)
+		return ERR_INVALID_HANDLE;
 
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if(port->id != id) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		dprintf("port_count: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
-	sem_get_count(ports[slot].read_sem, &count);
+	sem_get_count(port->read_sem, &count);
 	// do not return negative numbers
 	if (count < 0)
 		count = 0;
 
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
 	// return count of messages (sem_count)
 	return count;
 }
 
+// a PORT_FLAG_REMAP buffer has to be the start of one of the caller's regions,
+// the whole region goes along with the message
+static region_id port_remap_source(void *msg_buffer, size_t buffer_size)
+{
+	vm_region_info info;
+	region_id rid;
+	int err;
+
+	rid = vm_find_region_by_address(vm_get_current_user_aspace_id(), (addr_t)msg_buffer);
+	if(rid < 0)
+		return ERR_VM_BAD_USER_MEMORY;
+
+	err = vm_get_region_info(rid, &info);
+	if(err < 0)
+		return err;
+
+	if(info.base != (addr_t)msg_buffer || buffer_size > info.size)
+		return ERR_INVALID_ARGS;
+
+	return rid;
+}
+
+// only big messages out of private anonymous memory have their pages moved.
+// anything else, a file mapping, text, or memory shared with someone else,
+// would end up shared with the reader, so it's copied like any other message.
+static bool port_can_remap(region_id src_region, size_t buffer_size)
+{
+	return buffer_size >= PORT_REMAP_THRESHOLD && vm_region_is_private_anonymous(src_region);
+}
+
+// hand a message to a PORT_FLAG_REMAP reader as a region in its address space
+static int port_remap_to_user(region_id msg_region, cbuf *msg_store, size_t len, region_id *uregion)
+{
+	void *address;
+	region_id rid;
+	int err;
+
+	if(msg_region >= 0) {
+		// move the parked pages over. The writer may have mapped them again
+		// since we looked, so the reader only gets to look at them.
+		rid = vm_clone_region(vm_get_current_user_aspace_id(), "port_msg", &address,
+			REGION_ADDR_ANY_ADDRESS, msg_region, REGION_NO_PRIVATE_MAP, LOCK_RO);
+		vm_delete_region(vm_get_kernel_aspace_id(), msg_region);
+		if(rid < 0)
+			return rid;
+	} else {
+		// it was small enough to be copied, the reader still gets a region
+		rid = vm_create_anonymous_region(vm_get_current_user_aspace_id(), "port_msg", &address,
+			REGION_ADDR_ANY_ADDRESS, ROUNDUP(max(len, 1), PAGE_SIZE), REGION_WIRING_LAZY, LOCK_RW);
+		if(rid < 0)
+			return rid;
+		if(len > 0) {
+			err = cbuf_user_memcpy_from_chain(address, msg_store, 0, len);
+			if(err < 0) {
+				vm_delete_region(vm_get_current_user_aspace_id(), rid);
+				return err;
+			}
+		}
+	}
+
+	err = user_memcpy(uregion, &rid, sizeof(region_id));
+	if(err < 0) {
+		vm_delete_region(vm_get_current_user_aspace_id(), rid);
+		return err;
+	}
+
+	return NO_ERROR;
+}
+
 ssize_t
 port_read(port_id port,
 			int32 *msg_code,
@@ -603,12 +747,14 @@ port_read_etc(port_id id,
 				uint32	flags,
 				bigtime_t	timeout)
 {
-	int		slot;
+	struct port_entry *port;
 	sem_id	cached_semid;
 	size_t 	siz;
+	size_t	len;
 	int		res;
 	int		t;
 	cbuf*	msg_store;
+	region_id msg_region;
 	int32	code;
 	int		err;
 
@@ -623,24 +769,32 @@ port_read_etc(port_id id,
 	if (timeout < 0)
 		return ERR_INVALID_ARGS;
 
-	flags = flags & (PORT_FLAG_USE_USER_MEMCPY | PORT_FLAG_INTERRUPTABLE | PORT_FLAG_TIMEOUT);
+	flags = flags & (PORT_FLAG_USE_USER_MEMCPY | PORT_FLAG_INTERRUPTABLE | PORT_FLAG_TIMEOUT | PORT_FLAG_REMAP);
 
-	slot = id % MAX_PORTS;
+	// remapping only makes sense into a user address space
+	if ((flags & PORT_FLAG_USE_USER_MEMCPY) == 0)
+		flags &= ~PORT_FLAG_REMAP;
+	if ((flags & PORT_FLAG_REMAP) && buffer_size < sizeof(region_id))
+		return ERR_INVALID_ARGS;
+
+	port = id_table_lookup(port_table, id);
+	if(port == NULL)
+		return ERR_INVALID_HANDLE;
 
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if(port->id != id) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		dprintf("read_port_etc: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 	// store sem_id in local variable
-	cached_semid = ports[slot].read_sem;
+	cached_semid = port->read_sem;
 
 	// unlock port && enable ints/
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
 	// XXX -> possible race condition if port gets deleted (->sem deleted too), therefore
@@ -648,7 +802,7 @@ port_read_etc(port_id id,
 
 	// get 1 entry from the queue, block if needed
 	res = sem_acquire_etc(cached_semid, 1,
-						flags, timeout, NULL);
+						flags & (SEM_FLAG_TIMEOUT | SEM_FLAG_INTERRUPTABLE), timeout, NULL);
 
 	// XXX: possible race condition if port read by two threads...
 	//      both threads will read in 2 different slots allocated above, simultaneously
@@ -675,38 +829,66 @@ port_read_etc(port_id id,
 	}
 
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	t = ports[slot].tail;
+	t = port->tail;
 	if (t < 0)
-		panic("port %id: tail < 0", ports[slot].id);
-	if (t > ports[slot].capacity)
-		panic("port %id: tail > cap %d", ports[slot].id, ports[slot].capacity);
+		panic("port %id: tail < 0", port->id);
+	if (t > port->capacity)
+		panic("port %id: tail > cap %d", port->id, port->capacity);
 
-	ports[slot].tail = (ports[slot].tail + 1) % ports[slot].capacity;
+	port->tail = (port->tail + 1) % port->capacity;
 
-	msg_store	= ports[slot].msg_queue[t].data_cbuf;
-	code 		= ports[slot].msg_queue[t].msg_code;
+	msg_store	= port->msg_queue[t].data_cbuf;
+	msg_region	= port->msg_queue[t].data_region;
+	code 		= port->msg_queue[t].msg_code;
+	len			= port->msg_queue[t].data_len;
 
 	// mark queue entry unused
-	ports[slot].msg_queue[t].data_cbuf	= NULL;
+	port->msg_queue[t].data_cbuf	= NULL;
+	port->msg_queue[t].data_region	= -1;
 
 	// check output buffer size
-	siz	= min(buffer_size, ports[slot].msg_queue[t].data_len);
+	siz	= min(buffer_size, len);
 
-	cached_semid = ports[slot].write_sem;
+	cached_semid = port->write_sem;
 
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
-	// copy message
 	*msg_code = code;
+
+	if (flags & PORT_FLAG_REMAP) {
+		// the reader gets the message as a region of its own, msg_buffer receives the region_id
+		err = port_remap_to_user(msg_region, msg_store, len, (region_id *)msg_buffer);
+		cbuf_free_chain(msg_store);
+		port_release_sem(port, cached_semid, WAIT_EVENT_WRITE);
+		return (err < 0) ? err : (ssize_t)len;
+	}
+
+	if (msg_region >= 0) {
+		// sent with PORT_FLAG_REMAP, but the reader wants a copy
+		vm_region_info info;
+
+		err = vm_get_region_info(msg_region, &info);
+		if (err >= 0 && siz > 0) {
+			if (flags & PORT_FLAG_USE_USER_MEMCPY)
+				err = user_memcpy(msg_buffer, (void *)info.base, siz);
+			else
+				memcpy(msg_buffer, (void *)info.base, siz);
+		}
+		vm_delete_region(vm_get_kernel_aspace_id(), msg_region);
+		port_release_sem(port, cached_semid, WAIT_EVENT_WRITE);
+		return (err < 0) ? err : (ssize_t)siz;
+	}
+
+	// copy message
 	if (siz > 0) {
 		if (flags & PORT_FLAG_USE_USER_MEMCPY) {
 			if ((err = cbuf_user_memcpy_from_chain(msg_buffer, msg_store, 0, siz) < 0))	{
 				// leave the port intact, for other threads that might not crash
 				cbuf_free_chain(msg_store);
-				sem_release(cached_semid, 1);
+				port_release_sem(port, cached_semid, WAIT_EVENT_WRITE);
 				return err;
 			}
 		} else
@@ -716,7 +898,7 @@ port_read_etc(port_id id,
 	cbuf_free_chain(msg_store);
 
 	// make one spot in queue available again for write
-	sem_release(cached_semid, 1);
+	port_release_sem(port, cached_semid, WAIT_EVENT_WRITE);
 
 	return siz;
 }
@@ -724,30 +906,32 @@ port_read_etc(port_id id,
 int
 port_set_owner(port_id id, proc_id proc)
 {
-	int slot;
+	struct port_entry *port;
 
 	if(ports_active == false)
 		return ERR_PORT_NOT_ACTIVE;
 	if(id < 0)
 		return ERR_INVALID_HANDLE;
 
-	slot = id % MAX_PORTS;
+	port = id_table_lookup(port_table, id);
+	if(port == NULL)
+		return ERR_INVALID_HANDLE;
 
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if(port->id != id) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		dprintf("port_set_owner: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
 	// transfer ownership to other process
-	ports[slot].owner = proc;
+	port->owner = proc;
 
 	// unlock port
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
 	return NO_ERROR;
@@ -770,11 +954,14 @@ port_write_etc(port_id id,
 	uint32 flags,
 	bigtime_t timeout)
 {
-	int slot;
+	struct port_entry *port;
 	int res;
 	sem_id cached_semid;
 	int h;
 	cbuf* msg_store;
+	region_id src_region = -1;
+	region_id msg_region = -1;
+	void *kaddr;
 	int c1, c2;
 	int err;
 
@@ -784,35 +971,49 @@ port_write_etc(port_id id,
 		return ERR_INVALID_HANDLE;
 
 	// mask irrelevant flags
-	flags = flags & (PORT_FLAG_USE_USER_MEMCPY | PORT_FLAG_INTERRUPTABLE | PORT_FLAG_TIMEOUT);
+	flags = flags & (PORT_FLAG_USE_USER_MEMCPY | PORT_FLAG_INTERRUPTABLE | PORT_FLAG_TIMEOUT | PORT_FLAG_REMAP);
 
-	slot = id % MAX_PORTS;
+	// remapping only makes sense out of a user address space
+	if ((flags & PORT_FLAG_USE_USER_MEMCPY) == 0)
+		flags &= ~PORT_FLAG_REMAP;
+
+	port = id_table_lookup(port_table, id);
+	if(port == NULL)
+		return ERR_INVALID_HANDLE;
 
-	// check buffer_size
-	if (buffer_size > PORT_MAX_MESSAGE_SIZE)
+	if (flags & PORT_FLAG_REMAP) {
+		// the size is only limited by the region the message lives in, if it can be moved
+		src_region = port_remap_source(msg_buffer, buffer_size);
+		if (src_region < 0)
+			return src_region;
+		if (!port_can_remap(src_region, buffer_size) && buffer_size > PORT_MAX_MESSAGE_SIZE)
+			return ERR_INVALID_ARGS;
+	} else if (buffer_size > PORT_MAX_MESSAGE_SIZE) {
+		// check buffer_size
 		return ERR_INVALID_ARGS;
+	}
 
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if(port->id != id) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		dprintf("write_port_etc: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
-	if (ports[slot].closed) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if (port->closed) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		dprintf("write_port_etc: port %d closed\n", id);
 		return ERR_PORT_CLOSED;
 	}
 
 	// store sem_id in local variable
-	cached_semid = ports[slot].write_sem;
+	cached_semid = port->write_sem;
 
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
 	// XXX -> possible race condition if port gets deleted (->sem deleted too),
@@ -842,48 +1043,67 @@ port_write_etc(port_id id,
 		return res;
 	}
 
-	if (buffer_size > 0) {
+	msg_store = NULL;
+	if (src_region >= 0 && port_can_remap(src_region, buffer_size)) {
+		// park the pages in the kernel until a reader picks them up, no copying
+		msg_region = vm_clone_region(vm_get_kernel_aspace_id(), "port_msg", &kaddr,
+			REGION_ADDR_ANY_ADDRESS, src_region, REGION_NO_PRIVATE_MAP, LOCK_RO|LOCK_KERNEL);
+		if (msg_region < 0) {
+			port_release_sem(port, cached_semid, WAIT_EVENT_WRITE);
+			return msg_region;
+		}
+	} else if (buffer_size > 0) {
 		msg_store = cbuf_get_chain(buffer_size);
-		if (msg_store == NULL)
+		if (msg_store == NULL) {
+			port_release_sem(port, cached_semid, WAIT_EVENT_WRITE);
 			return ERR_NO_MEMORY;
+		}
 		if (flags & PORT_FLAG_USE_USER_MEMCPY) {
 			// copy from user memory
-			if ((err = cbuf_user_memcpy_to_chain(msg_store, 0, msg_buffer, buffer_size)) < 0)
-				return err; // memory exception
-		} else
+			err = cbuf_user_memcpy_to_chain(msg_store, 0, msg_buffer, buffer_size);
+		} else {
 			// copy from kernel memory
-			if ((err = cbuf_memcpy_to_chain(msg_store, 0, msg_buffer, buffer_size)) < 0)
-				return err; // memory exception
-	} else {
-		msg_store = NULL;
+			err = cbuf_memcpy_to_chain(msg_store, 0, msg_buffer, buffer_size);
+		}
+		if (err < 0) {
+			// memory exception
+			cbuf_free_chain(msg_store);
+			port_release_sem(port, cached_semid, WAIT_EVENT_WRITE);
+			return err;
+		}
 	}
 
+	// a PORT_FLAG_REMAP buffer belongs to the message now, whichever way it was sent
+	if (src_region >= 0)
+		vm_delete_region(vm_get_current_user_aspace_id(), src_region);
+
 	// attach copied message to queue
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	h = ports[slot].head;
+	h = port->head;
 	if (h < 0)
-		panic("port %id: head < 0", ports[slot].id);
-	if (h >= ports[slot].capacity)
-		panic("port %id: head > cap %d", ports[slot].id, ports[slot].capacity);
-	ports[slot].msg_queue[h].msg_code	= msg_code;
-	ports[slot].msg_queue[h].data_cbuf	= msg_store;
-	ports[slot].msg_queue[h].data_len	= buffer_size;
-	ports[slot].head = (ports[slot].head + 1) % ports[slot].capacity;
-	ports[slot].total_count++;
+		panic("port %id: head < 0", port->id);
+	if (h >= port->capacity)
+		panic("port %id: head > cap %d", port->id, port->capacity);
+	port->msg_queue[h].msg_code	= msg_code;
+	port->msg_queue[h].data_cbuf	= msg_store;
+	port->msg_queue[h].data_region	= msg_region;
+	port->msg_queue[h].data_len	= buffer_size;
+	port->head = (port->head + 1) % port->capacity;
+	port->total_count++;
 
 	// store sem_id in local variable
-	cached_semid = ports[slot].read_sem;
+	cached_semid = port->read_sem;
 
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
-	sem_get_count(ports[slot].read_sem, &c1);
-	sem_get_count(ports[slot].write_sem, &c2);
+	sem_get_count(port->read_sem, &c1);
+	sem_get_count(port->write_sem, &c2);
 
 	// release sem, allowing read (might reschedule)
-	sem_release(cached_semid, 1);
+	port_release_sem(port, cached_semid, WAIT_EVENT_READ);
 
 	return NO_ERROR;
 }
@@ -892,33 +1112,28 @@ port_write_etc(port_id id,
    the passed proc_id */
 int port_delete_owned_ports(proc_id owner)
 {
-	int i;
+	unsigned int i;
 	int count = 0;
+	struct port_entry *port;
+	port_id id;
 
 	if(ports_active == false)
 		return ERR_PORT_NOT_ACTIVE;
 
-	int_disable_interrupts();
-	GRAB_PORT_LIST_LOCK();
-
-	for(i=0; i<MAX_PORTS; i++) {
-		if(ports[i].id != -1 && ports[i].owner == owner) {
-			port_id id = ports[i].id;
+	for(i=0; i<id_table_capacity(port_table); i++) {
+		port = id_table_lookup(port_table, i);
 
-			RELEASE_PORT_LIST_LOCK();
-			int_restore_interrupts();
+		int_disable_interrupts();
+		GRAB_PORT_LOCK(*port);
+		id = (port->owner == owner) ? port->id : -1;
+		RELEASE_PORT_LOCK(*port);
+		int_restore_interrupts();
 
-			port_delete(id);
+		// port_delete rechecks the id, so it's fine if the port went away in the meantime
+		if(id >= 0 && port_delete(id) == NO_ERROR)
 			count++;
-
-			int_disable_interrupts();
-			GRAB_PORT_LIST_LOCK();
-		}
 	}
 
-	RELEASE_PORT_LIST_LOCK();
-	int_restore_interrupts();
-
 	return count;
 }
 
@@ -1018,6 +1233,82 @@ int port_test_thread_func(void* arg)
 	return 0;
 }
 
+/*
+ * create/delete storm, one thread per cpu hammering the port and sem tables.
+ * every thread keeps PORT_STRESS_BATCH ports alive at a time, so with a couple of
+ * cpus the tables have to grow past their initial size while under load.
+ */
+#define PORT_STRESS_ROUNDS 16
+#define PORT_STRESS_BATCH 2048
+
+static volatile int port_stress_failures;
+
+static int port_stress_thread_func(void *arg)
+{
+	port_id *ids;
+	int round;
+	int i;
+
+	ids = (port_id *)kmalloc(sizeof(port_id) * PORT_STRESS_BATCH);
+	if(ids == NULL)
+		return ERR_NO_MEMORY;
+
+	for(round = 0; round < PORT_STRESS_ROUNDS; round++) {
+		for(i = 0; i < PORT_STRESS_BATCH; i++) {
+			ids[i] = port_create(1, "stress port");
+			if(ids[i] < 0)
+				atomic_add((int *)&port_stress_failures, 1);
+		}
+
+		// delete in a different order than we created in, to stir up the free lists
+		for(i = PORT_STRESS_BATCH - 1; i >= 0; i--) {
+			if(ids[i] >= 0 && port_delete(ids[i]) < 0)
+				atomic_add((int *)&port_stress_failures, 1);
+		}
+
+		// a stale id must not find the recycled slot
+		if(port_delete(ids[0]) != ERR_INVALID_HANDLE)
+			atomic_add((int *)&port_stress_failures, 1);
+	}
+
+	kfree(ids);
+	return 0;
+}
+
+void port_stress_test(void)
+{
+	struct id_table_stats stats;
+	thread_id threads[_MAX_CPUS];
+	int num_threads = smp_get_num_cpus();
+	bigtime_t start, elapsed;
+	int ops;
+	int i;
+
+	dprintf("portstress: %d threads, %d rounds of %d ports each\n",
+		num_threads, PORT_STRESS_ROUNDS, PORT_STRESS_BATCH);
+
+	port_stress_failures = 0;
+	start = system_time();
+
+	for(i = 0; i < num_threads; i++) {
+		threads[i] = thread_create_kernel_thread("port_stress", &port_stress_thread_func, NULL);
+		thread_resume_thread(threads[i]);
+	}
+	for(i = 0; i < num_threads; i++)
+		thread_wait_on_thread(threads[i], NULL);
+
+	elapsed = system_time() - start;
+
+	// every port is a port slot plus two sems, created and deleted
+	ops = num_threads * PORT_STRESS_ROUNDS * PORT_STRESS_BATCH;
+	dprintf("portstress: %d port create/delete pairs in %Ld usecs, %Ld pairs/sec, %d failures\n",
+		ops, elapsed, elapsed > 0 ? ((bigtime_t)ops * 1000000) / elapsed : 0, port_stress_failures);
+
+	id_table_get_stats(port_table, &stats);
+	dprintf("portstress: port table %d slots, %d in use, %d grows, %d free list retries\n",
+		stats.capacity, stats.in_use, stats.grows, stats.retries);
+}
+
 /*
  *	user level ports
  */
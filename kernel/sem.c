@@ -7,10 +7,13 @@
 #include <kernel/smp.h>
 #include <kernel/int.h>
 #include <kernel/timer.h>
+#include <kernel/time.h>
 #include <kernel/debug.h>
 #include <kernel/heap.h>
 #include <kernel/thread.h>
 #include <kernel/vm.h>
+#include <kernel/id_table.h>
+#include <kernel/wait_set.h>
 #include <newos/errors.h>
 
 #include <boot/stage2.h>
@@ -25,19 +28,36 @@ struct sem_entry {
 	const char *name;
 	int       lock;
 	proc_id   owner;		 // if set to -1, means owned by a port
+	int       flags;
+
+	// SEM_ENTRY_FLAG_INHERIT sems only
+	thread_id holder;
+	struct thread *holder_thread; // set along with holder, threads let go of their sems before they're freed
+	struct list_node holder_node; // on the holder's pi_sems list
+	int       waiter_priority; // highest priority of the waiters, -1 if none
+	bigtime_t inversion_start; // when a higher priority thread started waiting on the holder
+	bigtime_t inversion_time;  // total time spent in priority inversion
+	bigtime_t max_inversion_time;
+	int       inversion_count;
+
+	struct id_table_link slot_link;
+
+	// wait set watches, these outlive the sem in the slot
+	struct wait_object waiters;
 };
 
-#define MAX_SEMS 4096
+// sem_entry flags
+#define SEM_ENTRY_FLAG_INHERIT 1 // mutex sem, waiters lend the holder their priority
 
-static struct sem_entry *sems = NULL;
-static region_id sem_region = 0;
-static bool sems_active = false;
+// the table starts out at SEM_TABLE_INITIAL entries and grows a chunk at a time
+// MAX_SEMS and SEM_TABLE_CHUNK must be powers of 2
+#define MAX_SEMS 65536
+#define SEM_TABLE_INITIAL 4096
+#define SEM_TABLE_CHUNK 512
 
-static sem_id next_sem = 0;
+static void *sem_table = NULL;
+static bool sems_active = false;
 
-static int sem_spinlock = 0;
-#define GRAB_SEM_LIST_LOCK() acquire_spinlock(&sem_spinlock)
-#define RELEASE_SEM_LIST_LOCK() release_spinlock(&sem_spinlock)
 #define GRAB_SEM_LOCK(s) acquire_spinlock(&(s).lock)
 #define RELEASE_SEM_LOCK(s) release_spinlock(&(s).lock)
 
@@ -45,6 +65,7 @@ static int sem_spinlock = 0;
 #define READY_THREAD_CACHE_SIZE 16
 
 static int remove_thread_from_sem(struct thread *t, struct sem_entry *sem, struct list_node *queue, int sem_errcode);
+static sem_id _sem_create(int count, const char *name, proc_id owner, int flags);
 
 struct sem_timeout_args {
 	thread_id blocked_thread;
@@ -54,13 +75,16 @@ struct sem_timeout_args {
 
 static void dump_sem_list(int argc, char **argv)
 {
-	int i;
+	unsigned int i;
+	struct sem_entry *sem;
 
-	for(i=0; i<MAX_SEMS; i++) {
-		if(sems[i].id >= 0) {
-			dprintf("%p\tid: 0x%x\t\tname: '%s'\n", &sems[i], sems[i].id, sems[i].name);
+	for(i=0; i<id_table_capacity(sem_table); i++) {
+		sem = id_table_lookup(sem_table, i);
+		if(sem->id >= 0) {
+			dprintf("%p\tid: 0x%x\t\tname: '%s'\n", sem, sem->id, sem->name);
 		}
 	}
+	id_table_dump(sem_table);
 }
 
 static void _dump_sem_info(struct sem_entry *sem)
@@ -70,11 +94,18 @@ static void _dump_sem_info(struct sem_entry *sem)
 	dprintf("owner: 0x%x\n", sem->owner);
 	dprintf("count: 0x%x\n", sem->count);
 	dprintf("queue: head %p tail %p\n", sem->q.next, sem->q.prev);
+	if(sem->flags & SEM_ENTRY_FLAG_INHERIT) {
+		dprintf("holder: 0x%x\n", sem->holder);
+		dprintf("priority inversions: %d, total %Ld usecs, max %Ld usecs%s\n",
+			sem->inversion_count, sem->inversion_time, sem->max_inversion_time,
+			sem->inversion_start != 0 ? " (in progress)" : "");
+	}
 }
 
 static void dump_sem_info(int argc, char **argv)
 {
-	int i;
+	unsigned int i;
+	struct sem_entry *sem;
 
 	if(argc < 2) {
 		dprintf("sem: not enough arguments\n");
@@ -90,43 +121,44 @@ static void dump_sem_info(int argc, char **argv)
 			_dump_sem_info((struct sem_entry *)num);
 			return;
 		} else {
-			unsigned slot = num % MAX_SEMS;
-			if(sems[slot].id != (int)num) {
+			sem = id_table_lookup(sem_table, num);
+			if(sem == NULL || sem->id != (int)num) {
 				dprintf("sem 0x%lx doesn't exist!\n", num);
 				return;
 			}
-			_dump_sem_info(&sems[slot]);
+			_dump_sem_info(sem);
 			return;
 		}
 	}
 
 	// walk through the sem list, trying to match name
-	for(i=0; i<MAX_SEMS; i++) {
-		if (sems[i].name != NULL)
-			if(strcmp(argv[1], sems[i].name) == 0) {
-				_dump_sem_info(&sems[i]);
+	for(i=0; i<id_table_capacity(sem_table); i++) {
+		sem = id_table_lookup(sem_table, i);
+		if (sem->name != NULL)
+			if(strcmp(argv[1], sem->name) == 0) {
+				_dump_sem_info(sem);
 				return;
 			}
 	}
 }
 
-int sem_init(kernel_args *ka)
+static void sem_init_entry(void *e)
 {
-	int i;
+	((struct sem_entry *)e)->id = -1;
+	wait_object_init(&((struct sem_entry *)e)->waiters);
+}
 
+int sem_init(kernel_args *ka)
+{
 	dprintf("sem_init: entry\n");
 
 	// create and initialize semaphore table
-	sem_region = vm_create_anonymous_region(vm_get_kernel_aspace_id(), "sem_table", (void **)&sems,
-		REGION_ADDR_ANY_ADDRESS, sizeof(struct sem_entry) * MAX_SEMS, REGION_WIRING_WIRED, LOCK_RW|LOCK_KERNEL);
-	if(sem_region < 0) {
+	sem_table = id_table_create("sem", sizeof(struct sem_entry), offsetof(struct sem_entry, slot_link),
+		SEM_TABLE_CHUNK, SEM_TABLE_INITIAL, MAX_SEMS, &sem_init_entry);
+	if(sem_table == NULL || id_table_capacity(sem_table) < SEM_TABLE_INITIAL) {
 		panic("unable to allocate semaphore table!\n");
 	}
 
-	memset(sems, 0, sizeof(struct sem_entry) * MAX_SEMS);
-	for(i=0; i<MAX_SEMS; i++)
-		sems[i].id = -1;
-
 	// add debugger commands
 	dbg_add_command(&dump_sem_list, "sems", "Dump a list of all active semaphores");
 	dbg_add_command(&dump_sem_info, "sem", "Dump info about a particular semaphore");
@@ -140,8 +172,20 @@ int sem_init(kernel_args *ka)
 
 sem_id sem_create_etc(int count, const char *name, proc_id owner)
 {
-	int i;
-	sem_id retval = ERR_SEM_OUT_OF_SLOTS;
+	return _sem_create(count, name, owner, 0);
+}
+
+// creates a sem to be used as a mutex. Threads blocking on it lend their
+// priority to the holder, so a low priority holder can't stall them indefinitely.
+sem_id sem_create_mutex(const char *name)
+{
+	return _sem_create(1, name, proc_get_kernel_proc_id(), SEM_ENTRY_FLAG_INHERIT);
+}
+
+static sem_id _sem_create(int count, const char *name, proc_id owner, int flags)
+{
+	sem_id id;
+	struct sem_entry *sem;
 	char *temp_name;
 	int name_len;
 
@@ -160,47 +204,147 @@ sem_id sem_create_etc(int count, const char *name, proc_id owner)
 
 	strlcpy(temp_name, name, name_len);
 
+	// grab a free slot, the id encodes the slot it's in
+	id = id_table_alloc(sem_table);
+	if(id < 0) {
+		kfree(temp_name);
+		return (id == ERR_NO_MORE_HANDLES) ? ERR_SEM_OUT_OF_SLOTS : id;
+	}
+	sem = id_table_lookup(sem_table, id);
+
 	int_disable_interrupts();
-	GRAB_SEM_LIST_LOCK();
-
-	// find the first empty spot
-	for(i=0; i<MAX_SEMS; i++) {
-		if(sems[i].id == -1) {
-			// make the sem id be a multiple of the slot it's in
-			if(i >= next_sem % MAX_SEMS) {
-				next_sem += i - next_sem % MAX_SEMS;
-			} else {
-				next_sem += MAX_SEMS - (next_sem % MAX_SEMS - i);
-			}
-			sems[i].id = next_sem++;
+	GRAB_SEM_LOCK(*sem);
+
+	list_initialize(&sem->q);
+	sem->count = count;
+	sem->name = temp_name;
+	sem->owner = owner;
+	sem->flags = flags;
+	sem->holder = -1;
+	sem->holder_thread = NULL;
+	sem->waiter_priority = -1;
+	sem->inversion_start = 0;
+	sem->inversion_time = 0;
+	sem->max_inversion_time = 0;
+	sem->inversion_count = 0;
+	sem->id = id;
+
+	RELEASE_SEM_LOCK(*sem);
+	int_restore_interrupts();
 
-			sems[i].lock = 0;
-			GRAB_SEM_LOCK(sems[i]);
-			RELEASE_SEM_LIST_LOCK();
+	return id;
+}
 
-			list_initialize(&sems[i].q);
-			sems[i].count = count;
-			sems[i].name = temp_name;
-			sems[i].owner = owner;
-			retval = sems[i].id;
+sem_id sem_create(int count, const char *name)
+{
+	return sem_create_etc(count, name, proc_get_kernel_proc_id());
+}
 
-			RELEASE_SEM_LOCK(sems[i]);
-			goto out;
-		}
+// the holder of a priority inheriting sem is letting go, account for the inversion if any
+// NOTE: expects the sem lock to be held
+static void sem_end_inversion(struct sem_entry *sem)
+{
+	bigtime_t delta;
+
+	if(sem->inversion_start == 0)
+		return;
+
+	delta = system_time() - sem->inversion_start;
+	sem->inversion_start = 0;
+	sem->inversion_time += delta;
+	if(delta > sem->max_inversion_time)
+		sem->max_inversion_time = delta;
+	sem->inversion_count++;
+}
+
+// highest priority of the threads still waiting on a sem
+// NOTE: expects the sem lock to be held
+static int sem_max_waiter_priority(struct sem_entry *sem)
+{
+	struct thread *t;
+	int priority = -1;
+
+	list_for_every_entry(&sem->q, t, struct thread, q_node) {
+		priority = max(priority, t->priority);
 	}
+	return priority;
+}
 
-	RELEASE_SEM_LIST_LOCK();
-	kfree(temp_name);
+// makes t the holder of a priority inheriting sem
+// NOTE: expects the sem lock to be held
+static void sem_set_holder(struct sem_entry *sem, struct thread *t)
+{
+	sem->holder = t->id;
+	sem->holder_thread = t;
 
-out:
-	int_restore_interrupts();
+	acquire_spinlock(&t->pi_sems_lock);
+	list_add_tail(&t->pi_sems, &sem->holder_node);
+	release_spinlock(&t->pi_sems_lock);
+}
+
+// returns who held the sem, -1 if nobody did
+// NOTE: expects the sem lock to be held
+static thread_id sem_clear_holder(struct sem_entry *sem)
+{
+	struct thread *t = sem->holder_thread;
+	thread_id holder = sem->holder;
+
+	if(t == NULL)
+		return -1;
+
+	acquire_spinlock(&t->pi_sems_lock);
+	list_delete(&sem->holder_node);
+	release_spinlock(&t->pi_sems_lock);
 
-	return retval;
+	sem->holder = -1;
+	sem->holder_thread = NULL;
+	return holder;
 }
 
-sem_id sem_create(int count, const char *name)
+// a thread is about to block on a priority inheriting sem, lend the holder our priority
+// NOTE: expects the thread lock to be held
+static void sem_lend_priority(struct sem_entry *sem, sem_id id, thread_id holder_id, int priority)
 {
-	return sem_create_etc(count, name, proc_get_kernel_proc_id());
+	struct thread *holder = thread_get_thread_struct_locked(holder_id);
+
+	if(holder == NULL || holder->priority >= priority)
+		return;
+
+	GRAB_SEM_LOCK(*sem);
+	// make sure the holder didn't let go while we were switching locks
+	if(sem->id == id && sem->holder == holder_id) {
+		thread_inherit_priority(holder, priority);
+		if(sem->inversion_start == 0)
+			sem->inversion_start = system_time();
+	}
+	RELEASE_SEM_LOCK(*sem);
+}
+
+// the holder let go of a priority inheriting sem, or a waiter gave up on one,
+// so it may be owed less now. Only the sems it still holds are looked at.
+// waiter_priority is read without the sem locks, a waiter sets it before it
+// takes the thread lock to lend its priority.
+// NOTE: expects the thread lock to be held and no sem lock
+static void sem_update_inherited_priority(thread_id holder_id)
+{
+	struct thread *holder = thread_get_thread_struct_locked(holder_id);
+	struct sem_entry *sem;
+	int priority = -1;
+
+	if(holder == NULL || holder->inherited_priority < 0)
+		return;
+
+	acquire_spinlock(&holder->pi_sems_lock);
+	list_for_every_entry(&holder->pi_sems, sem, struct sem_entry, holder_node) {
+		priority = max(priority, sem->waiter_priority);
+	}
+	release_spinlock(&holder->pi_sems_lock);
+
+	if(priority < holder->inherited_priority) {
+		thread_drop_inherited_priority(holder);
+		if(priority >= 0)
+			thread_inherit_priority(holder, priority);
+	}
 }
 
 int sem_delete(sem_id id)
@@ -210,25 +354,26 @@ int sem_delete(sem_id id)
 
 int sem_delete_etc(sem_id id, int return_code)
 {
-	int slot;
+	struct sem_entry *sem;
 	int err = NO_ERROR;
 	struct thread *t;
 	int released_threads;
 	char *old_name;
 	struct list_node release_queue;
+	thread_id holder = -1;
 
 	if(sems_active == false)
 		return ERR_SEM_NOT_ACTIVE;
-	if(id < 0)
-		return ERR_INVALID_HANDLE;
 
-	slot = id % MAX_SEMS;
+	sem = id_table_lookup(sem_table, id);
+	if(sem == NULL)
+		return ERR_INVALID_HANDLE;
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
-		RELEASE_SEM_LOCK(sems[slot]);
+	if(sem->id != id) {
+		RELEASE_SEM_LOCK(*sem);
 		int_restore_interrupts();
 		dprintf("sem_delete: invalid sem_id %d\n", id);
 		return ERR_INVALID_HANDLE;
@@ -238,7 +383,7 @@ int sem_delete_etc(sem_id id, int return_code)
 	list_initialize(&release_queue);
 
 	// free any threads waiting for this semaphore
-	while((t = thread_dequeue(&sems[slot].q)) != NULL) {
+	while((t = thread_dequeue(&sem->q)) != NULL) {
 		t->state = THREAD_STATE_READY;
 		t->sem_errcode = ERR_SEM_DELETED;
 		t->sem_deleted_retcode = return_code;
@@ -247,23 +392,38 @@ int sem_delete_etc(sem_id id, int return_code)
 		released_threads++;
 	}
 
-	sems[slot].id = -1;
-	old_name = (char *)sems[slot].name;
-	sems[slot].name = NULL;
+	if(sem->flags & SEM_ENTRY_FLAG_INHERIT) {
+		holder = sem_clear_holder(sem);
+		sem->waiter_priority = -1;
+	}
+
+	sem->id = -1;
+	old_name = (char *)sem->name;
+	sem->name = NULL;
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 
-	if(released_threads > 0) {
+	if(released_threads > 0 || holder >= 0) {
 		GRAB_THREAD_LOCK();
+		if(holder >= 0)
+			sem_update_inherited_priority(holder);
 		while((t = thread_dequeue(&release_queue)) != NULL) {
 			thread_enqueue_run_q(t);
 		}
-		thread_resched();
+		if(released_threads > 0)
+			thread_resched();
 		RELEASE_THREAD_LOCK();
 	}
 
 	int_restore_interrupts();
 
+	// the id is dead, wait sets watching it will find that out when they poll it.
+	// Not done with the sem lock held, it leads to the thread lock.
+	wait_object_detach_all(&sem->waiters);
+
+	// the slot can be handed out again now
+	id_table_free(sem_table, id);
+
 	kfree(old_name);
 
 	return err;
@@ -274,31 +434,39 @@ static int sem_timeout(void *data)
 {
 	struct sem_timeout_args *args = (struct sem_timeout_args *)data;
 	struct thread *t;
-	int slot;
+	struct sem_entry *sem;
 	struct list_node wakeup_queue;
+	thread_id holder;
 
 	t = thread_get_thread_struct(args->blocked_thread);
 	if(t == NULL)
 		return INT_NO_RESCHEDULE;
-	slot = args->blocked_sem_id % MAX_SEMS;
+	sem = id_table_lookup(sem_table, args->blocked_sem_id);
+	if(sem == NULL) {
+		panic("sem_timeout: thid %d was trying to wait on sem %d which doesn't exist!\n",
+			args->blocked_thread, args->blocked_sem_id);
+	}
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
 //	dprintf("sem_timeout: called on 0x%x sem %d, tid %d\n", to, to->sem_id, to->thread_id);
 
-	if(sems[slot].id != args->blocked_sem_id) {
+	if(sem->id != args->blocked_sem_id) {
 		// this thread was not waiting on this semaphore
 		panic("sem_timeout: thid %d was trying to wait on sem %d which doesn't exist!\n",
 			args->blocked_thread, args->blocked_sem_id);
 	}
 
 	list_initialize(&wakeup_queue);
-	remove_thread_from_sem(t, &sems[slot], &wakeup_queue, ERR_SEM_TIMED_OUT);
+	remove_thread_from_sem(t, sem, &wakeup_queue, ERR_SEM_TIMED_OUT);
+	holder = (sem->flags & SEM_ENTRY_FLAG_INHERIT) ? sem->holder : -1;
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 
 	GRAB_THREAD_LOCK();
+	if(holder >= 0)
+		sem_update_inherited_priority(holder);
 	// put the threads in the run q here to make sure we dont deadlock in sem_interrupt_thread
 	while((t = thread_dequeue(&wakeup_queue)) != NULL) {
 		thread_enqueue_run_q(t);
@@ -317,13 +485,14 @@ int sem_acquire(sem_id id, int count)
 
 int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *deleted_retcode)
 {
-	int slot = id % MAX_SEMS;
+	struct sem_entry *sem;
 	int err = 0;
 
 	if(sems_active == false)
 		return ERR_SEM_NOT_ACTIVE;
 
-	if(id < 0) {
+	sem = id_table_lookup(sem_table, id);
+	if(sem == NULL) {
 		dprintf("sem_acquire_etc: invalid sem handle %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
@@ -335,30 +504,31 @@ int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *del
 		panic("sem_acquire_etc: sem attempted to be acquired with interrupts disabled\n");
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
+	if(sem->id != id) {
 		dprintf("sem_acquire_etc: bad sem_id %d\n", id);
 		err = ERR_INVALID_HANDLE;
 		goto err;
 	}
 
-	if(sems[slot].count - count < 0 && (flags & SEM_FLAG_TIMEOUT) != 0 && timeout <= 0) {
+	if(sem->count - count < 0 && (flags & SEM_FLAG_TIMEOUT) != 0 && timeout <= 0) {
 		// immediate timeout
 		err = ERR_SEM_TIMED_OUT;
 		goto err;
 	}
 
-	if((sems[slot].count -= count) < 0) {
+	if((sem->count -= count) < 0) {
 		// we need to block
 		struct thread *t = thread_get_current_thread();
 		struct timer_event timer; // stick it on the stack, since we may be blocking here
 		struct sem_timeout_args args;
+		thread_id holder = -1;
 
 		// do a quick check to see if the thread has any pending kill signals
 		// this should catch most of the cases where the thread had a signal
 		if((flags & SEM_FLAG_INTERRUPTABLE) && t->sig_pending) {
-			sems[slot].count += count;
+			sem->count += count;
 			err = ERR_INTERRUPTED;
 			goto err;
 		}
@@ -367,10 +537,12 @@ int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *del
 		t->sem_flags = flags;
 		t->sem_blocking = id;
 		t->sem_acquire_count = count;
-		t->sem_count = min(-sems[slot].count, count); // store the count we need to restore upon release
+		t->sem_count = min(-sem->count, count); // store the count we need to restore upon release
 		t->sem_deleted_retcode = 0;
 		t->sem_errcode = NO_ERROR;
-		thread_enqueue(t, &sems[slot].q);
+		thread_enqueue(t, &sem->q);
+		if(sem->flags & SEM_ENTRY_FLAG_INHERIT)
+			sem->waiter_priority = max(sem->waiter_priority, t->priority);
 
 		if((flags & SEM_FLAG_TIMEOUT) != 0) {
 //			dprintf("sem_acquire_etc: setting timeout sem for %d %d usecs, semid %d, tid %d\n",
@@ -383,8 +555,13 @@ int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *del
 			timer_set_event(timeout, TIMER_MODE_ONESHOT, &timer);
 		}
 
-		RELEASE_SEM_LOCK(sems[slot]);
+		if((sem->flags & SEM_ENTRY_FLAG_INHERIT) && sem->holder != t->id)
+			holder = sem->holder;
+
+		RELEASE_SEM_LOCK(*sem);
 		GRAB_THREAD_LOCK();
+		if(holder >= 0)
+			sem_lend_priority(sem, id, holder, t->priority);
 		// check again to see if a kill signal is pending.
 		// it may have been delivered while setting up the sem, though it's pretty unlikely
 		if((flags & SEM_FLAG_INTERRUPTABLE) && t->sig_pending) {
@@ -394,11 +571,16 @@ int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *del
 			// here, since the threadlock is held. The previous check would have found most
 			// instances, but there was a race, so we have to handle it. It'll be more messy...
 			list_initialize(&wakeup_queue);
-			GRAB_SEM_LOCK(sems[slot]);
-			if(sems[slot].id == id) {
-				remove_thread_from_sem(t, &sems[slot], &wakeup_queue, ERR_INTERRUPTED);
+			holder = -1;
+			GRAB_SEM_LOCK(*sem);
+			if(sem->id == id) {
+				remove_thread_from_sem(t, sem, &wakeup_queue, ERR_INTERRUPTED);
+				if(sem->flags & SEM_ENTRY_FLAG_INHERIT)
+					holder = sem->holder;
 			}
-			RELEASE_SEM_LOCK(sems[slot]);
+			RELEASE_SEM_LOCK(*sem);
+			if(holder >= 0)
+				sem_update_inherited_priority(holder);
 			while((t = thread_dequeue(&wakeup_queue)) != NULL) {
 				thread_enqueue_run_q(t);
 			}
@@ -421,8 +603,17 @@ int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *del
 		return t->sem_errcode;
 	}
 
+	// we got it without blocking
+	if(sem->flags & SEM_ENTRY_FLAG_INHERIT) {
+		struct thread *t = thread_get_current_thread();
+
+		// there may not be a current thread this early in boot
+		if(t != NULL)
+			sem_set_holder(sem, t);
+	}
+
 err:
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 	int_restore_interrupts();
 
 	return err;
@@ -435,24 +626,28 @@ int sem_release(sem_id id, int count)
 
 int sem_release_etc(sem_id id, int count, int flags)
 {
-	int slot = id % MAX_SEMS;
+	struct sem_entry *sem;
 	int released_threads = 0;
 	int err = 0;
 	struct list_node release_queue;
+	thread_id old_holder = -1;
+	struct thread *new_holder = NULL;
+	int waiter_priority = -1;
 
 	if(sems_active == false)
 		return ERR_SEM_NOT_ACTIVE;
 
-	if(id < 0)
+	sem = id_table_lookup(sem_table, id);
+	if(sem == NULL)
 		return ERR_INVALID_HANDLE;
 
 	if(count <= 0)
 		return ERR_INVALID_ARGS;
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
+	if(sem->id != id) {
 		dprintf("sem_release_etc: invalid sem_id %d\n", id);
 		err = ERR_INVALID_HANDLE;
 		goto err;
@@ -464,46 +659,78 @@ int sem_release_etc(sem_id id, int count, int flags)
 	// order in sem_interrupt_thread.
 	list_initialize(&release_queue);
 
+	if(sem->flags & SEM_ENTRY_FLAG_INHERIT) {
+		old_holder = sem_clear_holder(sem);
+		sem_end_inversion(sem);
+	}
+
 	while(count > 0) {
 		int delta = count;
-		if(sems[slot].count < 0) {
-			struct thread *t = thread_lookat_queue(&sems[slot].q);
+		if(sem->count < 0) {
+			struct thread *t = thread_lookat_queue(&sem->q);
 
 			delta = min(count, t->sem_count);
 			t->sem_count -= delta;
 			if(t->sem_count <= 0) {
 				// release this thread
-				t = thread_dequeue(&sems[slot].q);
+				t = thread_dequeue(&sem->q);
 				thread_enqueue(t, &release_queue);
 				t->state = THREAD_STATE_READY;
 				released_threads++;
 				t->sem_count = 0;
 				t->sem_deleted_retcode = 0;
+				if((sem->flags & SEM_ENTRY_FLAG_INHERIT) && new_holder == NULL) {
+					// hand the mutex over to the first waiter
+					new_holder = t;
+					sem_set_holder(sem, t);
+				}
 			}
 		}
 
-		sems[slot].count += delta;
+		sem->count += delta;
 		count -= delta;
 	}
-	RELEASE_SEM_LOCK(sems[slot]);
+
+	// the new holder may already be in the way of the remaining waiters
+	if(new_holder != NULL) {
+		waiter_priority = sem->waiter_priority = sem_max_waiter_priority(sem);
+		if(waiter_priority > new_holder->priority)
+			sem->inversion_start = system_time();
+	}
+	RELEASE_SEM_LOCK(*sem);
+
+	// the common case, letting go of a mutex nobody lent us priority for
+	if(old_holder >= 0 && old_holder == thread_get_current_thread_id()) {
+		if(thread_get_current_thread()->inherited_priority < 0)
+			old_holder = -1;
+	}
 
 	// pull off any items in the release queue and put them in the run queue
-	if(released_threads > 0) {
+	if(released_threads > 0 || old_holder >= 0) {
 		struct thread *t;
 		GRAB_THREAD_LOCK();
+		if(old_holder >= 0)
+			sem_update_inherited_priority(old_holder);
+		if(new_holder != NULL && waiter_priority > new_holder->priority)
+			thread_inherit_priority(new_holder, waiter_priority);
 		while((t = thread_dequeue(&release_queue)) != NULL) {
+			thread_wakeup_boost(t);
 			thread_enqueue_run_q(t);
 		}
-		if((flags & SEM_FLAG_NO_RESCHED) == 0) {
+		if(released_threads > 0 && (flags & SEM_FLAG_NO_RESCHED) == 0) {
 			thread_resched();
 		}
 		RELEASE_THREAD_LOCK();
 	}
-	goto outnolock;
+	int_restore_interrupts();
+
+	if((flags & SEM_FLAG_NO_NOTIFY) == 0)
+		wait_object_notify(&sem->waiters, WAIT_EVENT_READ);
+
+	return err;
 
 err:
-	RELEASE_SEM_LOCK(sems[slot]);
-outnolock:
+	RELEASE_SEM_LOCK(*sem);
 	int_restore_interrupts();
 
 	return err;
@@ -511,7 +738,7 @@ outnolock:
 
 int sem_get_count(sem_id id, int32* thread_count)
 {
-	int slot;
+	struct sem_entry *sem;
 
 	if(sems_active == false)
 		return ERR_SEM_NOT_ACTIVE;
@@ -520,29 +747,64 @@ int sem_get_count(sem_id id, int32* thread_count)
 	if (thread_count == NULL)
 		return ERR_INVALID_ARGS;
 
-	slot = id % MAX_SEMS;
+	sem = id_table_lookup(sem_table, id);
+	if(sem == NULL)
+		return ERR_INVALID_HANDLE;
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
-		RELEASE_SEM_LOCK(sems[slot]);
+	if(sem->id != id) {
+		RELEASE_SEM_LOCK(*sem);
 		int_restore_interrupts();
 		dprintf("sem_get_count: invalid sem_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
-	*thread_count = sems[slot].count;
+	*thread_count = sem->count;
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 	int_restore_interrupts();
 
 	return NO_ERROR;
 }
 
+int sem_poll(sem_id id, struct wait_watch *watch)
+{
+	struct sem_entry *sem;
+	int events = 0;
+
+	if(sems_active == false)
+		return ERR_SEM_NOT_ACTIVE;
+	if(id < 0)
+		return ERR_INVALID_HANDLE;
+
+	sem = id_table_lookup(sem_table, id);
+	if(sem == NULL)
+		return ERR_INVALID_HANDLE;
+
+	int_disable_interrupts();
+	GRAB_SEM_LOCK(*sem);
+
+	if(sem->id != id) {
+		RELEASE_SEM_LOCK(*sem);
+		int_restore_interrupts();
+		return ERR_INVALID_HANDLE;
+	}
+
+	wait_object_attach(&sem->waiters, watch);
+	if(sem->count > 0)
+		events = WAIT_EVENT_READ;
+
+	RELEASE_SEM_LOCK(*sem);
+	int_restore_interrupts();
+
+	return events;
+}
+
 int sem_get_sem_info(sem_id id, struct sem_info *info)
 {
-	int slot;
+	struct sem_entry *sem;
 
 	if(sems_active == false)
 		return ERR_SEM_NOT_ACTIVE;
@@ -551,25 +813,27 @@ int sem_get_sem_info(sem_id id, struct sem_info *info)
 	if (info == NULL)
 		return ERR_INVALID_ARGS;
 
-	slot = id % MAX_SEMS;
+	sem = id_table_lookup(sem_table, id);
+	if(sem == NULL)
+		return ERR_INVALID_HANDLE;
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
-		RELEASE_SEM_LOCK(sems[slot]);
+	if(sem->id != id) {
+		RELEASE_SEM_LOCK(*sem);
 		int_restore_interrupts();
 		dprintf("get_sem_info: invalid sem_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
-	info->sem			= sems[slot].id;
-	info->proc			= sems[slot].owner;
-	strncpy(info->name, sems[slot].name, SYS_MAX_OS_NAME_LEN-1);
-	info->count			= sems[slot].count;
-	info->latest_holder	= -1; // XXX fixme
+	info->sem			= sem->id;
+	info->proc			= sem->owner;
+	strncpy(info->name, sem->name, SYS_MAX_OS_NAME_LEN-1);
+	info->count			= sem->count;
+	info->latest_holder	= sem->holder; // only tracked for mutex sems
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 	int_restore_interrupts();
 
 	return NO_ERROR;
@@ -577,7 +841,9 @@ int sem_get_sem_info(sem_id id, struct sem_info *info)
 
 int sem_get_next_sem_info(proc_id proc, uint32 *cookie, struct sem_info *info)
 {
-	int slot;
+	unsigned int slot;
+	unsigned int capacity;
+	struct sem_entry *sem;
 
 	if(sems_active == false)
 		return ERR_SEM_NOT_ACTIVE;
@@ -591,37 +857,38 @@ int sem_get_next_sem_info(proc_id proc, uint32 *cookie, struct sem_info *info)
 		// return first found
 		slot = 0;
 	} else {
-		// start at index cookie, but check cookie against MAX_PORTS
+		// start at index cookie, but check cookie against the table size
 		slot = *cookie;
 		if (slot >= MAX_SEMS)
 			return ERR_INVALID_HANDLE;
 	}
-	// spinlock
+	// the table only ever grows, so anything past this was created after we started
+	capacity = id_table_capacity(sem_table);
+
 	int_disable_interrupts();
-	GRAB_SEM_LIST_LOCK();
 
-	while (slot < MAX_SEMS) {
-		GRAB_SEM_LOCK(sems[slot]);
-		if (sems[slot].id != -1)
-			if (sems[slot].owner == proc) {
+	while (slot < capacity) {
+		sem = id_table_lookup(sem_table, slot);
+		GRAB_SEM_LOCK(*sem);
+		if (sem->id != -1)
+			if (sem->owner == proc) {
 				// found one!
-				info->sem			= sems[slot].id;
-				info->proc			= sems[slot].owner;
-				strncpy(info->name, sems[slot].name, SYS_MAX_OS_NAME_LEN-1);
-				info->count			= sems[slot].count;
-				info->latest_holder	= -1; // XXX fixme
+				info->sem			= sem->id;
+				info->proc			= sem->owner;
+				strncpy(info->name, sem->name, SYS_MAX_OS_NAME_LEN-1);
+				info->count			= sem->count;
+				info->latest_holder	= sem->holder; // only tracked for mutex sems
 
-				RELEASE_SEM_LOCK(sems[slot]);
+				RELEASE_SEM_LOCK(*sem);
 				slot++;
 				break;
 			}
-		RELEASE_SEM_LOCK(sems[slot]);
+		RELEASE_SEM_LOCK(*sem);
 		slot++;
 	}
-	RELEASE_SEM_LIST_LOCK();
 	int_restore_interrupts();
 
-	if (slot == MAX_SEMS)
+	if (slot >= capacity)
 		return ERR_SEM_NOT_FOUND;
 	*cookie = slot;
 	return NO_ERROR;
@@ -629,7 +896,7 @@ int sem_get_next_sem_info(proc_id proc, uint32 *cookie, struct sem_info *info)
 
 int set_sem_owner(sem_id id, proc_id proc)
 {
-	int slot;
+	struct sem_entry *sem;
 
 	if(sems_active == false)
 		return ERR_SEM_NOT_ACTIVE;
@@ -642,21 +909,23 @@ int set_sem_owner(sem_id id, proc_id proc)
 //	if (proc_get_proc_struct(proc) == NULL)
 //		return ERR_INVALID_HANDLE; // proc_id doesn't exist right now
 
-	slot = id % MAX_SEMS;
+	sem = id_table_lookup(sem_table, id);
+	if(sem == NULL)
+		return ERR_INVALID_HANDLE;
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
-		RELEASE_SEM_LOCK(sems[slot]);
+	if(sem->id != id) {
+		RELEASE_SEM_LOCK(*sem);
 		int_restore_interrupts();
 		dprintf("set_sem_owner: invalid sem_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
-	sems[slot].owner = proc;
+	sem->owner = proc;
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 	int_restore_interrupts();
 
 	return NO_ERROR;
@@ -666,8 +935,9 @@ int set_sem_owner(sem_id id, proc_id proc)
 // this function must be entered with interrupts disabled and THREADLOCK held
 int sem_interrupt_thread(struct thread *t)
 {
-	int slot;
+	struct sem_entry *sem;
 	struct list_node wakeup_queue;
+	thread_id holder;
 
 //	dprintf("sem_interrupt_thread: called on thread %p (%d), blocked on sem 0x%x\n", t, t->id, t->sem_blocking);
 
@@ -678,19 +948,25 @@ int sem_interrupt_thread(struct thread *t)
 	if((t->sem_flags & SEM_FLAG_INTERRUPTABLE) == 0)
 		return ERR_SEM_NOT_INTERRUPTABLE;
 
-	slot = t->sem_blocking % MAX_SEMS;
+	sem = id_table_lookup(sem_table, t->sem_blocking);
+	if(sem == NULL)
+		panic("sem_interrupt_thread: thread 0x%x sez it's blocking on sem 0x%x, but that sem doesn't exist!\n", t->id, t->sem_blocking);
 
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != t->sem_blocking) {
+	if(sem->id != t->sem_blocking) {
 		panic("sem_interrupt_thread: thread 0x%x sez it's blocking on sem 0x%x, but that sem doesn't exist!\n", t->id, t->sem_blocking);
 	}
 
 	list_initialize(&wakeup_queue);
-	if(remove_thread_from_sem(t, &sems[slot], &wakeup_queue, ERR_INTERRUPTED) == ERR_NOT_FOUND)
+	if(remove_thread_from_sem(t, sem, &wakeup_queue, ERR_INTERRUPTED) == ERR_NOT_FOUND)
 		panic("sem_interrupt_thread: thread 0x%x not found in sem 0x%x's wait queue\n", t->id, t->sem_blocking);
+	holder = (sem->flags & SEM_ENTRY_FLAG_INHERIT) ? sem->holder : -1;
+
+	RELEASE_SEM_LOCK(*sem);
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	if(holder >= 0)
+		sem_update_inherited_priority(holder);
 
 	while((t = thread_dequeue(&wakeup_queue)) != NULL) {
 		thread_enqueue_run_q(t);
@@ -725,40 +1001,63 @@ static int remove_thread_from_sem(struct thread *t, struct sem_entry *sem, struc
 		}
 		sem->count -= delta;
 	}
+
+	if(sem->flags & SEM_ENTRY_FLAG_INHERIT)
+		sem->waiter_priority = sem_max_waiter_priority(sem);
+
 	return NO_ERROR;
 }
 
+// a thread that's going away forgets the priority inheriting sems it never
+// let go of, so none of them point at its thread structure once it's reused.
+// The sems stay locked, there's just no holder to lend priority to anymore.
+void sem_drop_held_sems(struct thread *t)
+{
+	struct sem_entry *sem;
+
+	int_disable_interrupts();
+	for(;;) {
+		acquire_spinlock(&t->pi_sems_lock);
+		sem = list_peek_head_type(&t->pi_sems, struct sem_entry, holder_node);
+		release_spinlock(&t->pi_sems_lock);
+		if(sem == NULL)
+			break;
+
+		// someone else may let go of it for us while the locks are switched
+		GRAB_SEM_LOCK(*sem);
+		if(sem->holder_thread == t)
+			sem_clear_holder(sem);
+		RELEASE_SEM_LOCK(*sem);
+	}
+	int_restore_interrupts();
+}
+
 /* this function cycles through the sem table, deleting all the sems that are owned by
    the passed proc_id */
 int sem_delete_owned_sems(proc_id owner)
 {
-	int i;
+	unsigned int i;
 	int count = 0;
+	struct sem_entry *sem;
+	sem_id id;
 
 	if (owner < 0)
 		return ERR_INVALID_HANDLE;
 
-	int_disable_interrupts();
-	GRAB_SEM_LIST_LOCK();
-
-	for(i=0; i<MAX_SEMS; i++) {
-		if(sems[i].id != -1 && sems[i].owner == owner) {
-			sem_id id = sems[i].id;
+	for(i=0; i<id_table_capacity(sem_table); i++) {
+		sem = id_table_lookup(sem_table, i);
 
-			RELEASE_SEM_LIST_LOCK();
-			int_restore_interrupts();
+		int_disable_interrupts();
+		GRAB_SEM_LOCK(*sem);
+		id = (sem->owner == owner) ? sem->id : -1;
+		RELEASE_SEM_LOCK(*sem);
+		int_restore_interrupts();
 
-			sem_delete_etc(id, 0);
+		// sem_delete_etc rechecks the id, so it's fine if the sem went away in the meantime
+		if(id >= 0 && sem_delete_etc(id, 0) == NO_ERROR)
 			count++;
-
-			int_disable_interrupts();
-			GRAB_SEM_LIST_LOCK();
-		}
 	}
 
-	RELEASE_SEM_LIST_LOCK();
-	int_restore_interrupts();
-
 	return count;
 }
 
@@ -0,0 +1,510 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/heap.h>
+#include <kernel/slab.h>
+#include <kernel/smp.h>
+#include <kernel/int.h>
+#include <kernel/list.h>
+#include <kernel/debug.h>
+#include <kernel/arch/cpu.h>
+#include <newos/errors.h>
+
+#include <string.h>
+
+#if DEBUG > 2
+#define WIPE_SLAB_FREE 1
+#endif
+
+// Object caches in the style of Bonwick's slab allocator, with the per cpu
+// magazine layer on top.
+
+#define SLAB_MAGAZINE_ROUNDS 14
+#define SLAB_MAX_PAGES 16		// largest page bin in the heap
+#define SLAB_MIN_OBJECTS 4
+#define SLAB_MAX_EMPTY 1		// empty slabs kept around per cache
+#define SLAB_DEPOT_BYTES (64*1024)	// worth of objects parked in full magazines per cache
+#define SLAB_DEPOT_MAX_FULL 8
+#define SLAB_CACHE_LINE 64
+
+struct slab {
+	struct list_node node;	// on one of the cache's slab lists
+	struct slab_cache *cache;
+	void *free_list;
+	unsigned int in_use;
+};
+
+struct slab_magazine {
+	struct slab_magazine *next;	// in the depot
+	int rounds;
+	void *objects[SLAB_MAGAZINE_ROUNDS];
+};
+
+struct slab_cpu {
+	struct slab_magazine *loaded;
+	struct slab_magazine *previous;
+
+	// stats
+	int allocs;
+	int frees;
+	int misses;	// had to go to the slab layer
+} _ALIGNED(SLAB_CACHE_LINE);
+
+struct slab_cache {
+	struct list_node node;	// on the global cache list
+	char name[SYS_MAX_OS_NAME_LEN];
+	unsigned int object_size;
+	unsigned int slab_pages;
+	unsigned int objects_per_slab;
+	unsigned int first_object;	// offset of the first object from the slab
+	unsigned int depot_max_full;
+	int flags;
+
+	// everything from here to the per cpu data is protected by this
+	spinlock_t lock;
+
+	struct list_node full;
+	struct list_node partial;
+	struct list_node empty;
+	int slab_count;
+	int empty_count;
+	int objects_out;	// handed out by the slab layer, including those sitting in magazines
+
+	struct slab_magazine *full_magazines;
+	struct slab_magazine *empty_magazines;
+	int full_magazine_count;
+	int empty_magazine_count;
+
+	// stats
+	int grows;
+	int shrinks;
+
+	struct slab_cpu cpu[_MAX_CPUS];
+};
+
+static struct list_node cache_list;
+static spinlock_t cache_list_lock;
+
+// bootstrap caches, everything else gets its struct out of cache_cache
+static struct slab_cache cache_cache;
+static struct slab_cache magazine_cache;
+static struct slab_cache kmalloc_caches[8];	// 16 .. SLAB_KMALLOC_MAX
+static const char *kmalloc_cache_names[8] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+static int init_cache(struct slab_cache *cache, const char *name, unsigned int size, unsigned int align, int flags)
+{
+	unsigned int pages;
+	unsigned int count;
+	unsigned int waste;
+
+	if(align < sizeof(void *))
+		align = sizeof(void *);
+	if((align & (align - 1)) != 0)
+		return ERR_INVALID_ARGS;
+
+	memset(cache, 0, sizeof(struct slab_cache));
+	strlcpy(cache->name, name, sizeof(cache->name));
+	cache->object_size = ROUNDUP(max(size, sizeof(void *)), align);
+	cache->first_object = ROUNDUP(sizeof(struct slab), align);
+	cache->flags = flags;
+
+	// smallest slab that holds a few objects without wasting more than an eighth of it
+	for(pages = 1; pages <= SLAB_MAX_PAGES; pages++) {
+		count = (pages * PAGE_SIZE - cache->first_object) / cache->object_size;
+		waste = pages * PAGE_SIZE - cache->first_object - count * cache->object_size;
+		if(count >= SLAB_MIN_OBJECTS && waste * 8 <= pages * PAGE_SIZE)
+			break;
+	}
+	if(pages > SLAB_MAX_PAGES) {
+		pages = SLAB_MAX_PAGES;
+		count = (pages * PAGE_SIZE - cache->first_object) / cache->object_size;
+		if(count == 0)
+			return ERR_INVALID_ARGS;
+	}
+	cache->slab_pages = pages;
+	cache->objects_per_slab = count;
+
+	// don't let the depot sit on too much memory for caches of big objects
+	cache->depot_max_full = SLAB_DEPOT_BYTES / (cache->object_size * SLAB_MAGAZINE_ROUNDS);
+	cache->depot_max_full = max(1, min(cache->depot_max_full, SLAB_DEPOT_MAX_FULL));
+
+	cache->lock = 0;
+	list_initialize(&cache->full);
+	list_initialize(&cache->partial);
+	list_initialize(&cache->empty);
+
+	int_disable_interrupts();
+	acquire_spinlock(&cache_list_lock);
+	list_add_tail(&cache_list, &cache->node);
+	release_spinlock(&cache_list_lock);
+	int_restore_interrupts();
+
+	return NO_ERROR;
+}
+
+static struct slab *create_slab(struct slab_cache *cache)
+{
+	struct slab *slab;
+	char *obj;
+	unsigned int i;
+
+	slab = (struct slab *)heap_alloc_slab_pages(cache->slab_pages);
+	if(slab == NULL)
+		return NULL;
+
+	slab->cache = cache;
+	slab->in_use = 0;
+	slab->free_list = NULL;
+
+	obj = (char *)slab + cache->first_object + (cache->objects_per_slab - 1) * cache->object_size;
+	for(i = 0; i < cache->objects_per_slab; i++) {
+		*(void **)obj = slab->free_list;
+		slab->free_list = obj;
+		obj -= cache->object_size;
+	}
+
+	return slab;
+}
+
+// NOTE: expects the cache lock to be held
+static void *get_object(struct slab_cache *cache)
+{
+	struct slab *slab;
+	void *obj;
+
+	slab = list_peek_head_type(&cache->partial, struct slab, node);
+	if(slab == NULL) {
+		slab = list_remove_head_type(&cache->empty, struct slab, node);
+		if(slab == NULL)
+			return NULL;
+		cache->empty_count--;
+		list_add_head(&cache->partial, &slab->node);
+	}
+
+	obj = slab->free_list;
+	slab->free_list = *(void **)obj;
+	slab->in_use++;
+	if(slab->in_use == cache->objects_per_slab) {
+		list_delete(&slab->node);
+		list_add_head(&cache->full, &slab->node);
+	}
+	cache->objects_out++;
+
+	return obj;
+}
+
+// NOTE: expects the cache lock to be held
+// returns a slab that should go back to the heap, if any
+static struct slab *put_object(struct slab_cache *cache, struct slab *slab, void *obj)
+{
+	*(void **)obj = slab->free_list;
+	slab->free_list = obj;
+	cache->objects_out--;
+
+	if(slab->in_use-- == cache->objects_per_slab) {
+		list_delete(&slab->node);
+		list_add_head(&cache->partial, &slab->node);
+	}
+	if(slab->in_use == 0) {
+		list_delete(&slab->node);
+		if(cache->empty_count >= SLAB_MAX_EMPTY) {
+			cache->slab_count--;
+			cache->shrinks++;
+			return slab;
+		}
+		list_add_head(&cache->empty, &slab->node);
+		cache->empty_count++;
+	}
+	return NULL;
+}
+
+static void *slab_layer_alloc(struct slab_cache *cache)
+{
+	struct slab *slab;
+	void *obj;
+
+	for(;;) {
+		int_disable_interrupts();
+		acquire_spinlock(&cache->lock);
+
+		obj = get_object(cache);
+
+		release_spinlock(&cache->lock);
+		int_restore_interrupts();
+
+		if(obj != NULL)
+			return obj;
+
+		// grab more pages from the heap, which may block
+		slab = create_slab(cache);
+		if(slab == NULL)
+			return NULL;
+
+		int_disable_interrupts();
+		acquire_spinlock(&cache->lock);
+
+		list_add_head(&cache->empty, &slab->node);
+		cache->empty_count++;
+		cache->slab_count++;
+		cache->grows++;
+
+		release_spinlock(&cache->lock);
+		int_restore_interrupts();
+	}
+}
+
+static void slab_layer_free(struct slab_cache *cache, void *obj)
+{
+	struct slab *slab;
+
+	slab = (struct slab *)heap_find_slab(obj);
+	if(slab == NULL || slab->cache != cache)
+		panic("slab_free: object %p does not belong to cache '%s'\n", obj, cache->name);
+
+	int_disable_interrupts();
+	acquire_spinlock(&cache->lock);
+
+	slab = put_object(cache, slab, obj);
+
+	release_spinlock(&cache->lock);
+	int_restore_interrupts();
+
+	if(slab != NULL)
+		heap_free_slab_pages(slab, cache->slab_pages);
+}
+
+struct slab_cache *slab_cache_create(const char *name, unsigned int size, unsigned int align, int flags)
+{
+	struct slab_cache *cache;
+
+	cache = (struct slab_cache *)slab_layer_alloc(&cache_cache);
+	if(cache == NULL)
+		return NULL;
+
+	if(init_cache(cache, name, size, align, flags) < 0) {
+		slab_layer_free(&cache_cache, cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+void *slab_alloc(struct slab_cache *cache)
+{
+	struct slab_cpu *cpu;
+	struct slab_magazine *mag;
+	void *obj;
+
+	if(cache->flags & SLAB_NO_MAGAZINES)
+		return slab_layer_alloc(cache);
+
+	int_disable_interrupts();
+	cpu = &cache->cpu[smp_get_current_cpu()];
+
+	if(cpu->loaded == NULL || cpu->loaded->rounds == 0) {
+		if(cpu->previous != NULL && cpu->previous->rounds > 0) {
+			mag = cpu->loaded;
+			cpu->loaded = cpu->previous;
+			cpu->previous = mag;
+		} else {
+			// trade the empty previous magazine for a full one from the depot
+			acquire_spinlock(&cache->lock);
+			mag = cache->full_magazines;
+			if(mag != NULL) {
+				cache->full_magazines = mag->next;
+				cache->full_magazine_count--;
+				if(cpu->previous != NULL) {
+					cpu->previous->next = cache->empty_magazines;
+					cache->empty_magazines = cpu->previous;
+					cache->empty_magazine_count++;
+				}
+				cpu->previous = cpu->loaded;
+				cpu->loaded = mag;
+			}
+			release_spinlock(&cache->lock);
+
+			if(mag == NULL) {
+				cpu->misses++;
+				int_restore_interrupts();
+				return slab_layer_alloc(cache);
+			}
+		}
+	}
+
+	obj = cpu->loaded->objects[--cpu->loaded->rounds];
+	cpu->allocs++;
+
+	int_restore_interrupts();
+
+	return obj;
+}
+
+void slab_free(struct slab_cache *cache, void *obj)
+{
+	struct slab_cpu *cpu;
+	struct slab_magazine *mag;
+
+	if(obj == NULL)
+		return;
+
+#if WIPE_SLAB_FREE
+	memset((char *)obj, 0x99, cache->object_size);
+#endif
+
+	if(cache->flags & SLAB_NO_MAGAZINES) {
+		slab_layer_free(cache, obj);
+		return;
+	}
+
+	for(;;) {
+		int_disable_interrupts();
+		cpu = &cache->cpu[smp_get_current_cpu()];
+
+		if(cpu->loaded != NULL && cpu->loaded->rounds < SLAB_MAGAZINE_ROUNDS)
+			break;
+
+		if(cpu->previous != NULL && cpu->previous->rounds < SLAB_MAGAZINE_ROUNDS) {
+			mag = cpu->loaded;
+			cpu->loaded = cpu->previous;
+			cpu->previous = mag;
+			break;
+		}
+
+		// trade the full previous magazine for an empty one from the depot
+		acquire_spinlock(&cache->lock);
+		mag = cache->empty_magazines;
+		if(mag != NULL) {
+			cache->empty_magazines = mag->next;
+			cache->empty_magazine_count--;
+			if(cpu->previous != NULL) {
+				cpu->previous->next = cache->full_magazines;
+				cache->full_magazines = cpu->previous;
+				cache->full_magazine_count++;
+			}
+			cpu->previous = cpu->loaded;
+			cpu->loaded = mag;
+		}
+		release_spinlock(&cache->lock);
+
+		if(mag != NULL)
+			break;
+
+		cpu->misses++;
+		int_restore_interrupts();
+
+		// the depot is out of empty magazines, make a new one unless it's holding enough already
+		if(cache->full_magazine_count >= (int)cache->depot_max_full
+			|| (mag = (struct slab_magazine *)slab_layer_alloc(&magazine_cache)) == NULL) {
+			slab_layer_free(cache, obj);
+			return;
+		}
+		mag->rounds = 0;
+
+		int_disable_interrupts();
+		acquire_spinlock(&cache->lock);
+		mag->next = cache->empty_magazines;
+		cache->empty_magazines = mag;
+		cache->empty_magazine_count++;
+		release_spinlock(&cache->lock);
+		int_restore_interrupts();
+	}
+
+	cpu->loaded->objects[cpu->loaded->rounds++] = obj;
+	cpu->frees++;
+
+	int_restore_interrupts();
+}
+
+void *slab_kmalloc(unsigned int size)
+{
+	int i;
+
+	for(i = 0; size > (16U << i); i++)
+		;
+	return slab_alloc(&kmalloc_caches[i]);
+}
+
+void slab_kfree(void *slab_base, void *address)
+{
+	struct slab *slab = (struct slab *)slab_base;
+
+	slab_free(slab->cache, address);
+}
+
+static void dump_cache(struct slab_cache *cache, bool verbose)
+{
+	int rounds = 0;
+	int allocs = 0;
+	int frees = 0;
+	int misses = 0;
+	int total;
+	int i;
+
+	for(i = 0; i < smp_get_num_cpus(); i++) {
+		if(cache->cpu[i].loaded)
+			rounds += cache->cpu[i].loaded->rounds;
+		if(cache->cpu[i].previous)
+			rounds += cache->cpu[i].previous->rounds;
+		allocs += cache->cpu[i].allocs;
+		frees += cache->cpu[i].frees;
+		misses += cache->cpu[i].misses;
+	}
+	rounds += cache->full_magazine_count * SLAB_MAGAZINE_ROUNDS;
+	total = cache->slab_count * cache->objects_per_slab;
+
+	dprintf("%-16s %5d %3d %6d %6d %6d %6d %3d%% %5d/%-5d %d/%d/%d\n",
+		cache->name, cache->object_size, cache->slab_pages, cache->slab_count,
+		cache->objects_out - rounds, rounds, total,
+		total ? ((cache->objects_out - rounds) * 100) / total : 0,
+		cache->full_magazine_count, cache->empty_magazine_count,
+		allocs, frees, misses);
+
+	if(!verbose)
+		return;
+
+	dprintf("\t%d objects per slab at offset %d, slabs %d full %d empty, grows %d shrinks %d, depot max %d\n",
+		cache->objects_per_slab, cache->first_object, cache->slab_count, cache->empty_count,
+		cache->grows, cache->shrinks, cache->depot_max_full);
+	for(i = 0; i < smp_get_num_cpus(); i++) {
+		dprintf("\tcpu %d: loaded %p (%d) previous %p (%d) allocs %d frees %d misses %d\n", i,
+			cache->cpu[i].loaded, cache->cpu[i].loaded ? cache->cpu[i].loaded->rounds : 0,
+			cache->cpu[i].previous, cache->cpu[i].previous ? cache->cpu[i].previous->rounds : 0,
+			cache->cpu[i].allocs, cache->cpu[i].frees, cache->cpu[i].misses);
+	}
+}
+
+static void dump_slab_caches(int argc, char **argv)
+{
+	struct slab_cache *cache;
+
+	dprintf("%-16s %5s %3s %6s %6s %6s %6s %4s %11s %s\n",
+		"cache", "size", "pgs", "slabs", "inuse", "cached", "total", "util", "depot f/e", "allocs/frees/misses");
+	list_for_every_entry(&cache_list, cache, struct slab_cache, node) {
+		if(argc > 1 && strcmp(argv[1], cache->name) != 0)
+			continue;
+		dump_cache(cache, argc > 1);
+	}
+}
+
+int slab_init(void)
+{
+	unsigned int i;
+
+	list_initialize(&cache_list);
+	cache_list_lock = 0;
+
+	init_cache(&cache_cache, "slab_cache", sizeof(struct slab_cache), SLAB_CACHE_LINE, SLAB_NO_MAGAZINES);
+	init_cache(&magazine_cache, "slab_magazine", sizeof(struct slab_magazine), 0, SLAB_NO_MAGAZINES);
+	for(i = 0; i < sizeof(kmalloc_caches) / sizeof(kmalloc_caches[0]); i++)
+		init_cache(&kmalloc_caches[i], kmalloc_cache_names[i], 16 << i, min(16 << i, SLAB_CACHE_LINE), 0);
+
+	dbg_add_command(&dump_slab_caches, "slabs", "dump slab cache utilization, or details of the named cache");
+
+	return NO_ERROR;
+}
+
@@ -73,6 +73,16 @@ void acquire_spinlock(spinlock_t *lock)
 	}
 }
 
+// grab the lock only if nobody has it, for when spinning could deadlock
+bool try_acquire_spinlock(spinlock_t *lock)
+{
+	if(smp_num_cpus > 1) {
+		if(*lock != 0 || atomic_set(lock, 1) != 0)
+			return false;
+	}
+	return true;
+}
+
 static void acquire_spinlock_nocheck(spinlock_t *lock)
 {
 	if(smp_num_cpus > 1) {
@@ -11,9 +11,11 @@
 #include <kernel/sem.h>
 #include <kernel/port.h>
 #include <kernel/vm.h>
+#include <kernel/vm_swap.h>
 #include <kernel/cpu.h>
 #include <kernel/time.h>
 #include <kernel/signal.h>
+#include <kernel/wait_set.h>
 #include <sys/resource.h>
 
 static int syscall_null(void)
@@ -119,6 +121,13 @@ const struct syscall_table_entry syscall_table[] = {
 	SYSCALL_ENTRY(setpgid),
 	SYSCALL_ENTRY(getpgid),
 	SYSCALL_ENTRY(setsid),
+	SYSCALL_ENTRY(user_vm_swapon),
+	SYSCALL_ENTRY(user_proc_fork),				/* 90 */
+	SYSCALL_ENTRY(user_wait_set_create),
+	SYSCALL_ENTRY(user_wait_set_delete),
+	SYSCALL_ENTRY(user_wait_set_add),
+	SYSCALL_ENTRY(user_wait_set_remove),
+	SYSCALL_ENTRY(user_wait_set_wait),			/* 95 */
 };
 
 int num_syscall_table_entries = sizeof(syscall_table) / sizeof(struct syscall_table_entry);
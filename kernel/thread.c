@@ -18,9 +18,11 @@
 #include <kernel/arch/vm.h>
 #include <kernel/sem.h>
 #include <kernel/port.h>
+#include <kernel/wait_set.h>
 #include <kernel/vfs.h>
 #include <kernel/elf.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/signal.h>
 #include <kernel/list.h>
 #include <newos/user_runtime.h>
@@ -45,12 +47,21 @@ struct proc_arg {
 	unsigned int argc;
 };
 
+// args to proc_fork_proc2()
+struct fork_arg {
+	void *user_state;
+	addr_t user_stack_base;
+	sigset_t sig_block_mask;
+	struct sigaction sig_action[32];
+};
+
 static void insert_proc_into_parent(struct proc *parent, struct proc *p);
 static void remove_proc_from_parent(struct proc *parent, struct proc *p);
 static struct proc *create_proc_struct(const char *name, bool kernel);
 static int proc_struct_compare(void *_p, const void *_key);
 static unsigned int proc_struct_hash(void *_p, const void *_key, unsigned int range);
 static void proc_reparent_children(struct proc *p);
+static void thread_finish_switch(void);
 
 // global
 spinlock_t thread_spinlock = 0;
@@ -95,7 +106,9 @@ static struct sid_node *create_session_struct(sess_id sid);
 
 // thread list
 static struct thread *idle_threads[_MAX_CPUS];
+static volatile int idle_cpu_mask; // bit set for every cpu running its idle thread
 static void *thread_hash = NULL;
+static struct slab_cache *thread_cache = NULL;
 static thread_id next_thread_id = 1;
 
 static sem_id snooze_sem = -1;
@@ -113,10 +126,18 @@ static unsigned int volatile death_stack_bitmap;
 static sem_id death_stack_sem;
 
 // thread queues
-static struct list_node run_q[THREAD_NUM_PRIORITY_LEVELS] = { { NULL, NULL }, };
+// the run queues live in the per-cpu structure, see cpu.h
+#define THREAD_AGING_TIME 20000 // a ready thread waiting longer than this starts moving up
+
+// scheduling quanta
+#define THREAD_QUANTUM 10000
+#define THREAD_MIN_QUANTUM 5000
+#define THREAD_MAX_QUANTUM 40000
+#define THREAD_MAX_QUANTUM_SHIFT 2
+
+#define THREAD_WAKEUP_BOOST 2 // priority levels added to a thread released from a sem
 static struct list_node dead_q;
 
-static int _rand(void);
 //static struct proc *proc_get_proc_struct(proc_id id); // unused
 static struct proc *proc_get_proc_struct_locked(proc_id id);
 
@@ -143,23 +164,203 @@ void thread_dequeue_thread(struct thread *t)
 
 struct thread *thread_lookat_run_q(int priority)
 {
-	return thread_lookat_queue(&run_q[priority]);
+	return thread_lookat_queue(&get_curr_cpu_struct()->run_q[priority]);
+}
+
+// index of the highest set bit in a non-zero word
+static int highest_bit(uint32 word)
+{
+	int bit = 0;
+
+	if(word & 0xffff0000) { word >>= 16; bit += 16; }
+	if(word & 0xff00) { word >>= 8; bit += 8; }
+	if(word & 0xf0) { word >>= 4; bit += 4; }
+	if(word & 0xc) { word >>= 2; bit += 2; }
+	if(word & 0x2) { bit += 1; }
+	return bit;
+}
+
+// highest priority non-empty run queue at or above min_priority, -1 if none
+static int run_q_highest(cpu_ent *c, int min_priority)
+{
+	int i;
+
+	for(i = THREAD_NUM_PRIORITY_LEVELS / 32 - 1; i >= min_priority / 32; i--) {
+		uint32 word = c->run_q_bitmap[i];
+
+		if(i == min_priority / 32)
+			word &= ~((1U << (min_priority % 32)) - 1);
+		if(word)
+			return i * 32 + highest_bit(word);
+	}
+	return -1;
+}
+
+// lowest priority non-empty run queue at or above min_priority, -1 if none
+static int run_q_lowest(cpu_ent *c, int min_priority)
+{
+	int i;
+
+	for(i = min_priority / 32; i < THREAD_NUM_PRIORITY_LEVELS / 32; i++) {
+		uint32 word = c->run_q_bitmap[i];
+
+		if(i == min_priority / 32)
+			word &= ~((1U << (min_priority % 32)) - 1);
+		if(word)
+			return i * 32 + highest_bit(word & -word);
+	}
+	return -1;
+}
+
+// NOTE: expects c's run queue lock to be held
+static void run_q_insert_level(cpu_ent *c, struct thread *t, int level)
+{
+	thread_enqueue(t, &c->run_q[level]);
+	c->run_q_bitmap[level / 32] |= (1U << (level % 32));
+	t->run_q_priority = level;
+	t->last_cpu = c;
+	if(level != THREAD_IDLE_PRIORITY)
+		c->run_q_count++;
+}
+
+// NOTE: expects c's run queue lock to be held
+static void run_q_insert(cpu_ent *c, struct thread *t)
+{
+	t->ready_time = system_time();
+	run_q_insert_level(c, t, t->priority);
+}
+
+// NOTE: expects c's run queue lock to be held
+static struct thread *run_q_remove(cpu_ent *c, int level)
+{
+	struct thread *t = thread_dequeue(&c->run_q[level]);
+
+	if(list_is_empty(&c->run_q[level]))
+		c->run_q_bitmap[level / 32] &= ~(1U << (level % 32));
+	if(t == NULL)
+		return NULL;
+	if(level != THREAD_IDLE_PRIORITY)
+		c->run_q_count--;
+	t->run_q_priority = -1;
+	return t;
+}
+
+// pull a ready thread out of whatever run queue it's sitting in.
+// returns false if a cpu picked it to run before we got to it.
+// NOTE: expects the thread lock to be held
+static bool run_q_remove_thread(struct thread *t)
+{
+	cpu_ent *c;
+	int level;
+
+	// it may get stolen over to another cpu while we wait for the lock
+	for(;;) {
+		c = t->last_cpu;
+		acquire_spinlock(&c->run_q_lock);
+		if(t->last_cpu == c)
+			break;
+		release_spinlock(&c->run_q_lock);
+	}
+
+	level = t->run_q_priority;
+	if(level < 0) {
+		release_spinlock(&c->run_q_lock);
+		return false;
+	}
+
+	thread_dequeue_thread(t);
+	if(list_is_empty(&c->run_q[level]))
+		c->run_q_bitmap[level / 32] &= ~(1U << (level % 32));
+	if(level != THREAD_IDLE_PRIORITY)
+		c->run_q_count--;
+	t->run_q_priority = -1;
+	release_spinlock(&c->run_q_lock);
+	return true;
+}
+
+// anti-starvation: the longest waiting thread in the lowest occupied regular
+// queue moves up a level each time we pick, once it has waited long enough.
+// being at the head of a fifo queue, it is the oldest thread at its level.
+// NOTE: expects c's run queue lock to be held
+static void run_q_age(cpu_ent *c, int top_level)
+{
+	struct thread *t;
+	int level = run_q_lowest(c, THREAD_MIN_PRIORITY);
+
+	if(level < 0 || level >= top_level || level >= THREAD_MAX_PRIORITY)
+		return;
+
+	t = thread_lookat_queue(&c->run_q[level]);
+	if(system_time() - t->ready_time < THREAD_AGING_TIME)
+		return;
+
+	run_q_remove(c, level);
+	run_q_insert_level(c, t, level + 1);
+}
+
+// a cpu's load is the number of threads waiting on it plus the one it's running
+static int cpu_load(cpu_ent *c)
+{
+	int load = c->run_q_count;
+
+	if(c->running_thread != NULL && c->running_thread->priority != THREAD_IDLE_PRIORITY)
+		load++;
+	return load;
+}
+
+// decide which cpu's run queue a thread that just became ready goes into.
+// stick with the cpu it last ran on to keep its cache warm, unless it
+// has work to do and another cpu is sitting idle. Balancing beyond that
+// is left to idle cpus stealing work.
+static cpu_ent *run_q_pick_cpu(struct thread *t)
+{
+	cpu_ent *target = t->last_cpu;
+	int idle;
+	int i;
+
+	if(target == NULL)
+		target = get_curr_cpu_struct();
+
+	// idle threads never leave their cpu. A thread still being switched out
+	// has to go back to the cpu doing it, which holds its run queue lock until
+	// it is off the thread's stack.
+	if(t->priority == THREAD_IDLE_PRIORITY || t->in_switch || smp_get_num_cpus() == 1)
+		return target;
+
+	idle = idle_cpu_mask;
+	if(idle == 0 || (idle & (1 << target->cpu_num)) || cpu_load(target) == 0)
+		return target;
+
+	// claim the idle cpu so the next wakeup doesn't pile onto it too,
+	// it sets its bit again if it still has nothing to run
+	i = highest_bit(idle & -idle);
+	atomic_and(&idle_cpu_mask, ~(1 << i));
+	return get_cpu_struct(i);
 }
 
 void thread_enqueue_run_q(struct thread *t)
 {
+	cpu_ent *target;
+	bool poke;
+
 	// these shouldn't exist
 	if(t->priority > THREAD_MAX_PRIORITY)
 		t->priority = THREAD_MAX_PRIORITY;
 	if(t->priority < 0)
 		t->priority = 0;
 
-	thread_enqueue(t, &run_q[t->priority]);
-}
+	target = run_q_pick_cpu(t);
+	acquire_spinlock(&target->run_q_lock);
+	run_q_insert(target, t);
 
-static struct thread *thread_dequeue_run_q(int priority)
-{
-	return thread_dequeue(&run_q[priority]);
+	// if the new thread should preempt whatever the other cpu is running, poke it
+	poke = target->cpu_num != smp_get_current_cpu()
+		&& target->running_thread != NULL
+		&& target->running_thread->priority < t->priority;
+	release_spinlock(&target->run_q_lock);
+
+	if(poke)
+		smp_send_ici(target->cpu_num, SMP_MSG_RESCHEDULE, 0, 0, 0, NULL, SMP_MSG_FLAG_ASYNC);
 }
 
 static void insert_thread_into_proc(struct proc *p, struct thread *t)
@@ -288,7 +489,7 @@ static struct thread *create_thread_struct(const char *name)
 	int_restore_interrupts();
 
 	if(t == NULL) {
-		t = (struct thread *)kmalloc(sizeof(struct thread));
+		t = (struct thread *)slab_alloc(thread_cache);
 		if(t == NULL)
 			goto err;
 	}
@@ -299,6 +500,8 @@ static struct thread *create_thread_struct(const char *name)
 	t->id = atomic_add(&next_thread_id, 1);
 	t->proc = NULL;
 	t->cpu = NULL;
+	t->last_cpu = NULL;
+	t->in_switch = false;
 	t->fpu_cpu = NULL;
 	t->fpu_state_saved = true;
 	t->sem_blocking = -1;
@@ -309,6 +512,13 @@ static struct thread *create_thread_struct(const char *name)
 	t->user_stack_base = 0;
 	list_clear_node(&t->proc_node);
 	t->priority = -1;
+	t->base_priority = -1;
+	t->inherited_priority = -1;
+	list_initialize(&t->pi_sems);
+	t->pi_sems_lock = 0;
+	t->run_q_priority = -1;
+	t->ready_time = 0;
+	t->quantum_expirations = 0;
 	t->args = NULL;
 	t->sig_pending = 0;
 	t->sig_block_mask = 0;
@@ -337,7 +547,7 @@ static struct thread *create_thread_struct(const char *name)
 err2:
 	sem_delete_etc(t->return_code_sem, -1);
 err1:
-	kfree(t);
+	slab_free(thread_cache, t);
 err:
 	return NULL;
 }
@@ -346,16 +556,16 @@ static void delete_thread_struct(struct thread *t)
 {
 	if(t->return_code_sem >= 0)
 		sem_delete_etc(t->return_code_sem, -1);
-	kfree(t);
+	slab_free(thread_cache, t);
 }
 
 static int _create_user_thread_kentry(void)
 {
 	struct thread *t;
 
-	// simulates the thread spinlock release that would occur if the thread had been
-	// rescheded from. The resched didn't happen because the thread is new.
-	RELEASE_THREAD_LOCK();
+	// finishes the context switch to us, like the resched we would have come
+	// back through does for threads that aren't new.
+	thread_finish_switch();
 	int_restore_interrupts(); // this essentially simulates a return-from-interrupt
 
 	t = thread_get_current_thread();
@@ -380,9 +590,9 @@ static int _create_kernel_thread_kentry(void)
 	struct thread *t;
 	int retcode;
 
-	// simulates the thread spinlock release that would occur if the thread had been
-	// rescheded from. The resched didn't happen because the thread is new.
-	RELEASE_THREAD_LOCK();
+	// finishes the context switch to us, like the resched we would have come
+	// back through does for threads that aren't new.
+	thread_finish_switch();
 	int_restore_interrupts(); // this essentially simulates a return-from-interrupt
 
 	// start tracking kernel time
@@ -412,7 +622,7 @@ static thread_id _create_thread(const char *name, proc_id pid, addr_t entry, voi
 	if(t == NULL)
 		return ERR_NO_MEMORY;
 
-	t->priority = THREAD_MEDIUM_PRIORITY;
+	t->priority = t->base_priority = THREAD_MEDIUM_PRIORITY;
 	t->state = THREAD_STATE_BIRTH;
 	t->next_state = THREAD_STATE_SUSPENDED;
 
@@ -542,6 +752,28 @@ int thread_resume_thread(thread_id id)
 	return send_signal_etc(id, SIGCONT, SIG_FLAG_NO_RESCHED);
 }
 
+// the priority a thread runs at when it isn't temporarily boosted
+static int thread_effective_priority(struct thread *t)
+{
+	return max(t->base_priority, t->inherited_priority);
+}
+
+// move a thread to a new effective priority, requeueing it if it's ready
+// NOTE: expects the thread lock to be held
+static void thread_change_priority(struct thread *t, int priority)
+{
+	if(t->priority == priority)
+		return;
+
+	if(t->state == THREAD_STATE_READY && run_q_remove_thread(t)) {
+		// this thread was in a ready queue, so it needs to be reinserted
+		t->priority = priority;
+		thread_enqueue_run_q(t);
+	} else {
+		t->priority = priority;
+	}
+}
+
 int thread_set_priority(thread_id id, int priority)
 {
 	struct thread *t;
@@ -557,7 +789,8 @@ int thread_set_priority(thread_id id, int priority)
 	if(t->id == id) {
 		// it's ourself, so we know we aren't in a run queue, and we can manipulate
 		// our structure directly
-		t->priority = priority;
+		t->base_priority = priority;
+		t->priority = thread_effective_priority(t);
 		retval = NO_ERROR;
 	} else {
 		int_disable_interrupts();
@@ -565,14 +798,8 @@ int thread_set_priority(thread_id id, int priority)
 
 		t = thread_get_thread_struct_locked(id);
 		if(t) {
-			if(t->state == THREAD_STATE_READY && t->priority != priority) {
-				// this thread is in a ready queue right now, so it needs to be reinserted
-				thread_dequeue_thread(t);
-				t->priority = priority;
-				thread_enqueue_run_q(t);
-			} else {
-				t->priority = priority;
-			}
+			t->base_priority = priority;
+			thread_change_priority(t, thread_effective_priority(t));
 			retval = NO_ERROR;
 		} else {
 			retval = ERR_INVALID_HANDLE;
@@ -585,6 +812,43 @@ int thread_set_priority(thread_id id, int priority)
 	return retval;
 }
 
+// priority inheritance: a thread blocking on a mutex we hold lends us its priority
+// until we let go of our priority inheriting sems.
+// NOTE: expects the thread lock to be held
+void thread_inherit_priority(struct thread *t, int priority)
+{
+	if(priority <= t->inherited_priority)
+		return;
+
+	t->inherited_priority = priority;
+	if(priority > t->priority)
+		thread_change_priority(t, priority);
+}
+
+// NOTE: expects the thread lock to be held
+void thread_drop_inherited_priority(struct thread *t)
+{
+	if(t->inherited_priority < 0)
+		return;
+
+	t->inherited_priority = -1;
+	thread_change_priority(t, thread_effective_priority(t));
+}
+
+// give a thread coming off a wait queue a small push so it gets to run soon.
+// the boost goes away the next time the thread reschedules.
+// NOTE: expects the thread lock to be held, and the thread not to be in a run queue yet
+void thread_wakeup_boost(struct thread *t)
+{
+	int priority = thread_effective_priority(t);
+
+	// leave real-time threads alone
+	if(priority > THREAD_MAX_PRIORITY)
+		return;
+
+	t->priority = min(priority + THREAD_WAKEUP_BOOST, THREAD_MAX_PRIORITY);
+}
+
 int user_thread_set_priority(thread_id id, int priority)
 {
 	// clamp the priority levels the user can set their threads to
@@ -979,6 +1243,30 @@ static void dump_next_thread_in_proc(int argc, char **argv)
 		dprintf("NULL\n");
 }
 
+static void dump_run_queues(int argc, char **argv)
+{
+	int i, j;
+	struct thread *t;
+
+	for(i = 0; i < smp_get_num_cpus(); i++) {
+		dprintf("cpu %d: %d threads waiting, %d steals, running thread %p (0x%x)\n",
+			i, cpu[i].run_q_count, cpu[i].run_q_steals, cpu[i].running_thread,
+			cpu[i].running_thread ? cpu[i].running_thread->id : -1);
+		for(j = THREAD_NUM_PRIORITY_LEVELS - 1; j >= 0; j--) {
+			if(list_is_empty(&cpu[i].run_q[j]))
+				continue;
+			dprintf("\tpri %d:", j);
+			list_for_every_entry(&cpu[i].run_q[j], t, struct thread, q_node) {
+				if(t->run_q_priority != t->priority)
+					dprintf(" 0x%x(%d)", t->id, t->priority);
+				else
+					dprintf(" 0x%x", t->id);
+			}
+			dprintf("\n");
+		}
+	}
+}
+
 static int get_death_stack(void)
 {
 	int i;
@@ -1027,12 +1315,11 @@ static void put_death_stack_and_reschedule(unsigned int index)
 		panic("put_death_stack: passed invalid stack index %d\n", index);
 
 	int_disable_interrupts();
-	GRAB_THREAD_LOCK();
-
-	death_stack_bitmap &= ~(1 << index);
 
-	sem_release_etc(death_stack_sem, 1, SEM_FLAG_NO_RESCHED);
+	// the stack is handed back by whoever we switch to, once we're off it
+	get_curr_cpu_struct()->switch_death_stack = index;
 
+	GRAB_THREAD_LOCK();
 	thread_resched();
 }
 
@@ -1046,6 +1333,11 @@ int thread_init(kernel_args *ka)
 	dprintf("thread_init: entry\n");
 	kprintf("initializing threading system...\n");
 
+	// thread structs hold the fpu save area, which wants 16 byte alignment
+	thread_cache = slab_cache_create("thread", sizeof(struct thread), 16, 0);
+	if(thread_cache == NULL)
+		panic("could not create the thread cache\n");
+
 	// create the process hash table
 	proc_hash = hash_init(15, offsetof(struct proc, next), &proc_struct_compare, &proc_struct_hash);
 
@@ -1086,8 +1378,18 @@ int thread_init(kernel_args *ka)
 		&thread_struct_compare, &thread_struct_hash);
 
 	// zero out the run queues
-	for(i = 0; i < THREAD_NUM_PRIORITY_LEVELS; i++) {
-		list_initialize(&run_q[i]);
+	for(i = 0; i < _MAX_CPUS; i++) {
+		unsigned int j;
+
+		for(j = 0; j < THREAD_NUM_PRIORITY_LEVELS; j++)
+			list_initialize(&cpu[i].run_q[j]);
+		memset(cpu[i].run_q_bitmap, 0, sizeof(cpu[i].run_q_bitmap));
+		cpu[i].run_q_count = 0;
+		cpu[i].running_thread = NULL;
+		cpu[i].run_q_steals = 0;
+		cpu[i].run_q_lock = 0;
+		cpu[i].switch_prev = NULL;
+		cpu[i].switch_death_stack = -1;
 	}
 
 	// zero out the dead thread structure q
@@ -1112,7 +1414,7 @@ int thread_init(kernel_args *ka)
 			return ERR_NO_MEMORY;
 		}
 		t->proc = proc_get_kernel_proc();
-		t->priority = THREAD_IDLE_PRIORITY;
+		t->priority = t->base_priority = THREAD_IDLE_PRIORITY;
 		t->state = THREAD_STATE_RUNNING;
 		t->next_state = THREAD_STATE_READY;
 		t->int_disable_level = 1; // ints are disabled until the int_restore_interrupts in main()
@@ -1131,6 +1433,9 @@ int thread_init(kernel_args *ka)
 		if(i == 0)
 			arch_thread_set_current_thread(t);
 		t->cpu = &cpu[i];
+		t->last_cpu = &cpu[i];
+		cpu[i].running_thread = t;
+		idle_cpu_mask |= (1 << i);
 	}
 
 	// create a set of death stacks
@@ -1171,6 +1476,7 @@ int thread_init(kernel_args *ka)
 	dbg_add_command(dump_next_thread_in_all_list, "next_all", "dump the next thread in the global list of the last thread viewed");
 	dbg_add_command(dump_next_thread_in_proc, "next_proc", "dump the next thread in the process of the last thread viewed");
 	dbg_add_command(dump_proc_info, "proc", "list info about a particular process");
+	dbg_add_command(dump_run_queues, "run_q", "dump the per-cpu run queues");
 
 	// initialize the architectural specific thread routines
 	arch_thread_init(ka);
@@ -1284,6 +1590,9 @@ static void thread_exit2(void *_args)
 //	dprintf("thread_exit2: deleting old kernel stack id 0x%x for thread 0x%x\n", args.old_kernel_stack, args.t->id);
 	vm_delete_region(vm_get_kernel_aspace_id(), args.old_kernel_stack);
 
+	// that was the last mutex we'll take, the thread structure is about to be freed
+	sem_drop_held_sems(args.t);
+
 //	dprintf("thread_exit2: removing thread 0x%x from global lists\n", args.t->id);
 
 	// remove this thread from all of the global lists
@@ -1420,6 +1729,7 @@ void thread_exit(int retcode)
 		// clean up resources owned by the process
 		vm_put_aspace(p->aspace);
 		vm_delete_aspace(p->aspace_id);
+		wait_set_delete_owned_sets(p->id);
 		port_delete_owned_ports(p->id);
 		sem_delete_owned_sems(p->id);
 		vfs_free_ioctx(p->ioctx);
@@ -1645,6 +1955,8 @@ static void thread_context_switch(struct thread *t_from, struct thread *t_to)
  
 	// set the current cpu and thread pointer
 	t_to->cpu = t_from->cpu;
+	t_to->last_cpu = t_to->cpu;
+	t_to->cpu->running_thread = t_to;
 	arch_thread_set_current_thread(t_to);
 	t_from->cpu = NULL;
 
@@ -1672,15 +1984,30 @@ static void thread_context_switch(struct thread *t_from, struct thread *t_to)
 	arch_thread_context_switch(t_from, t_to, new_tmap);
 }
 
-static int _rand(void)
+// high priority threads get short slices to keep latency down, low priority ones
+// get longer slices, and cpu bound threads get longer ones still so they switch less
+static bigtime_t thread_quantum(struct thread *t)
 {
-	static int next = 0;
+	bigtime_t quantum = THREAD_QUANTUM;
+
+	if(t->priority >= THREAD_HIGH_PRIORITY)
+		quantum = THREAD_MIN_QUANTUM;
+	else if(t->priority < THREAD_LOW_PRIORITY)
+		quantum = THREAD_QUANTUM * 2;
+
+	quantum <<= t->quantum_expirations;
+	if(quantum > THREAD_MAX_QUANTUM)
+		quantum = THREAD_MAX_QUANTUM;
+
+	return quantum;
+}
 
-	if(next == 0)
-		next = system_time();
+static void run_q_kick_idle_cpu(cpu_ent *curr)
+{
+	int idle = idle_cpu_mask & ~(1 << curr->cpu_num);
 
-	next = next * 1103515245 + 12345;
-	return((next >> 16) & 0x7FFF);
+	if(idle != 0)
+		smp_send_ici(highest_bit(idle & -idle), SMP_MSG_RESCHEDULE, 0, 0, 0, NULL, SMP_MSG_FLAG_ASYNC);
 }
 
 static int reschedule_event(void *unused)
@@ -1691,29 +2018,179 @@ static int reschedule_event(void *unused)
 	return INT_RESCHEDULE;
 }
 
-// NOTE: expects thread_spinlock to be held
-void thread_resched(void)
+// an idle cpu pulls the highest priority waiting thread off the busiest peer.
+// we already hold our own run queue lock, so a peer whose lock is taken is
+// skipped rather than waited on, two cpus stealing from each other would deadlock.
+// NOTE: expects curr's run queue lock to be held
+static struct thread *run_q_steal(cpu_ent *curr)
+{
+	cpu_ent *busiest = NULL;
+	struct thread *t = NULL;
+	int i;
+
+	for(i = 0; i < smp_get_num_cpus(); i++) {
+		cpu_ent *c = get_cpu_struct(i);
+
+		if(c == curr || c->run_q_count == 0)
+			continue;
+		if(busiest == NULL || c->run_q_count > busiest->run_q_count)
+			busiest = c;
+	}
+	if(busiest == NULL || !try_acquire_spinlock(&busiest->run_q_lock))
+		return NULL;
+
+	i = run_q_highest(busiest, THREAD_MIN_PRIORITY);
+	if(i >= 0) {
+		t = run_q_remove(busiest, i);
+		t->last_cpu = curr;
+		curr->run_q_steals++;
+	}
+	release_spinlock(&busiest->run_q_lock);
+
+	return t;
+}
+
+// runs on the thread just switched to, to finish letting go of the old one
+static void thread_finish_switch(void)
+{
+	cpu_ent *c = get_curr_cpu_struct();
+	struct thread *prev = c->switch_prev;
+	int death_stack = c->switch_death_stack;
+	bool dead = false;
+
+	if(prev != NULL) {
+		dead = prev->state == THREAD_STATE_FREE_ON_RESCHED;
+		prev->in_switch = false;
+	}
+	c->switch_prev = NULL;
+	c->switch_death_stack = -1;
+	release_spinlock(&c->run_q_lock);
+
+	// now that we're off the old thread's stack it can be reused
+	if(dead || death_stack >= 0) {
+		GRAB_THREAD_LOCK();
+		if(dead)
+			thread_enqueue(prev, &dead_q);
+		if(death_stack >= 0)
+			death_stack_bitmap &= ~(1 << death_stack);
+		RELEASE_THREAD_LOCK();
+		if(death_stack >= 0)
+			sem_release_etc(death_stack_sem, 1, SEM_FLAG_NO_RESCHED|SEM_FLAG_NO_NOTIFY);
+	}
+}
+
+// pick the next thread to run on this cpu and switch to it. The old thread
+// has already been put wherever it goes.
+// NOTE: expects curr_cpu's run queue lock to be held and the thread lock not
+// to be, returns with neither held
+static void run_q_switch(cpu_ent *curr_cpu, struct thread *old_thread)
 {
 	struct thread *next_thread = NULL;
-	int last_thread_pri = -1;
-	struct thread *old_thread = thread_get_current_thread();
+	int cpu_bit = 1 << curr_cpu->cpu_num;
 	int i;
-	bigtime_t quantum;
+	bool preempted;
 	struct timer_event *quantum_timer;
 
+	// find the highest priority occupied queue, letting starved threads creep up first
+	i = run_q_highest(curr_cpu, THREAD_MIN_PRIORITY);
+	if(i >= 0 && i <= THREAD_MAX_PRIORITY) {
+		run_q_age(curr_cpu, i);
+		i = run_q_highest(curr_cpu, THREAD_MIN_PRIORITY);
+	}
+
+	if(i >= 0) {
+		next_thread = run_q_remove(curr_cpu, i);
+	} else {
+		// nothing to do here, see if another cpu has work to spare
+		next_thread = run_q_steal(curr_cpu);
+		if(next_thread == NULL)
+			next_thread = run_q_remove(curr_cpu, THREAD_IDLE_PRIORITY);
+	}
+	if(next_thread == NULL)
+		panic("next_thread == NULL! no idle priorities!\n");
+
+	next_thread->state = THREAD_STATE_RUNNING;
+	next_thread->next_state = THREAD_STATE_READY;
+
+	// threads that run their quantum out get longer ones, threads that block start over
+	preempted = curr_cpu->preempted;
+	curr_cpu->preempted = 0;
+	if(preempted && old_thread->state == THREAD_STATE_READY) {
+		if(old_thread->quantum_expirations < THREAD_MAX_QUANTUM_SHIFT)
+			old_thread->quantum_expirations++;
+	} else {
+		old_thread->quantum_expirations = 0;
+	}
+
+	// only start a new quantum if we are switching threads or the old one ran out
+	if(next_thread != old_thread || preempted) {
+		quantum_timer = &curr_cpu->quantum_timer;
+		if(!preempted)
+			_local_timer_cancel_event(curr_cpu->cpu_num, quantum_timer);
+
+		if(next_thread->priority == THREAD_IDLE_PRIORITY) {
+			// nothing to preempt, let the cpu sleep until something shows up
+			timer_stop_tick();
+		} else {
+			timer_start_tick();
+			timer_setup_timer(&reschedule_event, NULL, quantum_timer);
+			timer_set_event(thread_quantum(next_thread), TIMER_MODE_ONESHOT, quantum_timer);
+		}
+	}
+
+	// let wakeups elsewhere know whether this cpu has anything to do
+	if(next_thread->priority == THREAD_IDLE_PRIORITY) {
+		if((idle_cpu_mask & cpu_bit) == 0)
+			atomic_or(&idle_cpu_mask, cpu_bit);
+	} else if(idle_cpu_mask & cpu_bit) {
+		atomic_and(&idle_cpu_mask, ~cpu_bit);
+	}
+
+	// there's still work queued up here, wake an idle cpu so it can steal some
+	if(curr_cpu->run_q_count > 0)
+		run_q_kick_idle_cpu(curr_cpu);
+
+	if(next_thread != old_thread) {
+//		dprintf("thread_resched: cpu %d switching from thread %d to %d\n",
+//			smp_get_current_cpu(), old_thread->id, next_thread->id);
+		curr_cpu->switch_prev = old_thread;
+		thread_context_switch(old_thread, next_thread);
+		// we may have come back on another cpu
+		thread_finish_switch();
+	} else {
+		old_thread->in_switch = false;
+		release_spinlock(&curr_cpu->run_q_lock);
+	}
+}
+
+// NOTE: expects thread_spinlock to be held. It is let go of while the next
+// thread is picked and switched to, and held again on return.
+void thread_resched(void)
+{
+	struct thread *old_thread = thread_get_current_thread();
+	cpu_ent *curr_cpu = old_thread->cpu;
+
 //	dprintf("top of thread_resched: cpu %d, cur_thread = 0x%x\n", smp_get_current_cpu(), thread_get_current_thread());
 
+	// any wakeup boost is used up once the thread comes back through here
+	old_thread->priority = thread_effective_priority(old_thread);
+
+	acquire_spinlock(&curr_cpu->run_q_lock);
+
 	switch(old_thread->next_state) {
 		case THREAD_STATE_RUNNING:
 		case THREAD_STATE_READY:
 //			dprintf("enqueueing thread 0x%x into run q. pri = %d\n", old_thread, old_thread->priority);
-			thread_enqueue_run_q(old_thread);
+			// it was just running here, so it goes back into our own queue
+			if(old_thread->priority > THREAD_MAX_PRIORITY)
+				old_thread->priority = THREAD_MAX_PRIORITY;
+			run_q_insert(curr_cpu, old_thread);
 			break;
 		case THREAD_STATE_SUSPENDED:
 			dprintf("suspending thread 0x%x\n", old_thread->id);
 			break;
 		case THREAD_STATE_FREE_ON_RESCHED:
-			thread_enqueue(old_thread, &dead_q);
+			// goes onto the dead queue once we're off its stack
 			break;
 		default:
 //			dprintf("not enqueueing thread 0x%x into run q. next_state = %d\n", old_thread, old_thread->next_state);
@@ -1721,62 +2198,42 @@ void thread_resched(void)
 	}
 	old_thread->state = old_thread->next_state;
 
-	// search the real-time queue
-	for(i = THREAD_MAX_RT_PRIORITY; i >= THREAD_MIN_RT_PRIORITY; i--) {
-		next_thread = thread_dequeue_run_q(i);
-		if(next_thread)
-			goto found_thread;
-	}
-
-	// search the regular queue
-	for(i = THREAD_MAX_PRIORITY; i > THREAD_IDLE_PRIORITY; i--) {
-		next_thread = thread_lookat_run_q(i);
-		if(next_thread != NULL) {
-			// skip it sometimes
-			if(_rand() > 0x3000) {
-				next_thread = thread_dequeue_run_q(i);
-				goto found_thread;
-			}
-			last_thread_pri = i;
-			next_thread = NULL;
-		}
-	}
-	if(next_thread == NULL) {
-		if(last_thread_pri != -1) {
-			next_thread = thread_dequeue_run_q(last_thread_pri);
-			if(next_thread == NULL)
-				panic("next_thread == NULL! last_thread_pri = %d\n", last_thread_pri);
-		} else {
-			next_thread = thread_dequeue_run_q(THREAD_IDLE_PRIORITY);
-			if(next_thread == NULL)
-				panic("next_thread == NULL! no idle priorities!\n");
-		}
-	}
+	// the rest only needs our run queue. Anyone waking the old thread before
+	// we are off its stack queues it here, and waits for the switch to finish.
+	old_thread->in_switch = true;
+	RELEASE_THREAD_LOCK();
 
-found_thread:
-	next_thread->state = THREAD_STATE_RUNNING;
-	next_thread->next_state = THREAD_STATE_READY;
+	run_q_switch(curr_cpu, old_thread);
 
-	// XXX should only reset the quantum timer if we are switching to a new thread,
-	// or we got here as a result of a quantum expire.
+	GRAB_THREAD_LOCK();
+}
 
-	// XXX calculate quantum
-	quantum = 10000;
+// gives up the cpu from the interrupt return path. A thread that is only being
+// preempted goes back into this cpu's run queue and nowhere else, so the
+// thread lock is left alone.
+// NOTE: expects interrupts to be disabled
+void thread_preempt(void)
+{
+	struct thread *old_thread = thread_get_current_thread();
+	cpu_ent *curr_cpu = old_thread->cpu;
 
-	// get the quantum timer for this cpu
-	quantum_timer = &old_thread->cpu->quantum_timer;
-	if(!old_thread->cpu->preempted) {
-		_local_timer_cancel_event(old_thread->cpu->cpu_num, quantum_timer);
+	// a running thread's next state is only changed by the thread itself, so it
+	// can be looked at unlocked. Dropping a wakeup boost takes the thread lock though.
+	if(old_thread->next_state != THREAD_STATE_READY
+		|| old_thread->priority != thread_effective_priority(old_thread)
+		|| old_thread->priority > THREAD_MAX_PRIORITY) {
+		GRAB_THREAD_LOCK();
+		thread_resched();
+		RELEASE_THREAD_LOCK();
+		return;
 	}
-	old_thread->cpu->preempted= 0;
-	timer_setup_timer(&reschedule_event, NULL, quantum_timer);
-	timer_set_event(quantum, TIMER_MODE_ONESHOT, quantum_timer);
 
-	if(next_thread != old_thread) {
-//		dprintf("thread_resched: cpu %d switching from thread %d to %d\n",
-//			smp_get_current_cpu(), old_thread->id, next_thread->id);
-		thread_context_switch(old_thread, next_thread);
-	}
+	acquire_spinlock(&curr_cpu->run_q_lock);
+	run_q_insert(curr_cpu, old_thread);
+	old_thread->state = THREAD_STATE_READY;
+	old_thread->in_switch = true;
+
+	run_q_switch(curr_cpu, old_thread);
 }
 
 static void insert_proc_into_parent(struct proc *parent, struct proc *p)
@@ -1902,6 +2359,8 @@ int proc_get_proc_info(proc_id id, struct proc_info *outinfo)
 	info.name[SYS_MAX_OS_NAME_LEN-1] = '\0';
 	info.state = p->state;
 	info.num_threads = p->num_threads;
+	info.page_faults = p->aspace ? p->aspace->faults : 0;
+	info.major_faults = p->aspace ? p->aspace->major_faults : 0;
 
 	err = NO_ERROR;
 
@@ -1970,6 +2429,8 @@ int proc_get_next_proc_info(uint32 *cookie, struct proc_info *outinfo)
 	info.name[SYS_MAX_OS_NAME_LEN-1] = '\0';
 	info.state = p->state;
 	info.num_threads = p->num_threads;
+	info.page_faults = p->aspace ? p->aspace->faults : 0;
+	info.major_faults = p->aspace ? p->aspace->major_faults : 0;
 
 	err = 0;
 
@@ -2230,6 +2691,148 @@ err1:
 	return err;
 }
 
+static int proc_fork_proc2(void *args)
+{
+	struct thread *t;
+	struct proc *p;
+	struct fork_arg *fargs = args;
+	void *user_state;
+
+	t = thread_get_current_thread();
+	p = t->proc;
+
+	dprintf("proc_fork_proc2: entry thread %d\n", t->id);
+
+	// the stack the parent's thread was on is in the copied address space
+	t->user_stack_base = fargs->user_stack_base;
+	t->user_stack_region_id = vm_find_region_by_address(p->aspace_id, fargs->user_stack_base);
+
+	t->sig_block_mask = fargs->sig_block_mask;
+	memcpy(t->sig_action, fargs->sig_action, sizeof(t->sig_action));
+
+	user_state = fargs->user_state;
+	kfree(fargs);
+
+	p->state = PROC_STATE_NORMAL;
+
+	// return from the syscall the parent made, in the child
+	arch_thread_enter_uspace_forked(t, user_state);
+
+	// never gets here
+	return 0;
+}
+
+// Creates a copy of the current process, like fork(). The child gets a copy
+// on write copy of the parent's address space and a copy of its file
+// descriptors, and its only thread returns to user space from the same
+// syscall the calling thread made, with a return value of 0.
+proc_id proc_fork_proc(void)
+{
+	struct thread *curr_thread = thread_get_current_thread();
+	struct proc *curr_proc = curr_thread->proc;
+	struct proc *p;
+	struct fork_arg *fargs;
+	thread_id tid;
+	proc_id pid;
+	int err;
+
+	if(curr_proc == kernel_proc)
+		return ERR_NOT_ALLOWED;
+
+	p = create_proc_struct(curr_proc->name, false);
+	if(p == NULL)
+		return ERR_NO_MEMORY;
+
+	pid = p->id;
+
+	int_disable_interrupts();
+	GRAB_PROC_LOCK();
+
+	// insert this proc into the global list
+	hash_insert(proc_hash, p);
+
+	// add it to the parent's list
+	insert_proc_into_parent(curr_proc, p);
+
+	// the child stays in the parent's session and process group
+	p->sid = curr_proc->sid;
+	add_proc_to_session(p, curr_proc->sid);
+	p->pgid = curr_proc->pgid;
+	add_proc_to_pgroup(p, curr_proc->pgid);
+
+	RELEASE_PROC_LOCK();
+	int_restore_interrupts();
+
+	fargs = kmalloc(sizeof(struct fork_arg));
+	if(fargs == NULL) {
+		err = ERR_NO_MEMORY;
+		goto err1;
+	}
+	fargs->user_stack_base = curr_thread->user_stack_base;
+	fargs->sig_block_mask = curr_thread->sig_block_mask;
+	memcpy(fargs->sig_action, curr_thread->sig_action, sizeof(fargs->sig_action));
+
+	// NULL from the ports that can't fork yet, and from i386 if it ran out of memory
+	fargs->user_state = arch_thread_save_user_state();
+	if(fargs->user_state == NULL) {
+		err = ERR_UNIMPLEMENTED;
+		goto err2;
+	}
+
+	// the child gets copies of the parent's file descriptors
+	p->ioctx = vfs_new_ioctx(curr_proc->ioctx);
+	if(!p->ioctx) {
+		err = ERR_NO_MEMORY;
+		goto err3;
+	}
+
+	// and of its address space
+	p->aspace_id = vm_clone_aspace(p->name, curr_proc->aspace_id);
+	if(p->aspace_id < 0) {
+		err = p->aspace_id;
+		goto err4;
+	}
+	p->aspace = vm_get_aspace_by_id(p->aspace_id);
+
+	// create a kernel thread, but under the context of the new process
+	tid = thread_create_kernel_thread_etc(curr_thread->name, proc_fork_proc2, fargs, p);
+	if(tid < 0) {
+		err = tid;
+		goto err5;
+	}
+
+	thread_resume_thread(tid);
+
+	return pid;
+
+err5:
+	vm_put_aspace(p->aspace);
+	vm_delete_aspace(p->aspace_id);
+err4:
+	vfs_free_ioctx(p->ioctx);
+err3:
+	kfree(fargs->user_state);
+err2:
+	kfree(fargs);
+err1:
+	// take the proc structure back out of everything it was put in and delete it
+	int_disable_interrupts();
+	GRAB_PROC_LOCK();
+	hash_remove(proc_hash, p);
+	remove_proc_from_pgroup(p, p->pgid);
+	remove_proc_from_session(p, p->sid);
+	remove_proc_from_parent(curr_proc, p);
+	RELEASE_PROC_LOCK();
+	int_restore_interrupts();
+	delete_proc_struct(p);
+	return err;
+}
+
+proc_id user_proc_fork(void)
+{
+	return proc_fork_proc();
+}
+
 proc_id user_proc_create_proc(const char *upath, const char *uname, char **args, int argc, int priority, int flags)
 {
 	char path[SYS_MAX_PATH_LEN];
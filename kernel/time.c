@@ -47,6 +47,19 @@ void time_tick(int tick_rate)
 	arch_time_tick();
 }
 
+// fold the time that went by with nobody ticking into the tick count
+void time_catch_up(void)
+{
+	sys_time += arch_get_time_delta();
+	arch_time_tick();
+}
+
+// system_time() only stays right with no tick at all if the arch can count on its own
+bool time_can_stop_tick(void)
+{
+	return arch_time_has_counter();
+}
+
 bigtime_t system_time(void)
 {
 	volatile bigtime_t *st = &sys_time;
@@ -22,6 +22,16 @@
 
 #define TICK_RATE 5000 // 5 msecs
 
+static void set_idle_timer(cpu_ent *cpu);
+
+// the cpu whose tick drives time_tick(), or -1 if every cpu has its tick
+// off and time is being kept by the arch's counter alone
+static volatile int timekeeper_cpu = 0;
+static spinlock_t timekeeper_lock = 0; // for handing the timekeeper job around
+// set when the job was handed to a cpu whose tick is out of phase with the old
+// one's. Its first tick adds the time that really went by, not a whole tick.
+static volatile bool timekeeper_resync = false;
+
 int timer_init(kernel_args *ka)
 {
 	dprintf("init_timer: entry\n");
@@ -73,17 +83,23 @@ int timer_interrupt(void)
 	cpu_ent *cpu = get_curr_cpu_struct();
 	int rc = INT_NO_RESCHEDULE;
 
-	// cpu 0 gets to increment the system timer
-	if(cpu->cpu_num == 0)
-		time_tick(TICK_RATE);
-
-	curr_time = system_time_lores();
+	// the timekeeper cpu gets to increment the system timer
+	if(cpu->cpu_num == timekeeper_cpu) {
+		if(timekeeper_resync) {
+			timekeeper_resync = false;
+			time_catch_up();
+		} else {
+			time_tick(TICK_RATE);
+		}
+	}
 
 	spinlock = &cpu->timer_spinlock;
 
 	acquire_spinlock(spinlock);
 
 restart_scan:
+	// same clock the events and the idle timer are set against
+	curr_time = system_time();
 	event = cpu->timer_events;
 	if(event != NULL && event->sched_time <= curr_time) {
 		// this event needs to happen
@@ -124,11 +140,96 @@ restart_scan:
 		arch_timer_set_hardware_timer(cpu->timer_events->sched_time - system_time());
 #endif
 
+	// with the tick stopped, we only wake up for the next event
+	if(cpu->tick_stopped)
+		set_idle_timer(cpu);
+
 	release_spinlock(spinlock);
 
 	return rc;
 }
 
+// program the hardware timer for the next event on an idle cpu, or shut it off
+// NOTE: expects the cpu's timer spinlock to be held
+static void set_idle_timer(cpu_ent *cpu)
+{
+	bigtime_t delta;
+
+	if(cpu->timer_events != NULL) {
+		// it may already be due, fire right away rather than never
+		delta = cpu->timer_events->sched_time - system_time();
+		if(delta < 1)
+			delta = 1;
+		arch_timer_set_hardware_timer(delta, HW_TIMER_ONESHOT);
+	} else {
+		arch_timer_clear_hardware_timer();
+	}
+}
+
+// called by the scheduler when a cpu is about to run its idle thread.
+// the timekeeper hands its job to a cpu that's still ticking. If there
+// is none, it only stops if the arch can keep time without the tick.
+// NOTE: expects interrupts to be off
+void timer_stop_tick(void)
+{
+	cpu_ent *cpu = get_curr_cpu_struct();
+	int i;
+
+	if(cpu->tick_stopped)
+		return;
+
+	acquire_spinlock(&timekeeper_lock);
+	if(cpu->cpu_num == timekeeper_cpu) {
+		for(i = 0; i < smp_get_num_cpus(); i++) {
+			if(i != cpu->cpu_num && !get_cpu_struct(i)->tick_stopped)
+				break;
+		}
+		if(i < smp_get_num_cpus()) {
+			// fold in the time since our last tick, the new timekeeper counts from here
+			// if the arch can tell. Without a counter its first tick is all there is.
+			if(time_can_stop_tick()) {
+				time_catch_up();
+				timekeeper_resync = true;
+			}
+			timekeeper_cpu = i;
+		} else if(time_can_stop_tick()) {
+			timekeeper_cpu = -1;
+		} else {
+			release_spinlock(&timekeeper_lock);
+			return;
+		}
+	}
+
+	acquire_spinlock(&cpu->timer_spinlock);
+	cpu->tick_stopped = true;
+	set_idle_timer(cpu);
+	release_spinlock(&cpu->timer_spinlock);
+	release_spinlock(&timekeeper_lock);
+}
+
+// called by the scheduler when a cpu leaves its idle thread
+// NOTE: expects interrupts to be off
+void timer_start_tick(void)
+{
+	cpu_ent *cpu = get_curr_cpu_struct();
+
+	if(!cpu->tick_stopped)
+		return;
+
+	acquire_spinlock(&timekeeper_lock);
+	if(timekeeper_cpu < 0) {
+		// nobody has been ticking, pick up the time that went by and take over
+		time_catch_up();
+		timekeeper_cpu = cpu->cpu_num;
+	}
+
+	acquire_spinlock(&cpu->timer_spinlock);
+	cpu->tick_stopped = false;
+	arch_timer_set_hardware_timer(TICK_RATE, HW_TIMER_REPEATING);
+	release_spinlock(&cpu->timer_spinlock);
+	release_spinlock(&timekeeper_lock);
+}
+
 void timer_setup_timer(timer_callback func, void *data, struct timer_event *event)
 {
 	event->func = func;
@@ -174,6 +275,10 @@ int timer_set_event(bigtime_t relative_time, timer_mode mode, struct timer_event
 	}
 #endif
 
+	// an idle cpu isn't ticking, so make sure it wakes up for this one
+	if(cpu->tick_stopped && event == cpu->timer_events)
+		set_idle_timer(cpu);
+
 	release_spinlock(&cpu->timer_spinlock);
 	int_restore_interrupts();
 
@@ -0,0 +1,300 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/heap.h>
+#include <kernel/vm.h>
+#include <kernel/thread.h>
+#include <kernel/debug.h>
+#include <kernel/id_table.h>
+#include <kernel/arch/cpu.h>
+#include <newos/errors.h>
+#include <string.h>
+#include <stdio.h>
+
+// Growable table of fixed size entries addressed by id.
+// The table is a directory of chunks, chunks are added on demand and never
+// freed, so a lookup is just two loads and needs no lock at all.
+// The initial chunks live in a wired region of their own, later ones come out
+// of the kernel heap: creating a sem can happen with vm locks held, so growing
+// must not go through the vm.
+// Free slots are kept on a lock-free stack. The stack head packs the slot
+// index with a tag that changes on every update, so a pop racing with a
+// pop/push of the same slot fails the compare and retries.
+
+struct id_table {
+	const char *name;
+	unsigned int entry_size;
+	int link_offset;
+	unsigned int chunk_shift;
+	unsigned int max_entries;
+	unsigned int slot_bits;	// log2(max_entries)
+	unsigned int gen_mask;
+	void (*init_func)(void *e);
+
+	int grow_lock;
+	volatile int num_chunks;
+	unsigned int max_chunks;
+	char **chunks;
+
+	volatile int free_head;	// (tag << (slot_bits + 1)) | (slot + 1)
+
+	// stats
+	int in_use;
+	int allocs;
+	int frees;
+	int grows;
+	int retries;
+};
+
+#define ENTRY(t, slot) ((void *)((t)->chunks[(slot) >> (t)->chunk_shift] + \
+	((slot) & ((1 << (t)->chunk_shift) - 1)) * (t)->entry_size))
+#define LINK(t, slot) ((struct id_table_link *)((char *)ENTRY(t, slot) + (t)->link_offset))
+
+#define HEAD_INDEX(t, h) ((unsigned int)(h) & ((1 << ((t)->slot_bits + 1)) - 1))
+#define HEAD_NEXT_TAG(t, h) (((unsigned int)(h) >> ((t)->slot_bits + 1)) + 1)
+#define MAKE_HEAD(t, tag, index) ((int)(((tag) << ((t)->slot_bits + 1)) | (index)))
+
+static unsigned int id_table_log2(unsigned int n)
+{
+	unsigned int bits = 0;
+
+	while((1U << bits) < n)
+		bits++;
+	return bits;
+}
+
+// push the chain of slots first .. last, already linked to each other, on the free list
+static void push_slots(struct id_table *t, unsigned int first, unsigned int last)
+{
+	struct id_table_link *link = LINK(t, last);
+	int old_head;
+	int new_head;
+
+	for(;;) {
+		old_head = t->free_head;
+		link->next = HEAD_INDEX(t, old_head);
+		new_head = MAKE_HEAD(t, HEAD_NEXT_TAG(t, old_head), first + 1);
+		if(test_and_set((int *)&t->free_head, new_head, old_head) == old_head)
+			break;
+		atomic_add(&t->retries, 1);
+	}
+}
+
+// NOTE: expects the grow lock to be held
+static void add_chunk(struct id_table *t, char *chunk)
+{
+	unsigned int chunk_entries = 1 << t->chunk_shift;
+	unsigned int base;
+	unsigned int i;
+
+	memset(chunk, 0, t->entry_size * chunk_entries);
+
+	base = t->num_chunks << t->chunk_shift;
+	t->chunks[t->num_chunks] = chunk;
+
+	// publish the chunk before any of its slots can show up on the free list
+	atomic_add((int *)&t->num_chunks, 1);
+
+	for(i = 0; i < chunk_entries; i++) {
+		if(t->init_func)
+			t->init_func(ENTRY(t, base + i));
+		LINK(t, base + i)->next = base + i + 2;
+	}
+	push_slots(t, base, base + chunk_entries - 1);
+}
+
+static int grow_table(struct id_table *t)
+{
+	unsigned int chunk_entries = 1 << t->chunk_shift;
+	char *chunk;
+
+	if(test_and_set(&t->grow_lock, 1, 0) != 0) {
+		// someone else is adding a chunk, let them get on with it and have the caller retry
+		thread_yield();
+		return NO_ERROR;
+	}
+
+	// slots may have been freed or added while we were getting here
+	if(HEAD_INDEX(t, t->free_head) != 0) {
+		atomic_set(&t->grow_lock, 0);
+		return NO_ERROR;
+	}
+
+	if((unsigned int)t->num_chunks >= t->max_chunks) {
+		atomic_set(&t->grow_lock, 0);
+		return ERR_NO_MORE_HANDLES;
+	}
+
+	chunk = (char *)kmalloc(t->entry_size * chunk_entries);
+	if(chunk == NULL) {
+		atomic_set(&t->grow_lock, 0);
+		return ERR_NO_MEMORY;
+	}
+
+	add_chunk(t, chunk);
+
+	t->grows++;
+	atomic_set(&t->grow_lock, 0);
+
+	return NO_ERROR;
+}
+
+void *id_table_create(const char *name, unsigned int entry_size, int link_offset,
+	unsigned int chunk_entries, unsigned int initial_entries, unsigned int max_entries,
+	void init_func(void *e))
+{
+	struct id_table *t;
+	char region_name[SYS_MAX_OS_NAME_LEN];
+	unsigned int initial_chunks;
+	unsigned int chunk_size;
+	unsigned int i;
+	char *initial;
+
+	// max_entries and chunk_entries must be powers of 2
+	if(max_entries == 0 || (max_entries & (max_entries - 1)) != 0)
+		return NULL;
+	if(chunk_entries == 0 || (chunk_entries & (chunk_entries - 1)) != 0 || chunk_entries > max_entries)
+		return NULL;
+	// leaves at least 8 bits for the id generation and the free list tag
+	if(id_table_log2(max_entries) > 22)
+		return NULL;
+
+	t = (struct id_table *)kmalloc(sizeof(struct id_table));
+	if(t == NULL)
+		return NULL;
+	memset(t, 0, sizeof(struct id_table));
+
+	t->name = name;
+	t->entry_size = entry_size;
+	t->link_offset = link_offset;
+	t->chunk_shift = id_table_log2(chunk_entries);
+	t->max_entries = max_entries;
+	t->slot_bits = id_table_log2(max_entries);
+	t->gen_mask = (1 << (31 - t->slot_bits)) - 1;
+	t->init_func = init_func;
+	t->max_chunks = max_entries >> t->chunk_shift;
+
+	t->chunks = (char **)kmalloc(sizeof(char *) * t->max_chunks);
+	if(t->chunks == NULL) {
+		kfree(t);
+		return NULL;
+	}
+	memset(t->chunks, 0, sizeof(char *) * t->max_chunks);
+
+	// carve the initial chunks out of one region
+	initial_chunks = min(ROUNDUP(initial_entries, chunk_entries) >> t->chunk_shift, t->max_chunks);
+	chunk_size = entry_size * chunk_entries;
+	if(initial_chunks > 0) {
+		sprintf(region_name, "%s_table", name);
+		if(vm_create_anonymous_region(vm_get_kernel_aspace_id(), region_name, (void **)&initial,
+			REGION_ADDR_ANY_ADDRESS, ROUNDUP(chunk_size * initial_chunks, PAGE_SIZE),
+			REGION_WIRING_WIRED, LOCK_RW|LOCK_KERNEL) < 0) {
+			kfree(t->chunks);
+			kfree(t);
+			return NULL;
+		}
+		for(i = 0; i < initial_chunks; i++)
+			add_chunk(t, initial + i * chunk_size);
+	}
+
+	return t;
+}
+
+int id_table_alloc(void *_table)
+{
+	struct id_table *t = (struct id_table *)_table;
+	struct id_table_link *link;
+	unsigned int index;
+	int old_head;
+	int new_head;
+	int err;
+
+	for(;;) {
+		old_head = t->free_head;
+		index = HEAD_INDEX(t, old_head);
+		if(index == 0) {
+			err = grow_table(t);
+			if(err < 0)
+				return err;
+			continue;
+		}
+
+		// the slot may get popped and reused under us, in which case the next
+		// pointer is junk, but the tag will have moved on and the swap fails
+		link = LINK(t, index - 1);
+		new_head = MAKE_HEAD(t, HEAD_NEXT_TAG(t, old_head), link->next);
+		if(test_and_set((int *)&t->free_head, new_head, old_head) == old_head)
+			break;
+		atomic_add(&t->retries, 1);
+	}
+
+	// the slot is ours now
+	link->gen = (link->gen + 1) & t->gen_mask;
+
+	atomic_add(&t->in_use, 1);
+	atomic_add(&t->allocs, 1);
+
+	return (link->gen << t->slot_bits) | (index - 1);
+}
+
+void id_table_free(void *_table, int id)
+{
+	struct id_table *t = (struct id_table *)_table;
+	unsigned int slot = (unsigned int)id & (t->max_entries - 1);
+
+	if(id < 0 || (slot >> t->chunk_shift) >= (unsigned int)t->num_chunks)
+		panic("id_table_free: table '%s' asked to free bad id 0x%x\n", t->name, id);
+
+	push_slots(t, slot, slot);
+
+	atomic_add(&t->in_use, -1);
+	atomic_add(&t->frees, 1);
+}
+
+void *id_table_lookup(void *_table, int id)
+{
+	struct id_table *t = (struct id_table *)_table;
+	unsigned int slot;
+
+	if(id < 0)
+		return NULL;
+
+	slot = (unsigned int)id & (t->max_entries - 1);
+	if((slot >> t->chunk_shift) >= (unsigned int)t->num_chunks)
+		return NULL;
+
+	return ENTRY(t, slot);
+}
+
+unsigned int id_table_capacity(void *_table)
+{
+	struct id_table *t = (struct id_table *)_table;
+
+	return t->num_chunks << t->chunk_shift;
+}
+
+void id_table_get_stats(void *_table, struct id_table_stats *stats)
+{
+	struct id_table *t = (struct id_table *)_table;
+
+	stats->capacity = id_table_capacity(t);
+	stats->max_entries = t->max_entries;
+	stats->in_use = t->in_use;
+	stats->allocs = t->allocs;
+	stats->frees = t->frees;
+	stats->grows = t->grows;
+	stats->retries = t->retries;
+}
+
+void id_table_dump(void *_table)
+{
+	struct id_table *t = (struct id_table *)_table;
+
+	dprintf("id table '%s': %d of %d slots in use, max %d, %d chunks of %d\n",
+		t->name, t->in_use, id_table_capacity(t), t->max_entries, t->num_chunks, 1 << t->chunk_shift);
+	dprintf("\tallocs %d frees %d grows %d free list retries %d\n",
+		t->allocs, t->frees, t->grows, t->retries);
+}
+
@@ -2,9 +2,15 @@
 ** Copyright 2001, Travis Geiselbrecht. All rights reserved.
 ** Distributed under the terms of the NewOS License.
 */
+#include <kernel/kernel.h>
 #include <kernel/heap.h>
 #include <kernel/khash.h>
 #include <kernel/debug.h>
+#include <kernel/int.h>
+#include <kernel/smp.h>
+#include <kernel/thread.h>
+#include <kernel/elf.h>
+#include <kernel/list.h>
 #include <newos/errors.h>
 #include <string.h>
 
@@ -13,6 +19,30 @@
 
 #define VERIFY_TABLE 0
 
+// grow once the average chain is longer than this
+#define HASH_MAX_LOAD 2
+#define HASH_MAX_SIZE 0x100000
+
+// old buckets moved over to the new table per insert while resizing
+#define HASH_MIGRATE_BUCKETS 4
+
+#define HASH_RESIZER_INTERVAL 250000
+
+/*
+	Tables grow when the load goes over HASH_MAX_LOAD, to twice the old size
+	plus one. The old bucket array is kept around and emptied a few buckets
+	at a time by the following inserts, so no single insert pays for a full
+	rehash. While that is going on an element lives in the new table if its
+	bucket in the old one has already been moved, and in the old one otherwise.
+	Only inserts move elements around, so removing the current element while
+	walking a table still works. Tables don't shrink.
+
+	Plenty of tables are only ever touched with interrupts disabled, where
+	the new bucket array can't be allocated and the old one can't be freed.
+	Those tables are queued for the resizer thread, which hands them a spare
+	array for the next insert to switch to and frees the retired ones.
+*/
+
 struct hash_table {
 	struct hash_elem **table;
 	int next_ptr_offset;
@@ -21,13 +51,43 @@ struct hash_table {
 	int flags;
 	int (*compare_func)(void *e, const void *key);
 	unsigned int (*hash_func)(void *e, const void *key, unsigned int range);
+
+	// resize in progress, buckets of old_table below migrate_index have been moved
+	struct hash_elem **old_table;
+	unsigned int old_size;
+	unsigned int migrate_index;
+
+	// handed back and forth with the resizer, under hash_list_lock
+	struct hash_elem **spare_table;
+	unsigned int spare_size;
+	struct hash_elem **retired_table;
+	struct hash_table *resize_next;
+	bool resize_pending;
+
+	struct list_node all_node;
+
+	// stats
+	unsigned int lookups;
+	unsigned int lookup_steps;
+	int grows;
+	int deferred_grows;
+	int max_elems;
 };
 
+// all of the tables, for the debugger and the resizer
+static struct list_node hash_tables = { &hash_tables, &hash_tables };
+static spinlock_t hash_list_lock = 0;
+static struct hash_table *resize_queue = NULL;
+static struct hash_table *resizer_table = NULL;
+
 // XXX gross hack
 #define NEXT_ADDR(t, e) ((void *)(((unsigned long)(e)) + (t)->next_ptr_offset))
 #define NEXT(t, e) ((void *)(*(unsigned long *)NEXT_ADDR(t, e)))
 #define PUT_IN_NEXT(t, e, val) (*(unsigned long *)NEXT_ADDR(t, e) = (long)(val))
 
+#define GRAB_HASH_LIST_LOCK() acquire_spinlock(&hash_list_lock)
+#define RELEASE_HASH_LIST_LOCK() release_spinlock(&hash_list_lock)
+
 #if VERIFY_TABLE
 static bool find_in_table(struct hash_table *t, struct hash_elem *findit,
 	unsigned int starting_index, struct hash_elem *starting_element)
@@ -75,21 +135,152 @@ static int verify_hash_table(struct hash_table *t)
 #define verify_hash_table(table)
 #endif
 
+static bool can_allocate(void)
+{
+	return kernel_startup || int_are_interrupts_enabled();
+}
+
+static struct hash_elem **alloc_buckets(unsigned int size)
+{
+	struct hash_elem **buckets;
+
+	buckets = (struct hash_elem **)malloc(sizeof(void *) * size);
+	if(buckets != NULL)
+		memset(buckets, 0, sizeof(void *) * size);
+
+	return buckets;
+}
+
+// returns the head of the chain the element or key belongs in
+static struct hash_elem **find_bucket(struct hash_table *t, void *e, const void *key)
+{
+	unsigned int hash;
+
+	if(t->old_table != NULL) {
+		hash = t->hash_func(e, key, t->old_size);
+		if(hash >= t->migrate_index)
+			return &t->old_table[hash];
+	}
+
+	hash = t->hash_func(e, key, t->table_size);
+	return &t->table[hash];
+}
+
+// NOTE: expects the hash list lock to be held
+static void queue_for_resizer(struct hash_table *t)
+{
+	if(!t->resize_pending) {
+		t->resize_pending = true;
+		t->resize_next = resize_queue;
+		resize_queue = t;
+	}
+}
+
+static void start_grow(struct hash_table *t)
+{
+	struct hash_elem **buckets = NULL;
+	unsigned int size = t->table_size * 2 + 1;
+
+	if(t->spare_table != NULL) {
+		// the resizer left us one
+		int_disable_interrupts();
+		GRAB_HASH_LIST_LOCK();
+		if(t->spare_table != NULL && t->spare_size > t->table_size) {
+			buckets = t->spare_table;
+			size = t->spare_size;
+			t->spare_table = NULL;
+		}
+		RELEASE_HASH_LIST_LOCK();
+		int_restore_interrupts();
+	}
+
+	if(buckets == NULL) {
+		if(!can_allocate()) {
+			if(t->resize_pending)
+				return; // already asked
+			int_disable_interrupts();
+			GRAB_HASH_LIST_LOCK();
+			queue_for_resizer(t);
+			RELEASE_HASH_LIST_LOCK();
+			int_restore_interrupts();
+			t->deferred_grows++;
+			return;
+		}
+		buckets = alloc_buckets(size);
+		if(buckets == NULL)
+			return; // just keep the long chains
+	}
+
+	t->old_table = t->table;
+	t->old_size = t->table_size;
+	t->migrate_index = 0;
+	t->table = buckets;
+	t->table_size = size;
+	t->grows++;
+}
+
+static void finish_grow(struct hash_table *t)
+{
+	struct hash_elem **old = t->old_table;
+
+	t->old_table = NULL;
+	t->old_size = 0;
+	t->migrate_index = 0;
+
+	if(can_allocate()) {
+		free(old);
+	} else {
+		int_disable_interrupts();
+		GRAB_HASH_LIST_LOCK();
+		t->retired_table = old;
+		queue_for_resizer(t);
+		RELEASE_HASH_LIST_LOCK();
+		int_restore_interrupts();
+	}
+}
+
+// move a few of the old buckets over to the new table
+static void migrate_buckets(struct hash_table *t)
+{
+	unsigned int count;
+	struct hash_elem *e;
+	struct hash_elem *next;
+	unsigned int hash;
+
+	for(count = 0; count < HASH_MIGRATE_BUCKETS && t->migrate_index < t->old_size; count++) {
+		for(e = t->old_table[t->migrate_index]; e != NULL; e = next) {
+			next = NEXT(t, e);
+			hash = t->hash_func(e, NULL, t->table_size);
+			PUT_IN_NEXT(t, e, t->table[hash]);
+			t->table[hash] = e;
+		}
+		t->old_table[t->migrate_index] = NULL;
+		t->migrate_index++;
+	}
+
+	if(t->migrate_index >= t->old_size)
+		finish_grow(t);
+}
+
 void *hash_init(unsigned int table_size, int next_ptr_offset,
 	int compare_func(void *e, const void *key),
 	unsigned int hash_func(void *e, const void *key, unsigned int range))
 {
 	struct hash_table *t;
-	unsigned int i;
 
 	t = (struct hash_table *)malloc(sizeof(struct hash_table));
 	if(t == NULL) {
 		return NULL;
 	}
+	memset(t, 0, sizeof(struct hash_table));
 
-	t->table = (struct hash_elem **)malloc(sizeof(void *) * table_size);
-	for(i = 0; i<table_size; i++)
-		t->table[i] = NULL;
+	if(table_size == 0)
+		table_size = 1;
+	t->table = alloc_buckets(table_size);
+	if(t->table == NULL) {
+		free(t);
+		return NULL;
+	}
 	t->table_size = table_size;
 	t->next_ptr_offset = next_ptr_offset;
 	t->flags = 0;
@@ -97,6 +288,12 @@ void *hash_init(unsigned int table_size, int next_ptr_offset,
 	t->compare_func = compare_func;
 	t->hash_func = hash_func;
 
+	int_disable_interrupts();
+	GRAB_HASH_LIST_LOCK();
+	list_add_tail(&hash_tables, &t->all_node);
+	RELEASE_HASH_LIST_LOCK();
+	int_restore_interrupts();
+
 //	dprintf("hash_init: created table 0x%x, next_ptr_offset %d, compare_func 0x%x, hash_func 0x%x\n",
 //		t, next_ptr_offset, compare_func, hash_func);
 
@@ -106,6 +303,9 @@ void *hash_init(unsigned int table_size, int next_ptr_offset,
 int hash_uninit(void *_hash_table)
 {
 	struct hash_table *t = _hash_table;
+	struct hash_table **q;
+	struct hash_elem **spare;
+	struct hash_elem **retired;
 
 #if 0
 	if(t->num_elems > 0) {
@@ -113,6 +313,30 @@ int hash_uninit(void *_hash_table)
 	}
 #endif
 
+	int_disable_interrupts();
+	GRAB_HASH_LIST_LOCK();
+	list_delete(&t->all_node);
+	if(t->resize_pending) {
+		for(q = &resize_queue; *q != NULL; q = &(*q)->resize_next) {
+			if(*q == t) {
+				*q = t->resize_next;
+				break;
+			}
+		}
+	}
+	if(resizer_table == t)
+		resizer_table = NULL; // the resizer will toss whatever it was allocating
+	spare = t->spare_table;
+	retired = t->retired_table;
+	RELEASE_HASH_LIST_LOCK();
+	int_restore_interrupts();
+
+	if(spare)
+		free(spare);
+	if(retired)
+		free(retired);
+	if(t->old_table)
+		free(t->old_table);
 	free(t->table);
 	free(t);
 
@@ -122,16 +346,24 @@ int hash_uninit(void *_hash_table)
 int hash_insert(void *_hash_table, void *e)
 {
 	struct hash_table *t = _hash_table;
-	unsigned int hash;
+	struct hash_elem **bucket;
 
 //	dprintf("hash_insert: table 0x%x, element 0x%x\n", t, e);
 
 	verify_hash_table(t);
 
-	hash = t->hash_func(e, NULL, t->table_size);
-	PUT_IN_NEXT(t, e, t->table[hash]);
-	t->table[hash] = e;
+	if(t->old_table != NULL)
+		migrate_buckets(t);
+	else if(t->retired_table == NULL && (unsigned int)t->num_elems >= t->table_size * HASH_MAX_LOAD
+		&& t->table_size < HASH_MAX_SIZE)
+		start_grow(t);
+
+	bucket = find_bucket(t, e, NULL);
+	PUT_IN_NEXT(t, e, *bucket);
+	*bucket = e;
 	t->num_elems++;
+	if(t->num_elems > t->max_elems)
+		t->max_elems = t->num_elems;
 
 	verify_hash_table(t);
 
@@ -142,18 +374,18 @@ int hash_remove(void *_hash_table, void *e)
 {
 	struct hash_table *t = _hash_table;
 	void *i, *last_i;
-	unsigned int hash;
+	struct hash_elem **bucket;
 
 	verify_hash_table(t);
 
-	hash = t->hash_func(e, NULL, t->table_size);
+	bucket = find_bucket(t, e, NULL);
 	last_i = NULL;
-	for(i = t->table[hash]; i != NULL; last_i = i, i = NEXT(t, i)) {
+	for(i = *bucket; i != NULL; last_i = i, i = NEXT(t, i)) {
 		if(i == e) {
 			if(last_i != NULL)
 				PUT_IN_NEXT(t, last_i, NEXT(t, i));
 			else
-				t->table[hash] = NEXT(t, i);
+				*bucket = NEXT(t, i);
 			t->num_elems--;
 			verify_hash_table(t);
 			return NO_ERROR;
@@ -169,12 +401,10 @@ void *hash_find(void *_hash_table, void *e)
 {
 	struct hash_table *t = _hash_table;
 	void *i;
-	unsigned int hash;
 
 	verify_hash_table(t);
 
-	hash = t->hash_func(e, NULL, t->table_size);
-	for(i = t->table[hash]; i != NULL; i = NEXT(t, i)) {
+	for(i = *find_bucket(t, e, NULL); i != NULL; i = NEXT(t, i)) {
 		if(i == e) {
 			return i;
 		}
@@ -187,21 +417,23 @@ void *hash_lookup(void *_hash_table, const void *key)
 {
 	struct hash_table *t = _hash_table;
 	void *i;
-	unsigned int hash;
+	unsigned int steps = 0;
 
 	if(t->compare_func == NULL)
 		return NULL;
 
 	verify_hash_table(t);
 
-	hash = t->hash_func(NULL, key, t->table_size);
-	for(i = t->table[hash]; i != NULL; i = NEXT(t, i)) {
-		if(t->compare_func(i, key) == 0) {
-			return i;
-		}
+	// lookups may run concurrently under a reader lock, the stats are only approximate
+	t->lookups++;
+	for(i = *find_bucket(t, NULL, key); i != NULL; i = NEXT(t, i)) {
+		steps++;
+		if(t->compare_func(i, key) == 0)
+			break;
 	}
+	t->lookup_steps += steps;
 
-	return NULL;
+	return i;
 }
 
 struct hash_iterator *hash_open(void *_hash_table, struct hash_iterator *i)
@@ -231,19 +463,26 @@ void hash_rewind(void *_hash_table, struct hash_iterator *i)
 	i->bucket = -1;
 }
 
+// NOTE: buckets are numbered across the old table, if there is one, followed by the current one.
+// Inserting while walking can move elements around, in which case they may be seen twice or not at all.
 void *hash_next(void *_hash_table, struct hash_iterator *i)
 {
 	struct hash_table *t = _hash_table;
 	unsigned int index;
+	struct hash_elem *head;
 
 	verify_hash_table(t);
 
 restart:
 	if(!i->ptr) {
-		for(index = (unsigned int)(i->bucket + 1); index < t->table_size; index++) {
-			if(t->table[index]) {
+		for(index = (unsigned int)(i->bucket + 1); index < t->old_size + t->table_size; index++) {
+			if(index < t->old_size)
+				head = t->old_table[index];
+			else
+				head = t->table[index - t->old_size];
+			if(head) {
 				i->bucket = index;
-				i->ptr = t->table[index];
+				i->ptr = head;
 				break;
 			}
 		}
@@ -282,9 +521,135 @@ void hash_dump(void *_hash_table)
 	dprintf("\tnum_elems %d\n", t->num_elems);
 	dprintf("\tflags 0x%x\n", t->flags);
 	dprintf("\tcompare %p hash %p\n", t->compare_func, t->hash_func);
+	if(t->old_table) {
+		dprintf("\told table %p, %d buckets, moved up to %d:\n", t->old_table, t->old_size, t->migrate_index);
+		for(i = 0; i < t->old_size; i++) {
+			dprintf("\t\t%p\n", t->old_table[i]);
+		}
+	}
 	dprintf("\ttable %p:\n", t->table);
 	for(i = 0; i < t->table_size; i++) {
 		dprintf("\t\t%p\n", t->table[i]);
 	}
 }
 
+static unsigned int longest_chain(struct hash_table *t, struct hash_elem **buckets, unsigned int size)
+{
+	unsigned int longest = 0;
+	unsigned int len;
+	unsigned int i;
+	void *e;
+
+	for(i = 0; i < size; i++) {
+		len = 0;
+		for(e = buckets[i]; e != NULL; e = NEXT(t, e))
+			len++;
+		longest = max(longest, len);
+	}
+
+	return longest;
+}
+
+static void dump_hash_tables(int argc, char **argv)
+{
+	struct hash_table *t;
+	char name[64];
+	addr_t base;
+	unsigned int chain;
+
+	dprintf("table\t\thash func\t\t\tbuckets\telems\tmax\tload\tchain\tlookups\tsteps\tgrows\tdeferred\n");
+
+	list_for_every_entry(&hash_tables, t, struct hash_table, all_node) {
+		if(elf_reverse_lookup_symbol((addr_t)t->hash_func, &base, name, sizeof(name)) < 0)
+			strcpy(name, "?");
+
+		chain = longest_chain(t, t->table, t->table_size);
+		if(t->old_table)
+			chain = max(chain, longest_chain(t, t->old_table, t->old_size));
+
+		dprintf("%p\t%-24s\t%d\t%d\t%d\t%d.%02d\t%d\t%d\t%d.%02d\t%d\t%d",
+			t, name, t->table_size, t->num_elems, t->max_elems,
+			t->num_elems / t->table_size, (t->num_elems * 100 / t->table_size) % 100,
+			chain, t->lookups,
+			t->lookups ? t->lookup_steps / t->lookups : 0,
+			t->lookups ? (t->lookup_steps * 100 / t->lookups) % 100 : 0,
+			t->grows, t->deferred_grows);
+		if(t->old_table)
+			dprintf("\tresizing from %d, %d moved", t->old_size, t->migrate_index);
+		if(t->resize_pending)
+			dprintf("\twaiting on resizer");
+		dprintf("\n");
+	}
+}
+
+static int hash_resizer(void *unused)
+{
+	struct hash_table *t;
+	struct hash_elem **retired;
+	struct hash_elem **spare;
+	unsigned int size;
+
+	for(;;) {
+		thread_snooze(HASH_RESIZER_INTERVAL);
+
+		int_disable_interrupts();
+		GRAB_HASH_LIST_LOCK();
+
+		while(resize_queue != NULL) {
+			t = resize_queue;
+			resize_queue = t->resize_next;
+			t->resize_pending = false;
+
+			retired = t->retired_table;
+			t->retired_table = NULL;
+
+			size = 0;
+			if(t->spare_table == NULL && t->old_table == NULL)
+				size = t->table_size * 2 + 1;
+			resizer_table = t;
+
+			RELEASE_HASH_LIST_LOCK();
+			int_restore_interrupts();
+
+			if(retired)
+				free(retired);
+			spare = size ? alloc_buckets(size) : NULL;
+
+			int_disable_interrupts();
+			GRAB_HASH_LIST_LOCK();
+
+			// the table may have been torn down in the meantime
+			if(spare && resizer_table == t && t->spare_table == NULL) {
+				t->spare_table = spare;
+				t->spare_size = size;
+				spare = NULL;
+			}
+			resizer_table = NULL;
+
+			if(spare) {
+				RELEASE_HASH_LIST_LOCK();
+				int_restore_interrupts();
+				free(spare);
+				int_disable_interrupts();
+				GRAB_HASH_LIST_LOCK();
+			}
+		}
+
+		RELEASE_HASH_LIST_LOCK();
+		int_restore_interrupts();
+	}
+
+	return 0;
+}
+
+int hash_init_postthread(void)
+{
+	thread_id tid;
+
+	tid = thread_create_kernel_thread("hash resizer", &hash_resizer, NULL);
+	thread_resume_thread(tid);
+
+	dbg_add_command(&dump_hash_tables, "hashes", "dump size, load and lookup stats of every hash table");
+
+	return 0;
+}
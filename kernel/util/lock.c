@@ -26,7 +26,7 @@ int recursive_lock_create(recursive_lock *lock)
 		return ERR_INVALID_ARGS;
 	lock->holder = -1;
 	lock->recursion = 0;
-	lock->sem = sem_create(1, "recursive_lock_sem");
+	lock->sem = sem_create_mutex("recursive_lock_sem");
 //	if(lock->sem < 0)
 //		return -1;
 	return NO_ERROR;
@@ -86,7 +86,7 @@ int mutex_init(mutex *m, const char *in_name)
 
 	m->holder = -1;
 
-	m->sem = sem_create(1, name);
+	m->sem = sem_create_mutex(name);
 	if(m->sem < 0)
 		return m->sem;
 
@@ -116,6 +116,21 @@ void mutex_lock(mutex *m)
 	m->holder = me;
 }
 
+// returns false right away instead of blocking if someone else holds the mutex
+bool mutex_trylock(mutex *m)
+{
+	thread_id me = thread_get_current_thread_id();
+
+	// already ours, which to a caller that can't wait is as good as busy
+	if(me == m->holder)
+		return false;
+
+	if(sem_acquire_etc(m->sem, 1, SEM_FLAG_TIMEOUT, 0, NULL) < 0)
+		return false;
+	m->holder = me;
+	return true;
+}
+
 void mutex_unlock(mutex *m)
 {
 	thread_id me = thread_get_current_thread_id();
@@ -10,15 +10,19 @@
 #include <kernel/debug.h>
 #include <kernel/console.h>
 #include <kernel/khash.h>
+#include <kernel/list.h>
 #include <kernel/lock.h>
+#include <kernel/sem.h>
 #include <kernel/thread.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/arch/cpu.h>
 #include <kernel/elf.h>
 #include <kernel/fs/rootfs.h>
 #include <kernel/fs/bootfs.h>
 #include <kernel/fs/devfs.h>
 #include <kernel/fs/pipefs.h>
+#include <kernel/wait_set.h>
 #include <newos/errors.h>
 
 #include <kernel/fs/rootfs.h>
@@ -44,6 +48,8 @@ struct vnode {
 	int ref_count;
 	bool delete_me;
 	bool busy;
+	struct list_node unused_node;
+	struct list_node dirty_node;
 };
 struct vnode_hash_key {
 	fs_id fsid;
@@ -56,6 +62,8 @@ struct file_descriptor {
 	int ref_count;
 	bool coe;
 	bool dir;
+	bool cached;	// regular file read and written through the vnode's cache
+	off_t pos;		// file position, only kept here for cached files
 };
 
 struct ioctx {
@@ -70,6 +78,7 @@ struct fs_container {
 	struct fs_container *next;
 	struct fs_calls *calls;
 	const char *name;
+	int flags;
 };
 static struct fs_container *fs_list;
 
@@ -90,16 +99,51 @@ struct fs_mount {
 static mutex vfs_mutex;
 static mutex vfs_mount_mutex;
 static mutex vfs_mount_op_mutex;
-static mutex vfs_vnode_mutex;
 
+// The vnode table is split into stripes picked by a hash of the vnode's id,
+// each with its own lock and hash table. A stripe's lock covers the busy
+// flag and the ref count going to or coming back from zero for its vnodes,
+// refs are otherwise taken and dropped with atomics. Threads waiting for a
+// busy vnode sleep on the stripe's busy_sem until some vnode in the stripe
+// stops being busy, then look again.
+// Lock order is stripe lock, then unused_vnode_mutex.
 #define VNODE_HASH_TABLE_SIZE 1024
-static void *vnode_table;
+#define VNODE_HASH_STRIPES 32
+struct vnode_stripe {
+	mutex lock;
+	void *table;
+	sem_id busy_sem;
+	int busy_waiters;
+	int lookups;
+	int busy_waits;
+} _ALIGNED(64);
+static struct vnode_stripe vnode_stripes[VNODE_HASH_STRIPES];
+static struct slab_cache *fd_cache;
 static struct vnode *root_vnode;
 
 #define MOUNTS_HASH_TABLE_SIZE 16
 static void *mounts_table;
 static fs_id next_fsid = 0;
 
+// vnodes nobody holds a ref to are kept around with their caches until they
+// fall off the end of this list or the page daemon asks for memory back
+#define MAX_UNUSED_VNODES 1024
+static mutex unused_vnode_mutex;
+static struct list_node unused_vnodes;
+static int unused_vnode_count;
+static struct {
+	int reused;
+	int released;
+	int evicted;
+	int trimmed;
+} unused_vnode_stats;
+
+// vnodes with data written to their cache that hasn't made it to the file yet,
+// each one on the list holds a ref to the vnode
+#define FILE_FLUSH_INTERVAL 5000000
+static mutex dirty_vnode_mutex;
+static struct list_node dirty_vnodes;
+
 static int mount_compare(void *_m, const void *_key)
 {
 	struct fs_mount *mount = _m;
@@ -161,6 +205,441 @@ static unsigned int vnode_hash(void *_v, const void *_key, unsigned int range)
 #undef VHASH
 }
 
+static struct vnode_stripe *vnode_stripe(fs_id fsid, vnode_id vnid)
+{
+	uint32 hash = ((uint32)(vnid >> 32) + (uint32)vnid) ^ (uint32)fsid;
+
+	// use the high bits of a multiplicative hash, the tables in the stripes use the low ones
+	return &vnode_stripes[((hash * 2654435761U) >> 16) % VNODE_HASH_STRIPES];
+}
+
+// NOTE: expects the stripe lock to be held, returns with it held again
+static void wait_for_busy_vnode(struct vnode_stripe *stripe)
+{
+	stripe->busy_waiters++;
+	stripe->busy_waits++;
+	mutex_unlock(&stripe->lock);
+
+	sem_acquire(stripe->busy_sem, 1);
+
+	mutex_lock(&stripe->lock);
+}
+
+// NOTE: expects the stripe lock to be held
+static void wake_busy_vnode_waiters(struct vnode_stripe *stripe)
+{
+	if(stripe->busy_waiters > 0) {
+		sem_release_etc(stripe->busy_sem, stripe->busy_waiters, 0);
+		stripe->busy_waiters = 0;
+	}
+}
+
+/*
+	Name cache, maps (directory, name) to the vnode id the filesystem's
+	lookup returned, or remembers that it returned ERR_NOT_FOUND. Entries
+	hang off a per directory record keyed by the directory's vnode id, so
+	they outlive the directory's vnode and all of a directory's entries can
+	be found when it goes away. Anything that changes a directory's contents
+	through the vfs purges the names involved, filesystems that add or drop
+	names behind the vfs' back call vfs_name_cache_purge.
+	Lookups racing with a purge could put back a stale answer, so every purge
+	bumps name_cache_gen and an answer is only entered if it hasn't moved
+	since before the filesystem was asked.
+*/
+#define NAME_CACHE_NAME_LEN 32
+#define NAME_CACHE_MAX_ENTRIES 4096
+#define NAME_CACHE_HASH_SIZE 1024
+#define NAME_CACHE_DIR_HASH_SIZE 256
+
+struct name_cache_dir {
+	struct name_cache_dir *next;
+	fs_id fsid;
+	vnode_id vnid;
+	struct list_node entries;
+};
+
+struct name_cache_entry {
+	struct name_cache_entry *next;
+	struct list_node lru_node;
+	struct list_node dir_node;
+	struct name_cache_dir *dir;
+	vnode_id vnid;
+	bool negative;
+	char name[NAME_CACHE_NAME_LEN];
+};
+
+struct name_cache_key {
+	struct name_cache_dir *dir;
+	const char *name;
+};
+
+static mutex name_cache_mutex;
+static void *name_cache_table;
+static void *name_cache_dir_table;
+static struct slab_cache *name_cache_entry_cache;
+static struct list_node name_cache_lru;
+static int name_cache_count;
+static volatile int name_cache_gen;
+
+static struct {
+	int hits;
+	int negative_hits;
+	int misses;
+	int enters;
+	int evictions;
+	int purges;
+	int lost_races;
+} name_cache_stats;
+
+static int name_cache_compare(void *_e, const void *_key)
+{
+	struct name_cache_entry *e = _e;
+	const struct name_cache_key *key = _key;
+
+	if(e->dir == key->dir && strcmp(e->name, key->name) == 0)
+		return 0;
+	else
+		return -1;
+}
+
+static unsigned int name_cache_hash(void *_e, const void *_key, unsigned int range)
+{
+	struct name_cache_entry *e = _e;
+	const struct name_cache_key *key = _key;
+
+	if(e != NULL)
+		return ((addr_t)e->dir ^ hash_hash_str(e->name)) % range;
+	else
+		return ((addr_t)key->dir ^ hash_hash_str(key->name)) % range;
+}
+
+static int name_cache_dir_compare(void *_d, const void *_key)
+{
+	struct name_cache_dir *d = _d;
+	const struct vnode_hash_key *key = _key;
+
+	if(d->fsid == key->fsid && d->vnid == key->vnid)
+		return 0;
+	else
+		return -1;
+}
+
+static unsigned int name_cache_dir_hash(void *_d, const void *_key, unsigned int range)
+{
+	struct name_cache_dir *d = _d;
+	const struct vnode_hash_key *key = _key;
+
+#define NCHASH(fsid, vnid) (((uint32)((vnid)>>32) + (uint32)(vnid)) ^ (uint32)(fsid))
+
+	if(d != NULL)
+		return (NCHASH(d->fsid, d->vnid) % range);
+	else
+		return (NCHASH(key->fsid, key->vnid) % range);
+
+#undef NCHASH
+}
+
+static bool name_cache_wants(struct vnode *dir, const char *name)
+{
+	if(dir->mount->fs->flags & FS_FLAG_NO_NAME_CACHE)
+		return false;
+	if(strlen(name) >= NAME_CACHE_NAME_LEN)
+		return false;
+	// these move around with renames of the directory itself, and are cheap to look up anyway
+	if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return false;
+	return true;
+}
+
+// NOTE: expects the name cache lock to be held
+static struct name_cache_dir *name_cache_find_dir(fs_id fsid, vnode_id vnid)
+{
+	struct vnode_hash_key key;
+
+	key.fsid = fsid;
+	key.vnid = vnid;
+
+	return hash_lookup(name_cache_dir_table, &key);
+}
+
+// NOTE: expects the name cache lock to be held
+static struct name_cache_entry *name_cache_find(fs_id fsid, vnode_id dir_vnid, const char *name)
+{
+	struct name_cache_key key;
+
+	key.dir = name_cache_find_dir(fsid, dir_vnid);
+	if(key.dir == NULL)
+		return NULL;
+	key.name = name;
+
+	return hash_lookup(name_cache_table, &key);
+}
+
+// NOTE: expects the name cache lock to be held
+static void name_cache_remove_entry(struct name_cache_entry *e)
+{
+	struct name_cache_dir *dir = e->dir;
+
+	hash_remove(name_cache_table, e);
+	list_delete(&e->lru_node);
+	list_delete(&e->dir_node);
+	name_cache_count--;
+
+	if(list_is_empty(&dir->entries)) {
+		hash_remove(name_cache_dir_table, dir);
+		kfree(dir);
+	}
+
+	slab_free(name_cache_entry_cache, e);
+}
+
+// returns NO_ERROR on a hit, ERR_NOT_FOUND if the name is known not to exist,
+// and ERR_GENERAL if the cache doesn't know about it
+static int name_cache_lookup(struct vnode *dir, const char *name, vnode_id *vnid)
+{
+	struct name_cache_entry *e;
+	int err;
+
+	if(!name_cache_wants(dir, name))
+		return ERR_GENERAL;
+
+	mutex_lock(&name_cache_mutex);
+
+	e = name_cache_find(dir->fsid, dir->vnid, name);
+	if(e == NULL) {
+		name_cache_stats.misses++;
+		err = ERR_GENERAL;
+	} else {
+		// move it to the end of the lru
+		list_delete(&e->lru_node);
+		list_add_tail(&name_cache_lru, &e->lru_node);
+
+		if(e->negative) {
+			name_cache_stats.negative_hits++;
+			err = ERR_NOT_FOUND;
+		} else {
+			name_cache_stats.hits++;
+			*vnid = e->vnid;
+			err = NO_ERROR;
+		}
+	}
+
+	mutex_unlock(&name_cache_mutex);
+
+	return err;
+}
+
+// evicts the least recently used entry if the cache is full. This can free the
+// entry's dir record, so it has to be done before a dir record is looked up.
+// NOTE: expects name_cache_mutex to be held
+static void name_cache_make_room(void)
+{
+	if(name_cache_count >= NAME_CACHE_MAX_ENTRIES) {
+		name_cache_remove_entry(list_peek_head_type(&name_cache_lru, struct name_cache_entry, lru_node));
+		name_cache_stats.evictions++;
+	}
+}
+
+static void name_cache_enter(struct vnode *dir, const char *name, vnode_id vnid, bool negative, int gen)
+{
+	struct name_cache_entry *e;
+	struct name_cache_dir *d;
+	struct name_cache_dir *new_dir = NULL;
+
+	if(!name_cache_wants(dir, name))
+		return;
+
+	e = slab_alloc(name_cache_entry_cache);
+	if(e == NULL)
+		return;
+	strcpy(e->name, name);
+	e->vnid = vnid;
+	e->negative = negative;
+
+	mutex_lock(&name_cache_mutex);
+
+	if(gen != name_cache_gen) {
+		// something got purged while the filesystem was being asked, the answer may be stale
+		name_cache_stats.lost_races++;
+		goto out;
+	}
+
+	// someone else may have beaten us to it
+	if(name_cache_find(dir->fsid, dir->vnid, name) != NULL)
+		goto out;
+
+	name_cache_make_room();
+	d = name_cache_find_dir(dir->fsid, dir->vnid);
+	if(d == NULL) {
+		mutex_unlock(&name_cache_mutex);
+		new_dir = kmalloc(sizeof(struct name_cache_dir));
+		if(new_dir == NULL) {
+			slab_free(name_cache_entry_cache, e);
+			return;
+		}
+		mutex_lock(&name_cache_mutex);
+
+		if(gen != name_cache_gen) {
+			name_cache_stats.lost_races++;
+			goto out;
+		}
+		if(name_cache_find(dir->fsid, dir->vnid, name) != NULL)
+			goto out;
+
+		name_cache_make_room();
+		d = name_cache_find_dir(dir->fsid, dir->vnid);
+		if(d == NULL) {
+			d = new_dir;
+			new_dir = NULL;
+			d->fsid = dir->fsid;
+			d->vnid = dir->vnid;
+			list_initialize(&d->entries);
+			hash_insert(name_cache_dir_table, d);
+		}
+	}
+
+	e->dir = d;
+	list_add_tail(&d->entries, &e->dir_node);
+	list_add_tail(&name_cache_lru, &e->lru_node);
+	hash_insert(name_cache_table, e);
+	name_cache_count++;
+	name_cache_stats.enters++;
+	e = NULL;
+
+out:
+	mutex_unlock(&name_cache_mutex);
+
+	if(e)
+		slab_free(name_cache_entry_cache, e);
+	if(new_dir)
+		kfree(new_dir);
+}
+
+static void name_cache_purge(fs_id fsid, vnode_id dir_vnid, const char *name)
+{
+	struct name_cache_entry *e;
+
+	mutex_lock(&name_cache_mutex);
+
+	atomic_add((int *)&name_cache_gen, 1);
+
+	e = name_cache_find(fsid, dir_vnid, name);
+	if(e) {
+		name_cache_remove_entry(e);
+		name_cache_stats.purges++;
+	}
+
+	mutex_unlock(&name_cache_mutex);
+}
+
+// drop everything cached about the contents of a directory
+static void name_cache_purge_dir(fs_id fsid, vnode_id dir_vnid)
+{
+	struct name_cache_dir *d;
+
+	mutex_lock(&name_cache_mutex);
+
+	atomic_add((int *)&name_cache_gen, 1);
+
+	d = name_cache_find_dir(fsid, dir_vnid);
+	if(d) {
+		// the dir record goes away with its last entry
+		while(!list_is_empty(&d->entries)) {
+			name_cache_remove_entry(list_peek_head_type(&d->entries, struct name_cache_entry, dir_node));
+			name_cache_stats.purges++;
+		}
+	}
+
+	mutex_unlock(&name_cache_mutex);
+}
+
+static void name_cache_purge_fs(fs_id fsid)
+{
+	struct name_cache_entry *e;
+	struct name_cache_entry *temp;
+
+	mutex_lock(&name_cache_mutex);
+
+	atomic_add((int *)&name_cache_gen, 1);
+
+	list_for_every_entry_safe(&name_cache_lru, e, temp, struct name_cache_entry, lru_node) {
+		if(e->dir->fsid == fsid) {
+			name_cache_remove_entry(e);
+			name_cache_stats.purges++;
+		}
+	}
+
+	mutex_unlock(&name_cache_mutex);
+}
+
+int vfs_name_cache_purge(fs_id fsid, vnode_id dir_vnid, const char *name)
+{
+	if(name_cache_table == NULL)
+		return NO_ERROR;
+
+	if(name)
+		name_cache_purge(fsid, dir_vnid, name);
+	else
+		name_cache_purge_dir(fsid, dir_vnid);
+
+	return NO_ERROR;
+}
+
+static void dump_name_cache(int argc, char **argv)
+{
+	struct name_cache_entry *e;
+	int total;
+
+	total = name_cache_stats.hits + name_cache_stats.negative_hits + name_cache_stats.misses;
+
+	dprintf("name cache: %d of %d entries, gen %d\n", name_cache_count, NAME_CACHE_MAX_ENTRIES, name_cache_gen);
+	dprintf("\thits %d negative hits %d misses %d (%d%% hit)\n",
+		name_cache_stats.hits, name_cache_stats.negative_hits, name_cache_stats.misses,
+		total ? (name_cache_stats.hits + name_cache_stats.negative_hits) * 100 / total : 0);
+	dprintf("\tenters %d evictions %d purges %d lost races %d\n",
+		name_cache_stats.enters, name_cache_stats.evictions, name_cache_stats.purges, name_cache_stats.lost_races);
+
+	if(argc < 2 || strcmp(argv[1], "entries") != 0)
+		return;
+
+	// least recently used first
+	list_for_every_entry(&name_cache_lru, e, struct name_cache_entry, lru_node) {
+		if(e->negative)
+			dprintf("\t0x%x:0x%Lx\t%-32s\tnegative\n", e->dir->fsid, e->dir->vnid, e->name);
+		else
+			dprintf("\t0x%x:0x%Lx\t%-32s\t0x%Lx\n", e->dir->fsid, e->dir->vnid, e->name, e->vnid);
+	}
+}
+
+static int name_cache_init(void)
+{
+	name_cache_table = hash_init(NAME_CACHE_HASH_SIZE, offsetof(struct name_cache_entry, next),
+		&name_cache_compare, &name_cache_hash);
+	if(name_cache_table == NULL)
+		return ERR_NO_MEMORY;
+
+	name_cache_dir_table = hash_init(NAME_CACHE_DIR_HASH_SIZE, offsetof(struct name_cache_dir, next),
+		&name_cache_dir_compare, &name_cache_dir_hash);
+	if(name_cache_dir_table == NULL)
+		return ERR_NO_MEMORY;
+
+	name_cache_entry_cache = slab_cache_create("name_cache_entry", sizeof(struct name_cache_entry), 0, 0);
+	if(name_cache_entry_cache == NULL)
+		return ERR_NO_MEMORY;
+
+	list_initialize(&name_cache_lru);
+	name_cache_count = 0;
+	name_cache_gen = 0;
+	memset(&name_cache_stats, 0, sizeof(name_cache_stats));
+
+	if(mutex_init(&name_cache_mutex, "vfs_name_cache_lock") < 0)
+		return ERR_NO_MEMORY;
+
+	dbg_add_command(&dump_name_cache, "namecache", "dump name cache stats, 'namecache entries' lists the entries");
+
+	return NO_ERROR;
+}
+
 static int init_vnode(struct vnode *v)
 {
 #if MAKE_NOIZE
@@ -178,6 +657,8 @@ static int init_vnode(struct vnode *v)
 	v->busy = false;
 	v->covered_by = NULL;
 	v->mount = NULL;
+	list_clear_node(&v->unused_node);
+	list_clear_node(&v->dirty_node);
 
 	return 0;
 }
@@ -241,12 +722,104 @@ static struct vnode *create_new_vnode(void)
 	return v;
 }
 
+// tears down a vnode nobody has a ref to anymore, it has to be marked busy
+static void destroy_vnode(struct vnode *v, bool free_mem, bool r)
+{
+	struct vnode_stripe *stripe = vnode_stripe(v->fsid, v->vnid);
+
+	/* if we have a vm_cache attached, write back what's left in it and remove it.
+	   a reentrant call may have the fs locked, pages dirtied through write() can't be
+	   left at that point anyway since the dirty list holds a ref to the vnode */
+	if(v->cache) {
+		if(!v->delete_me && !r)
+			vm_cache_flush_file(v);
+		vm_cache_release_ref((vm_cache_ref *)v->cache);
+	}
+	v->cache = NULL;
+
+	if(v->delete_me) {
+		v->mount->fs->calls->fs_removevnode(v->mount->fscookie, v->priv_vnode, r);
+		// the id may get recycled, don't leave anything cached under it if it was a dir
+		name_cache_purge_dir(v->fsid, v->vnid);
+	} else
+		v->mount->fs->calls->fs_putvnode(v->mount->fscookie, v->priv_vnode, r);
+
+	remove_vnode_from_mount_list(v, v->mount);
+
+	mutex_lock(&stripe->lock);
+	hash_remove(stripe->table, v);
+	// anyone waiting on it will find it gone and read it in again
+	wake_busy_vnode_waiters(stripe);
+	mutex_unlock(&stripe->lock);
+
+	if(free_mem) {
+#if MAKE_NOIZE
+		dprintf("destroy_vnode: freeing vnode %p\n", v);
+#endif
+		kfree(v);
+	}
+}
+
+// takes the oldest vnode off the unused list and marks it busy, NULL if there are none
+static struct vnode *remove_oldest_unused_vnode(void)
+{
+	struct vnode_stripe *stripe;
+	struct vnode *v;
+
+	for(;;) {
+		// peek at the oldest one to see which stripe it is in
+		mutex_lock(&unused_vnode_mutex);
+		v = list_peek_head_type(&unused_vnodes, struct vnode, unused_node);
+		stripe = v ? vnode_stripe(v->fsid, v->vnid) : NULL;
+		mutex_unlock(&unused_vnode_mutex);
+
+		if(!v)
+			return NULL;
+
+		mutex_lock(&stripe->lock);
+		mutex_lock(&unused_vnode_mutex);
+
+		// it may have been picked back up in the meantime, settle for whatever is
+		// oldest now as long as it is covered by the lock we're holding
+		v = list_peek_head_type(&unused_vnodes, struct vnode, unused_node);
+		if(v && vnode_stripe(v->fsid, v->vnid) == stripe) {
+			list_delete(&v->unused_node);
+			unused_vnode_count--;
+			v->busy = true;
+		} else {
+			v = NULL;
+		}
+
+		mutex_unlock(&unused_vnode_mutex);
+		mutex_unlock(&stripe->lock);
+
+		if(v)
+			return v;
+	}
+}
+
 static int dec_vnode_ref_count(struct vnode *v, bool free_mem, bool r)
 {
+	struct vnode_stripe *stripe;
+	struct vnode *evict = NULL;
 	int err;
 	int old_ref;
 
-	mutex_lock(&vfs_vnode_mutex);
+	// as long as this isn't the last ref nobody else cares
+	for(;;) {
+		old_ref = v->ref_count;
+		if(old_ref <= 1)
+			break;
+		if(test_and_set(&v->ref_count, old_ref - 1, old_ref) == old_ref) {
+#if MAKE_NOIZE
+			dprintf("dec_vnode_ref_count: vnode %p, ref now %d, old_ref %d\n", v, old_ref - 1, old_ref);
+#endif
+			return 0;
+		}
+	}
+
+	stripe = vnode_stripe(v->fsid, v->vnid);
+	mutex_lock(&stripe->lock);
 
 	if(v->busy == true)
 		panic("dec_vnode_ref_count called on vnode that was busy! vnode %p\n", v);
@@ -256,41 +829,91 @@ static int dec_vnode_ref_count(struct vnode *v, bool free_mem, bool r)
 	dprintf("dec_vnode_ref_count: vnode %p, ref now %d, old_ref %d\n", v, v->ref_count, old_ref);
 #endif
 
-	if(old_ref == 1) {
+	if(old_ref == 1 && !v->delete_me && !v->mount->unmounting && free_mem) {
+		bool trim;
+
+		// park it on the unused list, get_vnode will pick it back up
+		mutex_lock(&unused_vnode_mutex);
+		list_add_tail(&unused_vnodes, &v->unused_node);
+		unused_vnode_count++;
+		unused_vnode_stats.released++;
+		// the filesystem may be holding its own locks if this is a reentrant call,
+		// so leave trimming the list to the next caller
+		trim = unused_vnode_count > MAX_UNUSED_VNODES && !r;
+		mutex_unlock(&unused_vnode_mutex);
+
+		mutex_unlock(&stripe->lock);
+
+		if(trim) {
+			evict = remove_oldest_unused_vnode();
+			if(evict) {
+				atomic_add(&unused_vnode_stats.evicted, 1);
+				destroy_vnode(evict, true, false);
+			}
+		}
+		err = 0;
+	} else if(old_ref == 1) {
 		v->busy = true;
 
-		mutex_unlock(&vfs_vnode_mutex);
+		mutex_unlock(&stripe->lock);
 
-		/* if we have a vm_cache attached, remove it */
-		if(v->cache)
-			vm_cache_release_ref((vm_cache_ref *)v->cache);
-		v->cache = NULL;
-
-		if(v->delete_me)
-			v->mount->fs->calls->fs_removevnode(v->mount->fscookie, v->priv_vnode, r);
-		else
-			v->mount->fs->calls->fs_putvnode(v->mount->fscookie, v->priv_vnode, r);
-
-		remove_vnode_from_mount_list(v, v->mount);
-
-		mutex_lock(&vfs_vnode_mutex);
-		hash_remove(vnode_table, v);
-		mutex_unlock(&vfs_vnode_mutex);
-
-		if(free_mem) {
-#if MAKE_NOIZE
-			dprintf("dec_vnode_ref_count: freeing vnode %p\n", v);
-#endif
-			kfree(v);
-		}
+		destroy_vnode(v, free_mem, r);
 		err = 1;
 	} else {
-		mutex_unlock(&vfs_vnode_mutex);
+		mutex_unlock(&stripe->lock);
 		err = 0;
 	}
 	return err;
 }
 
+// frees up to count unused vnodes, and with them their cached pages
+int vfs_free_unused_vnodes(int count)
+{
+	struct vnode *v;
+	int freed = 0;
+
+	while(freed < count) {
+		v = remove_oldest_unused_vnode();
+		if(!v)
+			break;
+
+		atomic_add(&unused_vnode_stats.trimmed, 1);
+		destroy_vnode(v, true, false);
+		freed++;
+	}
+
+	return freed;
+}
+
+static void dump_vnode_stripes(int argc, char **argv)
+{
+	int i;
+
+	dprintf("stripe\tlookups\tbusy waits\twaiting\n");
+	for(i = 0; i < VNODE_HASH_STRIPES; i++) {
+		dprintf("%d\t%d\t%d\t\t%d\n", i, vnode_stripes[i].lookups,
+			vnode_stripes[i].busy_waits, vnode_stripes[i].busy_waiters);
+	}
+}
+
+static void dump_unused_vnodes(int argc, char **argv)
+{
+	struct vnode *v;
+
+	dprintf("unused vnodes: %d, max %d\n", unused_vnode_count, MAX_UNUSED_VNODES);
+	dprintf("\treleased %d reused %d evicted %d trimmed by page daemon %d\n",
+		unused_vnode_stats.released, unused_vnode_stats.reused,
+		unused_vnode_stats.evicted, unused_vnode_stats.trimmed);
+
+	if(argc < 2 || strcmp(argv[1], "list") != 0)
+		return;
+
+	// oldest first
+	list_for_every_entry(&unused_vnodes, v, struct vnode, unused_node) {
+		dprintf("\t%p\tfsid 0x%x vnid 0x%Lx cache %p\n", v, v->fsid, v->vnid, v->cache);
+	}
+}
+
 static int inc_vnode_ref_count(struct vnode *v)
 {
 	int old_ref = atomic_add(&v->ref_count, 1);
@@ -300,18 +923,84 @@ static int inc_vnode_ref_count(struct vnode *v)
 	return old_ref;
 }
 
+// NOTE: expects the vnode's stripe lock to be held
 static struct vnode *lookup_vnode(fs_id fsid, vnode_id vnid)
 {
+	struct vnode_stripe *stripe = vnode_stripe(fsid, vnid);
 	struct vnode_hash_key key;
 
 	key.fsid = fsid;
 	key.vnid = vnid;
 
-	return hash_lookup(vnode_table, &key);
+	stripe->lookups++;
+	return hash_lookup(stripe->table, &key);
+}
+
+// the caller must hold a ref to the vnode
+static void mark_vnode_dirty(struct vnode *v)
+{
+	mutex_lock(&dirty_vnode_mutex);
+	if(v->dirty_node.next == NULL) {
+		inc_vnode_ref_count(v);
+		list_add_tail(&dirty_vnodes, &v->dirty_node);
+	}
+	mutex_unlock(&dirty_vnode_mutex);
+}
+
+// writes back the cached data of the dirty vnodes on mount, or of all of them if mount is NULL
+static int flush_dirty_vnodes(struct fs_mount *mount)
+{
+	struct list_node flush_list;
+	struct vnode *v;
+	struct vnode *temp;
+	int err = NO_ERROR;
+	int ferr;
+
+	list_initialize(&flush_list);
+
+	mutex_lock(&dirty_vnode_mutex);
+	list_for_every_entry_safe(&dirty_vnodes, v, temp, struct vnode, dirty_node) {
+		if(mount == NULL || v->mount == mount) {
+			list_delete(&v->dirty_node);
+			list_add_tail(&flush_list, &v->dirty_node);
+		}
+	}
+	mutex_unlock(&dirty_vnode_mutex);
+
+	for(;;) {
+		// once it's off the list, a new write puts it back on the dirty list
+		mutex_lock(&dirty_vnode_mutex);
+		v = list_remove_head_type(&flush_list, struct vnode, dirty_node);
+		mutex_unlock(&dirty_vnode_mutex);
+		if(v == NULL)
+			break;
+
+		ferr = vm_cache_flush_file(v);
+		if(ferr < 0) {
+			dprintf("flush_dirty_vnodes: error 0x%x writing back vnode %p (0x%x 0x%Lx)\n", ferr, v, v->fsid, v->vnid);
+			// hang on to it and try again next time
+			mark_vnode_dirty(v);
+			err = ferr;
+		}
+		dec_vnode_ref_count(v, true, false);
+	}
+
+	return err;
+}
+
+static int file_flusher(void *unused)
+{
+	for(;;) {
+		thread_snooze(FILE_FLUSH_INTERVAL);
+		flush_dirty_vnodes(NULL);
+	}
+
+	return 0;
 }
 
 static int get_vnode(fs_id fsid, vnode_id vnid, struct vnode **outv, int r)
 {
+	struct vnode_stripe *stripe = vnode_stripe(fsid, vnid);
 	struct vnode *v;
 	int err;
 
@@ -319,15 +1008,13 @@ static int get_vnode(fs_id fsid, vnode_id vnid, struct vnode **outv, int r)
 	dprintf("get_vnode: fsid %d vnid 0x%Lx\n", fsid, vnid);
 #endif
 
-	mutex_lock(&vfs_vnode_mutex);
+	mutex_lock(&stripe->lock);
 
 	for(;;) {
 		v = lookup_vnode(fsid, vnid);
 		if(v) {
 			if(v->busy) {
-				mutex_unlock(&vfs_vnode_mutex);
-				thread_snooze(10000); // 10 ms
-				mutex_lock(&vfs_vnode_mutex);
+				wait_for_busy_vnode(stripe);
 				continue;
 			}
 		}
@@ -338,7 +1025,14 @@ static int get_vnode(fs_id fsid, vnode_id vnid, struct vnode **outv, int r)
 	dprintf("get_vnode: tried to lookup vnode, got %p\n", v);
 #endif
 	if(v) {
-		inc_vnode_ref_count(v);
+		if(inc_vnode_ref_count(v) == 0) {
+			// it was sitting on the unused list
+			mutex_lock(&unused_vnode_mutex);
+			list_delete(&v->unused_node);
+			unused_vnode_count--;
+			unused_vnode_stats.reused++;
+			mutex_unlock(&unused_vnode_mutex);
+		}
 	} else {
 		// we need to create a new vnode and read it in
 		v = create_new_vnode();
@@ -354,8 +1048,8 @@ static int get_vnode(fs_id fsid, vnode_id vnid, struct vnode **outv, int r)
 			goto err;
 		}
 		v->busy = true;
-		hash_insert(vnode_table, v);
-		mutex_unlock(&vfs_vnode_mutex);
+		hash_insert(stripe->table, v);
+		mutex_unlock(&stripe->lock);
 
 		add_vnode_to_mount_list(v, v->mount);
 
@@ -364,15 +1058,16 @@ static int get_vnode(fs_id fsid, vnode_id vnid, struct vnode **outv, int r)
 		if(err < 0)
 			remove_vnode_from_mount_list(v, v->mount);
 
-		mutex_lock(&vfs_vnode_mutex);
+		mutex_lock(&stripe->lock);
 		if(err < 0)
 			goto err1;
 
 		v->busy = false;
 		v->ref_count = 1;
+		wake_busy_vnode_waiters(stripe);
 	}
 
-	mutex_unlock(&vfs_vnode_mutex);
+	mutex_unlock(&stripe->lock);
 #if MAKE_NOIZE
 	dprintf("get_vnode: returning %p\n", v);
 #endif
@@ -380,9 +1075,10 @@ static int get_vnode(fs_id fsid, vnode_id vnid, struct vnode **outv, int r)
 	return NO_ERROR;
 
 err1:
-	hash_remove(vnode_table, v);
+	hash_remove(stripe->table, v);
+	wake_busy_vnode_waiters(stripe);
 err:
-	mutex_unlock(&vfs_vnode_mutex);
+	mutex_unlock(&stripe->lock);
 	if(v)
 		kfree(v);
 
@@ -413,23 +1109,53 @@ int vfs_get_vnode(fs_id fsid, vnode_id vnid, fs_vnode *fsv)
 
 int vfs_put_vnode(fs_id fsid, vnode_id vnid)
 {
+	struct vnode_stripe *stripe;
 	struct vnode *v;
 
 #if MAKE_NOIZE
 	dprintf("vfs_put_vnode: fsid %d vnid 0x%Lx\n", fsid, vnid);
 #endif
 
-	mutex_lock(&vfs_vnode_mutex);
+	stripe = vnode_stripe(fsid, vnid);
+	mutex_lock(&stripe->lock);
 
 	v = lookup_vnode(fsid, vnid);
 
-	mutex_unlock(&vfs_vnode_mutex);
+	mutex_unlock(&stripe->lock);
 	if(v)
 		dec_vnode_ref_count(v, true, true);
 
 	return NO_ERROR;
 }
 
+// a vnode that isn't around has no cached data to drop
+int vfs_file_cache_invalidate(fs_id fsid, vnode_id vnid)
+{
+	struct vnode_stripe *stripe;
+	struct vnode *v;
+	int err = NO_ERROR;
+
+	stripe = vnode_stripe(fsid, vnid);
+	mutex_lock(&stripe->lock);
+
+	// whoever noticed the change is using the vnode, leave unused and busy ones alone
+	v = lookup_vnode(fsid, vnid);
+	if(v && (v->busy || v->ref_count == 0))
+		v = NULL;
+	if(v)
+		inc_vnode_ref_count(v);
+
+	mutex_unlock(&stripe->lock);
+
+	if(v) {
+		if(v->cache)
+			err = vm_cache_invalidate_file(v);
+		dec_vnode_ref_count(v, true, false);
+	}
+
+	return err;
+}
+
 void vfs_vnode_acquire_ref(void *v)
 {
 #if MAKE_NOIZE
@@ -448,15 +1174,16 @@ void vfs_vnode_release_ref(void *v)
 
 int vfs_remove_vnode(fs_id fsid, vnode_id vnid)
 {
+	struct vnode_stripe *stripe = vnode_stripe(fsid, vnid);
 	struct vnode *v;
 
-	mutex_lock(&vfs_vnode_mutex);
+	mutex_lock(&stripe->lock);
 
 	v = lookup_vnode(fsid, vnid);
 	if(v)
 		v->delete_me = true;
 
-	mutex_unlock(&vfs_vnode_mutex);
+	mutex_unlock(&stripe->lock);
 	return 0;
 }
 
@@ -477,13 +1204,15 @@ static struct file_descriptor *alloc_fd(void)
 {
 	struct file_descriptor *f;
 
-	f = kmalloc(sizeof(struct file_descriptor));
+	f = slab_alloc(fd_cache);
 	if(f) {
 		f->vnode = NULL;
 		f->cookie = NULL;
 		f->ref_count = 1;
 		f->coe = false;
 		f->dir = false;
+		f->cached = false;
+		f->pos = 0;
 	}
 	return f;
 }
@@ -515,7 +1244,7 @@ static void free_fd(struct file_descriptor *f)
 		f->vnode->mount->fs->calls->fs_closedir(f->vnode->mount->fscookie, f->vnode->priv_vnode, f->cookie);
 	}
 	dec_vnode_ref_count(f->vnode, true, false);
-	kfree(f);
+	slab_free(fd_cache, f);
 }
 
 static void put_fd(struct file_descriptor *f)
@@ -619,13 +1348,62 @@ static struct ioctx *get_current_ioctx(bool kernel)
 	return ioctx;
 }
 
+// looks up a single path component in dir, returns the vnode with a ref on it
+static int dir_lookup(struct vnode *dir, const char *name, struct vnode **outv)
+{
+	struct vnode_stripe *stripe;
+	struct vnode *v;
+	vnode_id vnid;
+	int gen;
+	int err;
+
+	err = name_cache_lookup(dir, name, &vnid);
+	if(err == ERR_NOT_FOUND)
+		return err;
+	if(err == NO_ERROR) {
+		if(get_vnode(dir->fsid, vnid, outv, false) >= 0)
+			return NO_ERROR;
+
+		// it went away under us, ask the filesystem
+		name_cache_purge(dir->fsid, dir->vnid, name);
+	}
+
+	gen = name_cache_gen;
+
+	// tell the filesystem to parse this path
+	err = dir->mount->fs->calls->fs_lookup(dir->mount->fscookie, dir->priv_vnode, name, &vnid);
+	if(err < 0) {
+		if(err == ERR_NOT_FOUND)
+			name_cache_enter(dir, name, 0, true, gen);
+		return err;
+	}
+
+	// lookup the vnode, the call to fs_lookup should have caused a get_vnode to be called
+	// from inside the filesystem, thus the vnode would have to be in the list and it's
+	// ref count incremented at this point
+	stripe = vnode_stripe(dir->fsid, vnid);
+	mutex_lock(&stripe->lock);
+	v = lookup_vnode(dir->fsid, vnid);
+	mutex_unlock(&stripe->lock);
+
+	if(!v) {
+		// pretty screwed up here
+		panic("path_to_vnode: could not lookup vnode (fsid 0x%x vnid 0x%Lx)\n", dir->fsid, vnid);
+		return ERR_VFS_PATH_NOT_FOUND;
+	}
+
+	name_cache_enter(dir, name, vnid, false, gen);
+
+	*outv = v;
+	return NO_ERROR;
+}
+
 static int path_to_vnode(char *path, struct vnode **v, bool kernel)
 {
 	char *p = path;
 	char *next_p;
 	struct vnode *curr_v;
 	struct vnode *next_v;
-	vnode_id vnid;
 	int err;
 
 	if(!p)
@@ -676,28 +1454,12 @@ static int path_to_vnode(char *path, struct vnode **v, bool kernel)
 			}
 		}
 
-		// tell the filesystem to parse this path
-		err = curr_v->mount->fs->calls->fs_lookup(curr_v->mount->fscookie, curr_v->priv_vnode, p, &vnid);
+		err = dir_lookup(curr_v, p, &next_v);
 		if(err < 0) {
 			dec_vnode_ref_count(curr_v, true, false);
 			goto out;
 		}
 
-		// lookup the vnode, the call to fs_lookup should have caused a get_vnode to be called
-		// from inside the filesystem, thus the vnode would have to be in the list and it's
-		// ref count incremented at this point
-		mutex_lock(&vfs_vnode_mutex);
-		next_v = lookup_vnode(curr_v->fsid, vnid);
-		mutex_unlock(&vfs_vnode_mutex);
-
-		if(!next_v) {
-			// pretty screwed up here
-			panic("path_to_vnode: could not lookup vnode (fsid 0x%x vnid 0x%Lx)\n", curr_v->fsid, vnid);
-			err = ERR_VFS_PATH_NOT_FOUND;
-			dec_vnode_ref_count(curr_v, true, false);
-			goto out;
-		}
-
 		// decrease the ref count on the old dir we just looked up into
 		dec_vnode_ref_count(curr_v, true, false);
 
@@ -839,19 +1601,43 @@ int vfs_free_ioctx(void *_ioctx)
 
 int vfs_init(kernel_args *ka)
 {
+	int i;
+
 	dprintf("vfs_init: entry\n");
 	kprintf("initializing fs layer...\n");
 
-	vnode_table = hash_init(VNODE_HASH_TABLE_SIZE, offsetof(struct vnode, next),
-		&vnode_compare, &vnode_hash);
-	if(vnode_table == NULL)
-		panic("vfs_init: error creating vnode hash table\n");
+	for(i = 0; i < VNODE_HASH_STRIPES; i++) {
+		struct vnode_stripe *stripe = &vnode_stripes[i];
+		char name[SYS_MAX_OS_NAME_LEN];
+
+		stripe->table = hash_init(VNODE_HASH_TABLE_SIZE / VNODE_HASH_STRIPES, offsetof(struct vnode, next),
+			&vnode_compare, &vnode_hash);
+		if(stripe->table == NULL)
+			panic("vfs_init: error creating vnode hash table\n");
+
+		sprintf(name, "vfs_vnode_lock %d", i);
+		if(mutex_init(&stripe->lock, name) < 0)
+			panic("vfs_init: error allocating vfs_vnode lock\n");
+
+		sprintf(name, "vfs_vnode_busy %d", i);
+		stripe->busy_sem = sem_create(0, name);
+		if(stripe->busy_sem < 0)
+			panic("vfs_init: error allocating vnode busy sem\n");
+
+		stripe->busy_waiters = 0;
+		stripe->lookups = 0;
+		stripe->busy_waits = 0;
+	}
 
 	mounts_table = hash_init(MOUNTS_HASH_TABLE_SIZE, offsetof(struct fs_mount, next),
 		&mount_compare, &mount_hash);
 	if(mounts_table == NULL)
 		panic("vfs_init: error creating mounts hash table\n");
 
+	fd_cache = slab_cache_create("file_descriptor", sizeof(struct file_descriptor), 0, 0);
+	if(fd_cache == NULL)
+		panic("vfs_init: error creating file descriptor cache\n");
+
 	fs_list = NULL;
 	root_vnode = NULL;
 
@@ -864,8 +1650,21 @@ int vfs_init(kernel_args *ka)
 	if(mutex_init(&vfs_mount_mutex, "vfs_mount_lock") < 0)
 		panic("vfs_init: error allocating vfs_mount lock\n");
 
-	if(mutex_init(&vfs_vnode_mutex, "vfs_vnode_lock") < 0)
-		panic("vfs_init: error allocating vfs_vnode lock\n");
+	if(mutex_init(&unused_vnode_mutex, "vfs_unused_vnode_lock") < 0)
+		panic("vfs_init: error allocating unused vnode lock\n");
+
+	if(name_cache_init() < 0)
+		panic("vfs_init: error creating name cache\n");
+
+	if(mutex_init(&dirty_vnode_mutex, "vfs_dirty_vnode_lock") < 0)
+		panic("vfs_init: error allocating dirty vnode lock\n");
+
+	list_initialize(&unused_vnodes);
+	unused_vnode_count = 0;
+	list_initialize(&dirty_vnodes);
+	memset(&unused_vnode_stats, 0, sizeof(unused_vnode_stats));
+	dbg_add_command(&dump_unused_vnodes, "unused_vnodes", "dump unused vnode cache stats, 'unused_vnodes list' lists them");
+	dbg_add_command(&dump_vnode_stripes, "vnode_stripes", "dump per stripe vnode table lookup and busy wait counts");
 
 	return 0;
 }
@@ -985,6 +1784,11 @@ int vfs_test(void)
 #endif
 
 int vfs_register_filesystem(const char *name, struct fs_calls *calls)
+{
+	return vfs_register_filesystem_etc(name, calls, 0);
+}
+
+int vfs_register_filesystem_etc(const char *name, struct fs_calls *calls, int flags)
 {
 	struct fs_container *container;
 
@@ -994,6 +1798,7 @@ int vfs_register_filesystem(const char *name, struct fs_calls *calls)
 
 	container->name = name;
 	container->calls = calls;
+	container->flags = flags;
 
 	mutex_lock(&vfs_mutex);
 
@@ -1125,6 +1930,7 @@ int vfs_unmount(char *path, bool kernel)
 	struct vnode *v;
 	struct fs_mount *mount;
 	int err;
+	int i;
 
 #if MAKE_NOIZE
 	dprintf("vfs_unmount: entry. path = '%s', kernel %d\n", path, kernel);
@@ -1150,20 +1956,25 @@ int vfs_unmount(char *path, bool kernel)
 		goto err1;
 	}
 
-	/* grab the vnode master mutex to keep someone from creating a vnode
+	/* dirty vnodes hold a ref, get their data out to the fs and drop them */
+	flush_dirty_vnodes(mount);
+
+	/* grab all of the vnode stripe locks to keep someone from creating a vnode
 	while we're figuring out if we can continue */
-	mutex_lock(&vfs_vnode_mutex);
+	for(i = 0; i < VNODE_HASH_STRIPES; i++)
+		mutex_lock(&vnode_stripes[i].lock);
 
 	/* simulate the root vnode having it's refcount decremented */
-	mount->root_vnode->ref_count -= 2;
+	atomic_add(&mount->root_vnode->ref_count, -2);
 
 	/* cycle through the list of vnodes associated with this mount and
 	make sure all of them are not busy or have refs on them */
 	err = 0;
 	for(v = mount->vnodes_head; v; v = v->mount_next) {
 		if(v->busy || v->ref_count != 0) {
-			mount->root_vnode->ref_count += 2;
-			mutex_unlock(&vfs_vnode_mutex);
+			atomic_add(&mount->root_vnode->ref_count, 2);
+			for(i = VNODE_HASH_STRIPES - 1; i >= 0; i--)
+				mutex_unlock(&vnode_stripes[i].lock);
 			dec_vnode_ref_count(mount->root_vnode, true, false);
 			err = ERR_VFS_FS_BUSY;
 			goto err1;
@@ -1172,15 +1983,23 @@ int vfs_unmount(char *path, bool kernel)
 
 	/* we can safely continue, mark all of the vnodes busy and this mount
 	structure in unmounting state */
-	for(v = mount->vnodes_head; v; v = v->mount_next)
+	mutex_lock(&unused_vnode_mutex);
+	for(v = mount->vnodes_head; v; v = v->mount_next) {
 		if(v != mount->root_vnode)
 			v->busy = true;
+		if(v->unused_node.next != NULL) {
+			list_delete(&v->unused_node);
+			unused_vnode_count--;
+		}
+	}
+	mutex_unlock(&unused_vnode_mutex);
 	mount->unmounting = true;
 
 	/* add 2 back to the root vnode's ref */
-	mount->root_vnode->ref_count += 2;
+	atomic_add(&mount->root_vnode->ref_count, 2);
 
-	mutex_unlock(&vfs_vnode_mutex);
+	for(i = VNODE_HASH_STRIPES - 1; i >= 0; i--)
+		mutex_unlock(&vnode_stripes[i].lock);
 
 	mount->covers_vnode->covered_by = NULL;
 	dec_vnode_ref_count(mount->covers_vnode, true, false);
@@ -1189,14 +2008,18 @@ int vfs_unmount(char *path, bool kernel)
 	dec_vnode_ref_count(mount->root_vnode, true, false);
 	dec_vnode_ref_count(mount->root_vnode, true, false);
 
-	// XXX when full vnode cache in place, will need to force
-	// a putvnode/removevnode here
+	/* everything left is an unused vnode, pulled off the unused list above */
+	while((v = mount->vnodes_head) != NULL)
+		destroy_vnode(v, true, false);
 
 	/* remove the mount structure from the hash table */
 	mutex_lock(&vfs_mount_mutex);
 	hash_remove(mounts_table, mount);
 	mutex_unlock(&vfs_mount_mutex);
 
+	// the fsid is gone, so are the names cached under it
+	name_cache_purge_fs(mount->id);
+
 	mutex_unlock(&vfs_mount_op_mutex);
 
 	mount->fs->calls->fs_unmount(mount->fscookie);
@@ -1221,6 +2044,9 @@ int vfs_sync(void)
 	dprintf("vfs_sync: entry.\n");
 #endif
 
+	/* write back everything sitting in the file caches first */
+	flush_dirty_vnodes(NULL);
+
 	/* cycle through and call sync on each mounted fs */
 	mutex_lock(&vfs_mount_op_mutex);
 	mutex_lock(&vfs_mount_mutex);
@@ -1367,6 +2193,113 @@ err:
 	return err;
 }
 
+// regular files on filesystems that can page are read and written through the vnode's cache
+static bool vnode_wants_file_cache(struct vnode *v)
+{
+	struct file_stat stat;
+
+	if(v->mount->fs->calls->fs_canpage(v->mount->fscookie, v->priv_vnode) <= 0)
+		return false;
+	if(v->mount->fs->calls->fs_rstat(v->mount->fscookie, v->priv_vnode, &stat) < 0)
+		return false;
+
+	return stat.type == STREAM_TYPE_FILE;
+}
+
+// a negative pos means the fd's current position, which moves past what was read
+static ssize_t file_cache_read(struct file_descriptor *f, void *buf, off_t pos, ssize_t len)
+{
+	struct vnode *v = f->vnode;
+	struct file_stat stat;
+	bool use_fd_pos = pos < 0;
+	ssize_t err;
+
+	if(use_fd_pos)
+		pos = f->pos;
+
+	err = v->mount->fs->calls->fs_rstat(v->mount->fscookie, v->priv_vnode, &stat);
+	if(err < 0)
+		return err;
+
+	if(len <= 0 || pos >= stat.size)
+		return 0;
+	if(pos + len > stat.size)
+		len = stat.size - pos;
+
+	err = vm_cache_read_file(v, buf, pos, len, stat.size);
+	if(err > 0 && use_fd_pos)
+		f->pos = pos + err;
+
+	return err;
+}
+
+// writes that stay inside the file go to the cache and are written back later if
+// the fs can take pages back. Everything else goes straight to the fs, and the
+// pages of it already in the cache are brought up to date.
+static ssize_t file_cache_write(struct file_descriptor *f, const void *buf, off_t pos, ssize_t len)
+{
+	struct vnode *v = f->vnode;
+	struct file_stat stat;
+	bool use_fd_pos = pos < 0;
+	ssize_t err;
+
+	if(use_fd_pos)
+		pos = f->pos;
+
+	if(len <= 0)
+		return 0;
+
+	if(v->mount->fs->flags & FS_FLAG_WRITE_BACK) {
+		err = v->mount->fs->calls->fs_rstat(v->mount->fscookie, v->priv_vnode, &stat);
+		if(err < 0)
+			return err;
+
+		if(pos + len <= stat.size) {
+			err = vm_cache_write_file(v, buf, pos, len, true);
+			if(err > 0)
+				mark_vnode_dirty(v);
+			goto done;
+		}
+	}
+
+	err = v->mount->fs->calls->fs_write(v->mount->fscookie, v->priv_vnode, f->cookie, buf, pos, len);
+	if(err > 0 && v->cache)
+		vm_cache_write_file(v, buf, pos, err, false);
+
+done:
+	if(err > 0 && use_fd_pos)
+		f->pos = pos + err;
+
+	return err;
+}
+
+static int file_cache_seek(struct file_descriptor *f, off_t pos, seek_type seek_type)
+{
+	struct vnode *v = f->vnode;
+	struct file_stat stat;
+	int err;
+
+	switch(seek_type) {
+		case _SEEK_SET:
+			break;
+		case _SEEK_CUR:
+			pos += f->pos;
+			break;
+		case _SEEK_END:
+			err = v->mount->fs->calls->fs_rstat(v->mount->fscookie, v->priv_vnode, &stat);
+			if(err < 0)
+				return err;
+			pos += stat.size;
+			break;
+		default:
+			return ERR_INVALID_ARGS;
+	}
+
+	f->pos = max(pos, 0);
+
+	return NO_ERROR;
+}
+
 static int _vfs_open(struct vnode *v, int omode, bool kernel)
 {
 	int fd;
@@ -1388,6 +2321,7 @@ static int _vfs_open(struct vnode *v, int omode, bool kernel)
 	f->vnode = v;
 	f->cookie = cookie;
 	f->coe = omode & O_CLOEXEC ? true : false;
+	f->cached = vnode_wants_file_cache(v);
 
 	fd = new_fd(get_current_ioctx(kernel), f);
 	if(fd < 0) {
@@ -1477,7 +2411,12 @@ int vfs_fsync(int fd, bool kernel)
 		return ERR_INVALID_HANDLE;
 
 	v = f->vnode;
-	err = v->mount->fs->calls->fs_fsync(v->mount->fscookie, v->priv_vnode);
+	if(f->cached)
+		err = vm_cache_flush_file(v);
+	else
+		err = NO_ERROR;
+	if(err >= 0)
+		err = v->mount->fs->calls->fs_fsync(v->mount->fscookie, v->priv_vnode);
 
 	put_fd(f);
 
@@ -1501,7 +2440,10 @@ ssize_t vfs_read(int fd, void *buf, off_t pos, ssize_t len, bool kernel)
 	}
 
 	v = f->vnode;
-	err = v->mount->fs->calls->fs_read(v->mount->fscookie, v->priv_vnode, f->cookie, buf, pos, len);
+	if(f->cached)
+		err = file_cache_read(f, buf, pos, len);
+	else
+		err = v->mount->fs->calls->fs_read(v->mount->fscookie, v->priv_vnode, f->cookie, buf, pos, len);
 
 	put_fd(f);
 
@@ -1526,7 +2468,10 @@ ssize_t vfs_write(int fd, const void *buf, off_t pos, ssize_t len, bool kernel)
 	}
 
 	v = f->vnode;
-	err = v->mount->fs->calls->fs_write(v->mount->fscookie, v->priv_vnode, f->cookie, buf, pos, len);
+	if(f->cached)
+		err = file_cache_write(f, buf, pos, len);
+	else
+		err = v->mount->fs->calls->fs_write(v->mount->fscookie, v->priv_vnode, f->cookie, buf, pos, len);
 
 	put_fd(f);
 
@@ -1551,7 +2496,10 @@ int vfs_seek(int fd, off_t pos, seek_type seek_type, bool kernel)
 	}
 
 	v = f->vnode;
-	err = v->mount->fs->calls->fs_seek(v->mount->fscookie, v->priv_vnode, f->cookie, pos, seek_type);
+	if(f->cached)
+		err = file_cache_seek(f, pos, seek_type);
+	else
+		err = v->mount->fs->calls->fs_seek(v->mount->fscookie, v->priv_vnode, f->cookie, pos, seek_type);
 
 	put_fd(f);
 
@@ -1601,6 +2549,7 @@ int vfs_create(char *path, void *args, bool kernel)
 		goto err;
 
 	err = dir->mount->fs->calls->fs_create(dir->mount->fscookie, dir->priv_vnode, filename, args, &vnid);
+	name_cache_purge(dir->fsid, dir->vnid, filename);
 	dec_vnode_ref_count(dir, true, false);
 	if (err < 0)
 		goto err;
@@ -1637,6 +2586,7 @@ int vfs_unlink(char *path, bool kernel)
 		goto err;
 
 	err = v->mount->fs->calls->fs_unlink(v->mount->fscookie, v->priv_vnode, filename);
+	name_cache_purge(v->fsid, v->vnid, filename);
 
 	dec_vnode_ref_count(v, true, false);
 err:
@@ -1654,7 +2604,7 @@ int vfs_rename(char *path, char *newpath, bool kernel)
 	if(err < 0)
 		goto err;
 
-	err = path_to_dir_vnode(path, &v2, filename2, kernel);
+	err = path_to_dir_vnode(newpath, &v2, filename2, kernel);
 	if(err < 0)
 		goto err1;
 
@@ -1664,6 +2614,8 @@ int vfs_rename(char *path, char *newpath, bool kernel)
 	}
 
 	err = v1->mount->fs->calls->fs_rename(v1->mount->fscookie, v1->priv_vnode, filename1, v2->priv_vnode, filename2);
+	name_cache_purge(v1->fsid, v1->vnid, filename1);
+	name_cache_purge(v2->fsid, v2->vnid, filename2);
 
 err2:
 	dec_vnode_ref_count(v2, true, false);
@@ -1688,6 +2640,7 @@ int vfs_mkdir(char *path, bool kernel)
 		goto err;
 
 	err = v->mount->fs->calls->fs_mkdir(v->mount->fscookie, v->priv_vnode, filename);
+	name_cache_purge(v->fsid, v->vnid, filename);
 
 	dec_vnode_ref_count(v, true, false);
 err:
@@ -1709,6 +2662,7 @@ int vfs_rmdir(char *path, bool kernel)
 		goto err;
 
 	err = v->mount->fs->calls->fs_rmdir(v->mount->fscookie, v->priv_vnode, filename);
+	name_cache_purge(v->fsid, v->vnid, filename);
 
 	dec_vnode_ref_count(v, true, false);
 err:
@@ -1833,6 +2787,37 @@ ssize_t vfs_writepage(void *_v, iovecs *vecs, off_t pos)
 	return v->mount->fs->calls->fs_writepage(v->mount->fscookie, v->priv_vnode, vecs, pos);
 }
 
+int vfs_get_fd_ptr(int fd, bool kernel, void **descriptor)
+{
+	struct file_descriptor *f;
+
+	f = get_fd(get_current_ioctx(kernel), fd);
+	if(f == NULL)
+		return ERR_INVALID_HANDLE;
+
+	*descriptor = f;
+	return NO_ERROR;
+}
+
+void vfs_put_fd_ptr(void *descriptor)
+{
+	put_fd((struct file_descriptor *)descriptor);
+}
+
+int vfs_poll(void *descriptor, struct wait_watch *watch)
+{
+	struct file_descriptor *f = descriptor;
+	struct vnode *v = f->vnode;
+
+	// directories and files that can't block are always ready
+	if(f->dir)
+		return WAIT_EVENT_READ;
+	if(v->mount->fs->calls->fs_poll == NULL)
+		return WAIT_EVENT_READ | WAIT_EVENT_WRITE;
+
+	return v->mount->fs->calls->fs_poll(v->mount->fscookie, v->priv_vnode, f->cookie, watch);
+}
+
 static int vfs_get_cwd(char* buf, size_t size, bool kernel)
 {
 	// Get current working directory from io context
@@ -2585,6 +3570,7 @@ image_id vfs_load_fs_module(const char *name)
 
 int vfs_bootstrap_all_filesystems(void)
 {
+	thread_id tid;
 	int err;
 	int fd;
 
@@ -2600,6 +3586,10 @@ int vfs_bootstrap_all_filesystems(void)
 
 	sys_setcwd("/");
 
+	// start writing back file data left in the vnode caches
+	tid = thread_create_kernel_thread("file flusher", &file_flusher, NULL);
+	thread_resume_thread(tid);
+
 	// bootstrap the bootfs
 	bootstrap_bootfs();
 
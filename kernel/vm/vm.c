@@ -8,10 +8,13 @@
 #include <kernel/vm_page.h>
 #include <kernel/vm_cache.h>
 #include <kernel/vm_store_anonymous_noswap.h>
+#include <kernel/vm_store_anonymous_swap.h>
+#include <kernel/vm_swap.h>
 #include <kernel/vm_store_device.h>
 #include <kernel/vm_store_null.h>
 #include <kernel/vm_store_vnode.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/debug.h>
 #include <kernel/console.h>
 #include <kernel/int.h>
@@ -42,6 +45,7 @@ static vm_address_space *kernel_aspace;
 static region_id next_region_id;
 static void *region_table;
 static sem_id region_hash_sem;
+static struct slab_cache *region_cache;
 
 #define ASPACE_HASH_TABLE_SIZE 1024
 static aspace_id next_aspace_id;
@@ -179,6 +183,27 @@ region_id vm_find_region_by_name(aspace_id aid, const char *name)
 	return id;
 }
 
+region_id vm_find_region_by_address(aspace_id aid, addr_t address)
+{
+	vm_region *region;
+	vm_address_space *aspace;
+	region_id id = ERR_NOT_FOUND;
+
+	aspace = vm_get_aspace_by_id(aid);
+	if(aspace == NULL)
+		return ERR_VM_INVALID_ASPACE;
+
+	sem_acquire(aspace->virtual_map.sem, READ_COUNT);
+
+	region = vm_virtual_map_lookup(&aspace->virtual_map, address);
+	if(region != NULL)
+		id = region->id;
+
+	sem_release(aspace->virtual_map.sem, READ_COUNT);
+	vm_put_aspace(aspace);
+	return id;
+}
+
 static vm_region *_vm_create_region_struct(vm_address_space *aspace, const char *name, int wiring, int lock)
 {
 	vm_region *region = NULL;
@@ -186,12 +211,12 @@ static vm_region *_vm_create_region_struct(vm_address_space *aspace, const char
 	VERIFY_VM_ASPACE(aspace);
 	ASSERT(name != NULL);
 
-	region = (vm_region *)kmalloc(sizeof(vm_region));
+	region = (vm_region *)slab_alloc(region_cache);
 	if(region == NULL)
 		return NULL;
 	region->name = (char *)kmalloc(strlen(name) + 1);
 	if(region->name == NULL) {
-		kfree(region);
+		slab_free(region_cache, region);
 		return NULL;
 	}
 	strcpy(region->name, name);
@@ -209,6 +234,12 @@ static vm_region *_vm_create_region_struct(vm_address_space *aspace, const char
 	region->aspace = aspace;
 	region->aspace_next = NULL;
 	region->map = &aspace->virtual_map;
+	region->tree_parent = NULL;
+	region->tree_left = NULL;
+	region->tree_right = NULL;
+	region->tree_height = 0;
+	region->gap = 0;
+	region->max_gap = 0;
 	list_clear_node(&region->cache_node);
 	region->hash_next = NULL;
 
@@ -218,9 +249,9 @@ static vm_region *_vm_create_region_struct(vm_address_space *aspace, const char
 // must be called with this address space's virtual_map.sem held
 static int find_and_insert_region_slot(vm_virtual_map *map, addr_t start, addr_t size, addr_t end, int addr_type, vm_region *region)
 {
-	vm_region *last_r = NULL;
-	vm_region *next_r;
-	bool foundspot = false;
+	vm_region *last_r;
+	addr_t base;
+	int err;
 
 //	dprintf("find_and_insert_region_slot: map %p, start 0x%lx, size %ld, end 0x%lx, addr_type %d, region %p\n",
 //		map, start, size, end, addr_type, region);
@@ -230,96 +261,42 @@ static int find_and_insert_region_slot(vm_virtual_map *map, addr_t start, addr_t
 	if(start < map->base || size == 0 || (end - 1) > (map->base + (map->size - 1)) || start + size > end)
 		return ERR_VM_BAD_ADDRESS;
 
-	// walk up to the spot where we should start searching
-	next_r = map->region_list;
-	while(next_r) {
-		if(next_r->base >= start + size) {
-			// we have a winner
-			break;
-		}
-		last_r = next_r;
-		next_r = next_r->aspace_next;
-	}
-
-#if 0
-	dprintf("last_r %p, next_r %p\n", last_r, next_r);
-	if(last_r) dprintf("last_r->base 0x%lx, last_r->size 0x%lx\n", last_r->base, last_r->size);
-	if(next_r) dprintf("next_r->base 0x%lx, next_r->size 0x%lx\n", next_r->base, next_r->size);
-#endif
-
 	switch(addr_type) {
 		case REGION_ADDR_ANY_ADDRESS:
-			// find a hole big enough for a new region
-			if(!last_r) {
-				// see if we can build it at the beginning of the virtual map
-				if(!next_r || (next_r->base >= map->base + size)) {
-					foundspot = true;
-					region->base = map->base;
-					break;
-				}
-				last_r = next_r;
-				next_r = next_r->aspace_next;
-			}
-			// keep walking
-			while(next_r) {
-				if(next_r->base >= last_r->base + last_r->size + size) {
-					// we found a spot
-					foundspot = true;
-					region->base = last_r->base + last_r->size;
-					break;
-				}
-				last_r = next_r;
-				next_r = next_r->aspace_next;
-			}
-			if((map->base + (map->size - 1)) >= (last_r->base + last_r->size + (size - 1))) {
-				// found a spot
-				foundspot = true;
-				region->base = last_r->base + last_r->size;
-				break;
-			}
+			// find the lowest hole big enough for a new region
+			err = vm_region_tree_find_gap(map, start, size, &base);
+			if(err < 0)
+				return err;
+			last_r = vm_region_tree_floor(map, base);
 			break;
 		case REGION_ADDR_EXACT_ADDRESS:
-			// see if we can create it exactly here
-			if(!last_r) {
-				if(!next_r || (next_r->base >= start + size)) {
-					foundspot = true;
-					region->base = start;
-					break;
-				}
-			} else {
-				if(next_r) {
-					if(last_r->base + last_r->size <= start && next_r->base >= start + size) {
-						foundspot = true;
-						region->base = start;
-						break;
-					}
-				} else {
-					if((last_r->base + (last_r->size - 1)) <= start - 1) {
-						foundspot = true;
-						region->base = start;
-					}
-				}
-			}
+			// see if we can create it exactly here, the region starting
+			// closest below the end of the new one has to end below its start
+			base = start;
+			last_r = vm_region_tree_floor(map, start + (size - 1));
+			if(last_r && last_r->base + last_r->size > start)
+				return ERR_VM_NO_REGION_SLOT;
 			break;
 		default:
 			return ERR_INVALID_ARGS;
 	}
 
-	if(foundspot) {
-		region->size = size;
-//		dprintf("found spot: base 0x%lx, size 0x%lx\n", region->base, region->size);
-		if(last_r) {
-			region->aspace_next = last_r->aspace_next;
-			last_r->aspace_next = region;
-		} else {
-			region->aspace_next = map->region_list;
-			map->region_list = region;
-		}
-		map->change_count++;
-		return NO_ERROR;
-	} else {
-		return ERR_VM_NO_REGION_SLOT;
-	}
+	region->base = base;
+	region->size = size;
+//	dprintf("found spot: base 0x%lx, size 0x%lx\n", region->base, region->size);
+	vm_region_tree_insert(map, region, last_r);
+	map->change_count++;
+
+	return NO_ERROR;
+}
+
+// the kernel's own memory never gets paged out, everyone else's can be
+static vm_store *create_anonymous_store(vm_address_space *aspace)
+{
+	if(aspace == kernel_aspace)
+		return vm_store_create_anonymous_noswap();
+	else
+		return vm_store_create_anonymous_swap();
 }
 
 // a ref to the cache holding this store must be held before entering here
@@ -354,9 +331,9 @@ static int map_backing_store(vm_address_space *aspace, vm_store *store, void **v
 	// pair to handle the private copies of pages as they are written to
 	if(mapping == REGION_PRIVATE_MAP) {
 		// create an anonymous store object
-		nu_store = vm_store_create_anonymous_noswap();
+		nu_store = create_anonymous_store(aspace);
 		if(nu_store == NULL)
-			panic("map_backing_store: vm_create_store_anonymous_noswap returned NULL");
+			panic("map_backing_store: create_anonymous_store returned NULL");
 		nu_cache = vm_cache_create(nu_store);
 		if(nu_cache == NULL)
 			panic("map_backing_store: vm_cache_create returned NULL");
@@ -477,10 +454,71 @@ err1a:
 	}
 err:
 	kfree(region->name);
-	kfree(region);
+	slab_free(region_cache, region);
 	return err;
 }
 
+// map_backing_store for physically contiguous memory starting at phys_addr.
+// Anywhere will do for REGION_ADDR_ANY_ADDRESS, so try to put the region where
+// it lines up with phys_addr on large page boundaries first, that lets it be
+// mapped with large pages.
+// a ref to the cache holding this store must be held before entering here
+static int map_backing_store_contiguous(vm_address_space *aspace, vm_store *store, void **vaddr,
+	addr_t size, int addr_type, int wiring, int lock, vm_region **_region, const char *region_name, addr_t phys_addr)
+{
+	addr_t large_page_size = vm_translation_map_large_page_size();
+	addr_t hole;
+	addr_t base;
+	int err;
+
+	if(addr_type == REGION_ADDR_ANY_ADDRESS && large_page_size != 0 && size >= large_page_size) {
+		sem_acquire(aspace->virtual_map.sem, READ_COUNT);
+		err = vm_region_tree_find_gap(&aspace->virtual_map, aspace->virtual_map.alloc_base, size + large_page_size, &hole);
+		sem_release(aspace->virtual_map.sem, READ_COUNT);
+
+		if(err >= 0) {
+			base = ROUNDOWN(hole, large_page_size) + (phys_addr % large_page_size);
+			if(base < hole)
+				base += large_page_size;
+
+			*vaddr = (void *)base;
+			err = map_backing_store(aspace, store, vaddr, 0, size, REGION_ADDR_EXACT_ADDRESS, wiring, lock,
+				REGION_NO_PRIVATE_MAP, _region, region_name);
+			if(err != ERR_VM_NO_REGION_SLOT)
+				return err;
+			// someone got in there first, take whatever is left
+		}
+	}
+
+	return map_backing_store(aspace, store, vaddr, 0, size, addr_type, wiring, lock, REGION_NO_PRIVATE_MAP, _region, region_name);
+}
+
+// maps the physically contiguous pa .. pa + size at va, with large pages where
+// both line up on a large page boundary and single pages elsewhere
+// NOTE: expects the translation map lock to be held
+static int map_contiguous_pages(vm_translation_map *map, addr_t va, addr_t pa, addr_t size, unsigned int attributes)
+{
+	addr_t large_page_size = vm_translation_map_large_page_size();
+	addr_t offset = 0;
+	int err;
+
+	while(offset < size) {
+		if(large_page_size != 0 && size - offset >= large_page_size
+			&& ((va + offset) % large_page_size) == 0 && ((pa + offset) % large_page_size) == 0
+			&& (*map->ops->map_large)(map, va + offset, pa + offset, attributes) >= 0) {
+			offset += large_page_size;
+			continue;
+		}
+
+		err = (*map->ops->map)(map, va + offset, pa + offset, attributes);
+		if(err < 0)
+			return err;
+		offset += PAGE_SIZE;
+	}
+
+	return 0;
+}
+
 region_id user_vm_create_anonymous_region(char *uname, void **uaddress, int addr_type,
 	addr_t size, int wiring, int lock)
 {
@@ -542,9 +580,9 @@ region_id vm_create_anonymous_region(aspace_id aid, char *name, void **address,
 	size = PAGE_ALIGN(size);
 
 	// create an anonymous store object
-	store = vm_store_create_anonymous_noswap();
+	store = create_anonymous_store(aspace);
 	if(store == NULL)
-		panic("vm_create_anonymous_region: vm_create_store_anonymous_noswap returned NULL");
+		panic("vm_create_anonymous_region: create_anonymous_store returned NULL");
 	cache = vm_cache_create(store);
 	if(cache == NULL)
 		panic("vm_create_anonymous_region: vm_cache_create returned NULL");
@@ -567,7 +605,12 @@ region_id vm_create_anonymous_region(aspace_id aid, char *name, void **address,
 //	dprintf("create_anonymous_region: calling map_backing store\n");
 
 	vm_cache_acquire_ref(cache_ref, true);
-	err = map_backing_store(aspace, store, address, 0, size, addr_type, wiring, lock, REGION_NO_PRIVATE_MAP, &region, name);
+	if(wiring == REGION_WIRING_WIRED_CONTIG) {
+		// the page run isn't allocated yet, but page runs are aligned to their size
+		err = map_backing_store_contiguous(aspace, store, address, size, addr_type, wiring, lock, &region, name, 0);
+	} else {
+		err = map_backing_store(aspace, store, address, 0, size, addr_type, wiring, lock, REGION_NO_PRIVATE_MAP, &region, name);
+	}
 	vm_cache_release_ref(cache_ref);
 	if(err < 0) {
 		vm_put_aspace(aspace);
@@ -641,16 +684,16 @@ region_id vm_create_anonymous_region(aspace_id aid, char *name, void **address,
 
 			mutex_lock(&cache_ref->lock);
 			(*aspace->translation_map.ops->lock)(&aspace->translation_map);
+			err = map_contiguous_pages(&aspace->translation_map, region->base, phys_addr, region->size, lock);
+			if(err < 0) {
+				panic("couldn't map physical page in page run\n");
+			}
 			for(va = region->base; va < region->base + region->size; va += PAGE_SIZE, offset += PAGE_SIZE, phys_addr += PAGE_SIZE) {
 				page = vm_lookup_page(phys_addr / PAGE_SIZE);
 				if(page == NULL) {
 					panic("couldn't lookup physical page just allocated\n");
 				}
 				atomic_add(&page->ref_count, 1);
-				err = (*aspace->translation_map.ops->map)(&aspace->translation_map, va, phys_addr, lock);
-				if(err < 0) {
-					panic("couldn't map physical page in page run\n");
-				}
 				vm_page_set_state(page, PAGE_STATE_WIRED);
 				vm_cache_insert_page(cache_ref, page, offset);
 			}
@@ -707,7 +750,7 @@ region_id vm_map_physical_memory(aspace_id aid, char *name, void **address, int
 	cache->scan_skip = 1;
 
 	vm_cache_acquire_ref(cache_ref, true);
-	err = map_backing_store(aspace, store, address, 0, size, addr_type, 0, lock, REGION_NO_PRIVATE_MAP, &region, name);
+	err = map_backing_store_contiguous(aspace, store, address, size, addr_type, 0, lock, &region, name, phys_addr);
 	vm_cache_release_ref(cache_ref);
 	vm_put_aspace(aspace);
 
@@ -775,7 +818,6 @@ static region_id _vm_map_file(aspace_id aid, char *name, void **address, int add
 	offset = ROUNDOWN(offset, PAGE_SIZE);
 	size = PAGE_ALIGN(size);
 
-restart:
 	// get the vnode for the object, this also grabs a ref to it
 	err = vfs_get_vnode_from_path(path, kernel, &v);
 	if(err < 0) {
@@ -783,41 +825,17 @@ restart:
 		return err;
 	}
 
-	cache_ref = vfs_get_cache_ptr(v);
-	if(!cache_ref) {
-		// create a vnode store object
-		store = vm_store_create_vnode(v);
-		if(store == NULL)
-			panic("vm_map_file: couldn't create vnode store");
-		cache = vm_cache_create(store);
-		if(cache == NULL)
-			panic("vm_map_physical_memory: vm_cache_create returned NULL");
-		cache_ref = vm_cache_ref_create(cache);
-		if(cache_ref == NULL)
-			panic("vm_map_physical_memory: vm_cache_ref_create returned NULL");
-
-		// acquire the cache ref once to represent the ref that the vnode will have
-		// this is one of the only places where we dont want to ref to ripple down to the store
-		vm_cache_acquire_ref(cache_ref, false);
-
-		// try to set the cache ptr in the vnode
-		if(vfs_set_cache_ptr(v, cache_ref) < 0) {
-			// the cache pointer was set between here and then
-			// this can only happen if someone else tries to map it
-			// at the same time. Rare enough to not worry about the
-			// performance impact of undoing what we just did and retrying
-
-			// this will delete the cache object and release the ref to the vnode we have
-			vm_cache_release_ref(cache_ref);
-			goto restart;
-		}
-	} else {
-		VERIFY_VM_CACHE_REF(cache_ref);
-		cache = cache_ref->cache;
-		VERIFY_VM_CACHE(cache);
-		store = cache->store;
-		VERIFY_VM_STORE(store);
+	// the same cache read and write use, if they've touched the file already
+	cache_ref = vm_get_vnode_cache(v);
+	if(cache_ref == NULL) {
+		vfs_put_vnode_ptr(v);
+		vm_put_aspace(aspace);
+		return ERR_NO_MEMORY;
 	}
+	cache = cache_ref->cache;
+	VERIFY_VM_CACHE(cache);
+	store = cache->store;
+	VERIFY_VM_STORE(store);
 
 	// acquire a ref to the cache before we do work on it. Dont ripple the ref acquision to the vnode
 	// below because we'll have to release it later anyway, since we grabbed a ref to the vnode at
@@ -997,7 +1015,6 @@ int vm_delete_region(aspace_id aid, region_id rid)
 
 static void _vm_put_region(vm_region *region, bool aspace_locked)
 {
-	vm_region *temp, *last = NULL;
 	vm_address_space *aspace;
 	bool removeit = false;
 
@@ -1019,28 +1036,15 @@ static void _vm_put_region(vm_region *region, bool aspace_locked)
 	// remove the region from the aspace's virtual map
 	if(!aspace_locked)
 		sem_acquire(aspace->virtual_map.sem, WRITE_COUNT);
-	temp = aspace->virtual_map.region_list;
-	while(temp != NULL) {
-		if(region == temp) {
-			if(last != NULL) {
-				last->aspace_next = temp->aspace_next;
-			} else {
-				aspace->virtual_map.region_list = temp->aspace_next;
-			}
-			aspace->virtual_map.change_count++;
-			break;
-		}
-		last = temp;
-		temp = temp->aspace_next;
-	}
+	if(vm_region_tree_lookup(&aspace->virtual_map, region->base) != region)
+		panic("vm_region_release_ref: region not found in aspace's region_list\n");
+	vm_region_tree_remove(&aspace->virtual_map, region);
+	aspace->virtual_map.change_count++;
 	if(region == aspace->virtual_map.region_hint)
 		aspace->virtual_map.region_hint = NULL;
 	if(!aspace_locked)
 		sem_release(aspace->virtual_map.sem, WRITE_COUNT);
 
-	if(temp == NULL)
-		panic("vm_region_release_ref: region not found in aspace's region_list\n");
-
 	vm_cache_remove_region(region->cache_ref, region);
 	vm_cache_release_ref(region->cache_ref);
 
@@ -1054,7 +1058,7 @@ static void _vm_put_region(vm_region *region, bool aspace_locked)
 
 	if(region->name)
 		kfree(region->name);
-	kfree(region);
+	slab_free(region_cache, region);
 
 	return;
 }
@@ -1391,6 +1395,7 @@ static void _dump_aspace(vm_address_space *aspace)
 	dprintf("id: 0x%x\n", aspace->id);
 	dprintf("ref_count: %d\n", aspace->ref_count);
 	dprintf("fault_count: %d\n", aspace->fault_count);
+	dprintf("faults: %d major %d\n", aspace->faults, aspace->major_faults);
 	dprintf("state: %d\n", aspace->state);
 	dprintf("scan_va: 0x%lx\n", aspace->scan_va);
 	dprintf("working_set_size: 0x%lx\n", aspace->working_set_size);
@@ -1399,12 +1404,17 @@ static void _dump_aspace(vm_address_space *aspace)
 	dprintf("last_working_set_adjust: %Ld\n", aspace->last_working_set_adjust);
 	dprintf("hash_next: %p\n", aspace->hash_next);
 	dprintf("translation_map: %p\n", &aspace->translation_map);
+	dprintf("translation_map.map_count: %d small, %d large (0x%lx bytes each)\n",
+		aspace->translation_map.map_count, aspace->translation_map.large_map_count,
+		vm_translation_map_large_page_size());
 	dprintf("virtual_map.base: 0x%lx\n", aspace->virtual_map.base);
 	dprintf("virtual_map.alloc_base: 0x%lx\n", aspace->virtual_map.alloc_base);
 	dprintf("virtual_map.size: 0x%lx\n", aspace->virtual_map.size);
 	dprintf("virtual_map.change_count: 0x%x\n", aspace->virtual_map.change_count);
 	dprintf("virtual_map.sem: 0x%x\n", aspace->virtual_map.sem);
+	dprintf("virtual_map.region_tree: %p\n", aspace->virtual_map.region_tree);
 	dprintf("virtual_map.region_hint: %p\n", aspace->virtual_map.region_hint);
+	dprintf("virtual_map.lookups: %d (hint hits %d)\n", aspace->virtual_map.lookups, aspace->virtual_map.hint_hits);
 	dprintf("virtual_map.region_list:\n");
 	for(region = aspace->virtual_map.region_list; region != NULL; region = region->aspace_next) {
 		dprintf(" region 0x%x: ", region->id);
@@ -1454,12 +1464,13 @@ static void dump_aspace_list(int argc, char **argv)
 	vm_address_space *as;
 	struct hash_iterator iter;
 
-	dprintf("addr\tid\t%32s\tbase\t\tsize\n", "name");
+	dprintf("addr\tid\t%32s\tbase\t\tsize\t\tsmall\tlarge\n", "name");
 
 	hash_open(aspace_table, &iter);
 	while((as = hash_next(aspace_table, &iter)) != NULL) {
-		dprintf("%p\t0x%x\t%32s\t0x%lx\t\t0x%lx\n",
-			as, as->id, as->name, as->virtual_map.base, as->virtual_map.size);
+		dprintf("%p\t0x%x\t%32s\t0x%lx\t\t0x%lx\t%d\t%d\n",
+			as, as->id, as->name, as->virtual_map.base, as->virtual_map.size,
+			as->translation_map.map_count, as->translation_map.large_map_count);
 	}
 	hash_close(aspace_table, &iter, false);
 }
@@ -1555,6 +1566,8 @@ aspace_id vm_create_aspace(const char *name, addr_t base, addr_t alloc_base, add
 	aspace->ref_count = 1;
 	aspace->state = VM_ASPACE_STATE_NORMAL;
 	aspace->fault_count = 0;
+	aspace->faults = 0;
+	aspace->major_faults = 0;
 	aspace->scan_va = base;
 	aspace->working_set_size = kernel ? DEFAULT_KERNEL_WORKING_SET : DEFAULT_WORKING_SET;
 	aspace->max_working_set = DEFAULT_MAX_WORKING_SET;
@@ -1571,7 +1584,10 @@ aspace_id vm_create_aspace(const char *name, addr_t base, addr_t alloc_base, add
 	aspace->virtual_map.alloc_base = alloc_base;
 	aspace->virtual_map.size = size;
 	aspace->virtual_map.region_list = NULL;
+	aspace->virtual_map.region_tree = NULL;
 	aspace->virtual_map.region_hint = NULL;
+	aspace->virtual_map.lookups = 0;
+	aspace->virtual_map.hint_hits = 0;
 	aspace->virtual_map.change_count = 0;
 	aspace->virtual_map.sem = sem_create(WRITE_COUNT, "aspacelock");
 	aspace->virtual_map.aspace = aspace;
@@ -1634,6 +1650,229 @@ int vm_delete_aspace(aspace_id aid)
 	return NO_ERROR;
 }
 
+// creates an empty anonymous cache on top of source_ref's cache, for one side
+// of a copy on write region to keep the pages it writes to in
+static vm_cache_ref *create_copy_on_write_cache(vm_address_space *aspace, vm_cache_ref *source_ref)
+{
+	vm_store *store;
+	vm_cache *cache;
+	vm_cache_ref *cache_ref;
+
+	store = create_anonymous_store(aspace);
+	if(store == NULL)
+		panic("create_copy_on_write_cache: create_anonymous_store returned NULL");
+	cache = vm_cache_create(store);
+	if(cache == NULL)
+		panic("create_copy_on_write_cache: vm_cache_create returned NULL");
+	cache_ref = vm_cache_ref_create(cache);
+	if(cache_ref == NULL)
+		panic("create_copy_on_write_cache: vm_cache_ref_create returned NULL");
+	cache->temporary = 1;
+	cache->scan_skip = source_ref->cache->scan_skip;
+
+	cache->source = source_ref->cache;
+	vm_cache_acquire_ref(source_ref, true);
+
+	return cache_ref;
+}
+
+// is the region's memory anonymous, writable and mapped by this region alone.
+// memory that's shared with other regions, read only or backed by a file or
+// device isn't.
+static bool region_is_private_anonymous(vm_region *region)
+{
+	vm_cache_ref *cache_ref = region->cache_ref;
+	vm_cache *cache = cache_ref->cache;
+	vm_region *temp;
+	int num_regions = 0;
+
+	mutex_lock(&cache_ref->lock);
+	list_for_every_entry(&cache_ref->region_list_head, temp, vm_region, cache_node)
+		num_regions++;
+	mutex_unlock(&cache_ref->lock);
+
+	return cache->temporary && num_regions == 1 && (region->lock & LOCK_RW)
+		&& cache->store->ops->fault == NULL;
+}
+
+bool vm_region_is_private_anonymous(region_id rid)
+{
+	vm_region *region;
+	bool private_anon;
+
+	region = vm_get_region_by_id(rid);
+	if(region == NULL)
+		return false;
+
+	private_anon = region_is_private_anonymous(region);
+	vm_put_region(region);
+
+	return private_anon;
+}
+
+// NOTE: expects both aspace's virtual_map.sem to be held for writing
+static int clone_region(vm_address_space *aspace, vm_address_space *src, vm_region *src_region)
+{
+	vm_cache_ref *cache_ref = src_region->cache_ref;
+	vm_cache *cache = cache_ref->cache;
+	vm_cache_ref *nu_cache_ref;
+	vm_region *region;
+	bool copy;
+	off_t size = 0;
+	int err;
+
+	VERIFY_VM_REGION(src_region);
+	VERIFY_VM_CACHE_REF(cache_ref);
+
+	// only the private anonymous memory of a single region gets copied,
+	// anything else is shared with the child as well
+	copy = region_is_private_anonymous(src_region);
+
+	if(copy) {
+		// see if the cache below this one can be folded into it first, it's
+		// left over from an earlier fork if it can
+		vm_cache_collapse(cache_ref);
+
+		// the child's cache needs as much commitment as the region has, the
+		// new cache on the parent's side takes over the one it has now
+		size = cache->virtual_size;
+		int_disable_interrupts();
+		acquire_spinlock(&max_commit_lock);
+		if(vm_info.max_commit < size) {
+			release_spinlock(&max_commit_lock);
+			int_restore_interrupts();
+			return ERR_VM_WOULD_OVERCOMMIT;
+		}
+		vm_info.max_commit -= size;
+		release_spinlock(&max_commit_lock);
+		int_restore_interrupts();
+	}
+
+	region = _vm_create_region_struct(aspace, src_region->name, src_region->wiring, src_region->lock);
+	if(region == NULL) {
+		err = ERR_NO_MEMORY;
+		goto err;
+	}
+	region->cache_offset = src_region->cache_offset;
+
+	err = find_and_insert_region_slot(&aspace->virtual_map, src_region->base, src_region->size,
+		src_region->base + src_region->size, REGION_ADDR_EXACT_ADDRESS, region);
+	if(err < 0)
+		goto err1;
+
+	if(copy) {
+		// move the parent over to a new cache of its own
+		nu_cache_ref = create_copy_on_write_cache(src, cache_ref);
+		nu_cache_ref->cache->virtual_size = size;
+		cache->virtual_size = 0;
+
+		vm_cache_acquire_ref(nu_cache_ref, true);
+		vm_cache_remove_region(cache_ref, src_region);
+		src_region->cache_ref = nu_cache_ref;
+		vm_cache_insert_region(nu_cache_ref, src_region);
+
+		// the pages it has mapped now belong to both sides, so a write to
+		// one of them has to fault and make a copy
+		(*src->translation_map.ops->lock)(&src->translation_map);
+		err = (*src->translation_map.ops->protect)(&src->translation_map, src_region->base,
+			src_region->base + (src_region->size - 1), src_region->lock & ~LOCK_RW);
+		if(err < 0)
+			(*src->translation_map.ops->unmap)(&src->translation_map, src_region->base,
+				src_region->base + (src_region->size - 1));
+		(*src->translation_map.ops->unlock)(&src->translation_map);
+
+		// and give the child one too
+		nu_cache_ref = create_copy_on_write_cache(aspace, cache_ref);
+		nu_cache_ref->cache->virtual_size = size;
+		vm_cache_acquire_ref(nu_cache_ref, true);
+
+		// the two new caches hold the only refs to the old one now
+		vm_cache_release_ref(cache_ref);
+		cache_ref = nu_cache_ref;
+	} else {
+		vm_cache_acquire_ref(cache_ref, true);
+	}
+
+	region->cache_ref = cache_ref;
+	vm_cache_insert_region(cache_ref, region);
+
+	sem_acquire(region_hash_sem, WRITE_COUNT);
+	hash_insert(region_table, region);
+	sem_release(region_hash_sem, WRITE_COUNT);
+
+	// grab a ref to the aspace (the region holds this)
+	atomic_add(&aspace->ref_count, 1);
+
+	return NO_ERROR;
+
+err1:
+	kfree(region->name);
+	slab_free(region_cache, region);
+err:
+	if(copy)
+		vm_increase_max_commit(size);
+	return err;
+}
+
+// Makes a copy of the user address space aid, for a forked process. Private
+// anonymous memory is shared copy on write: both sides get a new empty cache
+// on top of the one the region had and the pages the parent has mapped are
+// write protected, so whoever writes to a page first gets its own copy of it.
+// Everything else is mapped into the copy as is. No pages are copied or
+// mapped in the new address space up front.
+aspace_id vm_clone_aspace(const char *name, aspace_id aid)
+{
+	vm_address_space *src;
+	vm_address_space *aspace;
+	vm_region *region;
+	aspace_id id;
+	int err = NO_ERROR;
+
+	src = vm_get_aspace_by_id(aid);
+	if(src == NULL)
+		return ERR_VM_INVALID_ASPACE;
+	if(src == kernel_aspace) {
+		vm_put_aspace(src);
+		return ERR_INVALID_ARGS;
+	}
+
+	id = vm_create_aspace(name, src->virtual_map.base, src->virtual_map.alloc_base, src->virtual_map.size, false);
+	if(id < 0) {
+		vm_put_aspace(src);
+		return id;
+	}
+	aspace = vm_get_aspace_by_id(id);
+
+	sem_acquire(src->virtual_map.sem, WRITE_COUNT);
+	sem_acquire(aspace->virtual_map.sem, WRITE_COUNT);
+
+	if(src->state == VM_ASPACE_STATE_DELETION) {
+		err = ERR_VM_INVALID_ASPACE;
+	} else {
+		// faults already under way have to notice their region's cache changed
+		src->virtual_map.change_count++;
+
+		for(region = src->virtual_map.region_list; region != NULL; region = region->aspace_next) {
+			err = clone_region(aspace, src, region);
+			if(err < 0)
+				break;
+		}
+	}
+
+	sem_release(aspace->virtual_map.sem, WRITE_COUNT);
+	sem_release(src->virtual_map.sem, WRITE_COUNT);
+
+	vm_put_aspace(aspace);
+	vm_put_aspace(src);
+
+	if(err < 0) {
+		vm_delete_aspace(id);
+		return err;
+	}
+
+	return id;
+}
+
 int vm_aspace_walk_start(struct hash_iterator *i)
 {
 	hash_open(aspace_table, i);
@@ -1685,11 +1924,19 @@ int vm_init(kernel_args *ka)
 	heap_size = ROUNDUP(vm_get_mem_size() / 32, 1*1024*1024);
 	if(heap_size > 16*1024*1024)
 		heap_size = 16*1024*1024;
-	heap_base = vm_alloc_from_ka_struct(ka, heap_size, LOCK_KERNEL|LOCK_RW);
+	// the heap is touched from everywhere, if it's big enough for large pages
+	// round it up to whole ones and map it with them
+	if(vm_translation_map_large_page_size() != 0 && heap_size >= vm_translation_map_large_page_size())
+		heap_size = ROUNDUP(heap_size, vm_translation_map_large_page_size());
+	heap_base = vm_alloc_large_from_ka_struct(ka, heap_size, LOCK_KERNEL|LOCK_RW);
 	dprintf("heap at 0x%lx, size 0x%lx\n", heap_base, heap_size);
 	kprintf("creating kernel heap at 0x%lx, size 0x%lx\n", heap_base, heap_size);
 	heap_init(heap_base, heap_size);
 
+	region_cache = slab_cache_create("vm_region", sizeof(vm_region), 0, 0);
+	if(region_cache == NULL)
+		panic("vm_init: error creating region cache\n");
+
 	// initialize the free page list and page allocator
 	vm_page_init_postheap(ka);
 
@@ -1786,6 +2033,9 @@ int vm_init_postsem(kernel_args *ka)
 	vm_translation_map_module_init_post_sem(ka);
 	kernel_aspace->virtual_map.sem = sem_create(WRITE_COUNT, "kernel_aspacelock");
 	recursive_lock_create(&kernel_aspace->translation_map.lock);
+	vm_page_init_postsem(ka);
+	vm_swap_init();
+	vm_store_anonymous_swap_init();
 
 	for(region = kernel_aspace->virtual_map.region_list; region; region = region->aspace_next) {
 		if(region->cache_ref->lock.sem < 0) {
@@ -1849,7 +2099,68 @@ int vm_page_fault(addr_t address, addr_t fault_address, bool is_write, bool is_u
 #define TRACE
 #endif
 
-static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
+// NOTE: expects the aspace's virtual map sem to be held
+// maps the pages of the aligned block around address that are already in the
+// region's caches, so touching them later doesn't cost a fault each
+static void vm_fault_around(vm_address_space *aspace, vm_region *region, addr_t address)
+{
+	vm_translation_map *map = &aspace->translation_map;
+	vm_cache_ref *cache_ref;
+	vm_page *page;
+	addr_t start, end, va, pa;
+	unsigned int flags;
+	int mapped = 0;
+
+	start = ROUNDOWN(address, VM_FAULT_AROUND_PAGES * PAGE_SIZE);
+	end = start + VM_FAULT_AROUND_PAGES * PAGE_SIZE;
+	start = max(start, region->base);
+	end = min(end, region->base + region->size);
+
+	for(va = start; va < end; va += PAGE_SIZE) {
+		off_t offset = va - region->base + region->cache_offset;
+		int lock = region->lock;
+
+		if(va == address)
+			continue;
+
+		// the first cache down the chain that has it decides what's there
+		page = NULL;
+		for(cache_ref = region->cache_ref; cache_ref; cache_ref = (cache_ref->cache->source) ? cache_ref->cache->source->ref : NULL) {
+			mutex_lock(&cache_ref->lock);
+			page = vm_cache_lookup_page(cache_ref, offset);
+			if(page != NULL)
+				break;
+			mutex_unlock(&cache_ref->lock);
+		}
+		if(page == NULL)
+			continue;
+
+		if(page->type == PAGE_TYPE_PHYSICAL
+		  && (page->state == PAGE_STATE_ACTIVE || page->state == PAGE_STATE_INACTIVE || page->state == PAGE_STATE_MODIFIED)) {
+			// pages below the top cache get copied up on the first write, same as in the fault
+			if(cache_ref != region->cache_ref)
+				lock &= ~LOCK_RW;
+
+			(*map->ops->lock)(map);
+			if((*map->ops->query)(map, va, &pa, &flags) < 0 || (flags & PAGE_PRESENT) == 0) {
+				atomic_add(&page->ref_count, 1);
+				(*map->ops->map)(map, va, page->ppn * PAGE_SIZE, lock);
+				if(page->state == PAGE_STATE_INACTIVE)
+					vm_page_set_state(page, PAGE_STATE_ACTIVE);
+				mapped++;
+			}
+			(*map->ops->unlock)(map);
+		}
+		mutex_unlock(&cache_ref->lock);
+	}
+
+	if(mapped > 0)
+		atomic_add(&vm_info.fault_around_pages, mapped);
+}
+
+// one go at resolving a fault. retry is set if the region changed caches
+// underneath it and the whole thing needs to be done over.
+static int vm_soft_fault_pass(addr_t address, bool is_write, bool is_user, bool *retry)
 {
 	vm_address_space *aspace;
 	vm_virtual_map *map;
@@ -1858,17 +2169,17 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 	vm_cache_ref *last_cache_ref;
 	vm_cache_ref *top_cache_ref;
 	off_t cache_offset;
+	off_t cache_end;
 	vm_page dummy_page;
 	vm_page *page = NULL;
+	vm_page *old_page;
+	addr_t old_pa;
+	unsigned int old_flags;
+	int page_state = PAGE_STATE_ACTIVE;
 	int change_count;
 	int err;
 
-//	dprintf("vm_soft_fault: thid 0x%x address 0x%x, is_write %d, is_user %d\n",
-//		thread_get_current_thread_id(), address, is_write, is_user);
-
-	atomic_add(&vm_info.page_faults, 1);
-
-	address = ROUNDOWN(address, PAGE_SIZE);
+	*retry = false;
 
 	if(is_kernel_address(address)) {
 		aspace = vm_get_kernel_aspace();
@@ -1890,6 +2201,7 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 	}
 	map = &aspace->virtual_map;
 	atomic_add(&aspace->fault_count, 1);
+	atomic_add(&aspace->faults, 1);
 
 	sem_acquire(map->sem, READ_COUNT);
 	region = vm_virtual_map_lookup(map, address);
@@ -1919,6 +2231,7 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 	top_cache_ref = region->cache_ref;
 	VERIFY_VM_CACHE_REF(top_cache_ref);
 	cache_offset = address - region->base + region->cache_offset;
+	cache_end = region->cache_offset + region->size;
 	vm_cache_acquire_ref(top_cache_ref, true);
 	change_count = map->change_count;
 	sem_release(map->sem, READ_COUNT);
@@ -1950,6 +2263,9 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 		for(;;) {
 			page = vm_cache_lookup_page(cache_ref, cache_offset);
 			if(page != NULL && page->state != PAGE_STATE_BUSY) {
+				// a page dirtied through write() still has to be written back
+				if(page->state == PAGE_STATE_MODIFIED)
+					page_state = PAGE_STATE_MODIFIED;
 				vm_page_set_state(page, PAGE_STATE_BUSY);
 				mutex_unlock(&cache_ref->lock);
 				break;
@@ -1961,8 +2277,7 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 			TRACE;
 
 			// page must be busy
-			mutex_unlock(&cache_ref->lock);
-			thread_snooze(20000);
+			vm_page_wait_busy(page, cache_ref);
 			mutex_lock(&cache_ref->lock);
 		}
 
@@ -1986,29 +2301,21 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 		// see if the vm_store has it
 		if(cache_ref->cache->store->ops->has_page) {
 			if(cache_ref->cache->store->ops->has_page(cache_ref->cache->store, cache_offset)) {
-				IOVECS(vecs, 1);
-
 				TRACE;
 
-				mutex_unlock(&cache_ref->lock);
-
-				vecs->num = 1;
-				vecs->total_len = PAGE_SIZE;
-				vecs->vec[0].len = PAGE_SIZE;
-
-				page = vm_page_allocate_page(PAGE_STATE_FREE);
-				(*aspace->translation_map.ops->get_physical_page)(page->ppn * PAGE_SIZE, (addr_t *)&vecs->vec[0].start, PHYSICAL_PAGE_CAN_WAIT);
-				// handle errors here
-				err = cache_ref->cache->store->ops->read(cache_ref->cache->store, cache_offset, vecs);
-				(*aspace->translation_map.ops->put_physical_page)((addr_t)vecs->vec[0].start);
-
-				mutex_lock(&cache_ref->lock);
-
+				// the real page takes the dummy's place, busy until it's been read
 				if(cache_ref == top_cache_ref) {
 					vm_cache_remove_page(cache_ref, &dummy_page);
 					dummy_page.state = PAGE_STATE_INACTIVE;
+					vm_page_wake_busy_waiters(&dummy_page);
 				}
+				page = vm_page_allocate_page(PAGE_STATE_FREE);
 				vm_cache_insert_page(cache_ref, page, cache_offset);
+
+				// handle errors here
+				vm_cache_page_in(cache_ref, page, cache_offset, cache_end);
+				atomic_add(&aspace->major_faults, 1);
+
 				mutex_unlock(&cache_ref->lock);
 				break;
 			}
@@ -2039,6 +2346,7 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 		if(dummy_page.state == PAGE_STATE_BUSY && dummy_page.cache_ref == cache_ref) {
 			vm_cache_remove_page(cache_ref, &dummy_page);
 			dummy_page.state = PAGE_STATE_INACTIVE;
+			vm_page_wake_busy_waiters(&dummy_page);
 		}
 		vm_cache_insert_page(cache_ref, page, cache_offset);
 		mutex_unlock(&cache_ref->lock);
@@ -2048,6 +2356,7 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 			vm_cache_remove_page(temp_cache, &dummy_page);
 			mutex_unlock(&temp_cache->lock);
 			dummy_page.state = PAGE_STATE_INACTIVE;
+			vm_page_wake_busy_waiters(&dummy_page);
 		}
 	}
 
@@ -2078,12 +2387,14 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 		(*aspace->translation_map.ops->put_physical_page)((addr_t)src);
 		(*aspace->translation_map.ops->put_physical_page)((addr_t)dest);
 
-		vm_page_set_state(src_page, PAGE_STATE_ACTIVE);
+		vm_page_set_state(src_page, page_state);
+		page_state = PAGE_STATE_ACTIVE;
 
 		mutex_lock(&top_cache_ref->lock);
 		if(dummy_page.state == PAGE_STATE_BUSY && dummy_page.cache_ref == top_cache_ref) {
 			vm_cache_remove_page(top_cache_ref, &dummy_page);
 			dummy_page.state = PAGE_STATE_INACTIVE;
+			vm_page_wake_busy_waiters(&dummy_page);
 		}
 		vm_cache_insert_page(top_cache_ref, page, cache_offset);
 		mutex_unlock(&top_cache_ref->lock);
@@ -2094,6 +2405,7 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 			vm_cache_remove_page(temp_cache, &dummy_page);
 			mutex_unlock(&temp_cache->lock);
 			dummy_page.state = PAGE_STATE_INACTIVE;
+			vm_page_wake_busy_waiters(&dummy_page);
 		}
 	}
 
@@ -2105,25 +2417,40 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 		// something may have changed, see if the address is still valid
 		region = vm_virtual_map_lookup(map, address);
 		if(region == NULL
-		  || region->cache_ref != top_cache_ref
 		  || (address - region->base + region->cache_offset) != cache_offset) {
 			dprintf("vm_soft_fault: address space layout changed effecting ongoing soft fault\n");
 			err = ERR_VM_PF_BAD_ADDRESS; // BAD_ADDRESS
+		} else if(region->cache_ref != top_cache_ref) {
+			// the region got a new cache, like when the aspace was forked,
+			// so the page may not be the one to map anymore. Start over.
+			*retry = true;
 		}
 	}
 
 	TRACE;
 
-	if(err == 0) {
+	if(err == 0 && !*retry) {
 		int new_lock = region->lock;
 		if(page->cache_ref != top_cache_ref && !is_write)
 			new_lock &= ~LOCK_RW;
 
-		atomic_add(&page->ref_count, 1);
 		(*aspace->translation_map.ops->lock)(&aspace->translation_map);
+
+		// a write to a page mapped read only out of a lower cache replaces that
+		// mapping with the copy, so the page it pointed at loses its reference
+		if((*aspace->translation_map.ops->query)(&aspace->translation_map, address, &old_pa, &old_flags) >= 0
+			&& (old_flags & PAGE_PRESENT)) {
+			old_page = vm_lookup_page(old_pa / PAGE_SIZE);
+			if(old_page != NULL)
+				atomic_add(&old_page->ref_count, -1);
+		}
+
+		atomic_add(&page->ref_count, 1);
 		(*aspace->translation_map.ops->map)(&aspace->translation_map, address,
 			page->ppn * PAGE_SIZE, new_lock);
 		(*aspace->translation_map.ops->unlock)(&aspace->translation_map);
+
+		vm_fault_around(aspace, region, address);
 	}
 
 	TRACE;
@@ -2138,11 +2465,12 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 		vm_cache_remove_page(temp_cache, &dummy_page);
 		mutex_unlock(&temp_cache->lock);
 		dummy_page.state = PAGE_STATE_INACTIVE;
+		vm_page_wake_busy_waiters(&dummy_page);
 	}
 
 	TRACE;
 
-	vm_page_set_state(page, PAGE_STATE_ACTIVE);
+	vm_page_set_state(page, page_state);
 
 	vm_cache_release_ref(top_cache_ref);
 	vm_put_aspace(aspace);
@@ -2152,23 +2480,49 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 	return err;
 }
 
+static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
+{
+	bool retry;
+	int err;
+
+//	dprintf("vm_soft_fault: thid 0x%x address 0x%x, is_write %d, is_user %d\n",
+//		thread_get_current_thread_id(), address, is_write, is_user);
+
+	atomic_add(&vm_info.page_faults, 1);
+
+	address = ROUNDOWN(address, PAGE_SIZE);
+
+	do {
+		err = vm_soft_fault_pass(address, is_write, is_user, &retry);
+	} while(retry);
+
+	return err;
+}
+
 static vm_region *vm_virtual_map_lookup(vm_virtual_map *map, addr_t address)
 {
 	vm_region *region;
 
-	// check the region_hint region first
-	region = map->region_hint;
-	if(region)
-		VERIFY_VM_REGION(region);
-	if(region && region->base <= address && (region->base + region->size) > address)
-		return region;
+	atomic_add(&map->lookups, 1);
 
-	for(region = map->region_list; region != NULL; region = region->aspace_next) {
+	// check the region_hint region first, then the one after it, since
+	// faults tend to walk up through memory
+	region = map->region_hint;
+	if(region) {
 		VERIFY_VM_REGION(region);
-		if(region->base <= address && (region->base + region->size) > address)
-			break;
+		if(address - region->base < region->size) {
+			atomic_add(&map->hint_hits, 1);
+			return region;
+		}
+		region = region->aspace_next;
+		if(region && address - region->base < region->size) {
+			atomic_add(&map->hint_hits, 1);
+			map->region_hint = region;
+			return region;
+		}
 	}
 
+	region = vm_region_tree_lookup(map, address);
 	if(region) {
 		map->region_hint = region;
 		VERIFY_VM_REGION(region);
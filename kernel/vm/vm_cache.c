@@ -14,14 +14,46 @@
 #include <kernel/debug.h>
 #include <kernel/lock.h>
 #include <kernel/smp.h>
+#include <kernel/thread.h>
+#include <kernel/vfs.h>
+#include <kernel/vm_store_vnode.h>
+#include <kernel/vm_store_anonymous_swap.h>
 #include <kernel/arch/cpu.h>
 #include <newos/errors.h>
 
+#include <string.h>
+
 /* hash table of pages keyed by cache they're in and offset */
 #define PAGE_TABLE_SIZE 1024 /* make this dynamic */
 static void *page_cache_table;
 static spinlock_t page_cache_table_lock;
 
+#define FILE_CACHE_FLUSH_BATCH 16
+
+static struct {
+	int reads;
+	int writes;
+	int hits;
+	int misses;
+	int read_errors;
+	int flushes;
+	int pages_written;
+	int write_errors;
+	int invalidations;
+	int pages_dropped;
+} file_cache_stats;
+
+static void dump_file_cache_stats(int argc, char **argv)
+{
+	dprintf("file cache: %d reads, %d writes, %d page hits, %d page misses, %d read errors\n",
+		file_cache_stats.reads, file_cache_stats.writes, file_cache_stats.hits,
+		file_cache_stats.misses, file_cache_stats.read_errors);
+	dprintf("\t%d flushes, %d pages written back, %d write errors\n",
+		file_cache_stats.flushes, file_cache_stats.pages_written, file_cache_stats.write_errors);
+	dprintf("\t%d invalidations, %d pages dropped\n",
+		file_cache_stats.invalidations, file_cache_stats.pages_dropped);
+}
+
 struct page_lookup_key {
 	off_t offset;
 	vm_cache_ref *ref;
@@ -78,6 +110,8 @@ int vm_cache_init(kernel_args *ka)
 		panic("vm_cache_init: cannot allocate memory for page cache hash table\n");
 	page_cache_table_lock = 0;
 
+	dbg_add_command(&dump_file_cache_stats, "file_cache", "Dump file data cache statistics");
+
 	return 0;
 }
 
@@ -99,6 +133,8 @@ vm_cache *vm_cache_create(vm_store *store)
 	cache->virtual_size = 0;
 	cache->temporary = 0;
 	cache->scan_skip = 0;
+	cache->read_ahead = 0;
+	cache->read_ahead_next = -1;
 
 	return cache;
 }
@@ -137,7 +173,29 @@ void vm_cache_acquire_ref(vm_cache_ref *cache_ref, bool acquire_store_ref)
 	atomic_add(&cache_ref->ref_count, 1);
 }
 
+// takes a ref to the cache unless it's already being torn down. For the page
+// daemons, who only know that a page was in the cache when they looked.
+// The store isn't referenced, the ref has to be dropped with
+// vm_cache_release_ref_etc(cache_ref, false).
+bool vm_cache_try_acquire_ref(vm_cache_ref *cache_ref)
+{
+	int count;
+
+	do {
+		count = cache_ref->ref_count;
+		if(count <= 0)
+			return false;
+	} while(test_and_set(&cache_ref->ref_count, count + 1, count) != count);
+
+	return true;
+}
+
 void vm_cache_release_ref(vm_cache_ref *cache_ref)
+{
+	vm_cache_release_ref_etc(cache_ref, true);
+}
+
+void vm_cache_release_ref_etc(vm_cache_ref *cache_ref, bool release_store_ref)
 {
 //	dprintf("vm_cache_release_ref: cache_ref 0x%x, ref will be %d\n", cache_ref, cache_ref->ref_count-1);
 
@@ -164,6 +222,7 @@ void vm_cache_release_ref(vm_cache_ref *cache_ref)
 
 			// remove it from the cache list
 			list_delete(&last->cache_node);
+			last->cache_ref = NULL;
 
 			// remove it from the hash table
 			int_disable_interrupts();
@@ -189,7 +248,7 @@ void vm_cache_release_ref(vm_cache_ref *cache_ref)
 
 		return;
 	}
-	if(cache_ref->cache->store->ops->release_ref) {
+	if(release_store_ref && cache_ref->cache->store->ops->release_ref) {
 		cache_ref->cache->store->ops->release_ref(cache_ref->cache->store);
 	}
 }
@@ -285,3 +344,449 @@ int vm_cache_remove_region(vm_cache_ref *cache_ref, vm_region *region)
 	mutex_unlock(&cache_ref->lock);
 	return 0;
 }
+
+// Merges the cache's source into it once nothing else uses the source, like
+// after the other side of a fork has gone away, so chains of copy on write
+// caches don't keep growing with every fork. The source's pages move up unless
+// the cache has its own copy of them, and the cache takes over its source.
+// Gives up if any of the source's pages are busy or paged out.
+// NOTE: the caller has to hold the only ref to cache_ref and keep new ones from being taken
+void vm_cache_collapse(vm_cache_ref *cache_ref)
+{
+	vm_cache *cache = cache_ref->cache;
+	vm_cache *source;
+	vm_cache_ref *source_ref;
+	vm_page *page, *next;
+
+	VERIFY_VM_CACHE_REF(cache_ref);
+
+	mutex_lock(&cache_ref->lock);
+
+	source = cache->source;
+	if(source == NULL || !source->temporary || cache_ref->ref_count != 1) {
+		mutex_unlock(&cache_ref->lock);
+		return;
+	}
+	source_ref = source->ref;
+	VERIFY_VM_CACHE_REF(source_ref);
+
+	mutex_lock(&source_ref->lock);
+
+	if(source_ref->ref_count != 1 || !list_is_empty(&source_ref->region_list_head)
+	  || vm_store_anonymous_swap_swapped_pages(source->store) > 0)
+		goto out;
+	list_for_every_entry(&source->page_list_head, page, vm_page, cache_node) {
+		if(page->state == PAGE_STATE_BUSY)
+			goto out;
+	}
+
+	list_for_every_entry_safe(&source->page_list_head, page, next, vm_page, cache_node) {
+		off_t offset = page->offset;
+
+		vm_cache_remove_page(source_ref, page);
+		if(vm_cache_lookup_page(cache_ref, offset) != NULL
+		  || (cache->store->ops->has_page && (*cache->store->ops->has_page)(cache->store, offset))) {
+			// shadowed by the cache's own copy, nobody can see it anymore
+			vm_page_set_state(page, PAGE_STATE_FREE);
+		} else {
+			vm_cache_insert_page(cache_ref, page, offset);
+		}
+	}
+
+	// the source's ref to its own source is ours now
+	cache->source = source->source;
+	source->source = NULL;
+
+	mutex_unlock(&source_ref->lock);
+	mutex_unlock(&cache_ref->lock);
+
+	// this was the last ref to it, which gives its commitment back
+	vm_cache_release_ref(source_ref);
+	return;
+
+out:
+	mutex_unlock(&source_ref->lock);
+	mutex_unlock(&cache_ref->lock);
+}
+
+// NOTE: expects the cache_ref's lock to be held, drops it during the read
+// Reads in page, which has to be busy and in the cache at offset already, along
+// with some read-ahead if the misses on this cache have been sequential. The
+// read-ahead window doubles with every miss right where the last read left off,
+// up to VM_READ_AHEAD_MAX pages, and never goes to or past end or over a page
+// that's already in the cache. Read-ahead pages are left active, page is left
+// busy for the caller to deal with.
+ssize_t vm_cache_page_in(vm_cache_ref *cache_ref, vm_page *page, off_t offset, off_t end)
+{
+	vm_cache *cache = cache_ref->cache;
+	vm_store *store = cache->store;
+	vm_page *pages[VM_READ_AHEAD_MAX];
+	IOVECS(vecs, VM_READ_AHEAD_MAX);
+	ssize_t err;
+	int window;
+	int count;
+	int mapped;
+	int i;
+
+	VERIFY_VM_CACHE_REF(cache_ref);
+	VERIFY_VM_CACHE(cache);
+	VERIFY_VM_STORE(store);
+
+	if(offset == cache->read_ahead_next)
+		window = min(max(cache->read_ahead * 2, VM_READ_AHEAD_MIN), VM_READ_AHEAD_MAX);
+	else
+		window = 1;
+	cache->read_ahead = window;
+
+	pages[0] = page;
+	count = 1;
+	if(window > 1) {
+		int want = 1;
+
+		// only read ahead what the store has, a hole in an anonymous store
+		// may be covered by a cache further down the chain
+		while(want < window && offset + want * PAGE_SIZE < end
+		  && vm_cache_lookup_page(cache_ref, offset + want * PAGE_SIZE) == NULL
+		  && (store->ops->has_page == NULL || (*store->ops->has_page)(store, offset + want * PAGE_SIZE)))
+			want++;
+
+		// they come back busy, so anyone faulting on them waits for the read
+		if(want > 1)
+			count += vm_page_allocate_pages(PAGE_STATE_FREE, &pages[1], want - 1);
+		for(i = 1; i < count; i++)
+			vm_cache_insert_page(cache_ref, pages[i], offset + i * PAGE_SIZE);
+	}
+	cache->read_ahead_next = offset + count * PAGE_SIZE;
+
+	mutex_unlock(&cache_ref->lock);
+
+	// only the first page may wait for a mapping, the read stops short at the
+	// first of the others that can't be mapped right away
+	for(mapped = 0; mapped < count; mapped++) {
+		if(vm_get_physical_page(pages[mapped]->ppn * PAGE_SIZE, (addr_t *)&vecs->vec[mapped].start,
+		  mapped == 0 ? PHYSICAL_PAGE_CAN_WAIT : PHYSICAL_PAGE_NO_WAIT) < 0)
+			break;
+		vecs->vec[mapped].len = PAGE_SIZE;
+	}
+	vecs->num = mapped;
+	vecs->total_len = mapped * PAGE_SIZE;
+
+	err = (*store->ops->read)(store, offset, vecs);
+
+	for(i = 0; i < mapped; i++)
+		vm_put_physical_page((addr_t)vecs->vec[i].start);
+
+	mutex_lock(&cache_ref->lock);
+
+	for(i = 1; i < count; i++) {
+		if(err < 0 || i >= mapped) {
+			vm_cache_remove_page(cache_ref, pages[i]);
+			vm_page_set_state(pages[i], PAGE_STATE_FREE);
+		} else {
+			vm_page_set_state(pages[i], PAGE_STATE_ACTIVE);
+		}
+	}
+	if(err < 0)
+		cache->read_ahead_next = -1;
+	else if(mapped < count)
+		cache->read_ahead_next = offset + mapped * PAGE_SIZE;
+
+	atomic_add(&vm_info.page_ins, 1);
+	if(err >= 0)
+		atomic_add(&vm_info.read_ahead_pages, mapped - 1);
+
+	return err;
+}
+
+/*
+** file data cache
+** vfs_read and vfs_write on regular files go through the vnode's cache, the
+** same one mmap uses, so both see one copy of the data. Pages come in through
+** the vnode store and stay until the vnode is destroyed. Pages written to are
+** left in the modified state until vm_cache_flush_file writes them back.
+*/
+
+vm_cache_ref *vm_get_vnode_cache(void *vnode)
+{
+	vm_cache_ref *cache_ref;
+	vm_cache *cache;
+	vm_store *store;
+
+	for(;;) {
+		cache_ref = vfs_get_cache_ptr(vnode);
+		if(cache_ref) {
+			VERIFY_VM_CACHE_REF(cache_ref);
+			return cache_ref;
+		}
+
+		store = vm_store_create_vnode(vnode);
+		if(store == NULL)
+			return NULL;
+		cache = vm_cache_create(store);
+		if(cache == NULL) {
+			(*store->ops->destroy)(store);
+			return NULL;
+		}
+		cache_ref = vm_cache_ref_create(cache);
+		if(cache_ref == NULL) {
+			kfree(cache);
+			(*store->ops->destroy)(store);
+			return NULL;
+		}
+
+		// acquire the cache ref once to represent the ref that the vnode will have
+		// this is one of the only places where we dont want to ref to ripple down to the store
+		vm_cache_acquire_ref(cache_ref, false);
+
+		// try to set the cache ptr in the vnode
+		if(vfs_set_cache_ptr(vnode, cache_ref) == 0)
+			return cache_ref;
+
+		// someone else attached a cache at the same time, go with theirs
+		vm_cache_release_ref(cache_ref);
+	}
+}
+
+// NOTE: expects the cache_ref's lock to be held
+// returns the page at offset, reading it in from the store if it isn't there yet.
+// The lock is dropped while waiting on a busy page or doing the read.
+static vm_page *file_cache_get_page(vm_cache_ref *cache_ref, off_t offset, off_t end, bool read_in, ssize_t *err)
+{
+	vm_page *page;
+
+	for(;;) {
+		page = vm_cache_lookup_page(cache_ref, offset);
+		if(page != NULL && page->state != PAGE_STATE_BUSY) {
+			atomic_add(&file_cache_stats.hits, 1);
+			return page;
+		}
+
+		if(page == NULL)
+			break;
+
+		// someone is reading it in or writing it out
+		vm_page_wait_busy(page, cache_ref);
+		mutex_lock(&cache_ref->lock);
+	}
+
+	if(!read_in)
+		return NULL;
+
+	atomic_add(&file_cache_stats.misses, 1);
+
+	// put the new page in busy, so anyone else after it waits for the read to finish
+	page = vm_page_allocate_page(PAGE_STATE_FREE);
+	vm_cache_insert_page(cache_ref, page, offset);
+	*err = vm_cache_page_in(cache_ref, page, offset, end);
+	if(*err < 0) {
+		atomic_add(&file_cache_stats.read_errors, 1);
+		vm_cache_remove_page(cache_ref, page);
+		vm_page_set_state(page, PAGE_STATE_FREE);
+		return NULL;
+	}
+
+	vm_page_set_state(page, PAGE_STATE_ACTIVE);
+	return page;
+}
+
+// copies len bytes between buf and the file's cache, which the caller has
+// already clipped to the size of the file. Read-ahead doesn't go past end.
+// Pages are only touched with the cache locked, and a fault on buf with that lock
+// held could come right back to the same cache, so user buffers go through a
+// bounce page and are copied to or from with the lock dropped.
+static ssize_t file_cache_copy(void *vnode, void *buf, off_t pos, ssize_t len, off_t end, bool write, bool dirty)
+{
+	vm_cache_ref *cache_ref;
+	vm_page *page;
+	char *bounce = NULL;
+	char *data;
+	addr_t va;
+	ssize_t copied = 0;
+	ssize_t err = 0;
+
+	cache_ref = vm_get_vnode_cache(vnode);
+	if(cache_ref == NULL)
+		return ERR_NO_MEMORY;
+
+	if(!is_kernel_address(buf)) {
+		bounce = kmalloc(PAGE_SIZE);
+		if(bounce == NULL)
+			return ERR_NO_MEMORY;
+	}
+
+	while(copied < len) {
+		off_t offset = ROUNDOWN(pos, PAGE_SIZE);
+		size_t page_offset = pos - offset;
+		size_t chunk = min((size_t)(len - copied), PAGE_SIZE - page_offset);
+
+		data = bounce ? bounce : (char *)buf;
+		if(write && bounce) {
+			err = user_memcpy(bounce, buf, chunk);
+			if(err < 0)
+				break;
+		}
+
+		mutex_lock(&cache_ref->lock);
+
+		// a write through to the file only has to update pages that are already here
+		err = 0;
+		page = file_cache_get_page(cache_ref, offset, end, !write || dirty, &err);
+		if(page == NULL) {
+			mutex_unlock(&cache_ref->lock);
+			if(err < 0)
+				break;
+		} else {
+			vm_get_physical_page(page->ppn * PAGE_SIZE, &va, PHYSICAL_PAGE_CAN_WAIT);
+			if(write)
+				memcpy((char *)va + page_offset, data, chunk);
+			else
+				memcpy(data, (char *)va + page_offset, chunk);
+			vm_put_physical_page(va);
+
+			if(write && dirty)
+				vm_page_set_state(page, PAGE_STATE_MODIFIED);
+
+			mutex_unlock(&cache_ref->lock);
+		}
+
+		if(!write && bounce) {
+			err = user_memcpy(buf, bounce, chunk);
+			if(err < 0)
+				break;
+		}
+
+		buf = (char *)buf + chunk;
+		pos += chunk;
+		copied += chunk;
+	}
+
+	if(bounce)
+		kfree(bounce);
+
+	if(copied == 0 && err < 0)
+		return err;
+	return copied;
+}
+
+ssize_t vm_cache_read_file(void *vnode, void *buf, off_t pos, ssize_t len, off_t size)
+{
+	atomic_add(&file_cache_stats.reads, 1);
+	return file_cache_copy(vnode, buf, pos, len, size, false, false);
+}
+
+ssize_t vm_cache_write_file(void *vnode, const void *buf, off_t pos, ssize_t len, bool dirty)
+{
+	atomic_add(&file_cache_stats.writes, 1);
+	return file_cache_copy(vnode, (void *)buf, pos, len, PAGE_ALIGN(pos + len), true, dirty);
+}
+
+int vm_cache_flush_file(void *vnode)
+{
+	vm_cache_ref *cache_ref;
+	vm_store *store;
+	vm_region *region;
+	vm_page *pages[FILE_CACHE_FLUSH_BATCH];
+	vm_page *page;
+	ssize_t err = 0;
+	int count;
+	int i;
+	IOVECS(vecs, 1);
+
+	cache_ref = vfs_get_cache_ptr(vnode);
+	if(cache_ref == NULL)
+		return NO_ERROR;
+	VERIFY_VM_CACHE_REF(cache_ref);
+	store = cache_ref->cache->store;
+
+	atomic_add(&file_cache_stats.flushes, 1);
+
+	do {
+		// collect a batch of modified pages and mark them busy
+		count = 0;
+		mutex_lock(&cache_ref->lock);
+		list_for_every_entry(&cache_ref->cache->page_list_head, page, vm_page, cache_node) {
+			if(page->state != PAGE_STATE_MODIFIED)
+				continue;
+			vm_page_set_state(page, PAGE_STATE_BUSY);
+			pages[count++] = page;
+			if(count == FILE_CACHE_FLUSH_BATCH)
+				break;
+		}
+
+		// clear the modified flag in the mappings, so writes through them after
+		// this are noticed again by the page scanner
+		list_for_every_entry(&cache_ref->region_list_head, region, vm_region, cache_node) {
+			vm_translation_map *map = &region->aspace->translation_map;
+
+			for(i = 0; i < count; i++) {
+				if(pages[i]->offset >= region->cache_offset
+				  && pages[i]->offset - region->cache_offset < (off_t)region->size) {
+					map->ops->lock(map);
+					map->ops->clear_flags(map, pages[i]->offset - region->cache_offset + region->base, PAGE_MODIFIED);
+					map->ops->unlock(map);
+				}
+			}
+		}
+		mutex_unlock(&cache_ref->lock);
+
+		for(i = 0; i < count; i++) {
+			ssize_t werr;
+
+			vecs->num = 1;
+			vecs->total_len = PAGE_SIZE;
+			vecs->vec[0].len = PAGE_SIZE;
+
+			vm_get_physical_page(pages[i]->ppn * PAGE_SIZE, (addr_t *)&vecs->vec[0].start, PHYSICAL_PAGE_CAN_WAIT);
+			werr = (*store->ops->write)(store, pages[i]->offset, vecs);
+			vm_put_physical_page((addr_t)vecs->vec[0].start);
+
+			mutex_lock(&cache_ref->lock);
+			if(werr < 0) {
+				// leave it modified, it'll be tried again next time around
+				atomic_add(&file_cache_stats.write_errors, 1);
+				vm_page_set_state(pages[i], PAGE_STATE_MODIFIED);
+				err = werr;
+			} else {
+				atomic_add(&file_cache_stats.pages_written, 1);
+				vm_page_set_state(pages[i], PAGE_STATE_ACTIVE);
+			}
+			mutex_unlock(&cache_ref->lock);
+		}
+		// stop at the first batch with an error, the failed pages would just be picked again
+	} while(count == FILE_CACHE_FLUSH_BATCH && err >= 0);
+
+	return err < 0 ? err : NO_ERROR;
+}
+
+int vm_cache_invalidate_file(void *vnode)
+{
+	vm_cache_ref *cache_ref;
+	vm_page *page;
+	vm_page *temp;
+	int err;
+
+	cache_ref = vfs_get_cache_ptr(vnode);
+	if(cache_ref == NULL)
+		return NO_ERROR;
+	VERIFY_VM_CACHE_REF(cache_ref);
+
+	atomic_add(&file_cache_stats.invalidations, 1);
+
+	// what was written here still has to get to the file
+	err = vm_cache_flush_file(vnode);
+
+	// mapped pages stay, the mappings would have to be torn down to drop them
+	mutex_lock(&cache_ref->lock);
+	list_for_every_entry_safe(&cache_ref->cache->page_list_head, page, temp, vm_page, cache_node) {
+		if(page->ref_count > 0
+		  || (page->state != PAGE_STATE_ACTIVE && page->state != PAGE_STATE_INACTIVE))
+			continue;
+		vm_cache_remove_page(cache_ref, page);
+		vm_page_set_state(page, PAGE_STATE_FREE);
+		atomic_add(&file_cache_stats.pages_dropped, 1);
+	}
+	cache_ref->cache->read_ahead_next = -1;
+	mutex_unlock(&cache_ref->lock);
+
+	return err;
+}
@@ -13,10 +13,12 @@
 #include <kernel/vm_priv.h>
 #include <kernel/vm_cache.h>
 #include <kernel/vm_page.h>
+#include <kernel/vfs.h>
 
 bool trimming_cycle;
 static addr_t free_memory_low_water;
 static addr_t free_memory_high_water;
+static sem_id page_daemon_sem = -1;
 
 static void scan_pages(vm_address_space *aspace, addr_t free_target)
 {
@@ -168,7 +170,8 @@ static int page_daemon()
 	dprintf("page daemon starting\n");
 
 	for(;;) {
-		thread_snooze(PAGE_DAEMON_INTERVAL);
+		// run every so often, or right away when someone runs out of pages
+		sem_acquire_etc(page_daemon_sem, 1, SEM_FLAG_TIMEOUT, PAGE_DAEMON_INTERVAL, NULL);
 
 		// scan through all of the address spaces
 		vm_aspace_walk_start(&i);
@@ -213,6 +216,10 @@ static int page_daemon()
 			if(trimming_cycle && mapped_size > aspace->working_set_size)
 				free_memory_target = mapped_size - aspace->working_set_size;
 
+			// when it's getting really tight, dig into the working sets too
+			if(trimming_cycle && vm_page_num_free_pages() < free_memory_low_water / 2)
+				free_memory_target = max(free_memory_target, mapped_size / 8);
+
 			scan_pages(aspace, free_memory_target);
 //			scan_pages(aspace, 0x7fffffff);
 
@@ -222,14 +229,32 @@ static int page_daemon()
 			aspace = vm_aspace_walk_next(&i);
 			vm_put_aspace(old_aspace);
 		}
+
+		// unused vnodes sit on their cached pages, let some of them go if memory is tight
+		if(trimming_cycle) {
+			int freed = vfs_free_unused_vnodes(UNUSED_VNODE_TRIM_COUNT);
+			dprintf("page_daemon: freed %d unused vnodes\n", freed);
+
+			// the scan just left some pages unmapped, free the clean ones
+			freed = vm_page_reclaim(free_memory_high_water - min(vm_page_num_free_pages(), free_memory_high_water));
+			dprintf("page_daemon: reclaimed %d pages\n", freed);
+		}
 	}
 }
 
+// kicks the page daemon into running a pass now
+void vm_page_daemon_wakeup(void)
+{
+	if(page_daemon_sem >= 0)
+		sem_release_etc(page_daemon_sem, 1, SEM_FLAG_NO_RESCHED);
+}
+
 int vm_daemon_init()
 {
 	thread_id tid;
 
 	trimming_cycle = false;
+	page_daemon_sem = sem_create(0, "page_daemon_sem");
 
 	// calculate the free memory low and high water at which point we enter/leave trimming phase
 	free_memory_low_water = vm_page_num_pages() / 8;
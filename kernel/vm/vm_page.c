@@ -8,6 +8,7 @@
 #include <kernel/vm_priv.h>
 #include <kernel/vm_page.h>
 #include <kernel/vm_cache.h>
+#include <kernel/vm_swap.h>
 #include <kernel/arch/vm_translation_map.h>
 #include <kernel/console.h>
 #include <kernel/debug.h>
@@ -16,6 +17,8 @@
 #include <kernel/smp.h>
 #include <kernel/sem.h>
 #include <kernel/list.h>
+#include <kernel/lock.h>
+#include <kernel/time.h>
 #include <newos/errors.h>
 #include <boot/stage2.h>
 
@@ -28,7 +31,6 @@ typedef struct page_queue {
 
 extern bool trimming_cycle;
 
-static page_queue page_free_queue;
 static page_queue page_clear_queue;
 static page_queue page_active_queue;
 static page_queue page_modified_queue;
@@ -40,10 +42,77 @@ static unsigned int num_pages;
 
 static spinlock_t page_lock;
 
+// Free pages live in a buddy allocator: blocks of 2^order physically contiguous,
+// naturally aligned pages, with a queue of block heads per order. Only the head
+// of a block is on a queue, the rest of its pages are on none. The pages in a
+// block can be in the free or clear state, the buddy doesn't care.
+// page_clear_queue is a pool of single pages the scrubber has zeroed. They're
+// out of the buddy, so the pool is kept to clear_pool_max pages to limit how
+// much it breaks up the free blocks.
+#define PAGE_BUDDY_ORDERS 11	// up to 4MB blocks, bigger runs are strung together from them
+
+static page_queue buddy_queues[PAGE_BUDDY_ORDERS];
+static unsigned int clear_pool_max;
+
+// Per cpu caches of free and clear pages, so allocating and freeing pages
+// doesn't take page_lock every time. Pages move between them and the buddy
+// or the clear pool PAGE_CACHE_BATCH at a time. Cached pages stay in the free
+// or clear state and are counted as such in vm_info, but sit on their cpu's
+// queues with cpu_cached set.
+// Lock order is a cpu cache lock, then page_lock.
+#define PAGE_CACHE_BATCH 16
+#define PAGE_CACHE_HIGH 64
+
+struct page_cpu_cache {
+	spinlock_t lock;
+	page_queue free;
+	page_queue clear;
+
+	// stats
+	int allocs;
+	int frees;
+	int refills;
+	int drains;
+} _ALIGNED(64);
+
+static struct page_cpu_cache page_cpu_caches[_MAX_CPUS];
+
+// Threads that find a page busy sleep on one of a hashed set of wait queues
+// until whoever made it busy takes it out of that state. Waiters are counted
+// under the queue's spinlock, and the waker releases the sem once per waiter,
+// so a wakeup can't get lost between checking the page and blocking.
+// Queues are shared by pages that hash together, so a waiter may be woken
+// for someone else's page and has to look at its page again.
+#define PAGE_WAIT_QUEUES 64
+
+struct page_wait_queue {
+	spinlock_t lock;
+	sem_id sem;
+	int waiters;
+
+	// stats
+	int waits;
+	int wakeups;
+	bigtime_t wait_time;
+	bigtime_t max_wait_time;
+} _ALIGNED(64);
+
+static struct page_wait_queue page_wait_queues[PAGE_WAIT_QUEUES];
+
+#define PAGE_WAIT_QUEUE(page) (&page_wait_queues[(((addr_t)(page)) / sizeof(vm_page)) % PAGE_WAIT_QUEUES])
+
 static sem_id modified_pages_available;
+static thread_id pageout_daemon_tid = -1;
+
+// threads that found no free page sleep here for a while, and are woken
+// early if someone frees one
+static sem_id free_pages_sem = -1;
+static int free_page_waiters;
 
 void dump_page_stats(int argc, char **argv);
 void dump_free_page_table(int argc, char **argv);
+static void dump_buddy(int argc, char **argv);
+static void dump_page_waits(int argc, char **argv);
 static int vm_page_set_state_nolock(vm_page *page, int page_state);
 static void clear_page(addr_t pa);
 static int page_scrubber(void *);
@@ -86,101 +155,396 @@ static void remove_page_from_queue(page_queue *q, vm_page *page)
 	q->count--;
 }
 
-static void move_page_to_queue(page_queue *from_q, page_queue *to_q, vm_page *page)
+static vm_page *page_at(addr_t ppn)
 {
-#if DEBUG > 1
-	VERIFY_VM_PAGE(page);
-#endif
-	if(from_q != to_q) {
-		remove_page_from_queue(from_q, page);
-		enqueue_page(to_q, page);
+	if(ppn < physical_page_offset || ppn - physical_page_offset >= num_pages)
+		return NULL;
+	return &all_pages[ppn - physical_page_offset];
+}
+
+// NOTE: expects page_lock to be held
+// returns a naturally aligned block of 2^order pages to the buddy, merging it with its buddies
+static void buddy_free(vm_page *page, unsigned int order)
+{
+	vm_page *buddy;
+
+	while(order < PAGE_BUDDY_ORDERS - 1) {
+		buddy = page_at(page->ppn ^ (1 << order));
+		if(buddy == NULL || !buddy->buddy_head || buddy->buddy_order != order)
+			break;
+
+		// merge with it
+		remove_page_from_queue(&buddy_queues[order], buddy);
+		buddy->buddy_head = 0;
+		if(buddy < page)
+			page = buddy;
+		order++;
 	}
+
+	page->buddy_head = 1;
+	page->buddy_order = order;
+	enqueue_page(&buddy_queues[order], page);
 }
 
-static int pageout_daemon()
+// NOTE: expects page_lock to be held
+// frees an arbitrary run of pages, as the largest aligned blocks that fit
+static void buddy_free_run(vm_page *page, unsigned int count)
+{
+	unsigned int order;
+
+	while(count > 0) {
+		for(order = 0; order < PAGE_BUDDY_ORDERS - 1; order++) {
+			if((page->ppn & (1 << order)) != 0 || (2U << order) > count)
+				break;
+		}
+		buddy_free(page, order);
+		page += 1 << order;
+		count -= 1 << order;
+	}
+}
+
+// NOTE: expects page_lock to be held
+// returns the first page of a block of 2^order pages, or NULL
+static vm_page *buddy_alloc(unsigned int order)
+{
+	vm_page *page;
+	vm_page *half;
+	unsigned int k;
+
+	for(k = order; k < PAGE_BUDDY_ORDERS; k++) {
+		if(buddy_queues[k].count > 0)
+			break;
+	}
+	if(k == PAGE_BUDDY_ORDERS)
+		return NULL;
+
+	page = dequeue_page(&buddy_queues[k]);
+	page->buddy_head = 0;
+
+	// hand back the top halves until the block is the right size
+	while(k > order) {
+		k--;
+		half = page + (1 << k);
+		half->buddy_head = 1;
+		half->buddy_order = k;
+		enqueue_page(&buddy_queues[k], half);
+	}
+
+	return page;
+}
+
+// NOTE: expects page_lock to be held
+// runs bigger than the largest block are put together out of free top order
+// blocks that sit next to each other, found by walking the blocks in physical
+// order. Returns the first page of count such blocks, or NULL.
+static vm_page *buddy_alloc_blocks(addr_t count)
+{
+	unsigned int top = PAGE_BUDDY_ORDERS - 1;
+	addr_t block = (addr_t)1 << top;
+	addr_t found = 0;
+	addr_t ppn;
+	addr_t i;
+	vm_page *first = NULL;
+	vm_page *page;
+
+	if((addr_t)buddy_queues[top].count < count)
+		return NULL;
+
+	for(ppn = ROUNDUP(physical_page_offset, block); ppn - physical_page_offset + block <= num_pages; ppn += block) {
+		page = page_at(ppn);
+		if(!page->buddy_head || page->buddy_order != top) {
+			found = 0;
+			continue;
+		}
+		if(found++ == 0)
+			first = page;
+		if(found == count)
+			break;
+	}
+	if(found < count)
+		return NULL;
+
+	for(i = 0; i < count; i++) {
+		page = first + i * block;
+		remove_page_from_queue(&buddy_queues[top], page);
+		page->buddy_head = 0;
+	}
+
+	return first;
+}
+
+// NOTE: expects page_lock to be held
+// pulls one particular free page out of the buddy block it's in
+static void buddy_remove_page(vm_page *page)
+{
+	vm_page *head = NULL;
+	unsigned int order;
+	unsigned int k;
+
+	for(k = 0; k < PAGE_BUDDY_ORDERS; k++) {
+		head = page_at(page->ppn & ~((1 << k) - 1));
+		if(head != NULL && head->buddy_head && head->buddy_order >= k)
+			break;
+	}
+	if(k == PAGE_BUDDY_ORDERS)
+		panic("buddy_remove_page: page %p (ppn 0x%lx) is not in a free block\n", page, page->ppn);
+
+	order = head->buddy_order;
+	remove_page_from_queue(&buddy_queues[order], head);
+	head->buddy_head = 0;
+
+	// split the block down around the page
+	while(order > 0) {
+		order--;
+		if(page->ppn & (1 << order)) {
+			head->buddy_head = 1;
+			head->buddy_order = order;
+			enqueue_page(&buddy_queues[order], head);
+			head += 1 << order;
+		} else {
+			head[1 << order].buddy_head = 1;
+			head[1 << order].buddy_order = order;
+			enqueue_page(&buddy_queues[order], &head[1 << order]);
+		}
+	}
+}
+
+// NOTE: expects page_lock to be held
+// takes a free or clear page that isn't in a cpu cache off the clear pool or out of the buddy
+static void take_free_page(vm_page *page)
+{
+	if(page->cpu_cached)
+		panic("take_free_page: vm_page %p is in a cpu's page cache\n", page);
+
+	if(page->queue_node.next != NULL && !page->buddy_head)
+		remove_page_from_queue(&page_clear_queue, page);
+	else
+		buddy_remove_page(page);
+}
+
+// NOTE: expects page_lock to be held
+// the opposite, the page's state has to be free or clear already
+static void put_free_page(vm_page *page)
+{
+	if(page->state == PAGE_STATE_CLEAR && (unsigned int)page_clear_queue.count < clear_pool_max)
+		enqueue_page(&page_clear_queue, page);
+	else
+		buddy_free(page, 0);
+}
+
+// NOTE: expects page_lock to be held
+// puts the clear pool back in the buddy, so its pages can merge into runs again
+static void flush_clear_pool(void)
 {
 	vm_page *page;
+
+	while((page = dequeue_page(&page_clear_queue)) != NULL)
+		buddy_free(page, 0);
+}
+
+// takes page and the pages around it at consecutive offsets in the same
+// cache, up to PAGEOUT_CLUSTER of them, out of the modified temporary state
+// and writes them to the cache's store in one go. Returns the number of pages
+// written, or an error if the store couldn't take them.
+// NOTE: page's cache has to have a ref held
+static int pageout_cluster(vm_page *page, vm_cache_ref *cache_ref)
+{
+	vm_page *pages[PAGEOUT_CLUSTER];
+	vm_store *store = cache_ref->cache->store;
 	vm_region *region;
-	IOVECS(vecs, 1);
+	vm_page *p;
+	IOVECS(vecs, PAGEOUT_CLUSTER);
+	off_t first;
+	off_t offset;
 	ssize_t err;
+	int count = 0;
+	int mapped;
+	int i;
 
-	dprintf("pageout daemon starting\n");
+	mutex_lock(&cache_ref->lock);
+
+	// it may have been faulted on or freed while we weren't looking
+	if(page->cache_ref != cache_ref || page->state != PAGE_STATE_MODIFIED_TEMPORARY) {
+		mutex_unlock(&cache_ref->lock);
+		return 0;
+	}
 
-	// XXX remove
-	dprintf("pageout daemon disabled, exiting...\n");
-	return -1;
+	// look for the start of the run of modified pages this one is in
+	first = page->offset;
+	for(i = 1; i < PAGEOUT_CLUSTER && first >= PAGE_SIZE; i++) {
+		p = vm_cache_lookup_page(cache_ref, first - PAGE_SIZE);
+		if(p == NULL || p->state != PAGE_STATE_MODIFIED_TEMPORARY)
+			break;
+		first -= PAGE_SIZE;
+	}
 
-	for(;;) {
-		sem_acquire(modified_pages_available, 1);
+	// and make them busy, so nobody touches them while they're being written
+	for(offset = first; count < PAGEOUT_CLUSTER; offset += PAGE_SIZE) {
+		p = (offset == page->offset) ? page : vm_cache_lookup_page(cache_ref, offset);
+		if(p == NULL || p->state != PAGE_STATE_MODIFIED_TEMPORARY)
+			break;
+		vm_page_set_state(p, PAGE_STATE_BUSY);
+		pages[count++] = p;
+	}
 
-		dprintf("here\n");
+	// clear the modified flag in all of their mappings, a write from here on
+	// makes them modified again
+	list_for_every_entry(&cache_ref->region_list_head, region, vm_region, cache_node) {
+		vm_translation_map *map = &region->aspace->translation_map;
 
-		int_disable_interrupts();
-		acquire_spinlock(&page_lock);
-		page = dequeue_page(&page_modified_queue);
-		page->state = PAGE_STATE_BUSY;
-		vm_info.modified_pages--;
-		vm_info.busy_pages++;
-		vm_cache_acquire_ref(page->cache_ref, true);
-		release_spinlock(&page_lock);
-		int_restore_interrupts();
+		map->ops->lock(map);
+		for(i = 0; i < count; i++) {
+			if(pages[i]->offset >= region->cache_offset
+			  && pages[i]->offset - region->cache_offset < region->size)
+				map->ops->clear_flags(map, pages[i]->offset - region->cache_offset + region->base, PAGE_MODIFIED);
+		}
+		map->ops->unlock(map);
+	}
+
+	mutex_unlock(&cache_ref->lock);
 
-		dprintf("got page %p\n", page);
+	// only the first page may wait for a mapping, like in vm_cache_page_in
+	for(mapped = 0; mapped < count; mapped++) {
+		if(vm_get_physical_page(pages[mapped]->ppn * PAGE_SIZE, (addr_t *)&vecs->vec[mapped].start,
+		  mapped == 0 ? PHYSICAL_PAGE_CAN_WAIT : PHYSICAL_PAGE_NO_WAIT) < 0)
+			break;
+		vecs->vec[mapped].len = PAGE_SIZE;
+	}
+	vecs->num = mapped;
+	vecs->total_len = mapped * PAGE_SIZE;
+
+	err = (*store->ops->write)(store, pages[0]->offset, vecs);
+
+	for(i = 0; i < mapped; i++)
+		vm_put_physical_page((addr_t)vecs->vec[i].start);
+
+	// the ones that were written are clean now, the rest stay modified
+	for(i = 0; i < count; i++) {
+		if(err < 0 || i >= mapped)
+			vm_page_set_state(pages[i], PAGE_STATE_MODIFIED_TEMPORARY);
+		else if(pages[i]->ref_count > 0)
+			vm_page_set_state(pages[i], PAGE_STATE_ACTIVE);
+		else
+			vm_page_set_state(pages[i], PAGE_STATE_INACTIVE);
+	}
 
-		if(page->cache_ref->cache->temporary && !trimming_cycle) {
-			// unless we're in the trimming cycle, dont write out pages
-			// that back anonymous stores
+	if(err < 0)
+		return err;
+	return mapped;
+}
+
+// Pages of anonymous memory get written to swap while the page daemon is
+// trimming, a cluster at a time, oldest first. Once written they are clean
+// and the reclaim can take them. Modified pages of files are left to the
+// file cache flushes.
+static int pageout_daemon()
+{
+	vm_cache_ref *cache_ref;
+	vm_page *page;
+	int budget;
+	int err;
+
+	dprintf("pageout daemon starting\n");
+
+	for(;;) {
+		sem_acquire_etc(modified_pages_available, 1, SEM_FLAG_TIMEOUT, PAGEOUT_INTERVAL, NULL);
+
+		if(!trimming_cycle)
+			continue;
+
+		for(budget = page_modified_temporary_queue.count; budget > 0; budget--) {
+			if(!vm_swap_enabled() || vm_info.swap_free_pages == 0 || !trimming_cycle)
+				break;
+
+			// take the oldest one and move it to the front, so one we can't
+			// do anything with doesn't get picked again right away
 			int_disable_interrupts();
 			acquire_spinlock(&page_lock);
-			enqueue_page(&page_modified_queue, page);
-			page->state = PAGE_STATE_MODIFIED;
-			vm_info.busy_pages--;
-			vm_info.modified_pages++;
+			page = list_peek_tail_type(&page_modified_temporary_queue.list, vm_page, queue_node);
+			cache_ref = NULL;
+			if(page != NULL) {
+				remove_page_from_queue(&page_modified_temporary_queue, page);
+				list_add_head(&page_modified_temporary_queue.list, &page->queue_node);
+				page_modified_temporary_queue.count++;
+				cache_ref = page->cache_ref;
+				if(cache_ref != NULL && !vm_cache_try_acquire_ref(cache_ref))
+					cache_ref = NULL;
+			}
 			release_spinlock(&page_lock);
 			int_restore_interrupts();
-			vm_cache_release_ref(page->cache_ref);
-			continue;
-		}
 
-		/* clear the modified flag on this page in all it's mappings */
-		mutex_lock(&page->cache_ref->lock);
-		list_for_every_entry(&page->cache_ref->region_list_head, region, vm_region, cache_node) {
-			if(page->offset > region->cache_offset
-			  && page->offset < region->cache_offset + region->size) {
-				vm_translation_map *map = &region->aspace->translation_map;
-				map->ops->lock(map);
-				map->ops->clear_flags(map, page->offset - region->cache_offset + region->base, PAGE_MODIFIED);
-				map->ops->unlock(map);
+			if(page == NULL)
+				break;
+			if(cache_ref == NULL)
+				continue;
+
+			err = pageout_cluster(page, cache_ref);
+			vm_cache_release_ref_etc(cache_ref, false);
+			if(err < 0) {
+				dprintf("pageout_daemon: error %d writing out pages, giving up for now\n", err);
+				break;
 			}
 		}
-		mutex_unlock(&page->cache_ref->lock);
 
-		/* write the page out to it's backing store */
-		vecs->num = 1;
-		vecs->total_len = PAGE_SIZE;
-		vm_get_physical_page(page->ppn * PAGE_SIZE, (addr_t *)&vecs->vec[0].start, PHYSICAL_PAGE_CAN_WAIT);
-		vecs->vec[0].len = PAGE_SIZE;
+		vm_page_reclaim(PAGE_RECLAIM_BATCH);
+	}
 
-		err = page->cache_ref->cache->store->ops->write(page->cache_ref->cache->store, page->offset, vecs);
+	return 0;
+}
 
-		vm_put_physical_page((addr_t)vecs->vec[0].start);
+// Frees clean pages nobody has mapped that their store can give back, oldest
+// first. Pages on the active queue that aren't mapped get a second chance,
+// they're moved to the inactive state and freed if they're still there the
+// next time around. Caches that are locked are skipped, so this can be called
+// from an allocation with a cache locked. Returns the number of pages freed.
+int vm_page_reclaim(int target)
+{
+	vm_cache_ref *cache_ref;
+	vm_page *page;
+	int freed = 0;
+	int scan;
 
+	for(scan = min(page_active_queue.count, target * PAGE_RECLAIM_SCAN_FACTOR); scan > 0 && freed < target; scan--) {
 		int_disable_interrupts();
 		acquire_spinlock(&page_lock);
-		vm_info.busy_pages--;
-		if(page->ref_count > 0) {
-			page->state = PAGE_STATE_ACTIVE;
-			vm_info.active_pages++;
-		} else {
-			page->state = PAGE_STATE_INACTIVE;
-			vm_info.inactive_pages++;
+		page = list_peek_tail_type(&page_active_queue.list, vm_page, queue_node);
+		cache_ref = NULL;
+		if(page != NULL) {
+			remove_page_from_queue(&page_active_queue, page);
+			enqueue_page(&page_active_queue, page);
+			if(page->ref_count == 0 && page->cache_ref != NULL) {
+				if(page->state == PAGE_STATE_ACTIVE)
+					vm_page_set_state_nolock(page, PAGE_STATE_INACTIVE);
+				else if(page->state == PAGE_STATE_INACTIVE && vm_cache_try_acquire_ref(page->cache_ref))
+					cache_ref = page->cache_ref;
+			}
 		}
-		enqueue_page(&page_active_queue, page);
 		release_spinlock(&page_lock);
 		int_restore_interrupts();
 
-		vm_cache_release_ref(page->cache_ref);
+		if(page == NULL)
+			break;
+		if(cache_ref == NULL)
+			continue;
+
+		if(mutex_trylock(&cache_ref->lock)) {
+			// look again now that the cache can't change under us
+			if(page->cache_ref == cache_ref && page->state == PAGE_STATE_INACTIVE && page->ref_count == 0
+			  && cache_ref->cache->store->ops->has_page != NULL
+			  && (*cache_ref->cache->store->ops->has_page)(cache_ref->cache->store, page->offset)) {
+				vm_cache_remove_page(cache_ref, page);
+				vm_page_set_state(page, PAGE_STATE_FREE);
+				freed++;
+			}
+			mutex_unlock(&cache_ref->lock);
+		}
+		vm_cache_release_ref_etc(cache_ref, false);
 	}
+
+	if(freed > 0)
+		atomic_add(&vm_info.reclaimed_pages, freed);
+
+	return freed;
 }
 
 int vm_page_init(kernel_args *ka)
@@ -192,8 +556,10 @@ int vm_page_init(kernel_args *ka)
 	page_lock = 0;
 
 	// initialize queues
-	list_initialize(&page_free_queue.list);
-	page_free_queue.count = 0;
+	for(i = 0; i < PAGE_BUDDY_ORDERS; i++) {
+		list_initialize(&buddy_queues[i].list);
+		buddy_queues[i].count = 0;
+	}
 	list_initialize(&page_clear_queue.list);
 	page_clear_queue.count = 0;
 	list_initialize(&page_active_queue.list);
@@ -203,6 +569,20 @@ int vm_page_init(kernel_args *ka)
 	list_initialize(&page_modified_temporary_queue.list);
 	page_modified_temporary_queue.count = 0;
 
+	for(i = 0; i < _MAX_CPUS; i++) {
+		page_cpu_caches[i].lock = 0;
+		list_initialize(&page_cpu_caches[i].free.list);
+		page_cpu_caches[i].free.count = 0;
+		list_initialize(&page_cpu_caches[i].clear.list);
+		page_cpu_caches[i].clear.count = 0;
+	}
+
+	for(i = 0; i < PAGE_WAIT_QUEUES; i++) {
+		page_wait_queues[i].lock = 0;
+		page_wait_queues[i].sem = -1;
+		page_wait_queues[i].waiters = 0;
+	}
+
 	// calculate the size of memory by looking at the phys_mem_range array
 	{
 		unsigned int last_phys_page = 0;
@@ -244,10 +624,15 @@ int vm_page_init_postheap(kernel_args *ka)
 		all_pages[i].ppn = physical_page_offset + i;
 		all_pages[i].type = PAGE_TYPE_PHYSICAL;
 		all_pages[i].state = PAGE_STATE_FREE;
+		all_pages[i].cpu_cached = 0;
+		all_pages[i].buddy_head = 0;
+		all_pages[i].buddy_order = 0;
 		all_pages[i].ref_count = 0;
+		list_clear_node(&all_pages[i].queue_node);
 		vm_info.free_pages++;
-		enqueue_page(&page_free_queue, &all_pages[i]);
 	}
+	buddy_free_run(&all_pages[0], num_pages);
+	clear_pool_max = num_pages / 8;
 
 	// mark some of the page ranges inuse
 	for(i = 0; i < ka->num_phys_alloc_ranges; i++) {
@@ -274,6 +659,18 @@ int vm_page_init2(kernel_args *ka)
 
 	dbg_add_command(&dump_page_stats, "page_stats", "Dump statistics about page usage");
 	dbg_add_command(&dump_free_page_table, "free_pages", "Dump list of free pages");
+	dbg_add_command(&dump_buddy, "page_buddy", "Dump free block counts and fragmentation per buddy order");
+	dbg_add_command(&dump_page_waits, "page_waits", "Dump busy page wait queue statistics");
+
+	return 0;
+}
+
+int vm_page_init_postsem(kernel_args *ka)
+{
+	unsigned int i;
+
+	for(i = 0; i < PAGE_WAIT_QUEUES; i++)
+		page_wait_queues[i].sem = sem_create(0, "page_wait_sem");
 
 	return 0;
 }
@@ -288,10 +685,12 @@ int vm_page_init_postthread(kernel_args *ka)
 	thread_resume_thread(tid);
 
 	modified_pages_available = sem_create(0, "modified_pages_avail_sem");
+	free_pages_sem = sem_create(0, "free_pages_sem");
 
 	// create a kernel thread to schedule modified pages to write
 	tid = thread_create_kernel_thread("pageout daemon", &pageout_daemon, NULL);
 	thread_set_priority(tid, THREAD_MIN_RT_PRIORITY + 1);
+	pageout_daemon_tid = tid;
 	thread_resume_thread(tid);
 
 	return 0;
@@ -301,6 +700,7 @@ static int page_scrubber(void *unused)
 {
 #define SCRUB_SIZE 16
 	vm_page *page[SCRUB_SIZE];
+	vm_page *p;
 	int i;
 	int scrub_count;
 
@@ -311,22 +711,31 @@ static int page_scrubber(void *unused)
 	for(;;) {
 		thread_snooze(100000); // 100ms
 
-		if(page_free_queue.count > 0) {
+		if((unsigned int)page_clear_queue.count < clear_pool_max && vm_info.free_pages > 0) {
 			int_disable_interrupts();
 			acquire_spinlock(&page_lock);
 
-			for(i=0; i<SCRUB_SIZE; i++) {
-				page[i] = dequeue_page(&page_free_queue);
-				if(page[i] == NULL)
+			for(scrub_count = 0; scrub_count < SCRUB_SIZE; ) {
+				if((unsigned int)(page_clear_queue.count + scrub_count) >= clear_pool_max)
+					break;
+				p = buddy_alloc(0);
+				if(p == NULL)
 					break;
-				vm_info.free_pages--;
+				if(p->state == PAGE_STATE_CLEAR) {
+					// already zeroed, just move it over
+					enqueue_page(&page_clear_queue, p);
+					continue;
+				}
+				// busy while it's being scrubbed, so nobody goes looking for it in the buddy
+				p->state = PAGE_STATE_BUSY;
+				atomic_add(&vm_info.free_pages, -1);
+				atomic_add(&vm_info.busy_pages, 1);
+				page[scrub_count++] = p;
 			}
 
 			release_spinlock(&page_lock);
 			int_restore_interrupts();
 
-			scrub_count = i;
-
 			for(i=0; i<scrub_count; i++) {
 				clear_page(page[i]->ppn * PAGE_SIZE);
 			}
@@ -336,8 +745,9 @@ static int page_scrubber(void *unused)
 
 			for(i=0; i<scrub_count; i++) {
 				page[i]->state = PAGE_STATE_CLEAR;
+				atomic_add(&vm_info.busy_pages, -1);
+				atomic_add(&vm_info.clear_pages, 1);
 				enqueue_page(&page_clear_queue, page[i]);
-				vm_info.clear_pages++;
 			}
 
 			release_spinlock(&page_lock);
@@ -389,6 +799,10 @@ int vm_mark_page_range_inuse(addr_t start_page, addr_t len)
 		switch(page->state) {
 			case PAGE_STATE_FREE:
 			case PAGE_STATE_CLEAR:
+				if(page->cpu_cached) {
+					dprintf("vm_mark_page_range_inuse: page 0x%lx is in a cpu's page cache!\n", start_page + i);
+					break;
+				}
 				vm_page_set_state_nolock(page, PAGE_STATE_UNUSED);
 				break;
 			case PAGE_STATE_WIRED:
@@ -411,11 +825,162 @@ int vm_mark_page_range_inuse(addr_t start_page, addr_t len)
 	return i;
 }
 
+// NOTE: expects the cache lock to be held, expects page_lock to be held
+static int take_clear_pool_pages(struct page_cpu_cache *cache, int count)
+{
+	vm_page *page;
+	int i;
+
+	for(i = 0; i < count; i++) {
+		page = dequeue_page(&page_clear_queue);
+		if(page == NULL)
+			break;
+		page->cpu_cached = 1;
+		enqueue_page(&cache->clear, page);
+	}
+	return i;
+}
+
+// NOTE: expects the cache lock to be held, expects page_lock to be held
+static int take_buddy_pages(struct page_cpu_cache *cache, int count)
+{
+	vm_page *page;
+	unsigned int order;
+	int i = 0;
+	int n;
+
+	// take blocks as large as will fit, it's cheaper than one page at a time
+	while(i < count) {
+		for(order = 0; order < PAGE_BUDDY_ORDERS - 1 && (2 << order) <= count - i; order++)
+			;
+		page = buddy_alloc(order);
+		while(page == NULL && order > 0)
+			page = buddy_alloc(--order);
+		if(page == NULL)
+			break;
+
+		for(n = 0; n < (1 << order); n++, i++) {
+			page[n].cpu_cached = 1;
+			enqueue_page((page[n].state == PAGE_STATE_CLEAR) ? &cache->clear : &cache->free, &page[n]);
+		}
+	}
+	return i;
+}
+
+// NOTE: expects the cache lock to be held, takes page_lock
+// moves up to count pages from the clear pool or the buddy into the cache,
+// clear ones if clear is set and there are any, free ones otherwise
+static int refill_page_cache(struct page_cpu_cache *cache, bool clear, int count)
+{
+	int i;
+
+	acquire_spinlock(&page_lock);
+
+	if(clear) {
+		i = take_clear_pool_pages(cache, count);
+		if(i == 0 && cache->free.count == 0)
+			i = take_buddy_pages(cache, count);
+	} else {
+		i = take_buddy_pages(cache, count);
+		if(i == 0 && cache->clear.count == 0)
+			i = take_clear_pool_pages(cache, count);
+	}
+
+	release_spinlock(&page_lock);
+
+	if(i > 0)
+		cache->refills++;
+
+	return i;
+}
+
+// NOTE: expects the cache lock to be held, takes page_lock
+static void drain_page_cache(struct page_cpu_cache *cache, int count)
+{
+	vm_page *page;
+	int i;
+
+	acquire_spinlock(&page_lock);
+
+	// hand back free pages before clear ones, those are worth keeping
+	for(i = 0; i < count; i++) {
+		page = dequeue_page(&cache->free);
+		if(page == NULL) {
+			page = dequeue_page(&cache->clear);
+			if(page == NULL)
+				break;
+		}
+		page->cpu_cached = 0;
+		put_free_page(page);
+	}
+
+	release_spinlock(&page_lock);
+
+	cache->drains++;
+}
+
+// push every cpu's cached pages back to the global queues
+static void drain_all_page_caches(void)
+{
+	struct page_cpu_cache *cache;
+	int i;
+
+	for(i = 0; i < _MAX_CPUS; i++) {
+		cache = &page_cpu_caches[i];
+
+		int_disable_interrupts();
+		acquire_spinlock(&cache->lock);
+
+		if(cache->free.count + cache->clear.count > 0)
+			drain_page_cache(cache, cache->free.count + cache->clear.count);
+
+		release_spinlock(&cache->lock);
+		int_restore_interrupts();
+	}
+}
+
+// NOTE: expects the cache lock to be held
+static vm_page *get_cached_page(struct page_cpu_cache *cache, int page_state, int *old_page_state)
+{
+	page_queue *q = (page_state == PAGE_STATE_CLEAR) ? &cache->clear : &cache->free;
+	page_queue *q_other = (page_state == PAGE_STATE_CLEAR) ? &cache->free : &cache->clear;
+	vm_page *page;
+
+	if(q->count == 0)
+		refill_page_cache(cache, page_state == PAGE_STATE_CLEAR, PAGE_CACHE_BATCH);
+
+	page = dequeue_page(q);
+	if(page == NULL) {
+		// settle for the other kind, the caller zeroes it if it has to
+		page = dequeue_page(q_other);
+		if(page == NULL)
+			return NULL;
+	}
+
+	page->cpu_cached = 0;
+	*old_page_state = page->state;
+	if(page->state == PAGE_STATE_FREE)
+		atomic_add(&vm_info.free_pages, -1);
+	else
+		atomic_add(&vm_info.clear_pages, -1);
+
+	// busy pages fresh out of the allocator aren't on any queue
+	page->state = PAGE_STATE_BUSY;
+	atomic_add(&vm_info.busy_pages, 1);
+
+	cache->allocs++;
+
+	return page;
+}
+
 vm_page *vm_page_allocate_specific_page(addr_t page_num, int page_state)
 {
 	vm_page *p;
 	int old_page_state = PAGE_STATE_BUSY;
 
+	// the page could be sitting in some cpu's cache
+	drain_all_page_caches();
+
 	int_disable_interrupts();
 	acquire_spinlock(&page_lock);
 
@@ -425,12 +990,20 @@ vm_page *vm_page_allocate_specific_page(addr_t page_num, int page_state)
 
 	switch(p->state) {
 		case PAGE_STATE_FREE:
-			remove_page_from_queue(&page_free_queue, p);
-			vm_info.free_pages--;
+			if(p->cpu_cached) {
+				p = NULL;
+				break;
+			}
+			take_free_page(p);
+			atomic_add(&vm_info.free_pages, -1);
 			break;
 		case PAGE_STATE_CLEAR:
-			remove_page_from_queue(&page_clear_queue, p);
-			vm_info.clear_pages--;
+			if(p->cpu_cached) {
+				p = NULL;
+				break;
+			}
+			take_free_page(p);
+			atomic_add(&vm_info.clear_pages, -1);
 			break;
 		case PAGE_STATE_UNUSED:
 			break;
@@ -443,7 +1016,7 @@ vm_page *vm_page_allocate_specific_page(addr_t page_num, int page_state)
 
 	old_page_state = p->state;
 	p->state = PAGE_STATE_BUSY;
-	vm_info.busy_pages++;
+	atomic_add(&vm_info.busy_pages, 1);
 
 	if(old_page_state != PAGE_STATE_UNUSED)
 		enqueue_page(&page_active_queue, p);
@@ -461,105 +1034,178 @@ out:
 	return p;
 }
 
-vm_page *vm_page_allocate_page(int page_state)
+// allocates up to count pages, returns how many it got, which is less than
+// count only if memory ran out. The pages come back busy.
+int vm_page_allocate_pages(int page_state, vm_page **pages, int count)
 {
-	vm_page *p;
-	page_queue *q;
-	page_queue *q_other;
+	struct page_cpu_cache *cache;
+	bool needs_clear[PAGE_CACHE_BATCH];
+	bool drained = false;
 	int old_page_state;
+	int allocated = 0;
+	int chunk;
+	int i, j;
 
-	switch(page_state) {
-		case PAGE_STATE_FREE:
-			q = &page_free_queue;
-			q_other = &page_clear_queue;
-			break;
-		case PAGE_STATE_CLEAR:
-			q = &page_clear_queue;
-			q_other = &page_free_queue;
-			break;
-		default:
-			return NULL; // invalid
-	}
+	if(page_state != PAGE_STATE_FREE && page_state != PAGE_STATE_CLEAR)
+		return ERR_INVALID_ARGS;
 
-	int_disable_interrupts();
-	acquire_spinlock(&page_lock);
+	while(allocated < count) {
+		chunk = min(count - allocated, PAGE_CACHE_BATCH);
 
-	p = dequeue_page(q);
-	if(p == NULL) {
-		// the clear queue was empty, grab one from the free queue and zero it out
-		q = q_other;
-		p = dequeue_page(q);
-		if(p == NULL) {
-			// XXX hmm
-			panic("vm_allocate_page: out of memory!\n");
+		int_disable_interrupts();
+		cache = &page_cpu_caches[smp_get_current_cpu()];
+		acquire_spinlock(&cache->lock);
+
+		for(i = 0; i < chunk; i++) {
+			pages[allocated + i] = get_cached_page(cache, page_state, &old_page_state);
+			if(pages[allocated + i] == NULL)
+				break;
+			needs_clear[i] = (page_state == PAGE_STATE_CLEAR && old_page_state == PAGE_STATE_FREE);
+		}
+
+		release_spinlock(&cache->lock);
+		int_restore_interrupts();
+
+		// zero the ones that need it with interrupts on
+		for(j = 0; j < i; j++) {
+			if(needs_clear[j])
+				clear_page(pages[allocated + j]->ppn * PAGE_SIZE);
+			VERIFY_VM_PAGE(pages[allocated + j]);
+		}
+		allocated += i;
+
+		if(i < chunk) {
+			// the global queues are dry, pull in whatever the other cpus are holding on to, once
+			if(drained)
+				break;
+			drain_all_page_caches();
+			drained = true;
 		}
 	}
 
-	if(q == &page_free_queue)
-		vm_info.free_pages--;
-	else
-		vm_info.clear_pages--;
+	return allocated;
+}
 
-	old_page_state = p->state;
-	p->state = PAGE_STATE_BUSY;
-	vm_info.busy_pages++;
+static void wake_free_page_waiters(void)
+{
+	int count;
 
-	enqueue_page(&page_active_queue, p);
+	count = atomic_set(&free_page_waiters, 0);
+	if(count > 0)
+		sem_release_etc(free_pages_sem, count, SEM_FLAG_NO_RESCHED);
+}
 
-	release_spinlock(&page_lock);
-	int_restore_interrupts();
+// out of pages, try to get some back from the caches and wait a bit for
+// the daemons to free some. Returns false if the caller can't wait.
+static bool wait_for_free_pages(void)
+{
+	if(!int_are_interrupts_enabled() || free_pages_sem < 0)
+		return false;
 
-	if(page_state == PAGE_STATE_CLEAR && old_page_state == PAGE_STATE_FREE) {
-		clear_page(p->ppn * PAGE_SIZE);
-	}
+	// the pageout daemon is who everyone else is waiting for
+	if(thread_get_current_thread_id() == pageout_daemon_tid)
+		return false;
+
+	if(vm_page_reclaim(PAGE_RECLAIM_BATCH) > 0)
+		return true;
+
+	atomic_add(&free_page_waiters, 1);
+	vm_page_daemon_wakeup();
+	sem_acquire_etc(free_pages_sem, 1, SEM_FLAG_TIMEOUT, FREE_PAGE_WAIT_TIMEOUT, NULL);
+
+	return true;
+}
+
+vm_page *vm_page_allocate_page(int page_state)
+{
+	vm_page *p;
+	int retries = FREE_PAGE_WAIT_RETRIES;
+	int err;
+
+	for(;;) {
+		err = vm_page_allocate_pages(page_state, &p, 1);
+		if(err < 0)
+			return NULL; // invalid
+		if(err > 0)
+			break;
 
-	if(p)
-		VERIFY_VM_PAGE(p);
+		if(retries-- == 0 || !wait_for_free_pages()) {
+			// XXX hmm
+			panic("vm_allocate_page: out of memory!\n");
+		}
+	}
 
 	return p;
 }
 
+// a run of len pages, either as one buddy block or as a string of top order
+// blocks if it's bigger than the largest block. got is set to the pages taken.
+// NOTE: expects page_lock to be held
+static vm_page *buddy_alloc_run(addr_t len, addr_t *got)
+{
+	addr_t block = (addr_t)1 << (PAGE_BUDDY_ORDERS - 1);
+	unsigned int order;
+
+	if(len > block) {
+		*got = ROUNDUP(len, block);
+		return buddy_alloc_blocks(*got / block);
+	}
+
+	for(order = 0; ((addr_t)1 << order) < len; order++)
+		;
+	*got = (addr_t)1 << order;
+	return buddy_alloc(order);
+}
+
 vm_page *vm_page_allocate_page_run(int page_state, addr_t len)
 {
-	unsigned int start;
-	unsigned int i;
-	vm_page *first_page = NULL;
+	vm_page *first_page;
+	addr_t got;
+	addr_t i;
 
-	start = 0;
+	if(len == 0 || len > num_pages)
+		return NULL;
 
 	int_disable_interrupts();
 	acquire_spinlock(&page_lock);
 
-	for(;;) {
-		bool foundit = true;
-		if(start + len >= num_pages) {
-			break;
-		}
+	first_page = buddy_alloc_run(len, &got);
+	if(first_page == NULL) {
+		// the cpu caches and the clear pool are holding pages that may complete a block
+		release_spinlock(&page_lock);
+		int_restore_interrupts();
+
+		drain_all_page_caches();
+
+		int_disable_interrupts();
+		acquire_spinlock(&page_lock);
+
+		flush_clear_pool();
+		first_page = buddy_alloc_run(len, &got);
+	}
+
+	if(first_page != NULL) {
+		// give back what's left over past the end of the run
+		if(got > len)
+			buddy_free_run(first_page + len, got - len);
+
 		for(i = 0; i < len; i++) {
-			if(all_pages[start + i].state != PAGE_STATE_FREE &&
-			  all_pages[start + i].state != PAGE_STATE_CLEAR) {
-				foundit = false;
-				i++;
-				break;
-			}
-		}
-		if(foundit) {
-			// pull the pages out of the appropriate queues
-			for(i = 0; i < len; i++)
-				vm_page_set_state_nolock(&all_pages[start + i], PAGE_STATE_BUSY);
-			first_page = &all_pages[start];
-			break;
-		} else {
-			start += i;
-			if(start >= num_pages) {
-				// no more pages to look through
-				break;
-			}
+			atomic_add((first_page[i].state == PAGE_STATE_CLEAR) ? &vm_info.clear_pages : &vm_info.free_pages, -1);
+			first_page[i].state = PAGE_STATE_BUSY;
+			atomic_add(&vm_info.busy_pages, 1);
+			enqueue_page(&page_active_queue, &first_page[i]);
 		}
 	}
+
 	release_spinlock(&page_lock);
 	int_restore_interrupts();
 
+	// runs are rare enough to not bother tracking which of the pages were clear already
+	if(first_page != NULL && page_state == PAGE_STATE_CLEAR) {
+		for(i = 0; i < len; i++)
+			clear_page(first_page[i].ppn * PAGE_SIZE);
+	}
+
 	return first_page;
 }
 
@@ -576,107 +1222,243 @@ vm_page *vm_lookup_page(addr_t page_num)
 	return &all_pages[page_num];
 }
 
-static int vm_page_set_state_nolock(vm_page *page, int page_state)
+// NOTE: expects page_lock to be held, unless the page is busy and not on any queue
+// drops the page out of the accounting for its current state, returns the queue
+// it belongs on, NULL for free and clear pages
+static page_queue *leave_page_state(vm_page *page)
 {
-	page_queue *from_q = NULL;
-	page_queue *to_q = NULL;
+	if(page->cpu_cached)
+		panic("vm_page_set_state: vm_page %p is in a cpu's page cache\n", page);
 
 	switch(page->state) {
 		case PAGE_STATE_BUSY:
-			vm_info.busy_pages--;
-			goto removefromactive;
+			atomic_add(&vm_info.busy_pages, -1);
+			return &page_active_queue;
 		case PAGE_STATE_ACTIVE:
 			vm_info.active_pages--;
-			goto removefromactive;
+			return &page_active_queue;
 		case PAGE_STATE_INACTIVE:
 			vm_info.inactive_pages--;
-			goto removefromactive;
+			return &page_active_queue;
 		case PAGE_STATE_WIRED:
 			vm_info.wired_pages--;
-			goto removefromactive;
+			return &page_active_queue;
 		case PAGE_STATE_UNUSED:
 			vm_info.unused_pages--;
-removefromactive:
-			from_q = &page_active_queue;
-			break;
+			return &page_active_queue;
 		case PAGE_STATE_MODIFIED:
 			vm_info.modified_pages--;
-			from_q = &page_modified_queue;
-			break;
+			return &page_modified_queue;
 		case PAGE_STATE_MODIFIED_TEMPORARY:
 			vm_info.modified_temporary_pages--;
-			from_q = &page_modified_temporary_queue;
-			break;
+			return &page_modified_temporary_queue;
 		case PAGE_STATE_FREE:
-			vm_info.free_pages--;
-			from_q = &page_free_queue;
-			break;
+			atomic_add(&vm_info.free_pages, -1);
+			return NULL;
 		case PAGE_STATE_CLEAR:
-			vm_info.clear_pages--;
-			from_q = &page_clear_queue;
-			break;
+			atomic_add(&vm_info.clear_pages, -1);
+			return NULL;
 		default:
 			panic("vm_page_set_state: vm_page %p in invalid state %d\n", page, page->state);
+			return NULL;
 	}
+}
+
+// NOTE: expects page_lock to be held, unless the new state is free or clear
+// sets the page's state and accounts for it, returns the global queue it belongs
+// on, NULL for free and clear pages
+static page_queue *enter_page_state(vm_page *page, int page_state)
+{
+	page_queue *q;
 
 	switch(page_state) {
 		case PAGE_STATE_BUSY:
-			vm_info.busy_pages++;
-			goto addtoactive;
+			atomic_add(&vm_info.busy_pages, 1);
+			q = &page_active_queue;
+			break;
 		case PAGE_STATE_ACTIVE:
 			vm_info.active_pages++;
-			goto addtoactive;
+			q = &page_active_queue;
+			break;
 		case PAGE_STATE_INACTIVE:
 			vm_info.inactive_pages++;
-			goto addtoactive;
+			q = &page_active_queue;
+			break;
 		case PAGE_STATE_WIRED:
 			vm_info.wired_pages++;
-			goto addtoactive;
+			q = &page_active_queue;
+			break;
 		case PAGE_STATE_UNUSED:
 			vm_info.unused_pages++;
-addtoactive:
-			to_q = &page_active_queue;
+			q = &page_active_queue;
 			break;
 		case PAGE_STATE_MODIFIED:
 			vm_info.modified_pages++;
-			to_q = &page_modified_queue;
+			q = &page_modified_queue;
 			break;
 		case PAGE_STATE_MODIFIED_TEMPORARY:
 			vm_info.modified_temporary_pages++;
-			to_q = &page_modified_temporary_queue;
+			q = &page_modified_temporary_queue;
 			break;
 		case PAGE_STATE_FREE:
-			vm_info.free_pages++;
-			to_q = &page_free_queue;
+			atomic_add(&vm_info.free_pages, 1);
+			q = NULL;
 			break;
 		case PAGE_STATE_CLEAR:
-			vm_info.clear_pages++;
-			to_q = &page_clear_queue;
+			atomic_add(&vm_info.clear_pages, 1);
+			q = NULL;
 			break;
 		default:
 			panic("vm_page_set_state: invalid target state %d\n", page_state);
+			return NULL;
 	}
-	move_page_to_queue(from_q, to_q, page);
 	page->state = page_state;
 
+	return q;
+}
+
+static int vm_page_set_state_nolock(vm_page *page, int page_state)
+{
+	page_queue *from_q;
+	page_queue *to_q;
+
+	// free pages are in the buddy or the clear pool rather than on a queue
+	if(page->state == PAGE_STATE_FREE || page->state == PAGE_STATE_CLEAR)
+		take_free_page(page);
+
+	from_q = leave_page_state(page);
+	to_q = enter_page_state(page, page_state);
+
+	if(page->queue_node.next != NULL) {
+		if(from_q == to_q)
+			return 0;
+		remove_page_from_queue(from_q, page);
+	}
+
+	if(to_q != NULL)
+		enqueue_page(to_q, page);
+	else
+		put_free_page(page);
+
 	return 0;
 }
 
+// NOTE: expects the cache_ref's lock to be held, returns with it unlocked.
+// Blocks until page is no longer busy. The page may be gone from the cache
+// by then, so the caller has to relock and look it up again.
+void vm_page_wait_busy(vm_page *page, vm_cache_ref *cache_ref)
+{
+	struct page_wait_queue *q = PAGE_WAIT_QUEUE(page);
+	bigtime_t start;
+	bigtime_t waited;
+	bool wait = false;
+
+	int_disable_interrupts();
+	acquire_spinlock(&q->lock);
+	if(page->state == PAGE_STATE_BUSY && q->sem >= 0) {
+		q->waiters++;
+		wait = true;
+	}
+	release_spinlock(&q->lock);
+	int_restore_interrupts();
+
+	mutex_unlock(&cache_ref->lock);
+
+	if(!wait)
+		return;
+
+	start = system_time();
+	sem_acquire(q->sem, 1);
+	waited = system_time() - start;
+
+	atomic_add(&vm_info.busy_page_waits, 1);
+
+	int_disable_interrupts();
+	acquire_spinlock(&q->lock);
+	q->waits++;
+	q->wait_time += waited;
+	if(waited > q->max_wait_time)
+		q->max_wait_time = waited;
+	release_spinlock(&q->lock);
+	int_restore_interrupts();
+}
+
+// wakes up everyone waiting on page's queue, to be called once the page has left the busy state
+void vm_page_wake_busy_waiters(vm_page *page)
+{
+	struct page_wait_queue *q = PAGE_WAIT_QUEUE(page);
+	int count;
+
+	int_disable_interrupts();
+	acquire_spinlock(&q->lock);
+	count = q->waiters;
+	q->waiters = 0;
+	if(count > 0)
+		q->wakeups++;
+	release_spinlock(&q->lock);
+	int_restore_interrupts();
+
+	if(count > 0)
+		sem_release_etc(q->sem, count, SEM_FLAG_NO_RESCHED);
+}
+
 int vm_page_set_state(vm_page *page, int page_state)
 {
+	struct page_cpu_cache *cache;
+	page_queue *from_q;
+	bool was_busy;
 	int err;
 
 	VERIFY_VM_PAGE(page);
 
 	int_disable_interrupts();
-	acquire_spinlock(&page_lock);
 
-	err = vm_page_set_state_nolock(page, page_state);
+	if(page_state != PAGE_STATE_FREE && page_state != PAGE_STATE_CLEAR) {
+		acquire_spinlock(&page_lock);
+		was_busy = (page->state == PAGE_STATE_BUSY);
+		err = vm_page_set_state_nolock(page, page_state);
+		release_spinlock(&page_lock);
+		int_restore_interrupts();
+		if(was_busy && page_state != PAGE_STATE_BUSY)
+			vm_page_wake_busy_waiters(page);
+		return err;
+	}
 
-	release_spinlock(&page_lock);
+	// freed pages go to this cpu's cache
+	cache = &page_cpu_caches[smp_get_current_cpu()];
+	acquire_spinlock(&cache->lock);
+
+	was_busy = (page->state == PAGE_STATE_BUSY);
+	if(page->state == PAGE_STATE_BUSY && page->queue_node.next == NULL) {
+		// nobody else can see it
+		leave_page_state(page);
+	} else {
+		acquire_spinlock(&page_lock);
+		if(page->state == PAGE_STATE_FREE || page->state == PAGE_STATE_CLEAR)
+			panic("vm_page_set_state: vm_page %p is already free\n", page);
+		from_q = leave_page_state(page);
+		if(page->queue_node.next != NULL)
+			remove_page_from_queue(from_q, page);
+		release_spinlock(&page_lock);
+	}
+
+	enter_page_state(page, page_state);
+	page->cpu_cached = 1;
+	enqueue_page((page_state == PAGE_STATE_CLEAR) ? &cache->clear : &cache->free, page);
+	cache->frees++;
+
+	if(cache->free.count + cache->clear.count > PAGE_CACHE_HIGH)
+		drain_page_cache(cache, PAGE_CACHE_BATCH);
+
+	release_spinlock(&cache->lock);
 	int_restore_interrupts();
 
-	return err;
+	if(was_busy)
+		vm_page_wake_busy_waiters(page);
+	if(free_page_waiters > 0)
+		wake_free_page_waiters();
+
+	return 0;
 }
 
 addr_t vm_page_num_pages()
@@ -686,7 +1468,8 @@ addr_t vm_page_num_pages()
 
 addr_t vm_page_num_free_pages()
 {
-	return page_free_queue.count + page_clear_queue.count;
+	// includes the pages in the cpu caches
+	return vm_info.free_pages + vm_info.clear_pages;
 }
 
 void dump_free_page_table(int argc, char **argv)
@@ -695,6 +1478,31 @@ void dump_free_page_table(int argc, char **argv)
 	dprintf("not finished\n");
 }
 
+static void dump_page_waits(int argc, char **argv)
+{
+	int i;
+	int waits = 0;
+	int wakeups = 0;
+	bigtime_t wait_time = 0;
+	bigtime_t max_wait_time = 0;
+
+	dprintf("busy page wait queues:\n");
+	for(i = 0; i < PAGE_WAIT_QUEUES; i++) {
+		struct page_wait_queue *q = &page_wait_queues[i];
+
+		if(q->waits > 0 || q->waiters > 0)
+			dprintf("queue %2d: waiters %d waits %d wakeups %d avg %Ld usecs max %Ld usecs\n", i,
+				q->waiters, q->waits, q->wakeups, q->waits ? q->wait_time / q->waits : 0, q->max_wait_time);
+		waits += q->waits;
+		wakeups += q->wakeups;
+		wait_time += q->wait_time;
+		if(q->max_wait_time > max_wait_time)
+			max_wait_time = q->max_wait_time;
+	}
+	dprintf("total: waits %d wakeups %d wait time %Ld usecs avg %Ld usecs max %Ld usecs\n",
+		waits, wakeups, wait_time, waits ? wait_time / waits : 0, max_wait_time);
+}
+
 void dump_page_stats(int argc, char **argv)
 {
 	unsigned int page_types[9];
@@ -711,6 +1519,34 @@ void dump_page_stats(int argc, char **argv)
 		page_types[PAGE_STATE_ACTIVE], page_types[PAGE_STATE_INACTIVE], page_types[PAGE_STATE_BUSY], page_types[PAGE_STATE_UNUSED]);
 	dprintf("modified: %d\nmodified_temporary %d\nfree: %d\nclear: %d\nwired: %d\n",
 		page_types[PAGE_STATE_MODIFIED], page_types[PAGE_STATE_MODIFIED_TEMPORARY], page_types[PAGE_STATE_FREE], page_types[PAGE_STATE_CLEAR], page_types[PAGE_STATE_WIRED]);
+
+	dprintf("cpu page caches:\n");
+	for(i = 0; i < (addr_t)smp_get_num_cpus(); i++) {
+		dprintf("cpu %ld: free %d clear %d allocs %d frees %d refills %d drains %d\n", i,
+			page_cpu_caches[i].free.count, page_cpu_caches[i].clear.count, page_cpu_caches[i].allocs,
+			page_cpu_caches[i].frees, page_cpu_caches[i].refills, page_cpu_caches[i].drains);
+	}
+}
+
+static void dump_buddy(int argc, char **argv)
+{
+	unsigned int order;
+	unsigned int free_pages = 0;
+	unsigned int smaller = 0;
+	unsigned int count;
+
+	for(order = 0; order < PAGE_BUDDY_ORDERS; order++)
+		free_pages += buddy_queues[order].count << order;
+
+	dprintf("%d pages in the buddy, %d in the clear pool (max %d)\n", free_pages, page_clear_queue.count, clear_pool_max);
+	dprintf("order  run size  blocks   pages  unusable\n");
+	for(order = 0; order < PAGE_BUDDY_ORDERS; order++) {
+		count = buddy_queues[order].count;
+		// the share of the free pages that sit in blocks too small for a run this size
+		dprintf("%5d %8dk %7d %7d %8d%%\n", order, (PAGE_SIZE << order) / 1024, count, count << order,
+			free_pages ? (smaller * 100) / free_pages : 0);
+		smaller += count << order;
+	}
 }
 
 
@@ -864,3 +1700,81 @@ addr_t vm_alloc_from_ka_struct(kernel_args *ka, unsigned int size, int lock)
 
 	return vspot;
 }
+
+// finds size bytes of physical memory starting on an align boundary that nothing
+// has been allocated out of yet. Takes the highest one, out of the way of the
+// ranges vm_alloc_ppage_from_kernel_struct grows a page at a time.
+static addr_t find_phys_run_from_ka_struct(kernel_args *ka, addr_t size, addr_t align)
+{
+	addr_t best = 0;
+	addr_t start;
+	unsigned int i, j;
+
+	for(i = 0; i < ka->num_phys_mem_ranges; i++) {
+		if(ka->phys_mem_range[i].size < size)
+			continue;
+
+		// work down from the top of the range, hopping below anything in the way
+		start = ROUNDOWN(ka->phys_mem_range[i].start + ka->phys_mem_range[i].size - size, align);
+		while(start >= ka->phys_mem_range[i].start && start > best) {
+			for(j = 0; j < ka->num_phys_alloc_ranges; j++) {
+				if(ka->phys_alloc_range[j].start < start + size &&
+					start < ka->phys_alloc_range[j].start + ka->phys_alloc_range[j].size)
+					break;
+			}
+			if(j == ka->num_phys_alloc_ranges) {
+				best = start;
+				break;
+			}
+			if(ka->phys_alloc_range[j].start < size)
+				break;
+			start = ROUNDOWN(ka->phys_alloc_range[j].start - size, align);
+		}
+	}
+
+	return best;
+}
+
+// like vm_alloc_from_ka_struct, but backs it with physically contiguous memory
+// lined up with the virtual address on large page boundaries, and maps it with
+// large pages. Falls back to vm_alloc_from_ka_struct if it can't.
+addr_t vm_alloc_large_from_ka_struct(kernel_args *ka, unsigned int size, int lock)
+{
+	addr_t large_page_size = vm_translation_map_large_page_size();
+	addr_t vspot;
+	addr_t pspot;
+	addr_t offset;
+	unsigned int i;
+
+	size = PAGE_ALIGN(size);
+	if(large_page_size == 0 || (size % large_page_size) != 0 || ka->num_phys_alloc_ranges >= MAX_PHYS_ALLOC_ADDR_RANGE)
+		return vm_alloc_from_ka_struct(ka, size, lock);
+
+	pspot = find_phys_run_from_ka_struct(ka, size, large_page_size);
+	if(pspot == 0)
+		return vm_alloc_from_ka_struct(ka, size, lock);
+
+	// the virtual side only needs to be lined up, waste a bit of address space to do it
+	vspot = vm_alloc_vspace_from_ka_struct(ka, size + large_page_size);
+	if(vspot == 0)
+		panic("error allocating virtual space from ka_struct!\n");
+	vspot = ROUNDUP(vspot, large_page_size);
+
+	// record the physical run, keeping the ranges sorted
+	for(i = ka->num_phys_alloc_ranges; i > 0 && ka->phys_alloc_range[i-1].start > pspot; i--)
+		ka->phys_alloc_range[i] = ka->phys_alloc_range[i-1];
+	ka->phys_alloc_range[i].start = pspot;
+	ka->phys_alloc_range[i].size = size;
+	ka->num_phys_alloc_ranges++;
+
+	for(offset = 0; offset < size; offset += large_page_size) {
+		if(vm_translation_map_quick_map_large(ka, vspot + offset, pspot + offset, lock) >= 0)
+			continue;
+		for(i = 0; i < large_page_size / PAGE_SIZE; i++) {
+			vm_translation_map_quick_map(ka, vspot + offset + i*PAGE_SIZE, pspot + offset + i*PAGE_SIZE, lock,
+				&vm_alloc_ppage_from_kernel_struct);
+		}
+	}
+
+	return vspot;
+}
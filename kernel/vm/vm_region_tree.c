@@ -0,0 +1,313 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/vm.h>
+#include <kernel/vm_priv.h>
+#include <kernel/debug.h>
+#include <newos/errors.h>
+
+// The regions of a virtual map are kept in an AVL tree ordered by base
+// address, next to the map's region_list which stays sorted the same way.
+// Every region records the free space between it and the region before it
+// (or the start of the map), and every node the largest such gap in its
+// subtree, so finding a hole for a new region doesn't have to look at
+// subtrees that can't have one.
+// All of these expect the map's sem to be held, for writing if they change
+// the tree.
+
+static inline int tree_height(vm_region *r)
+{
+	return r ? r->tree_height : 0;
+}
+
+static inline addr_t tree_max_gap(vm_region *r)
+{
+	return r ? r->max_gap : 0;
+}
+
+// recompute a node's height and max gap from its children
+static void tree_update(vm_region *r)
+{
+	r->tree_height = 1 + max(tree_height(r->tree_left), tree_height(r->tree_right));
+	r->max_gap = max(r->gap, max(tree_max_gap(r->tree_left), tree_max_gap(r->tree_right)));
+}
+
+static void tree_update_path(vm_region *r)
+{
+	for(; r != NULL; r = r->tree_parent)
+		tree_update(r);
+}
+
+static vm_region *tree_first(vm_region *r)
+{
+	while(r->tree_left)
+		r = r->tree_left;
+	return r;
+}
+
+static vm_region *tree_last(vm_region *r)
+{
+	while(r->tree_right)
+		r = r->tree_right;
+	return r;
+}
+
+static vm_region *tree_prev(vm_region *r)
+{
+	vm_region *parent;
+
+	if(r->tree_left)
+		return tree_last(r->tree_left);
+
+	for(parent = r->tree_parent; parent != NULL && r == parent->tree_left; parent = parent->tree_parent)
+		r = parent;
+	return parent;
+}
+
+static void tree_replace_child(vm_virtual_map *map, vm_region *parent, vm_region *old, vm_region *new)
+{
+	if(parent == NULL)
+		map->region_tree = new;
+	else if(parent->tree_left == old)
+		parent->tree_left = new;
+	else
+		parent->tree_right = new;
+}
+
+static vm_region *tree_rotate_left(vm_virtual_map *map, vm_region *x)
+{
+	vm_region *y = x->tree_right;
+
+	x->tree_right = y->tree_left;
+	if(y->tree_left)
+		y->tree_left->tree_parent = x;
+	y->tree_parent = x->tree_parent;
+	tree_replace_child(map, x->tree_parent, x, y);
+	y->tree_left = x;
+	x->tree_parent = y;
+
+	tree_update(x);
+	tree_update(y);
+	return y;
+}
+
+static vm_region *tree_rotate_right(vm_virtual_map *map, vm_region *x)
+{
+	vm_region *y = x->tree_left;
+
+	x->tree_left = y->tree_right;
+	if(y->tree_right)
+		y->tree_right->tree_parent = x;
+	y->tree_parent = x->tree_parent;
+	tree_replace_child(map, x->tree_parent, x, y);
+	y->tree_right = x;
+	x->tree_parent = y;
+
+	tree_update(x);
+	tree_update(y);
+	return y;
+}
+
+// returns the root of the subtree r was the root of
+static vm_region *tree_rebalance(vm_virtual_map *map, vm_region *r)
+{
+	int balance;
+
+	tree_update(r);
+	balance = tree_height(r->tree_left) - tree_height(r->tree_right);
+
+	if(balance > 1) {
+		if(tree_height(r->tree_left->tree_left) < tree_height(r->tree_left->tree_right))
+			tree_rotate_left(map, r->tree_left);
+		return tree_rotate_right(map, r);
+	}
+	if(balance < -1) {
+		if(tree_height(r->tree_right->tree_right) < tree_height(r->tree_right->tree_left))
+			tree_rotate_right(map, r->tree_right);
+		return tree_rotate_left(map, r);
+	}
+	return r;
+}
+
+static void tree_retrace(vm_virtual_map *map, vm_region *r)
+{
+	while(r != NULL) {
+		r = tree_rebalance(map, r);
+		r = r->tree_parent;
+	}
+}
+
+static inline addr_t region_end(vm_virtual_map *map, vm_region *r)
+{
+	return r ? r->base + r->size : map->base;
+}
+
+// returns the region with the highest base at or below address
+vm_region *vm_region_tree_floor(vm_virtual_map *map, addr_t address)
+{
+	vm_region *r = map->region_tree;
+	vm_region *best = NULL;
+
+	while(r != NULL) {
+		if(r->base <= address) {
+			best = r;
+			r = r->tree_right;
+		} else {
+			r = r->tree_left;
+		}
+	}
+	return best;
+}
+
+vm_region *vm_region_tree_lookup(vm_virtual_map *map, addr_t address)
+{
+	vm_region *r = vm_region_tree_floor(map, address);
+
+	if(r != NULL && address - r->base < r->size)
+		return r;
+	return NULL;
+}
+
+// links region in after prev, which has to be the region right below it or NULL if there is none
+void vm_region_tree_insert(vm_virtual_map *map, vm_region *region, vm_region *prev)
+{
+	vm_region *next;
+	vm_region *parent;
+
+	// the sorted list
+	if(prev) {
+		region->aspace_next = prev->aspace_next;
+		prev->aspace_next = region;
+	} else {
+		region->aspace_next = map->region_list;
+		map->region_list = region;
+	}
+	next = region->aspace_next;
+
+	// the tree, as the in order successor of prev
+	region->tree_left = NULL;
+	region->tree_right = NULL;
+	if(prev == NULL) {
+		parent = map->region_tree ? tree_first(map->region_tree) : NULL;
+		if(parent)
+			parent->tree_left = region;
+		else
+			map->region_tree = region;
+	} else if(prev->tree_right == NULL) {
+		parent = prev;
+		parent->tree_right = region;
+	} else {
+		parent = tree_first(prev->tree_right);
+		parent->tree_left = region;
+	}
+	region->tree_parent = parent;
+
+	region->gap = region->base - region_end(map, prev);
+	tree_update(region);
+	tree_retrace(map, parent);
+
+	// the hole below the next region just got smaller
+	if(next) {
+		next->gap = next->base - (region->base + region->size);
+		tree_update_path(next);
+	}
+}
+
+void vm_region_tree_remove(vm_virtual_map *map, vm_region *region)
+{
+	vm_region *prev = tree_prev(region);
+	vm_region *next = region->aspace_next;
+	vm_region *parent = region->tree_parent;
+	vm_region *child;
+	vm_region *y;
+
+	if(prev)
+		prev->aspace_next = next;
+	else
+		map->region_list = next;
+	region->aspace_next = NULL;
+
+	if(region->tree_left && region->tree_right) {
+		// pull up the successor, it has no left child
+		y = next;
+		ASSERT(y == tree_first(region->tree_right));
+		if(y->tree_parent != region) {
+			vm_region *start = y->tree_parent;
+
+			start->tree_left = y->tree_right;
+			if(y->tree_right)
+				y->tree_right->tree_parent = start;
+			y->tree_right = region->tree_right;
+			region->tree_right->tree_parent = y;
+			parent = start;
+		} else {
+			parent = y;
+		}
+		y->tree_left = region->tree_left;
+		region->tree_left->tree_parent = y;
+		y->tree_parent = region->tree_parent;
+		tree_replace_child(map, region->tree_parent, region, y);
+	} else {
+		child = region->tree_left ? region->tree_left : region->tree_right;
+		if(child)
+			child->tree_parent = region->tree_parent;
+		tree_replace_child(map, region->tree_parent, region, child);
+	}
+	tree_retrace(map, parent);
+
+	region->tree_parent = region->tree_left = region->tree_right = NULL;
+
+	// the hole below the next region now reaches down to prev
+	if(next) {
+		next->gap = next->base - region_end(map, prev);
+		tree_update_path(next);
+	}
+}
+
+// finds the lowest hole in r's subtree that has room for size bytes at or above start
+static bool tree_find_gap(vm_region *r, addr_t start, addr_t size, addr_t *_base)
+{
+	addr_t hole_start;
+
+	if(r == NULL || r->max_gap < size)
+		return false;
+
+	// the holes in the left subtree all end below r, so they're only worth
+	// looking at if r starts above start
+	if(r->base > start && tree_find_gap(r->tree_left, start, size, _base))
+		return true;
+
+	if(r->gap >= size && r->base > start) {
+		hole_start = max(r->base - r->gap, start);
+		if(r->base - hole_start >= size) {
+			*_base = hole_start;
+			return true;
+		}
+	}
+
+	return tree_find_gap(r->tree_right, start, size, _base);
+}
+
+// returns the lowest address at or above start where size bytes fit in the map
+int vm_region_tree_find_gap(vm_virtual_map *map, addr_t start, addr_t size, addr_t *_base)
+{
+	addr_t map_last = map->base + (map->size - 1);
+	addr_t hole_start;
+
+	if(tree_find_gap(map->region_tree, start, size, _base))
+		return NO_ERROR;
+
+	// see if it fits between the last region and the end of the map
+	hole_start = map->region_tree ? region_end(map, tree_last(map->region_tree)) : map->base;
+	if(map->region_tree && hole_start == 0)
+		return ERR_VM_NO_REGION_SLOT; // the last region runs to the top of the address space
+	hole_start = max(hole_start, start);
+	if(hole_start <= map_last && map_last - hole_start >= size - 1) {
+		*_base = hole_start;
+		return NO_ERROR;
+	}
+
+	return ERR_VM_NO_REGION_SLOT;
+}
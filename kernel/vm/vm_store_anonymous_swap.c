@@ -0,0 +1,351 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/vm.h>
+#include <kernel/vm_priv.h>
+#include <kernel/vm_swap.h>
+#include <kernel/heap.h>
+#include <kernel/debug.h>
+#include <kernel/lock.h>
+#include <kernel/khash.h>
+#include <kernel/list.h>
+#include <kernel/vm_store_anonymous_swap.h>
+#include <newos/errors.h>
+#include <string.h>
+
+// Anonymous memory that can be paged out. Until the pageout daemon writes
+// one of its pages the store is just like the noswap one, after that the
+// swap slot each page went to is kept in a block of slots covering
+// SWAP_BLOCK_PAGES pages of the store. The blocks of all stores live in one
+// hash table keyed by store and offset, so a store that never gets paged out
+// costs nothing extra.
+
+#define STORE_DATA(x) ((struct swap_store_data *)(x->data))
+
+#define SWAP_BLOCK_PAGES 32
+#define SWAP_BLOCK_SIZE (SWAP_BLOCK_PAGES * PAGE_SIZE)
+#define SWAP_BLOCK_TABLE_SIZE 256
+
+struct swap_store_data {
+	struct list_node blocks;
+	int swapped_pages;
+};
+
+struct swap_block {
+	struct swap_block *hash_next;
+	struct list_node store_node;
+	vm_store *store;
+	off_t offset;
+	int used;
+	swap_slot slots[SWAP_BLOCK_PAGES];
+};
+
+struct swap_block_key {
+	vm_store *store;
+	off_t offset;
+};
+
+static void *swap_block_table;
+static mutex swap_block_lock;
+
+static int swap_block_compare(void *_b, const void *_key)
+{
+	struct swap_block *b = _b;
+	const struct swap_block_key *key = _key;
+
+	if(b->store == key->store && b->offset == key->offset)
+		return 0;
+	else
+		return -1;
+}
+
+static unsigned int swap_block_hash(void *_b, const void *_key, unsigned int range)
+{
+	struct swap_block *b = _b;
+	const struct swap_block_key *key = _key;
+
+	if(b)
+		return ((unsigned int)(b->offset / SWAP_BLOCK_SIZE) ^ (unsigned int)((addr_t)b->store >> 4)) % range;
+	else
+		return ((unsigned int)(key->offset / SWAP_BLOCK_SIZE) ^ (unsigned int)((addr_t)key->store >> 4)) % range;
+}
+
+// NOTE: expects swap_block_lock to be held
+static struct swap_block *lookup_block(vm_store *store, off_t offset, bool create)
+{
+	struct swap_block_key key;
+	struct swap_block *b;
+	int i;
+
+	key.store = store;
+	key.offset = ROUNDOWN(offset, SWAP_BLOCK_SIZE);
+
+	b = hash_lookup(swap_block_table, &key);
+	if(b != NULL || !create)
+		return b;
+
+	b = kmalloc(sizeof(struct swap_block));
+	if(b == NULL)
+		return NULL;
+
+	b->store = store;
+	b->offset = key.offset;
+	b->used = 0;
+	for(i = 0; i < SWAP_BLOCK_PAGES; i++)
+		b->slots[i] = SWAP_SLOT_NONE;
+	list_add_head(&STORE_DATA(store)->blocks, &b->store_node);
+	hash_insert(swap_block_table, b);
+
+	return b;
+}
+
+// NOTE: expects swap_block_lock to be held
+static swap_slot lookup_slot(vm_store *store, off_t offset)
+{
+	struct swap_block *b;
+
+	if(STORE_DATA(store)->swapped_pages == 0)
+		return SWAP_SLOT_NONE;
+
+	b = lookup_block(store, offset, false);
+	if(b == NULL)
+		return SWAP_SLOT_NONE;
+	return b->slots[(offset - b->offset) / PAGE_SIZE];
+}
+
+// NOTE: expects swap_block_lock to be held
+static void free_block(vm_store *store, struct swap_block *b)
+{
+	list_delete(&b->store_node);
+	hash_remove(swap_block_table, b);
+	kfree(b);
+}
+
+// gives the page's slot back, if it has one
+// NOTE: expects swap_block_lock to be held
+static void free_slot(vm_store *store, off_t offset)
+{
+	struct swap_block *b;
+	int index;
+
+	if(STORE_DATA(store)->swapped_pages == 0)
+		return;
+
+	b = lookup_block(store, offset, false);
+	if(b == NULL)
+		return;
+
+	index = (offset - b->offset) / PAGE_SIZE;
+	if(b->slots[index] == SWAP_SLOT_NONE)
+		return;
+
+	vm_swap_free(b->slots[index], 1);
+	b->slots[index] = SWAP_SLOT_NONE;
+	STORE_DATA(store)->swapped_pages--;
+	if(--b->used == 0)
+		free_block(store, b);
+}
+
+// NOTE: expects swap_block_lock to be held
+static int set_slot(vm_store *store, off_t offset, swap_slot slot)
+{
+	struct swap_block *b;
+	int index;
+
+	b = lookup_block(store, offset, true);
+	if(b == NULL)
+		return ERR_NO_MEMORY;
+
+	index = (offset - b->offset) / PAGE_SIZE;
+	ASSERT(b->slots[index] == SWAP_SLOT_NONE);
+	b->slots[index] = slot;
+	b->used++;
+	STORE_DATA(store)->swapped_pages++;
+
+	return NO_ERROR;
+}
+
+static void anonymous_swap_destroy(struct vm_store *store)
+{
+	struct swap_block *b;
+	int i;
+
+	if(store) {
+		VERIFY_VM_STORE(store);
+
+		mutex_lock(&swap_block_lock);
+		while((b = list_remove_head_type(&STORE_DATA(store)->blocks, struct swap_block, store_node)) != NULL) {
+			for(i = 0; i < SWAP_BLOCK_PAGES; i++) {
+				if(b->slots[i] != SWAP_SLOT_NONE)
+					vm_swap_free(b->slots[i], 1);
+			}
+			hash_remove(swap_block_table, b);
+			kfree(b);
+		}
+		mutex_unlock(&swap_block_lock);
+
+		kfree(store);
+	}
+}
+
+static off_t anonymous_swap_commit(struct vm_store *store, off_t size)
+{
+	VERIFY_VM_STORE(store);
+	return 0; // the swap space was added to max_commit, so commit like the noswap store does
+}
+
+static int anonymous_swap_has_page(struct vm_store *store, off_t offset)
+{
+	swap_slot slot;
+
+	VERIFY_VM_STORE(store);
+
+	if(STORE_DATA(store)->swapped_pages == 0)
+		return 0;
+
+	mutex_lock(&swap_block_lock);
+	slot = lookup_slot(store, offset);
+	mutex_unlock(&swap_block_lock);
+
+	return slot != SWAP_SLOT_NONE;
+}
+
+// reads the pages back in, runs of them that went out to consecutive slots
+// in one go. The slots are kept, so if the pages aren't touched again they
+// can be dropped without writing them out a second time.
+static ssize_t anonymous_swap_read(struct vm_store *store, off_t offset, iovecs *vecs)
+{
+	swap_slot slots[VM_READ_AHEAD_MAX];
+	ssize_t err;
+	unsigned int i, run;
+
+	VERIFY_VM_STORE(store);
+
+	if(vecs->num > VM_READ_AHEAD_MAX)
+		panic("anonymous_swap_read: too many vecs %ld\n", (long)vecs->num);
+
+	mutex_lock(&swap_block_lock);
+	for(i = 0; i < vecs->num; i++)
+		slots[i] = lookup_slot(store, offset + i * PAGE_SIZE);
+	mutex_unlock(&swap_block_lock);
+
+	for(i = 0; i < vecs->num; i += run) {
+		if(slots[i] == SWAP_SLOT_NONE) {
+			// never paged out, so it's still all zeros
+			memset(vecs->vec[i].start, 0, PAGE_SIZE);
+			run = 1;
+			continue;
+		}
+
+		for(run = 1; i + run < vecs->num && slots[i + run] == slots[i] + (swap_slot)run; run++)
+			;
+		err = vm_swap_read(slots[i], vecs, i, run);
+		if(err < 0)
+			return err;
+	}
+
+	return vecs->total_len;
+}
+
+// writes the pages to newly allocated slots, as few runs of them as the swap
+// space allows. Whatever slots the pages had before are given back first.
+// The pages are busy, so nobody else is reading or writing these offsets.
+static ssize_t anonymous_swap_write(struct vm_store *store, off_t offset, iovecs *vecs)
+{
+	ssize_t err = NO_ERROR;
+	swap_slot slot;
+	unsigned int i, j;
+	int count;
+
+	VERIFY_VM_STORE(store);
+
+	mutex_lock(&swap_block_lock);
+	for(i = 0; i < vecs->num; i++)
+		free_slot(store, offset + i * PAGE_SIZE);
+	mutex_unlock(&swap_block_lock);
+
+	for(i = 0; i < vecs->num; i += count) {
+		count = vm_swap_alloc(vecs->num - i, &slot);
+		if(count < 0)
+			return count;
+
+		err = vm_swap_write(slot, vecs, i, count);
+		if(err < 0) {
+			vm_swap_free(slot, count);
+			return err;
+		}
+
+		mutex_lock(&swap_block_lock);
+		for(j = 0; j < (unsigned int)count; j++) {
+			err = set_slot(store, offset + (i + j) * PAGE_SIZE, slot + j);
+			if(err < 0) {
+				vm_swap_free(slot + j, count - j);
+				break;
+			}
+		}
+		mutex_unlock(&swap_block_lock);
+		if(err < 0)
+			return err;
+	}
+
+	return vecs->total_len;
+}
+
+static vm_store_ops anonymous_swap_ops = {
+	&anonymous_swap_destroy,
+	&anonymous_swap_commit,
+	&anonymous_swap_has_page,
+	&anonymous_swap_read,
+	&anonymous_swap_write,
+	NULL, // fault() is unused
+	NULL,
+	NULL
+};
+
+vm_store *vm_store_create_anonymous_swap(void)
+{
+	vm_store *store;
+	struct swap_store_data *d;
+
+	store = kmalloc(sizeof(vm_store) + sizeof(struct swap_store_data));
+	if(store == NULL)
+		return NULL;
+
+	store->magic = VM_STORE_MAGIC;
+	store->ops = &anonymous_swap_ops;
+	store->cache = NULL;
+	store->data = (void *)((addr_t)store + sizeof(vm_store));
+	store->committed_size = 0;
+
+	d = STORE_DATA(store);
+	list_initialize(&d->blocks);
+	d->swapped_pages = 0;
+
+	return store;
+}
+
+// how many pages of store are out in swap, 0 for any other kind of store
+int vm_store_anonymous_swap_swapped_pages(vm_store *store)
+{
+	VERIFY_VM_STORE(store);
+
+	if(store->ops != &anonymous_swap_ops)
+		return 0;
+	return STORE_DATA(store)->swapped_pages;
+}
+
+int vm_store_anonymous_swap_init(void)
+{
+	struct swap_block b;
+
+	swap_block_table = hash_init(SWAP_BLOCK_TABLE_SIZE, (addr_t)&b.hash_next - (addr_t)&b,
+		&swap_block_compare, &swap_block_hash);
+	if(swap_block_table == NULL)
+		panic("vm_store_anonymous_swap_init: error creating swap block table\n");
+
+	mutex_init(&swap_block_lock, "swap_block_lock");
+
+	return 0;
+}
@@ -52,6 +52,9 @@ static ssize_t device_write(struct vm_store *store, off_t offset, iovecs *vecs)
 }
 
 // this fault handler should take over the page fault routine and map the page in
+// The memory behind a device store is physically contiguous, so where a region
+// lines up with it on large page boundaries the whole large page around the
+// fault gets mapped at once.
 //
 // setup: the cache that this store is part of has a ref being held and will be
 // released after this handler is done
@@ -59,7 +62,11 @@ static int device_fault(struct vm_store *store, struct vm_address_space *aspace,
 {
 	struct device_store_data *d = (struct device_store_data *)store->data;
 	vm_cache_ref *cache_ref = store->cache->ref;
+	vm_translation_map *map = &aspace->translation_map;
+	addr_t large_page_size = vm_translation_map_large_page_size();
 	vm_region *region;
+	addr_t va, pa;
+	addr_t large_va;
 
 	VERIFY_VM_STORE(store);
 	VERIFY_VM_CACHE(store->cache);
@@ -70,24 +77,35 @@ static int device_fault(struct vm_store *store, struct vm_address_space *aspace,
 
 	// figure out which page needs to be mapped where
 	mutex_lock(&cache_ref->lock);
-	(*aspace->translation_map.ops->lock)(&aspace->translation_map);
+	(*map->ops->lock)(map);
 
-	// cycle through all of the regions that map this cache and map the page in
+	// cycle through all of the regions of this address space that map this cache and map the page in,
+	// the ones in other address spaces get theirs when they fault on it
 	list_for_every_entry(&cache_ref->region_list_head, region, vm_region, cache_node) {
 		VERIFY_VM_REGION(region);
 
+		if(region->aspace != aspace)
+			continue;
+
 		// make sure this page in the cache that was faulted on is covered in this region
 		if(offset >= region->cache_offset && (offset - region->cache_offset) < region->size) {
-//			dprintf("device_fault: mapping paddr 0x%x to vaddr 0x%x\n",
-//				(addr_t)(d->base_addr + offset),
-//				(addr_t)(region->base + (offset - region->cache_offset)));
-			(*aspace->translation_map.ops->map)(&aspace->translation_map,
-				region->base + (offset - region->cache_offset),
-				d->base_addr + offset, region->lock);
+			va = region->base + (offset - region->cache_offset);
+			pa = d->base_addr + offset;
+//			dprintf("device_fault: mapping paddr 0x%x to vaddr 0x%x\n", pa, va);
+
+			if(large_page_size != 0 && (va % large_page_size) == (pa % large_page_size)) {
+				large_va = ROUNDOWN(va, large_page_size);
+				if(region->size >= large_page_size && large_va >= region->base
+					&& large_va - region->base <= region->size - large_page_size
+					&& (*map->ops->map_large)(map, large_va, ROUNDOWN(pa, large_page_size), region->lock) >= 0)
+					continue;
+			}
+
+			(*map->ops->map)(map, va, pa, region->lock);
 		}
 	}
 
-	(*aspace->translation_map.ops->unlock)(&aspace->translation_map);
+	(*map->ops->unlock)(map);
 	mutex_unlock(&cache_ref->lock);
 
 //	dprintf("device_fault: done\n");
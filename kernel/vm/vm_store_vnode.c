@@ -86,10 +86,8 @@ vm_store *vm_store_create_vnode(void *vnode)
 	struct vnode_store_data *d;
 
 	store = kmalloc(sizeof(vm_store) + sizeof(struct vnode_store_data));
-	if(store == NULL) {
-		vfs_put_vnode_ptr(vnode);
+	if(store == NULL)
 		return NULL;
-	}
 
 	store->magic = VM_STORE_MAGIC;
 	store->ops = &vnode_ops;
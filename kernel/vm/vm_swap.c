@@ -0,0 +1,390 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/vm.h>
+#include <kernel/vm_priv.h>
+#include <kernel/vm_swap.h>
+#include <kernel/heap.h>
+#include <kernel/debug.h>
+#include <kernel/lock.h>
+#include <kernel/vfs.h>
+#include <newos/errors.h>
+#include <newos/drivers.h>
+#include <fcntl.h>
+#include <string.h>
+
+// Slots are tracked with a bitmap, a set bit is a slot in use. Allocation is
+// next fit from a rotor, looking for a run of free slots as long as the
+// caller asked for, so pages written out together land next to each other
+// and can be read back in one go.
+
+// keeps max_commit, an int, from overflowing
+#define SWAP_MAX_SLOTS ((1024*1024*1024) / PAGE_SIZE)
+
+// the most pages moved in one I/O, runs are never longer than this anyway
+#define SWAP_IO_MAX_PAGES max(VM_READ_AHEAD_MAX, PAGEOUT_CLUSTER)
+
+static struct swap_space {
+	int fd;
+	void *vnode;
+	char path[SYS_MAX_PATH_LEN];
+	// devices that can't page get a whole run copied through here instead
+	char *bounce;
+	mutex bounce_lock;
+	unsigned int num_slots;
+	unsigned int free_slots;
+	unsigned int next_slot;
+	uint32 *bitmap;
+
+	// stats
+	int allocs;
+	int short_allocs;
+	int failed_allocs;
+	int frees;
+	int reads;
+	int writes;
+	int read_errors;
+	int write_errors;
+} swap;
+
+static mutex swap_lock;
+static bool swap_enabled;
+
+#define SLOT_USED(i) (swap.bitmap[(i) / 32] & (1 << ((i) % 32)))
+
+static void dump_swap(int argc, char **argv)
+{
+	if(!swap_enabled) {
+		dprintf("no swap space\n");
+		return;
+	}
+
+	dprintf("swap space '%s', fd %d\n", swap.path, swap.fd);
+	dprintf("\t%d slots, %d free, next slot %d\n", swap.num_slots, swap.free_slots, swap.next_slot);
+	dprintf("\tallocs %d (short %d failed %d) frees %d\n", swap.allocs, swap.short_allocs, swap.failed_allocs, swap.frees);
+	dprintf("\treads %d (errors %d) writes %d (errors %d)\n", swap.reads, swap.read_errors, swap.writes, swap.write_errors);
+}
+
+int vm_swap_init(void)
+{
+	swap.fd = -1;
+	swap_enabled = false;
+	mutex_init(&swap_lock, "swap_lock");
+	mutex_init(&swap.bounce_lock, "swap_bounce_lock");
+
+	dbg_add_command(&dump_swap, "swap", "Dump swap space usage");
+
+	return 0;
+}
+
+bool vm_swap_enabled(void)
+{
+	return swap_enabled;
+}
+
+int vm_swap_add(const char *path)
+{
+	struct file_stat stat;
+	devfs_partition_info info;
+	off_t size;
+	unsigned int num_slots;
+	uint32 *bitmap;
+	void *vnode = NULL;
+	char *bounce = NULL;
+	int fd;
+	int err;
+
+	// regular files are read and written through the file cache, which would
+	// need free pages to page out, so only devices will do
+	err = sys_rstat(path, &stat);
+	if(err < 0)
+		return err;
+	if(stat.type != STREAM_TYPE_DEVICE)
+		return ERR_VFS_WRONG_STREAM_TYPE;
+
+	fd = sys_open(path, O_RDWR);
+	if(fd < 0)
+		return fd;
+
+	err = vfs_get_vnode_from_fd(fd, true, &vnode);
+	if(err < 0)
+		goto err;
+	if(vfs_canpage(vnode) <= 0) {
+		bounce = (char *)kmalloc(SWAP_IO_MAX_PAGES * PAGE_SIZE);
+		if(bounce == NULL) {
+			err = ERR_NO_MEMORY;
+			goto err;
+		}
+	}
+
+	// devices may not report a size, but partitions can tell
+	size = stat.size;
+	if(size == 0 && sys_ioctl(fd, IOCTL_DEVFS_GET_PARTITION_INFO, &info, sizeof(info)) >= 0)
+		size = info.size;
+
+	num_slots = min(size / PAGE_SIZE, SWAP_MAX_SLOTS);
+	if(num_slots == 0) {
+		err = ERR_INVALID_ARGS;
+		goto err;
+	}
+
+	bitmap = (uint32 *)kmalloc(ROUNDUP(num_slots, 32) / 8);
+	if(bitmap == NULL) {
+		err = ERR_NO_MEMORY;
+		goto err;
+	}
+	memset(bitmap, 0, ROUNDUP(num_slots, 32) / 8);
+
+	mutex_lock(&swap_lock);
+	if(swap_enabled) {
+		mutex_unlock(&swap_lock);
+		kfree(bitmap);
+		err = ERR_NOT_ALLOWED;
+		goto err;
+	}
+
+	swap.fd = fd;
+	swap.vnode = vnode;
+	swap.bounce = bounce;
+	strlcpy(swap.path, path, sizeof(swap.path));
+	swap.num_slots = num_slots;
+	swap.free_slots = num_slots;
+	swap.next_slot = 0;
+	swap.bitmap = bitmap;
+	swap_enabled = true;
+
+	vm_info.swap_pages = num_slots;
+	vm_info.swap_free_pages = num_slots;
+	mutex_unlock(&swap_lock);
+
+	// anonymous memory can now be committed against the swap space too
+	vm_increase_max_commit(num_slots * PAGE_SIZE);
+
+	dprintf("vm_swap_add: added %d pages of swap space on '%s'\n", num_slots, path);
+
+	return NO_ERROR;
+
+err:
+	if(bounce != NULL)
+		kfree(bounce);
+	if(vnode != NULL)
+		vfs_put_vnode_ptr(vnode);
+	sys_close(fd);
+	return err;
+}
+
+// NOTE: expects swap_lock to be held
+static void mark_slots(unsigned int slot, int count, bool used)
+{
+	unsigned int i;
+
+	for(i = slot; i < slot + count; i++) {
+		if(used)
+			swap.bitmap[i / 32] |= (1 << (i % 32));
+		else
+			swap.bitmap[i / 32] &= ~(1 << (i % 32));
+	}
+}
+
+int vm_swap_alloc(int count, swap_slot *slot)
+{
+	unsigned int best_start = 0;
+	unsigned int best_len = 0;
+	unsigned int run_start = 0;
+	unsigned int run_len = 0;
+	unsigned int scanned;
+	unsigned int i;
+
+	if(!swap_enabled)
+		return ERR_NO_MEMORY;
+
+	mutex_lock(&swap_lock);
+
+	if(swap.free_slots == 0) {
+		swap.failed_allocs++;
+		mutex_unlock(&swap_lock);
+		return ERR_NO_MEMORY;
+	}
+
+	// runs don't wrap around the end of the swap space, starting over at 0 breaks them
+	i = swap.next_slot;
+	for(scanned = 0; scanned < swap.num_slots; scanned++, i++) {
+		if(i >= swap.num_slots) {
+			i = 0;
+			run_len = 0;
+		}
+
+		// skip over full words quickly
+		if((i % 32) == 0 && swap.bitmap[i / 32] == 0xffffffff && scanned + 32 <= swap.num_slots) {
+			run_len = 0;
+			scanned += 31;
+			i += 31;
+			continue;
+		}
+
+		if(SLOT_USED(i)) {
+			run_len = 0;
+			continue;
+		}
+
+		if(run_len == 0)
+			run_start = i;
+		run_len++;
+		if(run_len > best_len) {
+			best_start = run_start;
+			best_len = run_len;
+			if(best_len == (unsigned int)count)
+				break;
+		}
+	}
+
+	if(best_len == 0) {
+		swap.failed_allocs++;
+		mutex_unlock(&swap_lock);
+		return ERR_NO_MEMORY;
+	}
+
+	mark_slots(best_start, best_len, true);
+	swap.free_slots -= best_len;
+	swap.next_slot = best_start + best_len;
+	swap.allocs++;
+	if(best_len < (unsigned int)count)
+		swap.short_allocs++;
+	vm_info.swap_free_pages = swap.free_slots;
+
+	mutex_unlock(&swap_lock);
+
+	*slot = best_start;
+	return best_len;
+}
+
+void vm_swap_free(swap_slot slot, int count)
+{
+	unsigned int i;
+
+	mutex_lock(&swap_lock);
+
+	if(slot < 0 || (unsigned int)slot + count > swap.num_slots)
+		panic("vm_swap_free: slots %d - %d out of range\n", slot, slot + count - 1);
+	for(i = slot; i < (unsigned int)slot + count; i++) {
+		if(!SLOT_USED(i))
+			panic("vm_swap_free: slot %d is already free\n", i);
+	}
+
+	mark_slots(slot, count, false);
+	swap.free_slots += count;
+	swap.frees++;
+	vm_info.swap_free_pages = swap.free_slots;
+
+	mutex_unlock(&swap_lock);
+}
+
+// moves up to SWAP_IO_MAX_PAGES pages in vecs->vec[first ..] to or from
+// consecutive slots in one I/O, straight to the pages if the device can page
+static ssize_t swap_io_run(off_t pos, iovecs *vecs, int first, int count, bool write)
+{
+	IOVECS(run_vecs, SWAP_IO_MAX_PAGES);
+	ssize_t len = count * PAGE_SIZE;
+	ssize_t err;
+	int i;
+
+	if(swap.bounce == NULL) {
+		for(i = 0; i < count; i++) {
+			run_vecs->vec[i].start = vecs->vec[first + i].start;
+			run_vecs->vec[i].len = PAGE_SIZE;
+		}
+		run_vecs->num = count;
+		run_vecs->total_len = len;
+
+		if(write)
+			err = vfs_writepage(swap.vnode, run_vecs, pos);
+		else
+			err = vfs_readpage(swap.vnode, run_vecs, pos);
+	} else {
+		mutex_lock(&swap.bounce_lock);
+		if(write) {
+			for(i = 0; i < count; i++)
+				memcpy(swap.bounce + i * PAGE_SIZE, vecs->vec[first + i].start, PAGE_SIZE);
+			err = sys_write(swap.fd, swap.bounce, pos, len);
+		} else {
+			err = sys_read(swap.fd, swap.bounce, pos, len);
+			if(err == len) {
+				for(i = 0; i < count; i++)
+					memcpy(vecs->vec[first + i].start, swap.bounce + i * PAGE_SIZE, PAGE_SIZE);
+			}
+		}
+		mutex_unlock(&swap.bounce_lock);
+	}
+
+	if(err < 0)
+		return err;
+	if(err != len)
+		return ERR_IO_ERROR;
+	return len;
+}
+
+// moves the pages in vecs->vec[first .. first + count - 1] to or from consecutive slots
+static ssize_t swap_io(swap_slot slot, iovecs *vecs, int first, int count, bool write)
+{
+	off_t pos = (off_t)slot * PAGE_SIZE;
+	ssize_t total = 0;
+	ssize_t err;
+	int run;
+
+	for(; count > 0; first += run, count -= run) {
+		run = min(count, SWAP_IO_MAX_PAGES);
+		err = swap_io_run(pos, vecs, first, run, write);
+		if(err < 0)
+			return err;
+		pos += err;
+		total += err;
+	}
+
+	return total;
+}
+
+ssize_t vm_swap_read(swap_slot slot, iovecs *vecs, int first, int count)
+{
+	ssize_t err;
+
+	err = swap_io(slot, vecs, first, count, false);
+	atomic_add(&swap.reads, 1);
+	if(err < 0) {
+		atomic_add(&swap.read_errors, 1);
+	} else {
+		atomic_add(&vm_info.swap_ins, count);
+	}
+	return err;
+}
+
+ssize_t vm_swap_write(swap_slot slot, iovecs *vecs, int first, int count)
+{
+	ssize_t err;
+
+	err = swap_io(slot, vecs, first, count, true);
+	atomic_add(&swap.writes, 1);
+	if(err < 0) {
+		atomic_add(&swap.write_errors, 1);
+	} else {
+		atomic_add(&vm_info.swap_outs, count);
+	}
+	return err;
+}
+
+int user_vm_swapon(const char *upath)
+{
+	char path[SYS_MAX_PATH_LEN+1];
+	int rc;
+
+	if(is_kernel_address(upath))
+		return ERR_VM_BAD_USER_MEMORY;
+
+	rc = user_strncpy(path, upath, SYS_MAX_PATH_LEN);
+	if(rc < 0)
+		return rc;
+	path[SYS_MAX_PATH_LEN] = 0;
+
+	return vm_swap_add(path);
+}
@@ -0,0 +1,768 @@
+/*
+** Copyright 2001-2004, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/wait_set.h>
+#include <kernel/sem.h>
+#include <kernel/port.h>
+#include <kernel/vfs.h>
+#include <kernel/int.h>
+#include <kernel/smp.h>
+#include <kernel/lock.h>
+#include <kernel/heap.h>
+#include <kernel/khash.h>
+#include <kernel/debug.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+#include <kernel/vm.h>
+#include <newos/errors.h>
+
+#include <string.h>
+#include <stdlib.h>
+
+#define MAX_SET_WATCHES 4096
+#define MAX_WAIT_EVENTS 256
+
+struct wait_set;
+
+struct wait_watch {
+	struct wait_watch *hash_next;
+	struct list_node set_node;		// on the set's list of all its watches
+	struct list_node object_node;	// on the object's list, if attached
+	struct list_node ready_node;	// on the set's ready list, if queued
+	struct wait_set *set;
+	struct wait_object *object;
+	int type;
+	int id;
+	void *descriptor;	// fd watches hold a reference to the file descriptor
+	int events;
+	bool queued;
+	void *cookie;
+};
+
+struct wait_set {
+	struct wait_set *next;
+	wait_set_id id;
+	proc_id owner;
+	int ref_count;
+	bool deleted;
+
+	// protects the watches, held while they're polled
+	mutex lock;
+	void *watch_table;
+	struct list_node watch_list;
+	int num_watches;
+
+	// protected by wait_lock
+	struct list_node ready_list;
+	int waiters;
+	bool wakeup_pending;
+	sem_id wait_sem;
+};
+
+struct watch_key {
+	int type;
+	int id;
+};
+
+// protects every object's list of watches and every set's ready list
+static spinlock_t wait_lock = 0;
+
+#define GRAB_WAIT_LOCK() acquire_spinlock(&wait_lock)
+#define RELEASE_WAIT_LOCK() release_spinlock(&wait_lock)
+
+static void *set_table;
+static mutex set_table_lock;
+static wait_set_id next_set_id;
+
+static int set_compare_func(void *_s, const void *_key)
+{
+	struct wait_set *s = _s;
+	const wait_set_id *id = _key;
+
+	if(s->id == *id)
+		return 0;
+	else
+		return 1;
+}
+
+static unsigned int set_hash_func(void *_s, const void *_key, unsigned int range)
+{
+	struct wait_set *s = _s;
+	const wait_set_id *id = _key;
+
+	if(s)
+		return s->id % range;
+	else
+		return *id % range;
+}
+
+static int watch_compare_func(void *_w, const void *_key)
+{
+	struct wait_watch *w = _w;
+	const struct watch_key *key = _key;
+
+	if(w->type == key->type && w->id == key->id)
+		return 0;
+	else
+		return 1;
+}
+
+static unsigned int watch_hash_func(void *_w, const void *_key, unsigned int range)
+{
+	struct wait_watch *w = _w;
+	const struct watch_key *key = _key;
+
+	if(w)
+		return ((unsigned int)w->id * 3 + w->type) % range;
+	else
+		return ((unsigned int)key->id * 3 + key->type) % range;
+}
+
+static void dump_set_list(int argc, char **argv)
+{
+	struct hash_iterator i;
+	struct wait_set *set;
+
+	hash_open(set_table, &i);
+	while((set = hash_next(set_table, &i)) != NULL) {
+		dprintf("%p\tid: 0x%x\towner: 0x%x\twatches: %d\twaiters: %d\n",
+			set, set->id, set->owner, set->num_watches, set->waiters);
+	}
+	hash_close(set_table, &i, false);
+}
+
+static void dump_set_info(int argc, char **argv)
+{
+	struct wait_set *set;
+	struct wait_watch *w;
+	wait_set_id id;
+
+	if(argc < 2) {
+		dprintf("wait_set: not enough arguments\n");
+		return;
+	}
+
+	id = atoul(argv[1]);
+	set = hash_lookup(set_table, &id);
+	if(set == NULL) {
+		dprintf("wait set 0x%x doesn't exist!\n", id);
+		return;
+	}
+
+	dprintf("WAIT SET: %p\n", set);
+	dprintf("id:       0x%x\n", set->id);
+	dprintf("owner:    0x%x\n", set->owner);
+	dprintf("ref:      %d\n", set->ref_count);
+	dprintf("waiters:  %d\n", set->waiters);
+	dprintf("sem:      0x%x\n", set->wait_sem);
+	dprintf("watches:  %d\n", set->num_watches);
+	list_for_every_entry(&set->watch_list, w, struct wait_watch, set_node) {
+		dprintf("\t%p type %d id %d events 0x%x object %p%s\n",
+			w, w->type, w->id, w->events, w->object, w->queued ? " queued" : "");
+	}
+}
+
+int wait_set_init(void)
+{
+	next_set_id = 1;
+
+	mutex_init(&set_table_lock, "wait set table lock");
+
+	set_table = hash_init(64, offsetof(struct wait_set, next), &set_compare_func, &set_hash_func);
+	if(set_table == NULL)
+		return ERR_NO_MEMORY;
+
+	dbg_add_command(&dump_set_list, "wait_sets", "Dump a list of all wait sets");
+	dbg_add_command(&dump_set_info, "wait_set", "Dump info about a particular wait set");
+
+	return 0;
+}
+
+void wait_object_init(struct wait_object *obj)
+{
+	list_initialize(&obj->watches);
+}
+
+// puts the watch on its set's ready list and wakes up a waiter
+// NOTE: expects wait_lock to be held
+static void queue_watch(struct wait_watch *w)
+{
+	struct wait_set *set = w->set;
+
+	if(w->queued)
+		return;
+
+	list_add_tail(&set->ready_list, &w->ready_node);
+	w->queued = true;
+
+	if(set->waiters > 0 && !set->wakeup_pending) {
+		set->wakeup_pending = true;
+		// NO_NOTIFY, the wait lock is already held
+		sem_release_etc(set->wait_sem, 1, SEM_FLAG_NO_RESCHED | SEM_FLAG_NO_NOTIFY);
+	}
+}
+
+void wait_object_attach(struct wait_object *obj, struct wait_watch *w)
+{
+	int_disable_interrupts();
+	GRAB_WAIT_LOCK();
+
+	if(w->object != obj) {
+		if(w->object != NULL)
+			list_delete(&w->object_node);
+		list_add_tail(&obj->watches, &w->object_node);
+		w->object = obj;
+	}
+
+	RELEASE_WAIT_LOCK();
+	int_restore_interrupts();
+}
+
+void wait_object_notify(struct wait_object *obj, int events)
+{
+	struct wait_watch *w;
+
+	// callers change the object's state before notifying, under the lock its
+	// poll hook reads it under, so a watch attached after this check is made
+	// will see the new state when it's polled
+	if(list_is_empty(&obj->watches))
+		return;
+
+	int_disable_interrupts();
+	GRAB_WAIT_LOCK();
+
+	list_for_every_entry(&obj->watches, w, struct wait_watch, object_node) {
+		if((w->events & events) || (events & WAIT_EVENT_ERROR))
+			queue_watch(w);
+	}
+
+	RELEASE_WAIT_LOCK();
+	int_restore_interrupts();
+}
+
+void wait_object_detach_all(struct wait_object *obj)
+{
+	struct wait_watch *w;
+
+	int_disable_interrupts();
+	GRAB_WAIT_LOCK();
+
+	// polling them again will find the object gone
+	while((w = list_remove_head_type(&obj->watches, struct wait_watch, object_node)) != NULL) {
+		w->object = NULL;
+		queue_watch(w);
+	}
+
+	RELEASE_WAIT_LOCK();
+	int_restore_interrupts();
+}
+
+static struct wait_set *get_set(wait_set_id id)
+{
+	struct wait_set *set;
+
+	mutex_lock(&set_table_lock);
+	set = hash_lookup(set_table, &id);
+	if(set != NULL)
+		atomic_add(&set->ref_count, 1);
+	mutex_unlock(&set_table_lock);
+
+	return set;
+}
+
+static void put_set(struct wait_set *set)
+{
+	if(atomic_add(&set->ref_count, -1) == 1) {
+		// it's out of the table and has no watches left by now
+		mutex_destroy(&set->lock);
+		hash_uninit(set->watch_table);
+		kfree(set);
+	}
+}
+
+// returns the events that are ready on the watch's object, attaching the watch to it
+// NOTE: expects the set lock to be held
+static int poll_watch(struct wait_watch *w)
+{
+	switch(w->type) {
+		case WAIT_OBJECT_FD:
+			return vfs_poll(w->descriptor, w);
+		case WAIT_OBJECT_SEM:
+			return sem_poll(w->id, w);
+		case WAIT_OBJECT_PORT:
+			return port_poll(w->id, w);
+		default:
+			return ERR_INVALID_ARGS;
+	}
+}
+
+// NOTE: expects the set lock to be held
+static void remove_watch(struct wait_set *set, struct wait_watch *w)
+{
+	hash_remove(set->watch_table, w);
+	list_delete(&w->set_node);
+	set->num_watches--;
+
+	int_disable_interrupts();
+	GRAB_WAIT_LOCK();
+	if(w->object != NULL) {
+		list_delete(&w->object_node);
+		w->object = NULL;
+	}
+	if(w->queued) {
+		list_delete(&w->ready_node);
+		w->queued = false;
+	}
+	RELEASE_WAIT_LOCK();
+	int_restore_interrupts();
+
+	// may be the last reference, which closes the file
+	if(w->descriptor != NULL)
+		vfs_put_fd_ptr(w->descriptor);
+	kfree(w);
+}
+
+static wait_set_id _wait_set_create(proc_id owner)
+{
+	struct wait_set *set;
+
+	set = (struct wait_set *)kmalloc(sizeof(struct wait_set));
+	if(set == NULL)
+		return ERR_NO_MEMORY;
+
+	memset(set, 0, sizeof(struct wait_set));
+	set->owner = owner;
+	set->ref_count = 1;
+	list_initialize(&set->watch_list);
+	list_initialize(&set->ready_list);
+
+	if(mutex_init(&set->lock, "wait set lock") < 0)
+		goto err;
+
+	set->watch_table = hash_init(64, offsetof(struct wait_watch, hash_next), &watch_compare_func, &watch_hash_func);
+	if(set->watch_table == NULL)
+		goto err1;
+
+	set->wait_sem = sem_create(0, "wait set sem");
+	if(set->wait_sem < 0)
+		goto err2;
+
+	set->id = atomic_add(&next_set_id, 1);
+
+	mutex_lock(&set_table_lock);
+	hash_insert(set_table, set);
+	mutex_unlock(&set_table_lock);
+
+	return set->id;
+
+err2:
+	hash_uninit(set->watch_table);
+err1:
+	mutex_destroy(&set->lock);
+err:
+	kfree(set);
+	return ERR_NO_MEMORY;
+}
+
+wait_set_id wait_set_create(void)
+{
+	return _wait_set_create(proc_get_kernel_proc_id());
+}
+
+int wait_set_delete(wait_set_id id)
+{
+	struct wait_set *set;
+	struct wait_watch *w;
+
+	mutex_lock(&set_table_lock);
+	set = hash_lookup(set_table, &id);
+	if(set != NULL)
+		hash_remove(set_table, set);
+	mutex_unlock(&set_table_lock);
+
+	if(set == NULL)
+		return ERR_INVALID_HANDLE;
+
+	mutex_lock(&set->lock);
+	set->deleted = true;
+	while((w = list_peek_head_type(&set->watch_list, struct wait_watch, set_node)) != NULL)
+		remove_watch(set, w);
+	mutex_unlock(&set->lock);
+
+	// anyone still waiting on the set will see it's gone
+	sem_delete(set->wait_sem);
+
+	// the table's reference
+	put_set(set);
+
+	return NO_ERROR;
+}
+
+static int _wait_set_add(wait_set_id id, int type, int object, int events, void *cookie, bool kernel)
+{
+	struct wait_set *set;
+	struct wait_watch *w;
+	struct watch_key key;
+	void *descriptor = NULL;
+	void *old_descriptor = NULL;
+	int err;
+
+	if((events & ~(WAIT_EVENT_READ | WAIT_EVENT_WRITE | WAIT_EVENT_ERROR)) != 0)
+		return ERR_INVALID_ARGS;
+
+	switch(type) {
+		case WAIT_OBJECT_FD:
+			err = vfs_get_fd_ptr(object, kernel, &descriptor);
+			if(err < 0)
+				return err;
+			break;
+		case WAIT_OBJECT_SEM:
+		case WAIT_OBJECT_PORT:
+			break;
+		default:
+			return ERR_INVALID_ARGS;
+	}
+
+	set = get_set(id);
+	if(set == NULL) {
+		err = ERR_INVALID_HANDLE;
+		goto err;
+	}
+
+	mutex_lock(&set->lock);
+
+	if(set->deleted) {
+		err = ERR_INVALID_HANDLE;
+		goto err1;
+	}
+
+	key.type = type;
+	key.id = object;
+	w = hash_lookup(set->watch_table, &key);
+	if(w != NULL) {
+		// already watched, just change what it's watched for
+		int_disable_interrupts();
+		GRAB_WAIT_LOCK();
+		w->events = events;
+		w->cookie = cookie;
+		if(descriptor != w->descriptor) {
+			// the fd was closed and reused, watch the new one
+			if(w->object != NULL) {
+				list_delete(&w->object_node);
+				w->object = NULL;
+			}
+			old_descriptor = w->descriptor;
+			w->descriptor = descriptor;
+		} else {
+			old_descriptor = descriptor;
+		}
+		queue_watch(w);
+		RELEASE_WAIT_LOCK();
+		int_restore_interrupts();
+
+		mutex_unlock(&set->lock);
+		put_set(set);
+
+		if(old_descriptor != NULL)
+			vfs_put_fd_ptr(old_descriptor);
+		return NO_ERROR;
+	}
+
+	if(set->num_watches >= MAX_SET_WATCHES) {
+		err = ERR_NO_MORE_HANDLES;
+		goto err1;
+	}
+
+	w = (struct wait_watch *)kmalloc(sizeof(struct wait_watch));
+	if(w == NULL) {
+		err = ERR_NO_MEMORY;
+		goto err1;
+	}
+
+	memset(w, 0, sizeof(struct wait_watch));
+	w->set = set;
+	w->type = type;
+	w->id = object;
+	w->descriptor = descriptor;
+	w->events = events;
+	w->cookie = cookie;
+
+	hash_insert(set->watch_table, w);
+	list_add_tail(&set->watch_list, &w->set_node);
+	set->num_watches++;
+
+	// the first wait polls it, which attaches it to the object
+	int_disable_interrupts();
+	GRAB_WAIT_LOCK();
+	queue_watch(w);
+	RELEASE_WAIT_LOCK();
+	int_restore_interrupts();
+
+	mutex_unlock(&set->lock);
+	put_set(set);
+
+	return NO_ERROR;
+
+err1:
+	mutex_unlock(&set->lock);
+	put_set(set);
+err:
+	if(descriptor != NULL)
+		vfs_put_fd_ptr(descriptor);
+	return err;
+}
+
+int wait_set_add(wait_set_id id, int type, int object, int events, void *cookie)
+{
+	return _wait_set_add(id, type, object, events, cookie, true);
+}
+
+int wait_set_remove(wait_set_id id, int type, int object)
+{
+	struct wait_set *set;
+	struct wait_watch *w;
+	struct watch_key key;
+	int err;
+
+	set = get_set(id);
+	if(set == NULL)
+		return ERR_INVALID_HANDLE;
+
+	mutex_lock(&set->lock);
+
+	key.type = type;
+	key.id = object;
+	w = hash_lookup(set->watch_table, &key);
+	if(w != NULL) {
+		remove_watch(set, w);
+		err = NO_ERROR;
+	} else {
+		err = ERR_NOT_FOUND;
+	}
+
+	mutex_unlock(&set->lock);
+	put_set(set);
+
+	return err;
+}
+
+// polls the watches on the ready list, filling in events for the ones that are
+// really ready, and returns how many it found
+// NOTE: expects the set lock to be held
+static int collect_events(struct wait_set *set, wait_event *events, int count)
+{
+	struct list_node batch;
+	struct wait_watch *w;
+	int found = 0;
+	int ready;
+
+	// take the whole ready list, the watches on it stay marked queued until
+	// they're polled so notifications in the meantime don't requeue them
+	list_initialize(&batch);
+	int_disable_interrupts();
+	GRAB_WAIT_LOCK();
+	if(!list_is_empty(&set->ready_list)) {
+		batch.next = set->ready_list.next;
+		batch.prev = set->ready_list.prev;
+		batch.next->prev = &batch;
+		batch.prev->next = &batch;
+		list_initialize(&set->ready_list);
+	}
+	RELEASE_WAIT_LOCK();
+	int_restore_interrupts();
+
+	while(found < count && (w = list_remove_head_type(&batch, struct wait_watch, ready_node)) != NULL) {
+		int_disable_interrupts();
+		GRAB_WAIT_LOCK();
+		w->queued = false;
+		RELEASE_WAIT_LOCK();
+		int_restore_interrupts();
+
+		// anything that happens to the object from here on is either seen
+		// by the poll or queues the watch again
+		ready = poll_watch(w);
+		if(ready < 0)
+			ready = WAIT_EVENT_ERROR;
+		ready &= (w->events | WAIT_EVENT_ERROR);
+		if(ready == 0)
+			continue;
+
+		events[found].type = w->type;
+		events[found].id = w->id;
+		events[found].events = ready;
+		events[found].cookie = w->cookie;
+		found++;
+
+		// level triggered, it stays on the ready list until a poll says it isn't ready
+		int_disable_interrupts();
+		GRAB_WAIT_LOCK();
+		queue_watch(w);
+		RELEASE_WAIT_LOCK();
+		int_restore_interrupts();
+	}
+
+	// the ones that didn't fit go back to the front of the line
+	if(!list_is_empty(&batch)) {
+		int_disable_interrupts();
+		GRAB_WAIT_LOCK();
+		while((w = list_remove_tail_type(&batch, struct wait_watch, ready_node)) != NULL)
+			list_add_head(&set->ready_list, &w->ready_node);
+		RELEASE_WAIT_LOCK();
+		int_restore_interrupts();
+	}
+
+	return found;
+}
+
+int wait_set_wait(wait_set_id id, wait_event *events, int count, int flags, bigtime_t timeout)
+{
+	struct wait_set *set;
+	bigtime_t deadline = 0;
+	bigtime_t time_left = 0;
+	bool sleep;
+	int err;
+
+	if(count <= 0 || events == NULL)
+		return ERR_INVALID_ARGS;
+
+	set = get_set(id);
+	if(set == NULL)
+		return ERR_INVALID_HANDLE;
+
+	if(flags & WAIT_FLAG_TIMEOUT)
+		deadline = system_time() + timeout;
+
+	for(;;) {
+		mutex_lock(&set->lock);
+
+		if(set->deleted) {
+			mutex_unlock(&set->lock);
+			err = ERR_INVALID_HANDLE;
+			break;
+		}
+
+		err = collect_events(set, events, count);
+		if(err > 0) {
+			mutex_unlock(&set->lock);
+			break;
+		}
+
+		if(flags & WAIT_FLAG_TIMEOUT) {
+			time_left = deadline - system_time();
+			if(time_left <= 0) {
+				mutex_unlock(&set->lock);
+				err = ERR_TIMED_OUT;
+				break;
+			}
+		}
+
+		// nothing's ready, sleep until something gets queued
+		int_disable_interrupts();
+		GRAB_WAIT_LOCK();
+		sleep = list_is_empty(&set->ready_list);
+		if(sleep)
+			set->waiters++;
+		RELEASE_WAIT_LOCK();
+		int_restore_interrupts();
+
+		mutex_unlock(&set->lock);
+
+		if(!sleep)
+			continue;
+
+		err = sem_acquire_etc(set->wait_sem, 1, SEM_FLAG_INTERRUPTABLE | (flags & WAIT_FLAG_TIMEOUT), time_left, NULL);
+
+		int_disable_interrupts();
+		GRAB_WAIT_LOCK();
+		set->waiters--;
+		set->wakeup_pending = false;
+		RELEASE_WAIT_LOCK();
+		int_restore_interrupts();
+
+		// timeouts and the set being deleted are sorted out at the top of the loop
+		if(err == ERR_INTERRUPTED)
+			break;
+	}
+
+	put_set(set);
+
+	return err;
+}
+
+int wait_set_delete_owned_sets(proc_id owner)
+{
+	struct hash_iterator i;
+	struct wait_set *set;
+	wait_set_id id;
+	int count = 0;
+
+	for(;;) {
+		id = -1;
+		mutex_lock(&set_table_lock);
+		hash_open(set_table, &i);
+		while((set = hash_next(set_table, &i)) != NULL) {
+			if(set->owner == owner) {
+				id = set->id;
+				break;
+			}
+		}
+		hash_close(set_table, &i, false);
+		mutex_unlock(&set_table_lock);
+
+		if(id < 0)
+			break;
+		if(wait_set_delete(id) == NO_ERROR)
+			count++;
+	}
+
+	return count;
+}
+
+wait_set_id user_wait_set_create(void)
+{
+	return _wait_set_create(proc_get_current_proc_id());
+}
+
+int user_wait_set_delete(wait_set_id id)
+{
+	return wait_set_delete(id);
+}
+
+int user_wait_set_add(wait_set_id id, int type, int object, int events, void *cookie)
+{
+	return _wait_set_add(id, type, object, events, cookie, false);
+}
+
+int user_wait_set_remove(wait_set_id id, int type, int object)
+{
+	return wait_set_remove(id, type, object);
+}
+
+int user_wait_set_wait(wait_set_id id, wait_event *uevents, int count, int flags, bigtime_t timeout)
+{
+	wait_event *events;
+	int rc, rc2;
+
+	if(count <= 0 || uevents == NULL)
+		return ERR_INVALID_ARGS;
+	if(is_kernel_address(uevents))
+		return ERR_VM_BAD_USER_MEMORY;
+
+	count = min(count, MAX_WAIT_EVENTS);
+	events = (wait_event *)kmalloc(sizeof(wait_event) * count);
+	if(events == NULL)
+		return ERR_NO_MEMORY;
+
+	rc = wait_set_wait(id, events, count, flags, timeout);
+	if(rc > 0) {
+		rc2 = user_memcpy(uevents, events, sizeof(wait_event) * rc);
+		if(rc2 < 0)
+			rc = rc2;
+	}
+
+	kfree(events);
+
+	return rc;
+}
@@ -111,3 +111,22 @@ ssize_t socket_sendto(int fd, const void *buf, ssize_t len, sockaddr *addr)
 	return ioctl(fd, _SOCKET_API_SENDTO, &args, sizeof(args));
 }
 
+int socket_setopt(int fd, int opt, int value)
+{
+	_socket_api_args_t args;
+
+	args.u.opt.opt = opt;
+	args.u.opt.value = value;
+
+	return ioctl(fd, _SOCKET_API_SETOPT, &args, sizeof(args));
+}
+
+int socket_getopt(int fd, int opt)
+{
+	_socket_api_args_t args;
+
+	args.u.opt.opt = opt;
+	args.u.opt.value = 0;
+
+	return ioctl(fd, _SOCKET_API_GETOPT, &args, sizeof(args));
+}